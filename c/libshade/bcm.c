@@ -6,25 +6,21 @@
 
 #include <bcm_host.h>
 
-#define VIEWPORT_WIDTH (6 * 64 * 2)
-#define VIEWPORT_HEIGHT (64 * 2)
-
-// #define FRAMEBUFFER_WIDTH (6 * 64)
-// #define FRAMEBUFFER_HEIGHT 64
-#define FRAMEBUFFER_WIDTH  (800 / 2) // XXX
-#define FRAMEBUFFER_HEIGHT (600 / 2) // XXX
-
-// #define LED_WIDTH (6 * 64)
-// #define LED_HEIGHT 64
+// The shader draws one pixel per LED into a viewport at the top of
+// the screen.  Snapshots are taken at screen resolution, so there's
+// no scaling, and only the viewport's rows are read back.
 
 static __thread char *last_error;
 
 typedef struct videocore_context {
     uint32_t                   surface_width;
     uint32_t                   surface_height; 
+    uint32_t                   viewport_width;
+    uint32_t                   viewport_height;
     DISPMANX_DISPLAY_HANDLE_T  display;
     DISPMANX_ELEMENT_HANDLE_T  element;
     DISPMANX_RESOURCE_HANDLE_T screen_resource;
+    DISPMANX_RESOURCE_HANDLE_T rgba_resource;   // made on first use
 } videocore_context;
 
 // Return NULL on success; return error message on failure.
@@ -39,8 +35,8 @@ static const char *init_videocore(videocore_context *ctx)
     }
     ctx->surface_width = w;
     ctx->surface_height = h;
-    {                           // XXX XXX
-        assert(w == 800 && h == 600);
+    if (ctx->viewport_width > w || ctx->viewport_height > h) {
+        return "display is smaller than the LEDs";
     }
 
     ctx->display = vc_dispmanx_display_open(0);
@@ -58,14 +54,14 @@ static const char *init_videocore(videocore_context *ctx)
     VC_RECT_T src_rect = {
         .x             = 0,
         .y             = 0,
-        .width         = VIEWPORT_WIDTH << 16,
-        .height        = VIEWPORT_HEIGHT << 16,
+        .width         = ctx->viewport_width << 16,
+        .height        = ctx->viewport_height << 16,
     };
     VC_RECT_T dst_rect = {
         .x             = 0,
-        .y             = h - VIEWPORT_HEIGHT,
-        .width         = VIEWPORT_WIDTH,
-        .height        = VIEWPORT_HEIGHT,
+        .y             = 0,
+        .width         = ctx->viewport_width,
+        .height        = ctx->viewport_height,
     };
     VC_DISPMANX_ALPHA_T alpha = { DISPMANX_FLAGS_ALPHA_PREMULT, 0, 0 };
 
@@ -103,13 +99,41 @@ static const char *init_videocore(videocore_context *ctx)
     uint32_t native_image_handle = 0;
     ctx->screen_resource =
         vc_dispmanx_resource_create(VC_IMAGE_RGB565,
-                                    FRAMEBUFFER_WIDTH,
-                                    FRAMEBUFFER_HEIGHT,
+                                    w,
+                                    h,
                                     &native_image_handle);
 
     return NULL;
 }
 
+// Returns zero or positive on success.
+static int videocore_read_rgba(videocore_context *ctx,
+                               uint32_t pixel_buf[],
+                               size_t word_pitch)
+{
+    if (ctx->rgba_resource == DISPMANX_NO_HANDLE) {
+        uint32_t native_image_handle = 0;
+        ctx->rgba_resource =
+            vc_dispmanx_resource_create(VC_IMAGE_RGBA32,
+                                        ctx->surface_width,
+                                        ctx->surface_height,
+                                        &native_image_handle);
+        if (ctx->rgba_resource == DISPMANX_NO_HANDLE)
+            return -1;
+    }
+    VC_RECT_T rect;
+    vc_dispmanx_rect_set(&rect,
+                         0, 0,
+                         ctx->surface_width, ctx->viewport_height);
+    int r = vc_dispmanx_snapshot(ctx->display, ctx->rgba_resource, 0);
+    if (r >= 0)
+        r = vc_dispmanx_resource_read_data(ctx->rgba_resource,
+                                           &rect,
+                                           pixel_buf,
+                                           word_pitch * sizeof *pixel_buf);
+    return r;
+}
+
 // Returns zero or positive on success.
 static int videocore_read_pixels(videocore_context *ctx,
                                  uint16_t pixel_buf[],
@@ -117,7 +141,9 @@ static int videocore_read_pixels(videocore_context *ctx,
 {
 
     static VC_RECT_T rect;
-    vc_dispmanx_rect_set(&rect, 0, 0, FRAMEBUFFER_WIDTH, FRAMEBUFFER_HEIGHT);
+    vc_dispmanx_rect_set(&rect,
+                         0, 0,
+                         ctx->surface_width, ctx->viewport_height);
     int r = vc_dispmanx_snapshot(ctx->display, ctx->screen_resource, 0);
     assert(r >= 0);             // XXX
     if (r >= 0) {
@@ -142,10 +168,12 @@ static int videocore_read_pixels(videocore_context *ctx,
     return r;
 }
 
-bcm_context init_bcm(void)
+bcm_context init_bcm(int LEDs_width, int LEDs_height)
 {
     // Initialize VideoCore.
     videocore_context *vctx = calloc(1, sizeof *vctx);
+    vctx->viewport_width = LEDs_width;
+    vctx->viewport_height = LEDs_height;
     const char *err = init_videocore(vctx);
     if (err) {
         free(vctx);
@@ -161,6 +189,8 @@ void deinit_bcm(bcm_context bctx)
     // assert(0 && "This function has not been tested.");
     videocore_context *vctx = bctx;
     vc_dispmanx_resource_delete(vctx->screen_resource);
+    if (vctx->rgba_resource != DISPMANX_NO_HANDLE)
+        vc_dispmanx_resource_delete(vctx->rgba_resource);
     DISPMANX_UPDATE_HANDLE_T update = vc_dispmanx_update_start(0);
     if (update != DISPMANX_NO_HANDLE) {
         if (vc_dispmanx_element_remove(update, vctx->element) == 0) {
@@ -186,14 +216,25 @@ int bcm_get_surface_height(const bcm_context bctx)
     return ((videocore_context *)bctx)->surface_height;
 }
 
+// The top rows of the screen, full width.
 int bcm_get_framebuffer_width(const bcm_context bctx)
 {
-    return FRAMEBUFFER_WIDTH;
+    return ((videocore_context *)bctx)->surface_width;
 }
 
 int bcm_get_framebuffer_height(const bcm_context bctx)
 {
-    return FRAMEBUFFER_HEIGHT;
+    return ((videocore_context *)bctx)->viewport_height;
+}
+
+int bcm_get_viewport_width(const bcm_context bctx)
+{
+    return ((videocore_context *)bctx)->viewport_width;
+}
+
+int bcm_get_viewport_height(const bcm_context bctx)
+{
+    return ((videocore_context *)bctx)->viewport_height;
 }
 
 int bcm_get_surface(const bcm_context bctx)
@@ -201,6 +242,16 @@ int bcm_get_surface(const bcm_context bctx)
     return ((videocore_context *)bctx)->element;
 }
 
+// The screen is the render target.
+bool bcm_init_render_target(bcm_context bctx)
+{
+    return true;
+}
+
+void bcm_deinit_render_target(bcm_context bctx)
+{
+}
+
 // returns zero on success
 int bcm_read_pixels(bcm_context bctx,
                     uint16_t *pixels,
@@ -209,3 +260,11 @@ int bcm_read_pixels(bcm_context bctx,
     videocore_context *vctx = bctx;
     return videocore_read_pixels(vctx, pixels, row_pitch);
 }
+
+int bcm_read_rgba(bcm_context bctx,
+                  uint32_t *pixels,
+                  uint16_t row_pitch)
+{
+    videocore_context *vctx = bctx;
+    return videocore_read_rgba(vctx, pixels, row_pitch);
+}
@@ -1,24 +1,43 @@
 #ifndef BCM_included
 #define BCM_included
 
+#include <stdbool.h>
 #include <stdint.h>
 
+// The render backend.  bcm.c draws to the screen through DispmanX and
+// reads it back with a snapshot.  bcm_headless.c (make
+// RENDER_BACKEND=headless) draws into an offscreen FBO the size of
+// the LEDs and reads it back with glReadPixels; it runs on any
+// EGL/GLES2, including Mesa's llvmpipe.
+
 typedef void *bcm_context;
 
-extern bcm_context init_bcm(void);
+extern bcm_context init_bcm(int LEDs_width, int LEDs_height);
 extern void        deinit_bcm(bcm_context);
 
+// A surface of zero means there is no native window.
 extern int  bcm_get_surface_width(const bcm_context);
 extern int  bcm_get_surface_height(const bcm_context);
 extern int  bcm_get_framebuffer_width(const bcm_context);
 extern int  bcm_get_framebuffer_height(const bcm_context);
+extern int  bcm_get_viewport_width(const bcm_context);
+extern int  bcm_get_viewport_height(const bcm_context);
 extern int  bcm_get_surface(const bcm_context);
 
+// Call on the render thread once its EGL context is current.
+extern bool bcm_init_render_target(bcm_context);
+extern void bcm_deinit_render_target(bcm_context);
+
 // returns zero on success
 extern int  bcm_read_pixels(bcm_context,
                             uint16_t *pixels,
                             uint16_t row_pitch);
 
+// The same, as eight bit RGBA with red in the low byte.
+extern int  bcm_read_rgba(bcm_context,
+                          uint32_t *pixels,
+                          uint16_t row_pitch);
+
 extern const char *bcm_last_error(void);
 
 #endif /* !BCM_included */
@@ -0,0 +1,170 @@
+#define _GNU_SOURCE
+#include "bcm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <GLES2/gl2.h>
+
+// Headless render backend.  There is no window: EGL gets a pbuffer
+// (see egl.c), and the render thread draws into an FBO exactly the
+// size of the LEDs.  GL's origin is at the bottom, so readback flips
+// rows as it packs RGBA8888 into RGB565.
+
+static __thread char *last_error;
+
+typedef struct headless_context {
+    int       width;
+    int       height;
+    GLuint    framebuffer;
+    GLuint    texture;
+    uint32_t *rgba;             // glReadPixels lands here
+} headless_context;
+
+bcm_context init_bcm(int LEDs_width, int LEDs_height)
+{
+    headless_context *hctx = calloc(1, sizeof *hctx);
+    if (hctx)
+        hctx->rgba = calloc(LEDs_width * LEDs_height, sizeof *hctx->rgba);
+    if (!hctx || !hctx->rgba) {
+        free(hctx);
+        free(last_error);
+        last_error = NULL;
+        asprintf(&last_error, "init_bcm: out of memory");
+        return NULL;
+    }
+    hctx->width = LEDs_width;
+    hctx->height = LEDs_height;
+    return (bcm_context)hctx;
+}
+
+void deinit_bcm(bcm_context bctx)
+{
+    headless_context *hctx = bctx;
+    free(hctx->rgba);
+    free(hctx);
+}
+
+const char *bcm_last_error(void)
+{
+    return last_error;
+}
+
+int bcm_get_surface_width(const bcm_context bctx)
+{
+    return ((headless_context *)bctx)->width;
+}
+
+int bcm_get_surface_height(const bcm_context bctx)
+{
+    return ((headless_context *)bctx)->height;
+}
+
+int bcm_get_framebuffer_width(const bcm_context bctx)
+{
+    return ((headless_context *)bctx)->width;
+}
+
+int bcm_get_framebuffer_height(const bcm_context bctx)
+{
+    return ((headless_context *)bctx)->height;
+}
+
+int bcm_get_viewport_width(const bcm_context bctx)
+{
+    return ((headless_context *)bctx)->width;
+}
+
+int bcm_get_viewport_height(const bcm_context bctx)
+{
+    return ((headless_context *)bctx)->height;
+}
+
+int bcm_get_surface(const bcm_context bctx)
+{
+    return 0;
+}
+
+bool bcm_init_render_target(bcm_context bctx)
+{
+    headless_context *hctx = bctx;
+    glGenTextures(1, &hctx->texture);
+    glBindTexture(GL_TEXTURE_2D, hctx->texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D,
+                 0,             // level
+                 GL_RGBA,
+                 hctx->width,
+                 hctx->height,
+                 0,             // border, must be zero
+                 GL_RGBA,
+                 GL_UNSIGNED_BYTE,
+                 NULL);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glGenFramebuffers(1, &hctx->framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, hctx->framebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER,
+                           GL_COLOR_ATTACHMENT0,
+                           GL_TEXTURE_2D,
+                           hctx->texture,
+                           0);
+    GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    if (status != GL_FRAMEBUFFER_COMPLETE) {
+        free(last_error);
+        last_error = NULL;
+        asprintf(&last_error, "framebuffer incomplete: 0x%04x", status);
+        bcm_deinit_render_target(bctx);
+        return false;
+    }
+    return true;
+}
+
+void bcm_deinit_render_target(bcm_context bctx)
+{
+    headless_context *hctx = bctx;
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteFramebuffers(1, &hctx->framebuffer);
+    glDeleteTextures(1, &hctx->texture);
+    hctx->framebuffer = 0;
+    hctx->texture = 0;
+}
+
+// returns zero on success
+int bcm_read_pixels(bcm_context bctx,
+                    uint16_t *pixels,
+                    uint16_t row_pitch)
+{
+    headless_context *hctx = bctx;
+    size_t w = hctx->width, h = hctx->height;
+    glReadPixels(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, hctx->rgba);
+    if (glGetError() != GL_NO_ERROR)
+        return -1;
+    for (size_t y = 0; y < h; y++) {
+        const uint8_t *src = (const uint8_t *)(hctx->rgba + (h - 1 - y) * w);
+        uint16_t *dst = pixels + y * row_pitch;
+        for (size_t x = 0; x < w; x++, src += 4)
+            dst[x] = (src[0] >> 3) << 11 | (src[1] >> 2) << 5 | src[2] >> 3;
+    }
+    return 0;
+}
+
+int bcm_read_rgba(bcm_context bctx,
+                  uint32_t *pixels,
+                  uint16_t row_pitch)
+{
+    headless_context *hctx = bctx;
+    size_t w = hctx->width, h = hctx->height;
+    glReadPixels(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, hctx->rgba);
+    if (glGetError() != GL_NO_ERROR)
+        return -1;
+    for (size_t y = 0; y < h; y++)
+        memcpy(pixels + y * row_pitch,
+               hctx->rgba + (h - 1 - y) * w,
+               w * sizeof *pixels);
+    return 0;
+}
@@ -0,0 +1,85 @@
+#include "color.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FRACTION_BITS 8
+#define LANES         8
+
+typedef uint16_t u16_vec __attribute__((vector_size(LANES * 2)));
+
+struct color_stage {
+    uint16_t lut[3][256];       // LED levels, FRACTION_BITS fixed point
+    unsigned frame;
+    u16_vec  threshold[4];      // this frame's dither, by row mod 4
+};
+
+static const uint8_t bayer[4][4] = {
+    {  0,  8,  2, 10 },
+    { 12,  4, 14,  6 },
+    {  3, 11,  1,  9 },
+    { 15,  7, 13,  5 },
+};
+
+color_stage *create_color_stage(float gamma, const float gain[3])
+{
+    static const unsigned levels[3] = { 31, 63, 31 };
+    color_stage *cs = calloc(1, sizeof *cs);
+    if (!cs)
+        return NULL;
+    for (int c = 0; c < 3; c++) {
+        float top = levels[c] << FRACTION_BITS;
+        for (int v = 0; v < 256; v++) {
+            float level = gain[c] * powf(v / 255.0f, gamma) * top + 0.5f;
+            cs->lut[c][v] = level < 0 ? 0 : level > top ? top : level;
+        }
+    }
+    color_next_frame(cs);
+    return cs;
+}
+
+void destroy_color_stage(color_stage *cs)
+{
+    free(cs);
+}
+
+// Frame f shifts the pattern by (f mod 4, f / 4 mod 4), so every LED
+// sees all sixteen thresholds in turn.
+void color_next_frame(color_stage *cs)
+{
+    unsigned dx = cs->frame & 3;
+    unsigned dy = cs->frame >> 2 & 3;
+    for (unsigned y = 0; y < 4; y++)
+        for (unsigned x = 0; x < LANES; x++) {
+            unsigned b = bayer[(y + dy) & 3][(x + dx) & 3];
+            cs->threshold[y][x] = b << (FRACTION_BITS - 4) |
+                                  1 << (FRACTION_BITS - 5);
+        }
+    cs->frame++;
+}
+
+// The tables are lookups, one pixel at a time.  The dither and the
+// packing are done on eight pixels at once.
+void color_convert_row(const color_stage *cs,
+                       LED_pixel         *dst,
+                       const uint32_t    *src,
+                       size_t             width,
+                       size_t             row)
+{
+    const u16_vec t = cs->threshold[row & 3];
+    for (size_t x = 0; x < width; x += LANES) {
+        size_t count = width - x < LANES ? width - x : LANES;
+        u16_vec r = { 0 }, g = { 0 }, b = { 0 };
+        for (size_t i = 0; i < count; i++) {
+            uint32_t p = src[x + i];
+            r[i] = cs->lut[0][p       & 0xFF];
+            g[i] = cs->lut[1][p >>  8 & 0xFF];
+            b[i] = cs->lut[2][p >> 16 & 0xFF];
+        }
+        u16_vec px = (r + t) >> FRACTION_BITS << 11 |
+                     (g + t) >> FRACTION_BITS << 5 |
+                     (b + t) >> FRACTION_BITS;
+        memcpy(dst + x, &px, count * sizeof *dst);
+    }
+}
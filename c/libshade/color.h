@@ -0,0 +1,27 @@
+#ifndef COLOR_included
+#define COLOR_included
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "leds.h"
+
+typedef struct color_stage color_stage;
+
+// Converts RGBA8888 rows, as GL reads them, to the LEDs' RGB565.
+// Each channel goes through a table, gain * (v / 255) ^ gamma, that
+// keeps eight bits below the LEDs' five or six, and an ordered
+// dither rounds those away.  The dither pattern moves every frame,
+// so over sixteen frames each LED averages to its exact value.
+extern color_stage *create_color_stage(float gamma, const float gain[3]);
+extern void         destroy_color_stage(color_stage *);
+
+// Call once per frame, before converting its rows.
+extern void         color_next_frame(color_stage *);
+extern void         color_convert_row(const color_stage *,
+                                      LED_pixel       *dst,
+                                      const uint32_t  *src,
+                                      size_t           width,
+                                      size_t           row);
+
+#endif /* !COLOR_included */
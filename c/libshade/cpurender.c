@@ -0,0 +1,468 @@
+#define _GNU_SOURCE
+#include "cpurender.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "glsl.h"
+#include "native.h"
+
+// Tiles are a whole number of vectors and GLSL spans wide.  Rows of
+// a tile are contiguous in the LED framebuffer.
+#define TILE_WIDTH  GLSL_SPAN
+#define TILE_HEIGHT 16
+
+#define CACHE_LINE 64
+
+typedef uint16_t native_u16 __attribute__((vector_size(NATIVE_LANES * 2)));
+typedef uint32_t native_u32 __attribute__((vector_size(NATIVE_LANES * 4)));
+
+// Tiles are numbered face by face, so a run of them covers one cube
+// face before the next.  Each thread starts the frame owning a run
+// and takes tiles from its front.  Once its own run is empty, it
+// steals from the back of the longest one left.  Nothing is pushed
+// mid-frame, so a deque is just a range of tiles, and both ends
+// move by compare-and-swap on one word.
+typedef struct tile_deque {
+    _Alignas(CACHE_LINE) _Atomic uint64_t range;        // back << 32 | front
+} tile_deque;
+
+// One frame's work.
+typedef struct cpu_job {
+    native_shader       *shader;
+    void                *user;
+    const glsl_program  *glsl;
+    void                *pixels;        // LED_pixel, or uint32_t if rgba
+    size_t               row_pitch;
+    bool                 rgba;
+} cpu_job;
+
+// Each thread interprets GLSL in a context of its own.  Worker i
+// owns deque i + 1; the caller owns deque 0.
+typedef struct cpu_worker {
+    struct cpu_render_state *cs;
+    pthread_t                thread;
+    glsl_context            *glsl;
+    size_t                   index;
+    int                      core;      // -1 for none
+} cpu_worker;
+
+struct cpu_render_state {
+    size_t            width;
+    size_t            height;
+    size_t            face_width;
+    size_t            face_tiles_across;
+    size_t            face_tile_count;
+    size_t            tile_count;
+
+    int               prog_id;
+    struct timespec   time_zero;
+    native_inputs     inputs;
+
+    cpu_job           job;
+    tile_deque       *deques;           // worker_count + 1
+
+    // Workers wait for the generation to change, shade tiles until
+    // there are none left, and the last one out signals done_cond.
+    size_t            worker_count;     // not counting the caller
+    cpu_worker       *workers;
+    glsl_context     *glsl;             // the caller's
+    pthread_mutex_t   lock;
+    pthread_cond_t    start_cond;
+    pthread_cond_t    done_cond;
+    uint64_t          generation;
+    size_t            busy;
+    bool              shutdown;
+};
+
+// NaN and negative values go to zero.
+static inline native_float clamp01(native_float c)
+{
+    native_int positive = c > 0.0f;
+    native_int over = c > 1.0f;
+    native_int one = (native_int){ 0 } + 0x3f800000;
+    native_int bits = (native_int)c & positive;
+    return (native_float)((bits & ~over) | (one & over));
+}
+
+// Rounds to eight bits first, so it matches GL readback exactly.
+static inline native_int channel_bits(native_float c, int bits)
+{
+    native_float scaled = clamp01(c) * 255.0f + 0.5f;
+    return __builtin_convertvector(scaled, native_int) >> (8 - bits);
+}
+
+// RGBA rows are laid out as glReadPixels returns them, red in the
+// low byte.  Alpha is always opaque.
+static inline void store_pixels(const cpu_job     *job,
+                                size_t             y,
+                                size_t             x,
+                                const native_vec4 *color,
+                                size_t             count)
+{
+    if (job->rgba) {
+        uint32_t *dst = (uint32_t *)job->pixels + y * job->row_pitch + x;
+        native_int rgba = channel_bits(color->x, 8) |
+                          channel_bits(color->y, 8) << 8 |
+                          channel_bits(color->z, 8) << 16;
+        native_u32 px = (native_u32)rgba | 0xFF000000;
+        memcpy(dst, &px, count * sizeof *dst);
+    } else {
+        LED_pixel *dst = (LED_pixel *)job->pixels + y * job->row_pitch + x;
+        native_int rgb = channel_bits(color->x, 5) << 11 |
+                         channel_bits(color->y, 6) << 5 |
+                         channel_bits(color->z, 5);
+        native_u16 px = __builtin_convertvector(rgb, native_u16);
+        memcpy(dst, &px, count * sizeof *dst);
+    }
+}
+
+static void shade_glsl_row(cpu_render_state *cs,
+                           glsl_context     *ctx,
+                           size_t            row,
+                           float             y,
+                           size_t            x0,
+                           size_t            x1)
+{
+    float color[4][GLSL_SPAN];
+    for (size_t x = x0; x < x1; x += GLSL_SPAN) {
+        size_t count = x1 - x < GLSL_SPAN ? x1 - x : GLSL_SPAN;
+        glsl_shade(cs->job.glsl, ctx, &cs->inputs, x + 0.5f, y, count, color);
+        for (size_t i = 0; i < count; i += NATIVE_LANES) {
+            native_vec4 c4;
+            memcpy(&c4.x, &color[0][i], sizeof c4.x);
+            memcpy(&c4.y, &color[1][i], sizeof c4.y);
+            memcpy(&c4.z, &color[2][i], sizeof c4.z);
+            size_t n = count - i < NATIVE_LANES ? count - i : NATIVE_LANES;
+            store_pixels(&cs->job, row, x + i, &c4, n);
+        }
+    }
+}
+
+// The LEDs' top row is GL's y = height - 1.
+static void shade_tile(cpu_render_state *cs, glsl_context *ctx, size_t tile)
+{
+    static const native_float lane_x = { 0.5f, 1.5f, 2.5f, 3.5f };
+    _Static_assert(NATIVE_LANES == 4, "lane_x needs NATIVE_LANES values");
+    _Static_assert(GLSL_SPAN % NATIVE_LANES == 0, "spans are whole vectors");
+
+    const cpu_job *job = &cs->job;
+    size_t face = tile / cs->face_tile_count;
+    size_t t = tile % cs->face_tile_count;
+    size_t face_x1 = (face + 1) * cs->face_width;
+    size_t x0 = face * cs->face_width + t % cs->face_tiles_across * TILE_WIDTH;
+    size_t y0 = t / cs->face_tiles_across * TILE_HEIGHT;
+    size_t x1 = x0 + TILE_WIDTH, y1 = y0 + TILE_HEIGHT;
+    if (face_x1 > cs->width)
+        face_x1 = cs->width;
+    if (x1 > face_x1)
+        x1 = face_x1;
+    if (y1 > cs->height)
+        y1 = cs->height;
+    for (size_t y = y0; y < y1; y++) {
+        float gl_y = (float)(cs->height - 1 - y) + 0.5f;
+        if (!job->shader && job->glsl) {
+            shade_glsl_row(cs, ctx, y, gl_y, x0, x1);
+            continue;
+        }
+        native_vec2 coord;
+        coord.y = (native_float){ 0 } + gl_y;
+        for (size_t x = x0; x < x1; x += NATIVE_LANES) {
+            coord.x = lane_x + (float)x;
+            native_vec4 color = { .w = (native_float){ 0 } + 1.0f };
+            if (job->shader)
+                job->shader(&color, &coord, &cs->inputs, job->user);
+            size_t count = x1 - x < NATIVE_LANES ? x1 - x : NATIVE_LANES;
+            store_pixels(job, y, x, &color, count);
+        }
+    }
+}
+
+#define RANGE(front, back) ((uint64_t)(back) << 32 | (front))
+#define FRONT(range)       ((uint32_t)(range))
+#define BACK(range)        ((uint32_t)((range) >> 32))
+
+static bool pop_front(tile_deque *dq, size_t *tile)
+{
+    uint64_t r = atomic_load(&dq->range);
+    while (FRONT(r) < BACK(r)) {
+        if (atomic_compare_exchange_weak(&dq->range, &r,
+                                         RANGE(FRONT(r) + 1, BACK(r)))) {
+            *tile = FRONT(r);
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool steal_back(tile_deque *dq, size_t *tile)
+{
+    uint64_t r = atomic_load(&dq->range);
+    while (FRONT(r) < BACK(r)) {
+        if (atomic_compare_exchange_weak(&dq->range, &r,
+                                         RANGE(FRONT(r), BACK(r) - 1))) {
+            *tile = BACK(r) - 1;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Steals from whichever deque has the most left.  Fails once every
+// deque is empty.
+static bool steal(cpu_render_state *cs, size_t self, size_t *tile)
+{
+    size_t deque_count = cs->worker_count + 1;
+    while (true) {
+        size_t victim = self, most = 0;
+        for (size_t i = 0; i < deque_count; i++) {
+            uint64_t r = atomic_load_explicit(&cs->deques[i].range,
+                                              memory_order_relaxed);
+            if (BACK(r) > FRONT(r) && BACK(r) - FRONT(r) > most) {
+                most = BACK(r) - FRONT(r);
+                victim = i;
+            }
+        }
+        if (!most)
+            return false;
+        if (steal_back(&cs->deques[victim], tile))
+            return true;
+    }
+}
+
+static void run_tiles(cpu_render_state *cs, size_t self, glsl_context *ctx)
+{
+    size_t tile;
+    while (pop_front(&cs->deques[self], &tile))
+        shade_tile(cs, ctx, tile);
+    while (steal(cs, self, &tile))
+        shade_tile(cs, ctx, tile);
+}
+
+// Splits the tiles into runs, one per thread, in order.
+static void deal_tiles(cpu_render_state *cs)
+{
+    size_t deque_count = cs->worker_count + 1;
+    for (size_t i = 0; i < deque_count; i++) {
+        size_t front = cs->tile_count * i / deque_count;
+        size_t back = cs->tile_count * (i + 1) / deque_count;
+        atomic_store(&cs->deques[i].range, RANGE(front, back));
+    }
+}
+
+static void *worker_main(void *user_data)
+{
+    cpu_worker *wp = user_data;
+    cpu_render_state *cs = wp->cs;
+    pthread_setname_np(pthread_self(), "SHD CPU");
+
+    // If the core is offline or not ours, the worker runs unpinned.
+    if (wp->core >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(wp->core, &cpus);
+        (void)pthread_setaffinity_np(pthread_self(), sizeof cpus, &cpus);
+    }
+
+    uint64_t seen = 0;
+    pthread_mutex_lock(&cs->lock);
+    while (true) {
+        while (!cs->shutdown && cs->generation == seen)
+            pthread_cond_wait(&cs->start_cond, &cs->lock);
+        if (cs->shutdown)
+            break;
+        seen = cs->generation;
+        pthread_mutex_unlock(&cs->lock);
+        run_tiles(cs, wp->index, wp->glsl);
+        pthread_mutex_lock(&cs->lock);
+        if (--cs->busy == 0)
+            pthread_cond_signal(&cs->done_cond);
+    }
+    pthread_mutex_unlock(&cs->lock);
+    return NULL;
+}
+
+// Every core this process may run on, except the lowest, which is
+// left to the caller.
+static size_t default_cores(int **cores)
+{
+    cpu_set_t cpus;
+    if (sched_getaffinity(0, sizeof cpus, &cpus)) {
+        *cores = NULL;
+        return 0;
+    }
+    size_t count = 0;
+    *cores = calloc(CPU_COUNT(&cpus), sizeof **cores);
+    for (int cpu = 0; *cores && cpu < CPU_SETSIZE; cpu++)
+        if (CPU_ISSET(cpu, &cpus))
+            (*cores)[count++] = cpu;
+    if (!count)
+        return 0;
+    memmove(*cores, *cores + 1, --count * sizeof **cores);
+    return count;
+}
+
+cpu_render_state *cpu_render_init(size_t     width,
+                                  size_t     height,
+                                  const int *cores,
+                                  size_t     core_count)
+{
+    cpu_render_state *cs = calloc(1, sizeof *cs);
+    if (!cs)
+        return NULL;
+    cs->width = width;
+    cs->height = height;
+
+    // The cube's faces are square, side by side.
+    cs->face_width = height && width % height == 0 ? height : width;
+    cs->face_tiles_across = (cs->face_width + TILE_WIDTH - 1) / TILE_WIDTH;
+    size_t tiles_down = (height + TILE_HEIGHT - 1) / TILE_HEIGHT;
+    cs->face_tile_count = cs->face_tiles_across * tiles_down;
+    if (cs->face_width)
+        cs->tile_count = width / cs->face_width * cs->face_tile_count;
+    cs->prog_id = -1;
+    pthread_mutex_init(&cs->lock, NULL);
+    pthread_cond_init(&cs->start_cond, NULL);
+    pthread_cond_init(&cs->done_cond, NULL);
+
+    int *own_cores = NULL;
+    if (!cores) {
+        core_count = default_cores(&own_cores);
+        cores = own_cores;
+    }
+    cs->glsl = glsl_create_context();
+    cs->workers = calloc(core_count, sizeof *cs->workers);
+    cs->deques = aligned_alloc(CACHE_LINE,
+                               (core_count + 1) * sizeof *cs->deques);
+    if (!cs->glsl || (core_count && !cs->workers) || !cs->deques) {
+        free(own_cores);
+        cpu_render_deinit(cs);
+        return NULL;
+    }
+    for (size_t i = 0; i < core_count; i++) {
+        cpu_worker *wp = &cs->workers[i];
+        wp->cs = cs;
+        wp->index = i + 1;
+        wp->core = cores[i];
+        wp->glsl = glsl_create_context();
+        if (!wp->glsl)
+            break;
+        if (pthread_create(&wp->thread, NULL, worker_main, wp)) {
+            glsl_destroy_context(wp->glsl);
+            break;
+        }
+        cs->worker_count++;
+    }
+    free(own_cores);
+    return cs;
+}
+
+void cpu_render_deinit(cpu_render_state *cs)
+{
+    pthread_mutex_lock(&cs->lock);
+    cs->shutdown = true;
+    pthread_cond_broadcast(&cs->start_cond);
+    pthread_mutex_unlock(&cs->lock);
+    for (size_t i = 0; i < cs->worker_count; i++) {
+        pthread_join(cs->workers[i].thread, NULL);
+        glsl_destroy_context(cs->workers[i].glsl);
+    }
+    free(cs->workers);
+    free(cs->deques);
+    if (cs->glsl)
+        glsl_destroy_context(cs->glsl);
+    pthread_cond_destroy(&cs->done_cond);
+    pthread_cond_destroy(&cs->start_cond);
+    pthread_mutex_destroy(&cs->lock);
+    free(cs);
+}
+
+// Year, month from 0, day from 1, and seconds since midnight.
+static void get_date(float date[4])
+{
+    struct timespec now;
+    struct tm tm;
+    clock_gettime(CLOCK_REALTIME, &now);
+    localtime_r(&now.tv_sec, &tm);
+    date[0] = tm.tm_year + 1900;
+    date[1] = tm.tm_mon;
+    date[2] = tm.tm_mday;
+    date[3] = tm.tm_hour * 3600 + tm.tm_min * 60 + tm.tm_sec +
+              now.tv_nsec / 1.0e9;
+}
+
+static void update_inputs(cpu_render_state *cs, const prog *pp)
+{
+    native_inputs *in = &cs->inputs;
+    if (cs->prog_id != prog_id(pp)) {
+        cs->prog_id = prog_id(pp);
+        clock_gettime(CLOCK_MONOTONIC, &cs->time_zero);
+        in->frame = 0;
+    } else {
+        in->frame++;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    float t = (now.tv_nsec - cs->time_zero.tv_nsec) / 1.0e9;
+    t += now.tv_sec - cs->time_zero.tv_sec;
+    in->time_delta = in->frame ? t - in->time : 0.0;
+    in->time = t;
+    in->resolution[0] = cs->width;
+    in->resolution[1] = cs->height;
+    in->resolution[2] = 1.0;
+    get_date(in->date);
+    bool changed;
+    in->uniforms = prog_uniform_values(pp, &changed);
+}
+
+static void render_job(cpu_render_state *cs,
+                       const prog       *pp,
+                       void             *pixels,
+                       size_t            row_pitch,
+                       bool              rgba)
+{
+    update_inputs(cs, pp);
+    cs->job = (cpu_job) {
+        .shader    = prog_native_shader(pp),
+        .user      = prog_native_user(pp),
+        .glsl      = prog_cpu_program(pp),
+        .pixels    = pixels,
+        .row_pitch = row_pitch,
+        .rgba      = rgba,
+    };
+    deal_tiles(cs);
+
+    pthread_mutex_lock(&cs->lock);
+    cs->busy = cs->worker_count;
+    cs->generation++;
+    pthread_cond_broadcast(&cs->start_cond);
+    pthread_mutex_unlock(&cs->lock);
+
+    run_tiles(cs, 0, cs->glsl);
+
+    pthread_mutex_lock(&cs->lock);
+    while (cs->busy)
+        pthread_cond_wait(&cs->done_cond, &cs->lock);
+    pthread_mutex_unlock(&cs->lock);
+}
+
+void cpu_render_frame(cpu_render_state *cs,
+                      const prog       *pp,
+                      LED_pixel        *pixels,
+                      size_t            row_pitch)
+{
+    render_job(cs, pp, pixels, row_pitch, false);
+}
+
+void cpu_render_frame_rgba(cpu_render_state *cs,
+                           const prog       *pp,
+                           uint32_t         *pixels,
+                           size_t            row_pitch)
+{
+    render_job(cs, pp, pixels, row_pitch, true);
+}
@@ -0,0 +1,35 @@
+#ifndef CPURENDER_included
+#define CPURENDER_included
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "leds.h"
+#include "prog.h"
+
+typedef struct cpu_render_state cpu_render_state;
+
+// The CPU renderer runs native shaders, or interprets the GLSL of
+// programs that prog_use_cpu readied, straight into LED pixels.  It
+// shades tiles on the caller's thread and on one worker pinned to
+// each of `cores', which should leave the caller's core out.  NULL
+// cores means every core but the lowest.
+extern cpu_render_state *cpu_render_init(size_t     width,
+                                         size_t     height,
+                                         const int *cores,
+                                         size_t     core_count);
+extern void              cpu_render_deinit(cpu_render_state *);
+
+// Programs with neither draw black.
+extern void              cpu_render_frame(cpu_render_state *,
+                                          const prog       *,
+                                          LED_pixel        *pixels,
+                                          size_t            row_pitch);
+
+// The same, as eight bit RGBA for the color stage.
+extern void              cpu_render_frame_rgba(cpu_render_state *,
+                                               const prog       *,
+                                               uint32_t         *pixels,
+                                               size_t            row_pitch);
+
+#endif /* !CPURENDER_included */
@@ -1,14 +1,19 @@
 #include "egl.h"
 
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <EGL/egl.h>
+#include <EGL/eglext.h>
 
 struct EGL_context {
     EGLDisplay display;
     EGLContext context;
     EGLSurface surface;
     int        native_window[3];
+    bool       shared;          // another context owns the display
 };
 
 static __thread char *last_error;
@@ -65,13 +70,43 @@ const char *EGL_last_error(void)
     return last_error;
 }
 
-EGL_context *init_EGL(uint32_t native_surface,
-                      uint32_t surface_width,
-                      uint32_t surface_height)
+// Without a native window, prefer Mesa's surfaceless platform, which
+// needs no X or Wayland server.
+static EGLDisplay get_display(bool headless)
 {
+#ifdef EGL_PLATFORM_SURFACELESS_MESA
+    const char *extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+    if (headless && extensions &&
+        strstr(extensions, "EGL_MESA_platform_surfaceless")) {
+        PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+            (PFNEGLGETPLATFORMDISPLAYEXTPROC)
+            eglGetProcAddress("eglGetPlatformDisplayEXT");
+        if (get_platform_display)
+            return get_platform_display(EGL_PLATFORM_SURFACELESS_MESA,
+                                        EGL_DEFAULT_DISPLAY,
+                                        NULL);
+    }
+#endif
+    return eglGetDisplay(EGL_DEFAULT_DISPLAY);
+}
+
+static void release_display(EGL_context *ctx)
+{
+    if (!ctx->shared)
+        eglTerminate(ctx->display);
+}
+
+EGL_context *init_EGL(uint32_t     native_surface,
+                      uint32_t     surface_width,
+                      uint32_t     surface_height,
+                      EGL_context *share)
+{
+    // With no native surface, render offscreen into a pbuffer.
+    bool headless = native_surface == 0;
     EGL_context *ctx = calloc(1, sizeof *ctx);
+    ctx->shared = share != NULL;
 
-    ctx->display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    ctx->display = get_display(headless);
     if (ctx->display == EGL_NO_DISPLAY) {
         strerror_r(errno, last_error_buf, sizeof last_error_buf);
         last_error = last_error_buf;
@@ -82,7 +117,7 @@ EGL_context *init_EGL(uint32_t native_surface,
     EGLint major = 0, minor = 0;
     if (eglInitialize(ctx->display, &major, &minor) == EGL_FALSE) {
         last_error = egl_error_string("eglInitialize", eglGetError());
-        eglTerminate(ctx->display);
+        release_display(ctx);
         free(ctx);
         return NULL;
     }
@@ -99,14 +134,23 @@ EGL_context *init_EGL(uint32_t native_surface,
         EGL_NATIVE_RENDERABLE, EGL_TRUE,
         EGL_NONE
     };
+    static const EGLint pbuffer_attribute_list[] = {
+        EGL_RED_SIZE, 8,
+        EGL_GREEN_SIZE, 8,
+        EGL_BLUE_SIZE, 8,
+        EGL_ALPHA_SIZE, 8,
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
+        EGL_NONE
+    };
     EGLConfig config = 0;
     EGLint numconfig = 0;
     if (!eglChooseConfig(ctx->display,
-                         attribute_list,
+                         headless ? pbuffer_attribute_list : attribute_list,
                          &config, 1,
-                         &numconfig)) {
+                         &numconfig) || numconfig == 0) {
         last_error = egl_error_string("eglChooseConfig", eglGetError());
-        eglTerminate(ctx->display);
+        release_display(ctx);
         free(ctx);
         return NULL;
     }
@@ -118,24 +162,40 @@ EGL_context *init_EGL(uint32_t native_surface,
     ctx->context =
         eglCreateContext(ctx->display,
                          config,
-                         EGL_NO_CONTEXT,
+                         share ? share->context : EGL_NO_CONTEXT,
                          context_attributes);
     if (ctx->context == EGL_NO_CONTEXT) {
         last_error = "could not create EGL context";
-        eglTerminate(ctx->display);
+        release_display(ctx);
         free(ctx);
         return NULL;
     }
 
-    ctx->native_window[0] = native_surface;
-    ctx->native_window[1] = surface_width;
-    ctx->native_window[2] = surface_height;
-    ctx->surface =
-        eglCreateWindowSurface(ctx->display, config, ctx->native_window, NULL);
+    if (headless) {
+        // The render target is an FBO, so the pbuffer can be tiny.
+        static const EGLint pbuffer_attributes[] = {
+            EGL_WIDTH, 1,
+            EGL_HEIGHT, 1,
+            EGL_NONE
+        };
+        ctx->surface =
+            eglCreatePbufferSurface(ctx->display, config, pbuffer_attributes);
+    } else {
+        ctx->native_window[0] = native_surface;
+        ctx->native_window[1] = surface_width;
+        ctx->native_window[2] = surface_height;
+        ctx->surface =
+            eglCreateWindowSurface(ctx->display,
+                                   config,
+                                   (EGLNativeWindowType)ctx->native_window,
+                                   NULL);
+    }
     if (ctx->surface == EGL_NO_SURFACE) {
-        last_error = egl_error_string("eglCreateWindowSurface", eglGetError());
+        last_error = egl_error_string(headless ? "eglCreatePbufferSurface"
+                                               : "eglCreateWindowSurface",
+                                      eglGetError());
         eglDestroyContext(ctx->display, ctx->context);
-        eglTerminate(ctx->display);
+        release_display(ctx);
         free(ctx);
         return NULL;
     }
@@ -146,7 +206,7 @@ EGL_context *init_EGL(uint32_t native_surface,
                        ctx->context) == EGL_FALSE) {
         last_error = egl_error_string("eglMakeCurrent", eglGetError());
         eglDestroyContext(ctx->display, ctx->context);
-        eglTerminate(ctx->display);
+        release_display(ctx);
         free(ctx);
         return NULL;
     }
@@ -171,7 +231,7 @@ void deinit_EGL(EGL_context *ctx)
     if (eglDestroyContext(ctx->display, ctx->context) != EGL_TRUE) {
         // fprintf(stderr, "eglDestroyContext failed\n");
     }
-    if (eglTerminate(ctx->display) != EGL_TRUE) {
+    if (!ctx->shared && eglTerminate(ctx->display) != EGL_TRUE) {
         // fprintf(stderr, "eglTerminate failed\n");
     }
     free(ctx);
@@ -6,9 +6,12 @@
 
 typedef struct EGL_context EGL_context;
 
-extern EGL_context *init_EGL(uint32_t native_surface,
-                             uint32_t surface_width,
-                             uint32_t surface_height);
+// A context created with `share' sees its programs, textures and
+// buffers.  The sharing context must outlive it.
+extern EGL_context *init_EGL(uint32_t     native_surface,
+                             uint32_t     surface_width,
+                             uint32_t     surface_height,
+                             EGL_context *share);
 extern void         deinit_EGL(EGL_context *);
 
 extern const char  *EGL_last_error(void);
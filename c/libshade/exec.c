@@ -2,19 +2,26 @@
 #include "exec.h"
 
 #include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 #include "bcm.h"
-#include "queue.h"
+#include "color.h"
+#include "cpurender.h"
+#include "power.h"
 #include "render.h"
+#include "ring.h"
 
-#define FBQ_SIZE 200
-#define CBQ_SIZE 200
+#define DEFAULT_PIPELINE_DEPTH 3
+#define CPU_RENDER_RETRY_NS    10000000 // 10 msec
 
 struct exec {
     // borrowed objects
     bcm_context      *bcm;
+    EGL_context      *egl;
     LEDs_context     *leds;
 
     // start/stop control
@@ -29,22 +36,69 @@ struct exec {
     struct timespec time_zero;
     pthread_mutex_t fps_lock;
 
+    // frame accounting, never reset
+    _Atomic uint64_t shown_count;
+    _Atomic uint64_t output_errors;
+    _Atomic uint64_t vsync_missed;
+    _Atomic uint64_t render_errors;
+    uint64_t         dropped_before; // by previous pipelines
+
+    // telemetry.  Each histogram has one writer thread.
+    histogram        hist[EM_COUNT];
+    histogram        hist_baseline[EM_COUNT];
+    pthread_mutex_t  stats_lock;  // readers only
+    _Atomic unsigned start_count; // output thread restarts frame timing
+
+    // output thread state
+    unsigned         output_start_count;
+    uint64_t         last_shown_ns;
+
     // current program
     const prog     *prog;
     pthread_mutex_t prog_lock;
 
+    // background compilation.  Protected by prog_lock.
+    bool            background;
+    bool            compile_shutdown;
+    const prog     *pending;    // waiting to be prepared for a switch
+    const prog     *preparing;  // in render_prepare, unlocked
+    const prog     *drawing;    // in the render thread's hands
+    const prog     *drawn;      // last program the render thread drew
+    uint64_t        switch_count;
+    pthread_cond_t  compile_cond;
+    pthread_cond_t  prog_done_cond;
+
     // worker threads
     pthread_t       render_thread;
+    pthread_t       compile_thread;
     pthread_t       cmd_thread;
     pthread_t       output_thread;
 
+    // pipeline configuration
+    pipeline_policy policy;
+    size_t          depth;
+    readback_mode   mode;
+    bool            direct;     // render thread fills cmdbuffers
+    color_stage    *color;      // framebuffers are RGBA when set
+    power_limiter  *limiter;
+    bool            delta;      // LEDs send only changed rows
+
+    // CPU renderer workers' cores.  NULL means the default.  Changed
+    // only while the render thread is parked.
+    int            *cpu_cores;
+    size_t          cpu_core_count;
+    bool            cpu_cores_changed;
+
     // inter-worker queues
-    queue          *framebuffer_queue;
-    queue          *cmdbuffer_queue;
+    ring           *framebuffer_queue;
+    ring           *cmdbuffer_queue;
 
     // inter-worker data buffers
-    LED_pixel      *framebuffers[FBQ_SIZE];
-    LED_cmd        *cmdbuffers[CBQ_SIZE];
+    size_t          framebuffer_count;
+    size_t          cmdbuffer_count;
+    void          **framebuffers;
+    LED_cmd       **cmdbuffers;
+    size_t         *cmdbuffer_sizes;
 };
 
 static void thread_started(exec *ex, const char *name)
@@ -62,41 +116,107 @@ static void thread_finished(exec *ex)
     pthread_mutex_unlock(&ex->running_lock);
 }
 
-static bool check_running(exec *ex)
+typedef enum worker {
+    RENDER_WORKER,
+    CMD_WORKER,
+    OUTPUT_WORKER,
+} worker;
+
+static void retire_frames(exec *ex, size_t keep);
+
+// Returns false at shutdown.  Otherwise blocks until the exec is
+// running and this worker has work in the current mode.  The output
+// worker finishes its USB transfers before parking, because the
+// pipeline may be rebuilt while it sleeps.
+static bool check_running(exec *ex, worker who)
 {
     bool go = true;
+    bool parked = false;
     pthread_mutex_lock(&ex->running_lock);
-    while (!ex->running && !ex->shutdown) {
-        ex->running_count--;
-        pthread_cond_broadcast(&ex->running_cond);
+    while ((!ex->running || (who == CMD_WORKER && ex->direct)) &&
+           !ex->shutdown) {
+        if (who == OUTPUT_WORKER && LEDs_transfers_in_flight(ex->leds)) {
+            pthread_mutex_unlock(&ex->running_lock);
+            retire_frames(ex, 0);
+            pthread_mutex_lock(&ex->running_lock);
+            continue;
+        }
+        // Announce only the change.  Parked workers that broadcast on
+        // every wakeup keep waking each other.
+        if (!parked) {
+            ex->running_count--;
+            parked = true;
+            pthread_cond_broadcast(&ex->running_cond);
+        }
         pthread_cond_wait(&ex->running_cond, &ex->running_lock);
-        ex->running_count++;
     }
+    if (parked)
+        ex->running_count++;
     go = !ex->shutdown;
     pthread_mutex_unlock(&ex->running_lock);
     return go;
 }
 
+// Wake workers blocked on a queue or on vsync so they notice a stop.
+static void interrupt_waits(exec *ex)
+{
+    LEDs_interrupt_vsync(ex->leds);
+    if (ex->framebuffer_queue)
+        ring_interrupt(ex->framebuffer_queue);
+    if (ex->cmdbuffer_queue)
+        ring_interrupt(ex->cmdbuffer_queue);
+}
+
+static void resume_waits(exec *ex)
+{
+    LEDs_resume_vsync(ex->leds);
+    if (ex->framebuffer_queue)
+        ring_resume(ex->framebuffer_queue);
+    if (ex->cmdbuffer_queue)
+        ring_resume(ex->cmdbuffer_queue);
+}
+
 static void shutdown(exec *ex)
 {
     pthread_mutex_lock(&ex->running_lock);
     ex->shutdown = true;
     pthread_cond_broadcast(&ex->running_cond);
     pthread_mutex_unlock(&ex->running_lock);
+
+    pthread_mutex_lock(&ex->prog_lock);
+    ex->compile_shutdown = true;
+    pthread_cond_broadcast(&ex->compile_cond);
+    pthread_mutex_unlock(&ex->prog_lock);
 }
 
+// The render thread holds the program from get_prog until put_prog.
 static const prog *get_prog(exec *ex)
 {
     pthread_mutex_lock(&ex->prog_lock);
     const prog *pp = ex->prog;
+    ex->drawing = pp;
     pthread_mutex_unlock(&ex->prog_lock);
     return pp;
 }
 
-static void set_prog(exec *ex, const prog *pp)
+static void put_prog(exec *ex)
 {
     pthread_mutex_lock(&ex->prog_lock);
-    ex->prog = pp;
+    if (ex->drawing) {
+        ex->drawing = NULL;
+        pthread_cond_broadcast(&ex->prog_done_cond);
+    }
+    pthread_mutex_unlock(&ex->prog_lock);
+}
+
+// Called by the render thread after each frame.
+static void note_drawn(exec *ex, const prog *pp)
+{
+    pthread_mutex_lock(&ex->prog_lock);
+    if (ex->drawn != pp) {
+        ex->drawn = pp;
+        ex->switch_count++;
+    }
     pthread_mutex_unlock(&ex->prog_lock);
 }
 
@@ -115,73 +235,475 @@ static void count_frame(exec *ex)
     pthread_mutex_unlock(&ex->fps_lock);
 }
 
+// Native programs, and every program when there is no GPU, draw on
+// the CPU straight into the pixel buffer, so there is no readback.
+static void draw_on_cpu(exec             *ex,
+                        cpu_render_state *cs,
+                        const prog       *pp,
+                        LED_pixel        *pixels,
+                        size_t            row_pitch)
+{
+    uint64_t t0 = stats_now_ns();
+    cpu_render_frame(cs, pp, pixels, row_pitch);
+    histogram_record(&ex->hist[EM_RENDER], stats_now_ns() - t0);
+}
+
 static void *render_thread_main(void *user_data)
 {
     exec *ex = user_data;
     thread_started(ex, "SHD Render");
 
-    render_state *rs = render_init(ex->bcm);
-    while (check_running(ex)) {
+    render_state *rs = render_init(ex->bcm, ex->egl);
+    if (!rs)
+        fprintf(stderr, "render: no GPU, only CPU programs will draw\n");
+    cpu_render_state *cs = NULL;
+    bool cs_failed = false;
+    for (;;) {
+        put_prog(ex);
+        if (!check_running(ex, RENDER_WORKER))
+            break;
+        if (ex->cpu_cores_changed && cs) {
+            cpu_render_deinit(cs);
+            cs = NULL;
+        }
+        ex->cpu_cores_changed = false;
         const prog *pp = get_prog(ex);
-        render_frame(rs, pp);
-        size_t index = queue_acquire_empty(ex->framebuffer_queue);
-        LED_pixel *pixels = ex->framebuffers[index];
-        bcm_read_pixels(ex->bcm, pixels, LEDs_framebuffer_pitch(ex->leds));
-        queue_release_full(ex->framebuffer_queue);
+        bool on_cpu = !rs || prog_native_shader(pp) || prog_cpu_program(pp);
+        if (on_cpu && !cs) {
+            cs = cpu_render_init(bcm_get_viewport_width(ex->bcm),
+                                 bcm_get_viewport_height(ex->bcm),
+                                 ex->cpu_cores, ex->cpu_core_count);
+            if (!cs) {
+                // Skip the frame and retry, so stop and program
+                // switches still work.
+                if (!cs_failed)
+                    fprintf(stderr, "render: can't start the CPU renderer\n");
+                cs_failed = true;
+                atomic_fetch_add_explicit(&ex->render_errors, 1,
+                                          memory_order_relaxed);
+                struct timespec retry = { 0, CPU_RENDER_RETRY_NS };
+                nanosleep(&retry, NULL);
+                continue;
+            }
+            cs_failed = false;
+        }
+        if (!on_cpu) {
+            uint64_t t0 = stats_now_ns();
+            render_frame(rs, pp);
+            histogram_record(&ex->hist[EM_RENDER], stats_now_ns() - t0);
+        }
+        note_drawn(ex, pp);
+
+        if (ex->direct) {
+            // Read pixels into the cmdbuffer's payload slots, and the
+            // frame is ready to send.
+            size_t index = ring_acquire_empty(ex->cmdbuffer_queue);
+            if (index == RING_INTERRUPTED)
+                continue;
+            LED_cmd *cmds = ex->cmdbuffers[index];
+            LED_pixel *pixels = (LED_pixel *)cmds + LEDs_best_offset(ex->leds);
+            size_t pitch = LEDs_best_row_pitch(ex->leds);
+            uint64_t t1 = stats_now_ns();
+            if (on_cpu)
+                draw_on_cpu(ex, cs, pp, pixels, pitch);
+            else
+                bcm_read_pixels(ex->bcm, pixels, pitch);
+            uint64_t t2 = stats_now_ns();
+            if (!on_cpu)
+                histogram_record(&ex->hist[EM_READBACK], t2 - t1);
+            size_t size = LEDs_finish_direct_cmds(ex->leds, cmds);
+            histogram_record(&ex->hist[EM_ENCODE], stats_now_ns() - t2);
+            histogram_record(&ex->hist[EM_CMD_BYTES], size);
+            ex->cmdbuffer_sizes[index] = size;
+            ring_release_full(ex->cmdbuffer_queue);
+            continue;
+        }
+
+        size_t index = ring_acquire_empty(ex->framebuffer_queue);
+        if (index == RING_INTERRUPTED)
+            continue;
+        void *pixels = ex->framebuffers[index];
+        size_t pitch = LEDs_framebuffer_pitch(ex->leds);
+        if (on_cpu && ex->color) {
+            uint64_t t1 = stats_now_ns();
+            cpu_render_frame_rgba(cs, pp, pixels, pitch);
+            histogram_record(&ex->hist[EM_RENDER], stats_now_ns() - t1);
+        } else if (on_cpu) {
+            draw_on_cpu(ex, cs, pp, pixels, pitch);
+        } else {
+            uint64_t t1 = stats_now_ns();
+            if (ex->color)
+                bcm_read_rgba(ex->bcm, pixels, pitch);
+            else
+                bcm_read_pixels(ex->bcm, pixels, pitch);
+            histogram_record(&ex->hist[EM_READBACK], stats_now_ns() - t1);
+        }
+        ring_release_full(ex->framebuffer_queue);
     }
-    render_deinit(rs);
+    put_prog(ex);
+    if (cs)
+        cpu_render_deinit(cs);
+    if (rs)
+        render_deinit(rs);
     thread_finished(ex);
     return NULL;
 }
 
+// Prepares each pending program on a context of its own, so the
+// render thread finds it in the program cache and keeps drawing the
+// old program meanwhile.  The switch happens between frames.
+static void *compile_thread_main(void *user_data)
+{
+    exec *ex = user_data;
+    pthread_setname_np(pthread_self(), "SHD Compile");
+
+    // Offscreen, so it needs no surface of its own.
+    EGL_context *egl = init_EGL(0, 1, 1, ex->egl);
+    if (!egl)
+        fprintf(stderr, "compile: %s\n", EGL_last_error());
+
+    pthread_mutex_lock(&ex->prog_lock);
+    while (!ex->compile_shutdown) {
+        const prog *pp = ex->pending;
+        if (!pp) {
+            pthread_cond_wait(&ex->compile_cond, &ex->prog_lock);
+            continue;
+        }
+        if (egl) {
+            ex->preparing = pp;
+            pthread_mutex_unlock(&ex->prog_lock);
+            (void)render_prepare(pp);
+            pthread_mutex_lock(&ex->prog_lock);
+            ex->preparing = NULL;
+            pthread_cond_broadcast(&ex->prog_done_cond);
+        }
+        // Unless another program was queued meanwhile.
+        if (ex->pending == pp) {
+            ex->pending = NULL;
+            ex->prog = pp;
+            pthread_cond_broadcast(&ex->prog_done_cond);
+        }
+    }
+    pthread_mutex_unlock(&ex->prog_lock);
+
+    if (egl)
+        deinit_EGL(egl);
+    return NULL;
+}
+
+typedef struct encode_rows {
+    const color_stage *color;
+    power_limiter     *limiter;
+    const void        *pixels;
+} encode_rows;
+
+static void encode_row(void      *user,
+                       LED_pixel *dst,
+                       size_t     src_index,
+                       size_t     row,
+                       size_t     width)
+{
+    encode_rows *er = user;
+    if (er->color) {
+        const uint32_t *src = (const uint32_t *)er->pixels + src_index;
+        color_convert_row(er->color, dst, src, width, row);
+    } else {
+        const LED_pixel *src = (const LED_pixel *)er->pixels + src_index;
+        memcpy(dst, src, width * sizeof *dst);
+    }
+    if (er->limiter)
+        power_limit_row(er->limiter, dst, width);
+}
+
+// The color stage and the power limiter work on each row as it is
+// encoded, while it is still in cache, so the framebuffer is read
+// once.
+static size_t encode_frame(exec *ex, const void *pixels, LED_cmd *cmds)
+{
+    if (!ex->color && !ex->limiter)
+        return LEDs_create_cmds(ex->leds, pixels, cmds);
+    if (ex->color)
+        color_next_frame(ex->color);
+    if (ex->limiter)
+        power_next_frame(ex->limiter);
+    encode_rows er = {
+        .color   = ex->color,
+        .limiter = ex->limiter,
+        .pixels  = pixels,
+    };
+    return LEDs_fill_cmds(ex->leds, encode_row, &er, cmds);
+}
+
 static void *cmd_thread_main(void *user_data)
 {
     exec *ex = user_data;
     thread_started(ex, "SHD cmd");
-    while (check_running(ex)) {
-        size_t cb_idx = queue_acquire_empty(ex->cmdbuffer_queue);
-        size_t fb_idx = queue_acquire_full(ex->framebuffer_queue);
+    while (check_running(ex, CMD_WORKER)) {
+        size_t cb_idx = ring_acquire_empty(ex->cmdbuffer_queue);
+        if (cb_idx == RING_INTERRUPTED)
+            continue;
+        size_t fb_idx = ring_acquire_full(ex->framebuffer_queue);
+        if (fb_idx == RING_INTERRUPTED)
+            continue;
+        histogram_record(&ex->hist[EM_FB_QUEUE],
+                         ring_occupancy(ex->framebuffer_queue));
 
-        LED_pixel *pixels = ex->framebuffers[fb_idx];
-        LED_cmd   *cmds   = ex->cmdbuffers[cb_idx];
-        LEDs_create_cmds(ex->leds, pixels, cmds);
+        void    *pixels = ex->framebuffers[fb_idx];
+        LED_cmd *cmds   = ex->cmdbuffers[cb_idx];
+        uint64_t t0 = stats_now_ns();
+        size_t size = encode_frame(ex, pixels, cmds);
+        histogram_record(&ex->hist[EM_ENCODE], stats_now_ns() - t0);
+        histogram_record(&ex->hist[EM_CMD_BYTES], size);
+        ex->cmdbuffer_sizes[cb_idx] = size;
 
-        queue_release_full(ex->cmdbuffer_queue);
-        queue_release_empty(ex->framebuffer_queue);
+        ring_release_full(ex->cmdbuffer_queue);
+        ring_release_empty(ex->framebuffer_queue);
     }
     thread_finished(ex);
     return NULL;
 }
 
+// Counts a failed USB transfer or vsync wait.
+static void output_failed(exec *ex)
+{
+    atomic_fetch_add_explicit(&ex->output_errors, 1, memory_order_relaxed);
+}
+
+// Wait for the oldest transfers until at most `keep' are in flight,
+// and hand their cmdbuffers back to the cmd thread.  A frame is
+// shown when its transfer finishes.
+static void retire_frames(exec *ex, size_t keep)
+{
+    while (LEDs_transfers_in_flight(ex->leds) > keep) {
+        bool ok = LEDs_retire_cmds(ex->leds);
+        ring_release_empty(ex->cmdbuffer_queue);
+        if (!ok) {
+            output_failed(ex);
+            continue;
+        }
+        uint64_t now = stats_now_ns();
+
+        count_frame(ex);
+        atomic_fetch_add_explicit(&ex->shown_count, 1, memory_order_relaxed);
+
+        // Don't count time spent stopped as a frame interval.
+        unsigned starts = atomic_load(&ex->start_count);
+        if (starts == ex->output_start_count && ex->last_shown_ns)
+            histogram_record(&ex->hist[EM_FRAME], now - ex->last_shown_ns);
+        ex->output_start_count = starts;
+        ex->last_shown_ns = now;
+    }
+}
+
 static void *output_thread_main(void *user_data)
 {
     exec *ex = user_data;
     thread_started(ex, "SHD Output");
-    while (check_running(ex)) {
-        size_t index = queue_acquire_full(ex->cmdbuffer_queue);
+    while (check_running(ex, OUTPUT_WORKER)) {
+        // Each transfer in flight holds a cmdbuffer, and a mailbox
+        // lets us hold only one.
+        size_t limit = LEDs_max_transfers(ex->leds);
+        size_t hold_limit = ring_hold_limit(ex->cmdbuffer_queue);
+        if (limit > hold_limit)
+            limit = hold_limit;
+
+        uint64_t t0 = stats_now_ns();
+        retire_frames(ex, limit - 1);
+        uint64_t usb_wait = stats_now_ns() - t0;
+
+        size_t index = ring_acquire_full(ex->cmdbuffer_queue);
+        if (index == RING_INTERRUPTED)
+            continue;
+        histogram_record(&ex->hist[EM_CB_QUEUE],
+                         ring_occupancy(ex->cmdbuffer_queue));
         LED_cmd *cmds = ex->cmdbuffers[index];
+        size_t size = ex->cmdbuffer_sizes[index];
 
-        LEDs_write_cmds(ex->leds, cmds);
-        
-        queue_release_empty(ex->cmdbuffer_queue);
-        
-        count_frame(ex);
+        // Release frames at the panel's refresh.  Back pressure
+        // through the queues paces the renderer too.  A frame whose
+        // vsync never came goes out anyway, unless the FTDI is still
+        // stalled on GPIOL1.  Then it couldn't drain, so drop it.
+        if (LEDs_get_vsync_mode(ex->leds) != LVS_OFF ||
+            LEDs_vsync_stalled(ex->leds)) {
+            uint64_t tv = stats_now_ns();
+            LEDs_vsync_wait vw = LEDs_await_vsync(ex->leds);
+            switch (vw) {
+
+            case LVW_SYNCED:
+                break;
+
+            case LVW_MISSED:
+            case LVW_STALLED:
+                atomic_fetch_add_explicit(&ex->vsync_missed, 1,
+                                          memory_order_relaxed);
+                break;
+
+            case LVW_FAILED:
+                output_failed(ex);
+                break;
+            }
+            histogram_record(&ex->hist[EM_VSYNC], stats_now_ns() - tv);
+            if (vw == LVW_STALLED) {
+                // Older frames went out before the wait, so they
+                // drain.  Slots are released in order.
+                retire_frames(ex, 0);
+                ring_release_empty(ex->cmdbuffer_queue);
+                continue;
+            }
+        }
+
+        uint64_t t1 = stats_now_ns();
+        if (!LEDs_submit_cmds(ex->leds, cmds, size)) {
+            // Slots are released in order, so retire the older
+            // frames before giving this one back.
+            output_failed(ex);
+            retire_frames(ex, 0);
+            ring_release_empty(ex->cmdbuffer_queue);
+        }
+        usb_wait += stats_now_ns() - t1;
+        histogram_record(&ex->hist[EM_OUTPUT], usb_wait);
     }
+    retire_frames(ex, 0);
     thread_finished(ex);
     return NULL;
 }
 
-exec *create_exec(bcm_context *bcm, LEDs_context *leds)
+// The render->cmd queue is where a policy applies.  In queue mode it
+// is a ring `depth' frames deep and the render thread blocks when it
+// fills.  In mailbox mode the render thread never blocks and the cmd
+// thread always encodes the newest frame.  The cmd->output queue is
+// `depth' deep either way, so every encoded frame is sent.
+//
+// In direct mode there is no render->cmd queue or cmd thread, and
+// the policy applies to the render->output queue instead.
+
+static bool create_pipeline(exec           *ex,
+                            pipeline_policy policy,
+                            size_t          depth,
+                            readback_mode   mode)
+{
+    // The color stage and the power limiter run on the cmd thread.
+    bool can_direct = LEDs_can_read_direct(ex->leds) &&
+                      !ex->color && !ex->limiter;
+    bool direct;
+    switch (mode) {
+
+    case RM_COPY:
+        direct = false;
+        break;
+
+    case RM_DIRECT:
+        if (!can_direct)
+            return false;
+        direct = true;
+        break;
+
+    case RM_AUTO:
+        // Direct readback sends every row, so delta mode needs copy.
+        direct = can_direct && !ex->delta;
+        break;
+
+    default:
+        return false;
+    }
+
+    ring **policy_queue = direct ? &ex->cmdbuffer_queue
+                                 : &ex->framebuffer_queue;
+    switch (policy) {
+
+    case PP_QUEUE:
+        *policy_queue = create_ring(depth);
+        break;
+
+    case PP_MAILBOX:
+        *policy_queue = create_mailbox_ring();
+        break;
+
+    default:
+        return false;
+    }
+    if (!*policy_queue)
+        return false;
+    if (!direct && !(ex->cmdbuffer_queue = create_ring(depth)))
+        return false;
+    ex->policy = policy;
+    ex->depth = depth;
+    ex->mode = mode;
+    ex->direct = direct;
+
+    if (ex->framebuffer_queue) {
+        ex->framebuffer_count = ring_slot_count(ex->framebuffer_queue);
+        ex->framebuffers = calloc(ex->framebuffer_count,
+                                  sizeof *ex->framebuffers);
+        if (!ex->framebuffers)
+            return false;
+        for (size_t i = 0; i < ex->framebuffer_count; i++) {
+            if (ex->color)
+                ex->framebuffers[i] = LEDs_alloc_rgba_framebuffer(ex->leds);
+            else
+                ex->framebuffers[i] = LEDs_alloc_framebuffer(ex->leds);
+            if (!ex->framebuffers[i])
+                return false;
+        }
+    }
+
+    ex->cmdbuffer_count = ring_slot_count(ex->cmdbuffer_queue);
+    ex->cmdbuffers = calloc(ex->cmdbuffer_count, sizeof *ex->cmdbuffers);
+    ex->cmdbuffer_sizes = calloc(ex->cmdbuffer_count,
+                                 sizeof *ex->cmdbuffer_sizes);
+    if (!ex->cmdbuffers || !ex->cmdbuffer_sizes)
+        return false;
+    for (size_t i = 0; i < ex->cmdbuffer_count; i++)
+        if (!(ex->cmdbuffers[i] = LEDs_alloc_cmdbuffer(ex->leds)))
+            return false;
+
+    return true;
+}
+
+static void destroy_pipeline(exec *ex)
+{
+    if (ex->framebuffers) {
+        for (size_t i = 0; i < ex->framebuffer_count; i++)
+            if (ex->framebuffers[i])
+                LEDs_free_framebuffer(ex->framebuffers[i]);
+        free(ex->framebuffers);
+        ex->framebuffers = NULL;
+    }
+
+    if (ex->cmdbuffers) {
+        for (size_t i = 0; i < ex->cmdbuffer_count; i++)
+            if (ex->cmdbuffers[i])
+                LEDs_free_cmdbuffer(ex->cmdbuffers[i]);
+        free(ex->cmdbuffers);
+        ex->cmdbuffers = NULL;
+    }
+    free(ex->cmdbuffer_sizes);
+    ex->cmdbuffer_sizes = NULL;
+
+    if (ex->cmdbuffer_queue) {
+        ex->dropped_before += ring_dropped_count(ex->cmdbuffer_queue);
+        destroy_ring(ex->cmdbuffer_queue);
+        ex->cmdbuffer_queue = NULL;
+    }
+    if (ex->framebuffer_queue) {
+        ex->dropped_before += ring_dropped_count(ex->framebuffer_queue);
+        destroy_ring(ex->framebuffer_queue);
+        ex->framebuffer_queue = NULL;
+    }
+}
+
+exec *create_exec(bcm_context *bcm, EGL_context *egl, LEDs_context *leds)
 {
     exec *ex = calloc(1, sizeof *ex);
     if (!ex)
         goto FAIL;
 
     ex->bcm  = bcm;
+    ex->egl  = egl;
     ex->leds = leds;
 
-    ex->framebuffer_queue = create_queue(FBQ_SIZE);
-    ex->cmdbuffer_queue = create_queue(CBQ_SIZE);
+    if (!create_pipeline(ex, PP_QUEUE, DEFAULT_PIPELINE_DEPTH, RM_AUTO))
+        goto FAIL;
 
     if (pthread_cond_init(&ex->running_cond, NULL))
         goto FAIL;
@@ -192,11 +714,14 @@ exec *create_exec(bcm_context *bcm, LEDs_context *leds)
     if (pthread_mutex_init(&ex->prog_lock, NULL))
         goto FAIL;
 
-    for (size_t i = 0; i < FBQ_SIZE; i++)
-        ex->framebuffers[i] = LEDs_alloc_framebuffer(leds);
+    if (pthread_cond_init(&ex->compile_cond, NULL))
+        goto FAIL;
+
+    if (pthread_cond_init(&ex->prog_done_cond, NULL))
+        goto FAIL;
 
-    for (size_t i = 0; i < CBQ_SIZE; i++)
-        ex->cmdbuffers[i] = LEDs_alloc_cmdbuffer(leds);
+    if (pthread_mutex_init(&ex->stats_lock, NULL))
+        goto FAIL;
 
     if (pthread_create(&ex->render_thread, NULL, render_thread_main, ex))
         goto FAIL;
@@ -207,6 +732,9 @@ exec *create_exec(bcm_context *bcm, LEDs_context *leds)
     if (pthread_create(&ex->output_thread, NULL, output_thread_main, ex))
         goto FAIL;
 
+    if (pthread_create(&ex->compile_thread, NULL, compile_thread_main, ex))
+        goto FAIL;
+
     return ex;
 
 FAIL:
@@ -217,6 +745,7 @@ FAIL:
 
 void destroy_exec(exec *ex)
 {
+    exec_stop(ex);
     shutdown(ex);
 
     if (ex->output_thread) {
@@ -231,31 +760,32 @@ void destroy_exec(exec *ex)
         // pthread_cancel(ex->render_thread);
         pthread_join(ex->render_thread, NULL);
     }
+    if (ex->compile_thread)
+        pthread_join(ex->compile_thread, NULL);
 
-    for (size_t i = 0; i < FBQ_SIZE; i++)
-        if (ex->framebuffers[i])
-            LEDs_free_framebuffer(ex->framebuffers[i]);
-
-    for (size_t i = 0; i < CBQ_SIZE; i++)
-        if (ex->cmdbuffers[i])
-            LEDs_free_cmdbuffer(ex->cmdbuffers[i]);
-
-    if (ex->cmdbuffer_queue)
-        destroy_queue(ex->cmdbuffer_queue);
-    if (ex->framebuffer_queue)
-        destroy_queue(ex->framebuffer_queue);
+    destroy_pipeline(ex);
 
+    (void)pthread_mutex_destroy(&ex->stats_lock);
+    (void)pthread_cond_destroy(&ex->prog_done_cond);
+    (void)pthread_cond_destroy(&ex->compile_cond);
     (void)pthread_mutex_destroy(&ex->prog_lock);
     (void)pthread_cond_destroy(&ex->running_cond);
     (void)pthread_mutex_destroy(&ex->running_lock);
 
+    if (ex->color)
+        destroy_color_stage(ex->color);
+    if (ex->limiter)
+        destroy_power_limiter(ex->limiter);
+    free(ex->cpu_cores);
     free(ex);
 }
 
 void exec_start(exec *ex)
 {
     pthread_mutex_lock(&ex->running_lock);
+    resume_waits(ex);
     ex->running = true;
+    atomic_fetch_add(&ex->start_count, 1);
     pthread_cond_broadcast(&ex->running_cond);
     pthread_mutex_unlock(&ex->running_lock);
     reset_fps(ex);
@@ -266,9 +796,12 @@ void exec_stop(exec *ex)
 {
     pthread_mutex_lock(&ex->running_lock);
     ex->running = false;
-    while (ex->running_count) {
+    // A worker blocked on a queue whose peer has already parked would
+    // never get back to check_running.  Once the queues are
+    // interrupted, every acquire returns at once until exec_start.
+    interrupt_waits(ex);
+    while (ex->running_count)
         pthread_cond_wait(&ex->running_cond, &ex->running_lock);
-    }
     pthread_mutex_unlock(&ex->running_lock);
 }
 
@@ -284,8 +817,230 @@ double exec_fps(exec *ex)
     return fps;
 }
 
+// While stopped there is nothing on screen to keep drawing, so the
+// program is used at once either way.
 void exec_use_prog(exec *ex, const prog *pp)
 {
-    set_prog(ex, pp);
+    pthread_mutex_lock(&ex->running_lock);
+    bool running = ex->running;
+    pthread_mutex_unlock(&ex->running_lock);
+
+    pthread_mutex_lock(&ex->prog_lock);
+    if (ex->background && running && ex->prog && pp != ex->prog) {
+        ex->pending = pp;
+        pthread_cond_signal(&ex->compile_cond);
+    } else {
+        ex->pending = NULL;
+        ex->prog = pp;
+    }
+    pthread_mutex_unlock(&ex->prog_lock);
     reset_fps(ex);
 }
+
+void exec_set_background_compile(exec *ex, bool enabled)
+{
+    pthread_mutex_lock(&ex->prog_lock);
+    ex->background = enabled;
+    pthread_mutex_unlock(&ex->prog_lock);
+}
+
+// A queued program is dropped.  Wait while the compile thread is
+// preparing it, while it stays on screen until its replacement is
+// ready, and while the render thread is drawing it.
+void exec_forget_prog(exec *ex, const prog *pp)
+{
+    pthread_mutex_lock(&ex->prog_lock);
+    if (ex->pending == pp)
+        ex->pending = NULL;
+    while (ex->preparing == pp ||
+           (ex->prog == pp && ex->pending) ||
+           (ex->drawing == pp && ex->prog != pp))
+        pthread_cond_wait(&ex->prog_done_cond, &ex->prog_lock);
+    pthread_mutex_unlock(&ex->prog_lock);
+}
+
+const prog *exec_current_prog(exec *ex, uint64_t *switch_count)
+{
+    pthread_mutex_lock(&ex->prog_lock);
+    const prog *pp = ex->drawn;
+    if (switch_count)
+        *switch_count = ex->switch_count;
+    pthread_mutex_unlock(&ex->prog_lock);
+    return pp;
+}
+
+// Only reconfigure while every worker is parked.  On failure, put
+// the old pipeline back.  The exec owns `color' and `limiter' either
+// way.
+static bool reconfigure(exec           *ex,
+                        pipeline_policy policy,
+                        size_t          depth,
+                        readback_mode   mode,
+                        color_stage    *color,
+                        power_limiter  *limiter)
+{
+    pthread_mutex_lock(&ex->running_lock);
+    color_stage *old_color = ex->color;
+    power_limiter *old_limiter = ex->limiter;
+    bool ok = !ex->running;
+    if (ok) {
+        while (ex->running_count) {
+            pthread_cond_wait(&ex->running_cond, &ex->running_lock);
+        }
+        pipeline_policy old_policy = ex->policy;
+        size_t old_depth = ex->depth;
+        readback_mode old_mode = ex->mode;
+        destroy_pipeline(ex);
+        ex->color = color;
+        ex->limiter = limiter;
+        ok = create_pipeline(ex, policy, depth, mode);
+        if (!ok) {
+            destroy_pipeline(ex);
+            ex->color = old_color;
+            ex->limiter = old_limiter;
+            (void)create_pipeline(ex, old_policy, old_depth, old_mode);
+        }
+    }
+    pthread_mutex_unlock(&ex->running_lock);
+
+    // Free whichever of the old and new went unused.
+    if (color != old_color) {
+        color_stage *unused = ok ? old_color : color;
+        if (unused)
+            destroy_color_stage(unused);
+    }
+    if (limiter != old_limiter) {
+        power_limiter *unused = ok ? old_limiter : limiter;
+        if (unused)
+            destroy_power_limiter(unused);
+    }
+    return ok;
+}
+
+bool exec_set_pipeline_policy(exec *ex, pipeline_policy policy, size_t depth)
+{
+    if (depth == 0)
+        depth = DEFAULT_PIPELINE_DEPTH;
+    return reconfigure(ex, policy, depth, ex->mode, ex->color, ex->limiter);
+}
+
+bool exec_set_readback_mode(exec *ex, readback_mode mode)
+{
+    return reconfigure(ex, ex->policy, ex->depth, mode,
+                       ex->color, ex->limiter);
+}
+
+bool exec_set_color(exec *ex, bool enabled, float gamma, const float gain[3])
+{
+    color_stage *color = NULL;
+    if (enabled && !(color = create_color_stage(gamma, gain)))
+        return false;
+    return reconfigure(ex, ex->policy, ex->depth, ex->mode,
+                       color, ex->limiter);
+}
+
+bool exec_set_power_limit(exec        *ex,
+                          bool         enabled,
+                          float        budget,
+                          const float  full_scale[3])
+{
+    power_limiter *limiter = NULL;
+    if (enabled && !(limiter = create_power_limiter(budget, full_scale)))
+        return false;
+    return reconfigure(ex, ex->policy, ex->depth, ex->mode,
+                       ex->color, limiter);
+}
+
+bool exec_is_direct(exec *ex)
+{
+    pthread_mutex_lock(&ex->running_lock);
+    bool direct = ex->direct;
+    pthread_mutex_unlock(&ex->running_lock);
+    return direct;
+}
+
+uint64_t exec_frames_shown(exec *ex)
+{
+    return atomic_load_explicit(&ex->shown_count, memory_order_relaxed);
+}
+
+uint64_t exec_frames_dropped(exec *ex)
+{
+    pthread_mutex_lock(&ex->running_lock);
+    uint64_t dropped = ex->dropped_before;
+    if (ex->framebuffer_queue)
+        dropped += ring_dropped_count(ex->framebuffer_queue);
+    if (ex->cmdbuffer_queue)
+        dropped += ring_dropped_count(ex->cmdbuffer_queue);
+    pthread_mutex_unlock(&ex->running_lock);
+    return dropped;
+}
+
+void exec_get_stats(exec *ex, exec_stats *stats)
+{
+    pthread_mutex_lock(&ex->stats_lock);
+    for (size_t i = 0; i < EM_COUNT; i++) {
+        double scale = i <= EM_FRAME ? 1.e-9 : 1.0;
+        histogram_summarize(&ex->hist[i],
+                            &ex->hist_baseline[i],
+                            scale,
+                            &stats->metrics[i]);
+    }
+    pthread_mutex_unlock(&ex->stats_lock);
+    stats->frames_shown = exec_frames_shown(ex);
+    stats->frames_dropped = exec_frames_dropped(ex);
+    stats->output_errors = atomic_load_explicit(&ex->output_errors,
+                                                memory_order_relaxed);
+    stats->vsync_missed = atomic_load_explicit(&ex->vsync_missed,
+                                               memory_order_relaxed);
+    stats->render_errors = atomic_load_explicit(&ex->render_errors,
+                                                memory_order_relaxed);
+}
+
+void exec_reset_stats(exec *ex)
+{
+    pthread_mutex_lock(&ex->stats_lock);
+    for (size_t i = 0; i < EM_COUNT; i++)
+        histogram_copy(&ex->hist_baseline[i], &ex->hist[i]);
+    pthread_mutex_unlock(&ex->stats_lock);
+}
+
+// While stopped, rebuild the pipeline if RM_AUTO should now pick the
+// other readback.  While running, that waits for the next rebuild.
+void exec_set_delta(exec *ex, bool enabled)
+{
+    LEDs_set_delta(ex->leds, enabled);
+    pthread_mutex_lock(&ex->running_lock);
+    bool rebuild = enabled != ex->delta && ex->mode == RM_AUTO &&
+                   !ex->running;
+    ex->delta = enabled;
+    pthread_mutex_unlock(&ex->running_lock);
+    if (rebuild)
+        (void)reconfigure(ex, ex->policy, ex->depth, ex->mode,
+                          ex->color, ex->limiter);
+}
+
+bool exec_set_cpu_cores(exec *ex, const int *cores, size_t count)
+{
+    int *copy = NULL;
+    if (cores) {
+        copy = malloc((count ? count : 1) * sizeof *copy);
+        if (!copy)
+            return false;
+        memcpy(copy, cores, count * sizeof *copy);
+    }
+    pthread_mutex_lock(&ex->running_lock);
+    bool ok = !ex->running;
+    if (ok) {
+        while (ex->running_count)
+            pthread_cond_wait(&ex->running_cond, &ex->running_lock);
+        free(ex->cpu_cores);
+        ex->cpu_cores = copy;
+        ex->cpu_core_count = count;
+        ex->cpu_cores_changed = true;
+    }
+    pthread_mutex_unlock(&ex->running_lock);
+    if (!ok)
+        free(copy);
+    return ok;
+}
@@ -5,10 +5,44 @@
 #include "egl.h"
 #include "leds.h"
 #include "prog.h"
+#include "stats.h"
 
 typedef struct exec exec;
 
-extern exec  *create_exec(bcm_context *, LEDs_context *);
+typedef enum pipeline_policy {
+    PP_QUEUE,                   // block the renderer when the queue is full
+    PP_MAILBOX,                 // latest frame wins; drop stale frames
+} pipeline_policy;
+
+typedef enum readback_mode {
+    RM_COPY,                    // render -> framebuffer -> cmd thread -> output
+    RM_DIRECT,                  // render reads into cmdbuffers -> output
+    RM_AUTO,                    // direct if the layout allows, else copy
+} readback_mode;
+
+typedef enum exec_metric {
+    EM_RENDER,                  // render_frame, seconds
+    EM_READBACK,                // bcm_read_pixels, seconds
+    EM_ENCODE,                  // LEDs_create_cmds, seconds
+    EM_OUTPUT,                  // waiting on USB, seconds
+    EM_VSYNC,                   // LEDs_await_vsync, seconds
+    EM_FRAME,                   // interval between frames shown, seconds
+    EM_FB_QUEUE,                // framebuffer queue occupancy, frames
+    EM_CB_QUEUE,                // cmdbuffer queue occupancy, frames
+    EM_CMD_BYTES,               // command bytes per frame
+    EM_COUNT
+} exec_metric;
+
+typedef struct exec_stats {
+    hist_summary metrics[EM_COUNT];
+    uint64_t     frames_shown;
+    uint64_t     frames_dropped;
+    uint64_t     output_errors; // failed USB transfers and vsync waits
+    uint64_t     vsync_missed;  // vsync waits that timed out
+    uint64_t     render_errors; // frames skipped, renderer wouldn't start
+} exec_stats;
+
+extern exec  *create_exec(bcm_context *, EGL_context *, LEDs_context *);
 extern void   destroy_exec(exec *);
 
 extern void   exec_start(exec *);
@@ -16,6 +50,44 @@ extern void   exec_stop(exec *);
 
 extern double exec_fps(exec *);
 
+extern bool     exec_set_pipeline_policy(exec *,
+                                         pipeline_policy,
+                                         size_t depth);
+extern bool     exec_set_readback_mode(exec *, readback_mode);
+// Call while stopped.  When enabled, frames are read back as RGBA
+// and gamma corrected and dithered as they are encoded.  Needs copy
+// readback: RM_AUTO picks it, and RM_DIRECT fails.
+extern bool     exec_set_color(exec *,
+                               bool enabled,
+                               float gamma,
+                               const float gain[3]);
+// Call while stopped.  When enabled, the cmd thread dims frames that
+// would draw more than `budget' amps.  Needs copy readback too.
+extern bool     exec_set_power_limit(exec *,
+                                     bool enabled,
+                                     float budget,
+                                     const float full_scale[3]);
+extern bool     exec_is_direct(exec *);
+extern uint64_t exec_frames_shown(exec *);
+extern uint64_t exec_frames_dropped(exec *);
+extern void     exec_get_stats(exec *, exec_stats *);
+extern void     exec_reset_stats(exec *);
+// RM_AUTO picks copy readback while delta is on.  Set it while
+// stopped for that to take effect.
+extern void     exec_set_delta(exec *, bool enabled);
+// Call while stopped.  The CPU renderer pins one worker to each
+// core.  NULL cores means every core but the lowest.
+extern bool     exec_set_cpu_cores(exec *, const int *cores, size_t count);
+
 extern void   exec_use_prog(exec *, const prog *);
 
+// When enabled, exec_use_prog links the new program on a separate
+// thread and the old one stays on screen until it is ready.
+extern void        exec_set_background_compile(exec *, bool enabled);
+// The program drawn most recently, and how many switches so far.
+extern const prog *exec_current_prog(exec *, uint64_t *switch_count);
+// Call before destroying a program.  Returns once the compile thread
+// is done with it.
+extern void        exec_forget_prog(exec *, const prog *);
+
 #endif /* !EXEC_included */
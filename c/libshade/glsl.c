@@ -0,0 +1,3625 @@
+#define _GNU_SOURCE
+#include "glsl.h"
+
+#include <ctype.h>
+#include <math.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "glsl_vm.h"
+
+// The compiler makes one pass over the preprocessed tokens and emits
+// bytecode as it parses.  Function bodies are parsed again for every
+// call, which inlines them, and once where they are defined, to find
+// errors and to learn which parameters they assign.
+//
+// A compile error longjmps back to glsl_compile.  Everything the
+// compiler allocates hangs off the compiler, so nothing leaks.
+
+#define CONST_BASE   (1 << 24)  // constants' slots, until linking
+#define MASK_ALL     (-2)       // every lane is running
+#define MASK_DEAD    (-3)       // no lane is
+#define MAX_ARGS     16
+#define MAX_CONDS    32
+#define NAME_BUCKETS 256
+
+// Tokens
+
+enum {
+    TK_EOF,
+    TK_IDENT,
+    TK_INT,
+    TK_FLOAT,
+    TK_PUNCT,
+};
+
+// Punctuators longer than one character.  The rest are themselves.
+enum {
+    P_INC = 256,
+    P_DEC,
+    P_LE,
+    P_GE,
+    P_EQ,
+    P_NE,
+    P_AND,
+    P_OR,
+    P_XOR,
+    P_ADD_ASSIGN,
+    P_SUB_ASSIGN,
+    P_MUL_ASSIGN,
+    P_DIV_ASSIGN,
+    P_MOD_ASSIGN,
+    P_AND_ASSIGN,
+    P_OR_ASSIGN,
+    P_XOR_ASSIGN,
+    P_SHL_ASSIGN,
+    P_SHR_ASSIGN,
+    P_SHL,
+    P_SHR,
+    P_PASTE,
+};
+
+typedef struct token {
+    int         kind;
+    int         punct;
+    const char *text;
+    int         len;
+    const char *name;           // interned, for identifiers
+    int         line;
+    bool        bol;            // first on its line
+    bool        space;          // whitespace before it
+    int64_t     ival;
+    double      fval;
+} token;
+
+typedef struct name_entry {
+    struct name_entry *next;
+    size_t             len;
+    char               text[];
+} name_entry;
+
+typedef struct macro {
+    const char   *name;
+    bool          function;
+    const char  **params;
+    int           param_count;
+    token        *body;
+    int           body_count;
+    bool          disabled;     // while its expansion is being read
+    struct macro *next;
+} macro;
+
+// Tokens the preprocessor reads before the source's: macro
+// expansions and pushed-back tokens.  A barrier ends the stream
+// rather than falling through to the frames under it.
+typedef struct pp_frame {
+    token           *toks;
+    int              count;
+    int              pos;
+    macro           *macro;
+    bool             barrier;
+    struct pp_frame *next;
+} pp_frame;
+
+typedef struct pp_cond {
+    bool parent_active;
+    bool taken;
+    bool active;
+} pp_cond;
+
+// Types
+
+typedef enum kind {
+    K_VOID,
+    K_BOOL,
+    K_INT,
+    K_FLOAT,
+    K_SAMPLER,
+    K_STRUCT,
+} kind;
+
+typedef struct field {
+    const char         *name;
+    const struct gtype *type;
+    int                 offset;
+} field;
+
+typedef struct gtype {
+    kind                kind;
+    int                 rows;   // components of a vector, rows of a matrix
+    int                 cols;   // columns of a matrix, else 1
+    int                 size;   // slots
+    const char         *name;
+    int                 array;  // element count of an array, else 0
+    const struct gtype *elem;
+    const field        *fields;
+    int                 field_count;
+} gtype;
+
+enum {
+    TY_VOID, TY_BOOL, TY_INT, TY_FLOAT,
+    TY_VEC2, TY_VEC3, TY_VEC4,
+    TY_BVEC2, TY_BVEC3, TY_BVEC4,
+    TY_IVEC2, TY_IVEC3, TY_IVEC4,
+    TY_MAT2, TY_MAT3, TY_MAT4,
+    TY_SAMPLER2D,
+    TY_COUNT
+};
+
+#define TYPE(k, r, c, n) { .kind = k, .rows = r, .cols = c, .size = r * c, .name = n }
+
+static const gtype types[TY_COUNT] = {
+    [TY_VOID]      = { .kind = K_VOID, .rows = 1, .cols = 1, .name = "void" },
+    [TY_BOOL]      = TYPE(K_BOOL,  1, 1, "bool"),
+    [TY_INT]       = TYPE(K_INT,   1, 1, "int"),
+    [TY_FLOAT]     = TYPE(K_FLOAT, 1, 1, "float"),
+    [TY_VEC2]      = TYPE(K_FLOAT, 2, 1, "vec2"),
+    [TY_VEC3]      = TYPE(K_FLOAT, 3, 1, "vec3"),
+    [TY_VEC4]      = TYPE(K_FLOAT, 4, 1, "vec4"),
+    [TY_BVEC2]     = TYPE(K_BOOL,  2, 1, "bvec2"),
+    [TY_BVEC3]     = TYPE(K_BOOL,  3, 1, "bvec3"),
+    [TY_BVEC4]     = TYPE(K_BOOL,  4, 1, "bvec4"),
+    [TY_IVEC2]     = TYPE(K_INT,   2, 1, "ivec2"),
+    [TY_IVEC3]     = TYPE(K_INT,   3, 1, "ivec3"),
+    [TY_IVEC4]     = TYPE(K_INT,   4, 1, "ivec4"),
+    [TY_MAT2]      = TYPE(K_FLOAT, 2, 2, "mat2"),
+    [TY_MAT3]      = TYPE(K_FLOAT, 3, 3, "mat3"),
+    [TY_MAT4]      = TYPE(K_FLOAT, 4, 4, "mat4"),
+    [TY_SAMPLER2D] = { .kind = K_SAMPLER, .rows = 1, .cols = 1,
+                       .name = "sampler2D" },
+};
+
+#define T(x) (&types[TY_##x])
+
+// Values
+
+struct symbol;
+
+// A value's components are in slots, not necessarily adjacent: a
+// swizzle or a constructor just rearranges slot numbers.  With a
+// dynamic index, component k is at slot[k] + index * stride in each
+// lane.
+typedef struct value {
+    const gtype   *type;
+    int           *slot;
+    int            index;       // slot, or GLSL_NO_SLOT
+    int            stride;
+    int            count;
+    struct symbol *var;         // the variable, for lvalues
+    int            sampler;     // uniform index, for samplers
+} value;
+
+typedef struct symbol {
+    const char     *name;
+    const gtype    *type;       // for struct names
+    value           v;
+    int             decl_mask;  // the mask its scope runs under
+    bool            readonly;
+    int             param;      // index, while its function is checked
+} symbol;
+
+enum {
+    Q_IN    = 1,
+    Q_OUT   = 2,
+    Q_INOUT = 3,
+};
+
+typedef struct param {
+    const char  *name;
+    const gtype *type;
+    int          qual;
+    bool         is_const;
+} param;
+
+typedef struct function {
+    const char      *name;
+    const gtype     *ret;
+    param            params[MAX_ARGS];
+    int              param_count;
+    int              body;      // token index of the body, or -1
+    bool             written[MAX_ARGS];
+    bool             inlining;
+    struct function *next;
+} function;
+
+// Masks are slots too.  A loop's brk holds the lanes still looping,
+// and cnt those that haven't continued in this iteration.
+typedef struct loop {
+    int          brk;
+    int          cnt;
+    bool         broke;
+    bool         continued;
+    struct loop *outer;
+} loop;
+
+// An inlined function.  live holds the lanes that haven't returned.
+typedef struct frame {
+    function *fn;
+    symbol   *result;
+    int       entry_mask;
+    int       live;
+    int       live_init;        // instruction that sets live
+    bool      returned;         // in some lanes only
+} frame;
+
+typedef struct slot_info {
+    int  writer;                // last instruction that wrote it
+    bool var;                   // holds a variable or mask
+    bool pinned;                // a parameter aliases it
+} slot_info;
+
+typedef struct arena_block {
+    struct arena_block *next;
+    size_t              used;
+    size_t              size;
+    max_align_t         data[];
+} arena_block;
+
+typedef struct compiler {
+    jmp_buf        fail;
+    char          *message;
+    arena_block   *arena;
+    name_entry    *names[NAME_BUCKETS];
+
+    // preprocessor
+    token         *raw;
+    int            raw_count;
+    int            raw_alloc;
+    int            raw_pos;
+    pp_frame      *frames;
+    macro         *macros;
+    pp_cond        conds[MAX_CONDS];
+    int            cond_depth;
+    int            line_delta;
+
+    // parser
+    token         *toks;
+    int            tok_count;
+    int            tok_alloc;
+    int            pos;
+    int            stmt_pos;    // where the current expression statement began
+
+    // code
+    glsl_insn     *code;
+    int            code_count;
+    int            code_alloc;
+    slot_info     *slots;
+    int            slot_alloc;
+    int            next_slot;
+    int            max_slot;
+    int32_t       *consts;
+    int            const_count;
+    int            const_alloc;
+    glsl_uniform  *uniforms;
+    int            uniform_count;
+    int            uniform_alloc;
+
+    // names
+    symbol       **syms;
+    int            sym_count;
+    int            sym_alloc;
+    int            global_count;
+    int            scope_start;
+    int            floor;       // first symbol of the current function
+    function      *functions;
+
+    // control
+    int            mask;
+    frame         *frame;
+    loop          *loop;
+    int            nest;        // ifs and loops in the current function
+    int            jumps;       // breaks, continues and returns so far
+    function      *checking;    // function being checked, not inlined
+    bool           at_global;
+    int            frag_coord;
+    int            frag_color;
+} compiler;
+
+static _Atomic uint64_t next_program_id;
+
+static void fail(compiler *c, const char *fmt, ...)
+    __attribute__((noreturn, format(printf, 2, 3)));
+
+static void fail(compiler *c, const char *fmt, ...)
+{
+    int line = 0;
+    if (c->toks && c->pos < c->tok_count)
+        line = c->toks[c->pos].line;
+    else if (c->raw && c->raw_pos < c->raw_count)
+        line = c->raw[c->raw_pos].line;
+    char *msg = NULL;
+    va_list ap;
+    va_start(ap, fmt);
+    if (vasprintf(&msg, fmt, ap) < 0)
+        msg = NULL;
+    va_end(ap);
+    if (asprintf(&c->message, "line %d: %s", line, msg ? msg : "?") < 0)
+        c->message = NULL;
+    free(msg);
+    longjmp(c->fail, 1);
+}
+
+static void *alloc(compiler *c, size_t size)
+{
+    size = (size + 15) & ~(size_t)15;
+    arena_block *b = c->arena;
+    if (!b || b->used + size > b->size) {
+        size_t block_size = size > 65536 ? size : 65536;
+        b = calloc(1, sizeof *b + block_size);
+        if (!b)
+            fail(c, "out of memory");
+        b->size = block_size;
+        b->next = c->arena;
+        c->arena = b;
+    }
+    void *p = (char *)b->data + b->used;
+    b->used += size;
+    return p;
+}
+
+#define GROW(c, array, count, alloc_)                                   \
+    do {                                                                \
+        if ((count) >= (alloc_)) {                                      \
+            int n_ = 2 * (alloc_) + 10;                                 \
+            void *p_ = realloc((array), n_ * sizeof *(array));          \
+            if (!p_)                                                    \
+                fail((c), "out of memory");                             \
+            (array) = p_;                                               \
+            (alloc_) = n_;                                              \
+        }                                                               \
+    } while (0)
+
+static const char *intern(compiler *c, const char *s, size_t len)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (uint8_t)s[i]) * 16777619u;
+    name_entry **bucket = &c->names[h % NAME_BUCKETS];
+    for (name_entry *n = *bucket; n; n = n->next)
+        if (n->len == len && !memcmp(n->text, s, len))
+            return n->text;
+    name_entry *n = alloc(c, sizeof *n + len + 1);
+    memcpy(n->text, s, len);
+    n->len = len;
+    n->next = *bucket;
+    *bucket = n;
+    return n->text;
+}
+
+static const char *word(compiler *c, const char *s)
+{
+    return intern(c, s, strlen(s));
+}
+
+// Lexer
+
+static const struct {
+    const char *text;
+    int         punct;
+} long_puncts[] = {
+    { "<<=", P_SHL_ASSIGN }, { ">>=", P_SHR_ASSIGN },
+    { "++", P_INC },         { "--", P_DEC },
+    { "<=", P_LE },          { ">=", P_GE },
+    { "==", P_EQ },          { "!=", P_NE },
+    { "&&", P_AND },         { "||", P_OR },
+    { "^^", P_XOR },         { "+=", P_ADD_ASSIGN },
+    { "-=", P_SUB_ASSIGN },  { "*=", P_MUL_ASSIGN },
+    { "/=", P_DIV_ASSIGN },  { "%=", P_MOD_ASSIGN },
+    { "&=", P_AND_ASSIGN },  { "|=", P_OR_ASSIGN },
+    { "^=", P_XOR_ASSIGN },  { "<<", P_SHL },
+    { ">>", P_SHR },         { "##", P_PASTE },
+};
+
+static bool is_ident_char(int ch)
+{
+    return isalnum(ch) || ch == '_';
+}
+
+static void lex_number(compiler *c, token *t, const char *p, const char **endp)
+{
+    const char *q = p;
+    bool is_float = false;
+    if (q[0] == '0' && (q[1] == 'x' || q[1] == 'X')) {
+        q += 2;
+        while (isxdigit((uint8_t)*q))
+            q++;
+    } else {
+        while (isdigit((uint8_t)*q))
+            q++;
+        if (*q == '.') {
+            is_float = true;
+            q++;
+            while (isdigit((uint8_t)*q))
+                q++;
+        }
+        if (*q == 'e' || *q == 'E') {
+            const char *e = q + 1;
+            if (*e == '+' || *e == '-')
+                e++;
+            if (isdigit((uint8_t)*e)) {
+                is_float = true;
+                for (q = e; isdigit((uint8_t)*q); q++)
+                    continue;
+            }
+        }
+    }
+    if (is_float) {
+        t->kind = TK_FLOAT;
+        t->fval = strtod(p, NULL);
+        if (*q == 'f' || *q == 'F')
+            q++;
+    } else {
+        t->kind = TK_INT;
+        t->ival = strtoll(p, NULL, 0);
+    }
+    if (is_ident_char((uint8_t)*q)) {
+        c->raw_pos = c->raw_count;
+        fail(c, "bad number %.*s", (int)(q - p + 1), p);
+    }
+    *endp = q;
+}
+
+static void lex(compiler *c, const char *src)
+{
+    const char *p = src;
+    int line = 1;
+    bool bol = true, space = false;
+    while (true) {
+        if (*p == '\n') {
+            line++;
+            bol = true;
+            p++;
+            continue;
+        }
+        if (p[0] == '\\' && (p[1] == '\n' || (p[1] == '\r' && p[2] == '\n'))) {
+            p += p[1] == '\r' ? 3 : 2;
+            line++;
+            space = true;
+            continue;
+        }
+        if (isspace((uint8_t)*p)) {
+            p++;
+            space = true;
+            continue;
+        }
+        if (p[0] == '/' && p[1] == '/') {
+            while (*p && *p != '\n')
+                p++;
+            continue;
+        }
+        if (p[0] == '/' && p[1] == '*') {
+            for (p += 2; *p && !(p[0] == '*' && p[1] == '/'); p++)
+                if (*p == '\n')
+                    line++;
+            p += *p ? 2 : 0;
+            space = true;
+            continue;
+        }
+        GROW(c, c->raw, c->raw_count, c->raw_alloc);
+        token *t = &c->raw[c->raw_count];
+        *t = (token) {
+            .text  = p,
+            .line  = line,
+            .bol   = bol,
+            .space = space,
+        };
+        bol = space = false;
+        if (!*p) {
+            t->kind = TK_EOF;
+            c->raw_count++;
+            break;
+        }
+        if (isalpha((uint8_t)*p) || *p == '_') {
+            const char *q = p;
+            while (is_ident_char((uint8_t)*q))
+                q++;
+            t->kind = TK_IDENT;
+            t->name = intern(c, p, q - p);
+            p = q;
+        } else if (isdigit((uint8_t)*p) ||
+                   (*p == '.' && isdigit((uint8_t)p[1]))) {
+            c->raw_count++;
+            lex_number(c, t, p, &p);
+            c->raw_count--;
+        } else {
+            t->kind = TK_PUNCT;
+            t->punct = (uint8_t)*p;
+            size_t n = 1;
+            for (size_t i = 0; i < sizeof long_puncts / sizeof *long_puncts;
+                 i++) {
+                size_t len = strlen(long_puncts[i].text);
+                if (!strncmp(p, long_puncts[i].text, len)) {
+                    t->punct = long_puncts[i].punct;
+                    n = len;
+                    break;
+                }
+            }
+            p += n;
+        }
+        t->len = p - t->text;
+        c->raw_count++;
+    }
+}
+
+static bool is_punct(const token *t, int punct)
+{
+    return t->kind == TK_PUNCT && t->punct == punct;
+}
+
+static bool is_word(const token *t, const char *w)
+{
+    return t->kind == TK_IDENT && !strcmp(t->name, w);
+}
+
+// Preprocessor
+
+static const token eof_token = { .kind = TK_EOF };
+
+static void push_frame(compiler *c,
+                       token    *toks,
+                       int       count,
+                       macro    *m,
+                       bool      barrier)
+{
+    pp_frame *f = alloc(c, sizeof *f);
+    *f = (pp_frame) {
+        .toks    = toks,
+        .count   = count,
+        .macro   = m,
+        .barrier = barrier,
+        .next    = c->frames,
+    };
+    c->frames = f;
+}
+
+static void pop_frame(compiler *c)
+{
+    pp_frame *f = c->frames;
+    if (f->macro)
+        f->macro->disabled = false;
+    c->frames = f->next;
+}
+
+static bool skipping(const compiler *c)
+{
+    return c->cond_depth && !c->conds[c->cond_depth - 1].active;
+}
+
+static void directive(compiler *c);
+
+static token read_raw(compiler *c)
+{
+    while (true) {
+        pp_frame *f = c->frames;
+        if (f) {
+            if (f->pos < f->count)
+                return f->toks[f->pos++];
+            if (f->barrier)
+                return eof_token;
+            pop_frame(c);
+            continue;
+        }
+        token *t = &c->raw[c->raw_pos];
+        if (t->kind == TK_EOF) {
+            if (c->cond_depth)
+                fail(c, "#if without #endif");
+            return *t;
+        }
+        if (t->bol && is_punct(t, '#')) {
+            c->raw_pos++;
+            directive(c);
+            continue;
+        }
+        c->raw_pos++;
+        if (skipping(c))
+            continue;
+        token u = *t;
+        u.line += c->line_delta;
+        return u;
+    }
+}
+
+static macro *find_macro(compiler *c, const char *name)
+{
+    for (macro *m = c->macros; m; m = m->next)
+        if (m->name == name)
+            return m;
+    return NULL;
+}
+
+typedef struct token_list {
+    token *toks;
+    int    count;
+    int    alloc;
+} token_list;
+
+static void append_token(compiler *c, token_list *tl, const token *t)
+{
+    if (tl->count >= tl->alloc) {
+        int n = 2 * tl->alloc + 10;
+        token *toks = alloc(c, n * sizeof *toks);
+        if (tl->count)
+            memcpy(toks, tl->toks, tl->count * sizeof *toks);
+        tl->toks = toks;
+        tl->alloc = n;
+    }
+    tl->toks[tl->count++] = *t;
+}
+
+static token pp_next(compiler *c);
+
+// Macro-expands tokens on their own.
+static token_list expand_tokens(compiler *c, token *toks, int count)
+{
+    token_list out = { 0 };
+    push_frame(c, toks, count, NULL, true);
+    pp_frame *barrier = c->frames;
+    while (true) {
+        token t = pp_next(c);
+        if (t.kind == TK_EOF)
+            break;
+        append_token(c, &out, &t);
+    }
+    while (c->frames != barrier)
+        pop_frame(c);
+    pop_frame(c);
+    return out;
+}
+
+static void expand_call(compiler *c, macro *m, const token *name)
+{
+    token_list args[MAX_ARGS] = { { 0 } };
+    int arg_count = 1, depth = 0;
+    while (true) {
+        token t = read_raw(c);
+        if (t.kind == TK_EOF)
+            fail(c, "unterminated call to macro %s", m->name);
+        if (is_punct(&t, ')') && depth == 0)
+            break;
+        if (is_punct(&t, ',') && depth == 0) {
+            if (arg_count == MAX_ARGS)
+                fail(c, "too many arguments to macro %s", m->name);
+            arg_count++;
+            continue;
+        }
+        if (is_punct(&t, '('))
+            depth++;
+        if (is_punct(&t, ')'))
+            depth--;
+        append_token(c, &args[arg_count - 1], &t);
+    }
+    if (arg_count == 1 && !args[0].count && m->param_count == 0)
+        arg_count = 0;
+    if (arg_count != m->param_count)
+        fail(c, "macro %s takes %d arguments", m->name, m->param_count);
+    token_list expanded[MAX_ARGS];
+    for (int i = 0; i < arg_count; i++)
+        expanded[i] = expand_tokens(c, args[i].toks, args[i].count);
+
+    token_list body = { 0 };
+    for (int i = 0; i < m->body_count; i++) {
+        const token *t = &m->body[i];
+        int p = -1;
+        for (int j = 0; t->kind == TK_IDENT && j < m->param_count; j++)
+            if (t->name == m->params[j])
+                p = j;
+        if (p < 0) {
+            token u = *t;
+            u.line = name->line;
+            append_token(c, &body, &u);
+            continue;
+        }
+        for (int j = 0; j < expanded[p].count; j++)
+            append_token(c, &body, &expanded[p].toks[j]);
+    }
+    push_frame(c, body.toks, body.count, m, false);
+    m->disabled = true;
+}
+
+static token pp_next(compiler *c)
+{
+    while (true) {
+        token t = read_raw(c);
+        if (t.kind != TK_IDENT)
+            return t;
+        macro *m = find_macro(c, t.name);
+        if (!m || m->disabled)
+            return t;
+        if (m->function) {
+            token paren = read_raw(c);
+            if (!is_punct(&paren, '(')) {
+                token *u = alloc(c, sizeof *u);
+                *u = paren;
+                push_frame(c, u, 1, NULL, false);
+                return t;
+            }
+            expand_call(c, m, &t);
+            continue;
+        }
+        token *body = alloc(c, (m->body_count + 1) * sizeof *body);
+        for (int i = 0; i < m->body_count; i++) {
+            body[i] = m->body[i];
+            body[i].line = t.line;
+        }
+        push_frame(c, body, m->body_count, m, false);
+        m->disabled = true;
+    }
+}
+
+// The rest of the directive's line.
+static token_list directive_tokens(compiler *c)
+{
+    token_list tl = { 0 };
+    while (true) {
+        token *t = &c->raw[c->raw_pos];
+        if (t->kind == TK_EOF || t->bol)
+            break;
+        append_token(c, &tl, t);
+        c->raw_pos++;
+    }
+    return tl;
+}
+
+static void define_macro(compiler *c, token_list *tl)
+{
+    if (tl->count < 2 || tl->toks[1].kind != TK_IDENT)
+        fail(c, "#define needs a name");
+    macro *m = alloc(c, sizeof *m);
+    m->name = tl->toks[1].name;
+    int i = 2;
+    if (i < tl->count && is_punct(&tl->toks[i], '(') && !tl->toks[i].space) {
+        m->function = true;
+        m->params = alloc(c, MAX_ARGS * sizeof *m->params);
+        i++;
+        while (i < tl->count && !is_punct(&tl->toks[i], ')')) {
+            if (tl->toks[i].kind == TK_IDENT) {
+                if (m->param_count == MAX_ARGS)
+                    fail(c, "macro %s has too many parameters", m->name);
+                m->params[m->param_count++] = tl->toks[i].name;
+            } else if (!is_punct(&tl->toks[i], ',')) {
+                fail(c, "bad parameter list for macro %s", m->name);
+            }
+            i++;
+        }
+        if (i == tl->count)
+            fail(c, "bad parameter list for macro %s", m->name);
+        i++;
+    }
+    m->body = tl->toks + i;
+    m->body_count = tl->count - i;
+    for (int j = 0; j < m->body_count; j++)
+        if (is_punct(&m->body[j], '#') || is_punct(&m->body[j], P_PASTE))
+            fail(c, "macro %s: # and ## are not supported", m->name);
+    m->next = c->macros;
+    c->macros = m;
+}
+
+static void undef_macro(compiler *c, const char *name)
+{
+    for (macro **mp = &c->macros; *mp; mp = &(*mp)->next) {
+        if ((*mp)->name == name) {
+            *mp = (*mp)->next;
+            return;
+        }
+    }
+}
+
+// #if expressions
+
+typedef struct pp_expr {
+    compiler *c;
+    token    *toks;
+    int       count;
+    int       pos;
+} pp_expr;
+
+static int64_t pp_ternary(pp_expr *e);
+
+static const token *pp_peek(pp_expr *e)
+{
+    return e->pos < e->count ? &e->toks[e->pos] : &eof_token;
+}
+
+static int64_t pp_primary(pp_expr *e)
+{
+    const token *t = pp_peek(e);
+    e->pos++;
+    if (t->kind == TK_INT)
+        return t->ival;
+    if (t->kind == TK_IDENT)
+        return 0;
+    if (is_punct(t, '(')) {
+        int64_t v = pp_ternary(e);
+        if (!is_punct(pp_peek(e), ')'))
+            fail(e->c, "missing ) in #if");
+        e->pos++;
+        return v;
+    }
+    if (is_punct(t, '!'))
+        return !pp_primary(e);
+    if (is_punct(t, '~'))
+        return ~pp_primary(e);
+    if (is_punct(t, '-'))
+        return -pp_primary(e);
+    if (is_punct(t, '+'))
+        return pp_primary(e);
+    fail(e->c, "bad #if expression");
+}
+
+// Binary operators by precedence, loosest first.
+static const int pp_levels[][5] = {
+    { P_OR },
+    { P_AND },
+    { '|' },
+    { '^' },
+    { '&' },
+    { P_EQ, P_NE },
+    { '<', '>', P_LE, P_GE },
+    { P_SHL, P_SHR },
+    { '+', '-' },
+    { '*', '/', '%' },
+};
+
+static int64_t pp_binary(pp_expr *e, size_t level)
+{
+    if (level == sizeof pp_levels / sizeof pp_levels[0])
+        return pp_primary(e);
+    int64_t v = pp_binary(e, level + 1);
+    while (true) {
+        const token *t = pp_peek(e);
+        int op = 0;
+        for (int i = 0; i < 5 && pp_levels[level][i]; i++)
+            if (is_punct(t, pp_levels[level][i]))
+                op = pp_levels[level][i];
+        if (!op)
+            return v;
+        e->pos++;
+        int64_t w = pp_binary(e, level + 1);
+        switch (op) {
+        case P_OR:  v = v || w;  break;
+        case P_AND: v = v && w;  break;
+        case '|':   v |= w;      break;
+        case '^':   v ^= w;      break;
+        case '&':   v &= w;      break;
+        case P_EQ:  v = v == w;  break;
+        case P_NE:  v = v != w;  break;
+        case '<':   v = v < w;   break;
+        case '>':   v = v > w;   break;
+        case P_LE:  v = v <= w;  break;
+        case P_GE:  v = v >= w;  break;
+        case P_SHL: v <<= w;     break;
+        case P_SHR: v >>= w;     break;
+        case '+':   v += w;      break;
+        case '-':   v -= w;      break;
+        case '*':   v *= w;      break;
+        case '/':
+        case '%':
+            if (!w)
+                fail(e->c, "division by zero in #if");
+            v = op == '/' ? v / w : v % w;
+            break;
+        }
+    }
+}
+
+static int64_t pp_ternary(pp_expr *e)
+{
+    int64_t v = pp_binary(e, 0);
+    if (!is_punct(pp_peek(e), '?'))
+        return v;
+    e->pos++;
+    int64_t a = pp_ternary(e);
+    if (!is_punct(pp_peek(e), ':'))
+        fail(e->c, "missing : in #if");
+    e->pos++;
+    int64_t b = pp_ternary(e);
+    return v ? a : b;
+}
+
+static bool pp_condition(compiler *c, token_list *tl)
+{
+    // Resolve "defined" before macros expand.
+    token_list resolved = { 0 };
+    for (int i = 1; i < tl->count; i++) {
+        token *t = &tl->toks[i];
+        if (!is_word(t, "defined")) {
+            append_token(c, &resolved, t);
+            continue;
+        }
+        bool paren = i + 1 < tl->count && is_punct(&tl->toks[i + 1], '(');
+        int n = i + 1 + paren;
+        if (n >= tl->count || tl->toks[n].kind != TK_IDENT)
+            fail(c, "bad use of defined");
+        token v = { .kind = TK_INT, .line = t->line };
+        v.ival = find_macro(c, tl->toks[n].name) != NULL;
+        append_token(c, &resolved, &v);
+        i = n + paren;
+    }
+    token_list expanded = expand_tokens(c, resolved.toks, resolved.count);
+    pp_expr e = { c, expanded.toks, expanded.count, 0 };
+    int64_t v = pp_ternary(&e);
+    if (e.pos != e.count)
+        fail(c, "junk at end of #if");
+    return v != 0;
+}
+
+static void directive(compiler *c)
+{
+    int line = c->raw[c->raw_pos - 1].line;
+    token_list tl = directive_tokens(c);
+    if (!tl.count)
+        return;
+    const token *t = &tl.toks[0];
+    bool active = !skipping(c);
+    pp_cond *top = c->cond_depth ? &c->conds[c->cond_depth - 1] : NULL;
+
+    if (is_word(t, "if") || is_word(t, "ifdef") || is_word(t, "ifndef")) {
+        if (c->cond_depth == MAX_CONDS)
+            fail(c, "#if nested too deep");
+        bool v = false;
+        if (active && is_word(t, "if")) {
+            v = pp_condition(c, &tl);
+        } else if (active) {
+            if (tl.count < 2 || tl.toks[1].kind != TK_IDENT)
+                fail(c, "#%s needs a name", t->name);
+            v = (find_macro(c, tl.toks[1].name) != NULL) ==
+                is_word(t, "ifdef");
+        }
+        c->conds[c->cond_depth++] = (pp_cond) {
+            .parent_active = active,
+            .taken         = v,
+            .active        = active && v,
+        };
+    } else if (is_word(t, "elif")) {
+        if (!top)
+            fail(c, "#elif without #if");
+        bool v = !top->taken && top->parent_active && pp_condition(c, &tl);
+        top->active = v;
+        top->taken |= v;
+    } else if (is_word(t, "else")) {
+        if (!top)
+            fail(c, "#else without #if");
+        top->active = top->parent_active && !top->taken;
+        top->taken = true;
+    } else if (is_word(t, "endif")) {
+        if (!top)
+            fail(c, "#endif without #if");
+        c->cond_depth--;
+    } else if (!active) {
+        return;
+    } else if (is_word(t, "define")) {
+        define_macro(c, &tl);
+    } else if (is_word(t, "undef")) {
+        if (tl.count > 1 && tl.toks[1].kind == TK_IDENT)
+            undef_macro(c, tl.toks[1].name);
+    } else if (is_word(t, "line")) {
+        if (tl.count < 2 || tl.toks[1].kind != TK_INT)
+            fail(c, "#line needs a number");
+        c->line_delta = tl.toks[1].ival - (line + 1);
+    } else if (is_word(t, "error")) {
+        fail(c, "#error");
+    } else if (!is_word(t, "pragma") && !is_word(t, "version") &&
+               !is_word(t, "extension")) {
+        fail(c, "unknown directive #%.*s", t->len, t->text);
+    }
+}
+
+static void predefine(compiler *c, const char *name, int value)
+{
+    macro *m = alloc(c, sizeof *m);
+    token *t = alloc(c, sizeof *t);
+    *t = (token) { .kind = TK_INT, .ival = value };
+    m->name = word(c, name);
+    m->body = t;
+    m->body_count = 1;
+    m->next = c->macros;
+    c->macros = m;
+}
+
+static void preprocess(compiler *c, const char *source)
+{
+    lex(c, source);
+    predefine(c, "GL_ES", 1);
+    predefine(c, "__VERSION__", 100);
+    predefine(c, "GL_FRAGMENT_PRECISION_HIGH", 1);
+    while (true) {
+        token t = pp_next(c);
+        GROW(c, c->toks, c->tok_count, c->tok_alloc);
+        c->toks[c->tok_count++] = t;
+        if (t.kind == TK_EOF)
+            break;
+    }
+}
+
+// Parser helpers
+
+static token *peek(compiler *c)
+{
+    return &c->toks[c->pos];
+}
+
+static token *peek_at(compiler *c, int n)
+{
+    int i = c->pos + n;
+    return &c->toks[i < c->tok_count ? i : c->tok_count - 1];
+}
+
+static token *next(compiler *c)
+{
+    token *t = &c->toks[c->pos];
+    if (t->kind != TK_EOF)
+        c->pos++;
+    return t;
+}
+
+static bool accept(compiler *c, int punct)
+{
+    if (!is_punct(peek(c), punct))
+        return false;
+    c->pos++;
+    return true;
+}
+
+static bool accept_word(compiler *c, const char *w)
+{
+    if (!is_word(peek(c), w))
+        return false;
+    c->pos++;
+    return true;
+}
+
+static void expect(compiler *c, int punct)
+{
+    if (!accept(c, punct)) {
+        token *t = peek(c);
+        if (t->kind == TK_EOF)
+            fail(c, "unexpected end of shader");
+        if (punct < 256)
+            fail(c, "expected '%c' at '%.*s'", punct, t->len, t->text);
+        fail(c, "syntax error at '%.*s'", t->len, t->text);
+    }
+}
+
+static const char *expect_ident(compiler *c)
+{
+    token *t = peek(c);
+    if (t->kind != TK_IDENT)
+        fail(c, "expected a name at '%.*s'", t->len, t->text);
+    c->pos++;
+    return t->name;
+}
+
+// Skips over a balanced (...), [...] or {...}.
+static void skip_balanced(compiler *c)
+{
+    int depth = 0;
+    do {
+        token *t = next(c);
+        if (t->kind == TK_EOF)
+            fail(c, "unexpected end of shader");
+        if (is_punct(t, '(') || is_punct(t, '[') || is_punct(t, '{'))
+            depth++;
+        if (is_punct(t, ')') || is_punct(t, ']') || is_punct(t, '}'))
+            depth--;
+    } while (depth > 0);
+}
+
+// Skips a statement without compiling it, for code that can't run.
+static void skip_statement(compiler *c)
+{
+    token *t = peek(c);
+    if (is_punct(t, '{')) {
+        skip_balanced(c);
+    } else if (accept_word(c, "if")) {
+        skip_balanced(c);
+        skip_statement(c);
+        if (accept_word(c, "else"))
+            skip_statement(c);
+    } else if (accept_word(c, "for") || accept_word(c, "while")) {
+        skip_balanced(c);
+        skip_statement(c);
+    } else if (accept_word(c, "do")) {
+        skip_statement(c);
+        accept_word(c, "while");
+        skip_balanced(c);
+        expect(c, ';');
+    } else {
+        while (!is_punct(peek(c), ';')) {
+            t = peek(c);
+            if (t->kind == TK_EOF)
+                fail(c, "unexpected end of shader");
+            if (is_punct(t, '(') || is_punct(t, '[') || is_punct(t, '{'))
+                skip_balanced(c);
+            else
+                next(c);
+        }
+        next(c);
+    }
+}
+
+// Types
+
+static const gtype *vector_type(kind k, int n)
+{
+    switch (k) {
+
+    case K_BOOL:
+        return n == 1 ? T(BOOL) : &types[TY_BVEC2 + n - 2];
+
+    case K_INT:
+        return n == 1 ? T(INT) : &types[TY_IVEC2 + n - 2];
+
+    case K_FLOAT:
+        return n == 1 ? T(FLOAT) : &types[TY_VEC2 + n - 2];
+
+    default:
+        return NULL;
+    }
+}
+
+static bool is_scalar(const gtype *t)
+{
+    return t->size == 1 && !t->array && t->kind <= K_FLOAT;
+}
+
+static bool is_vector(const gtype *t)
+{
+    return !t->array && t->cols == 1 && t->rows > 1;
+}
+
+static bool is_matrix(const gtype *t)
+{
+    return !t->array && t->cols > 1;
+}
+
+static bool is_numeric(const gtype *t)
+{
+    return !t->array && (t->kind == K_INT || t->kind == K_FLOAT);
+}
+
+static bool same_type(const gtype *a, const gtype *b)
+{
+    if (a == b)
+        return true;
+    if (a->array && b->array)
+        return a->array == b->array && same_type(a->elem, b->elem);
+    return false;
+}
+
+static const char *type_name(compiler *c, const gtype *t)
+{
+    if (!t->array)
+        return t->name;
+    char *s;
+    if (asprintf(&s, "%s[%d]", type_name(c, t->elem), t->array) < 0)
+        fail(c, "out of memory");
+    const char *n = word(c, s);
+    free(s);
+    return n;
+}
+
+static const gtype *array_of(compiler *c, const gtype *elem, int n)
+{
+    if (n <= 0)
+        fail(c, "array size must be positive");
+    if (elem->array)
+        fail(c, "arrays of arrays are not allowed");
+    gtype *t = alloc(c, sizeof *t);
+    *t = (gtype) {
+        .kind  = elem->kind,
+        .rows  = 1,
+        .cols  = 1,
+        .size  = n * elem->size,
+        .name  = elem->name,
+        .array = n,
+        .elem  = elem,
+    };
+    return t;
+}
+
+static const gtype *builtin_type(const token *t)
+{
+    if (t->kind != TK_IDENT)
+        return NULL;
+    for (int i = 0; i < TY_COUNT; i++)
+        if (!strcmp(t->name, types[i].name))
+            return &types[i];
+    return NULL;
+}
+
+static symbol *lookup(compiler *c, const char *name)
+{
+    for (int i = c->sym_count - 1; i >= c->floor; i--)
+        if (c->syms[i]->name == name)
+            return c->syms[i];
+    for (int i = c->global_count - 1; i >= 0; i--)
+        if (c->syms[i]->name == name)
+            return c->syms[i];
+    return NULL;
+}
+
+static const gtype *struct_type(compiler *c, const token *t)
+{
+    if (t->kind != TK_IDENT)
+        return NULL;
+    symbol *s = lookup(c, t->name);
+    return s && s->type ? s->type : NULL;
+}
+
+static bool is_precision(const token *t)
+{
+    return is_word(t, "highp") || is_word(t, "mediump") || is_word(t, "lowp");
+}
+
+static void add_symbol(compiler *c, symbol *s)
+{
+    for (int i = c->scope_start; i < c->sym_count; i++)
+        if (c->syms[i]->name == s->name)
+            fail(c, "%s is already defined", s->name);
+    GROW(c, c->syms, c->sym_count, c->sym_alloc);
+    c->syms[c->sym_count++] = s;
+    if (c->at_global) {
+        c->global_count = c->sym_count;
+        c->floor = c->sym_count;
+    }
+}
+
+static const gtype *type_specifier(compiler *c);
+static int          const_int_expression(compiler *c);
+
+static const gtype *struct_specifier(compiler *c)
+{
+    const char *name = NULL;
+    if (peek(c)->kind == TK_IDENT)
+        name = expect_ident(c);
+    expect(c, '{');
+    field fields[64];
+    int n = 0, offset = 0;
+    while (!accept(c, '}')) {
+        const gtype *ft = type_specifier(c);
+        if (!ft)
+            fail(c, "expected a type in struct");
+        do {
+            const gtype *t = ft;
+            const char *fname = expect_ident(c);
+            if (accept(c, '[')) {
+                int size = const_int_expression(c);
+                expect(c, ']');
+                t = array_of(c, t, size);
+            }
+            if (n == 64)
+                fail(c, "struct has too many fields");
+            if (t->kind == K_SAMPLER)
+                fail(c, "structs can't hold samplers");
+            fields[n++] = (field) { fname, t, offset };
+            offset += t->size;
+        } while (accept(c, ','));
+        expect(c, ';');
+    }
+    gtype *t = alloc(c, sizeof *t);
+    field *f = alloc(c, n * sizeof *f);
+    memcpy(f, fields, n * sizeof *f);
+    *t = (gtype) {
+        .kind        = K_STRUCT,
+        .rows        = 1,
+        .cols        = 1,
+        .size        = offset,
+        .name        = name ? name : "struct",
+        .fields      = f,
+        .field_count = n,
+    };
+    if (name) {
+        symbol *s = alloc(c, sizeof *s);
+        s->name = name;
+        s->type = t;
+        add_symbol(c, s);
+    }
+    return t;
+}
+
+// NULL if no type is next.
+static const gtype *type_specifier(compiler *c)
+{
+    while (is_precision(peek(c)))
+        next(c);
+    if (accept_word(c, "struct"))
+        return struct_specifier(c);
+    const gtype *t = builtin_type(peek(c));
+    if (!t)
+        t = struct_type(c, peek(c));
+    if (t)
+        next(c);
+    return t;
+}
+
+// Whether a declaration is next, rather than an expression.
+static bool type_is_next(compiler *c)
+{
+    token *t = peek(c);
+    if (is_word(t, "const") || is_word(t, "uniform") || is_precision(t) ||
+        is_word(t, "struct") || is_word(t, "invariant") ||
+        is_word(t, "varying") || is_word(t, "attribute"))
+        return true;
+    return (builtin_type(t) || struct_type(c, t)) &&
+           peek_at(c, 1)->kind == TK_IDENT;
+}
+
+// Slots and code
+
+static void note_slots(compiler *c, int end)
+{
+    if (end > c->max_slot)
+        c->max_slot = end;
+    while (c->slot_alloc < end) {
+        int n = 2 * c->slot_alloc + 10;
+        slot_info *s = realloc(c->slots, n * sizeof *s);
+        if (!s)
+            fail(c, "out of memory");
+        c->slots = s;
+        c->slot_alloc = n;
+    }
+}
+
+static int new_slots(compiler *c, int n, bool var)
+{
+    int first = c->next_slot;
+    c->next_slot += n;
+    if (c->next_slot >= CONST_BASE)
+        fail(c, "shader is too big");
+    note_slots(c, c->next_slot);
+    for (int i = first; i < c->next_slot; i++)
+        c->slots[i] = (slot_info) { .writer = -1, .var = var };
+    return first;
+}
+
+static bool is_const(int slot)
+{
+    return slot >= CONST_BASE;
+}
+
+static int32_t const_bits(const compiler *c, int slot)
+{
+    return c->consts[slot - CONST_BASE];
+}
+
+static int const_slot(compiler *c, int32_t bits)
+{
+    for (int i = 0; i < c->const_count; i++)
+        if (c->consts[i] == bits)
+            return CONST_BASE + i;
+    GROW(c, c->consts, c->const_count, c->const_alloc);
+    c->consts[c->const_count] = bits;
+    return CONST_BASE + c->const_count++;
+}
+
+static int const_float(compiler *c, float f)
+{
+    int32_t bits;
+    memcpy(&bits, &f, sizeof bits);
+    return const_slot(c, bits);
+}
+
+static int const_int(compiler *c, int32_t i)
+{
+    return const_slot(c, i);
+}
+
+static int const_bool(compiler *c, bool b)
+{
+    return const_slot(c, b ? -1 : 0);
+}
+
+static int emit(compiler *c, glsl_op op, int d, int a, int b, int cc, int e)
+{
+    GROW(c, c->code, c->code_count, c->code_alloc);
+    int i = c->code_count++;
+    c->code[i] = (glsl_insn) { op, d, a, b, cc, e };
+    if ((glsl_op_roles[op] & OW_D) && d >= 0 && d < CONST_BASE)
+        c->slots[d].writer = i;
+    return i;
+}
+
+static void patch(compiler *c, int jump)
+{
+    c->code[jump].a = c->code_count;
+}
+
+// Evaluates an instruction on constants, the way the VM would.
+static int32_t fold(glsl_op op, int32_t a, int32_t b, int32_t cc)
+{
+    glsl_slot s[4];
+    s[1].i = (glsl_vi){ 0 } + a;
+    s[2].i = (glsl_vi){ 0 } + b;
+    s[3].i = (glsl_vi){ 0 } + cc;
+    glsl_insn code[2] = { { op, 0, 1, 2, 3, 0 }, { GOP_HALT } };
+    glsl_exec(code, s, NULL);
+    return s[0].i[0];
+}
+
+static int op3(compiler *c, glsl_op op, int a, int b, int cc)
+{
+    unsigned roles = glsl_op_roles[op];
+    if (is_const(a) && (!(roles & OR_B) || is_const(b)) &&
+        (!(roles & OR_C) || is_const(cc))) {
+        int32_t bb = roles & OR_B ? const_bits(c, b) : 0;
+        int32_t bc = roles & OR_C ? const_bits(c, cc) : 0;
+        return const_slot(c, fold(op, const_bits(c, a), bb, bc));
+    }
+    int d = new_slots(c, 1, false);
+    emit(c, op, d, a, b, cc, 0);
+    return d;
+}
+
+static int op2(compiler *c, glsl_op op, int a, int b)
+{
+    return op3(c, op, a, b, 0);
+}
+
+static int op1(compiler *c, glsl_op op, int a)
+{
+    return op3(c, op, a, 0, 0);
+}
+
+// Whether instruction i reads or writes slot s.
+static bool touches(const glsl_insn *in, int s)
+{
+    unsigned roles = glsl_op_roles[in->op];
+    if (roles & (OR_TARGET | OR_RANGE))
+        return true;
+    if (in->op == GOP_TEX)
+        return (s >= in->d && s < in->d + 4) || in->a == s || in->b == s;
+    return ((roles & OW_D) && in->d == s) ||
+           ((roles & OR_A) && in->a == s) ||
+           ((roles & OR_B) && in->b == s) ||
+           ((roles & OR_C) && in->c == s);
+}
+
+// Makes the instruction that computed temporary s write d instead,
+// if nothing since has used either.
+static bool retarget(compiler *c, int s, int d)
+{
+    if (is_const(s) || c->slots[s].var || c->slots[s].pinned)
+        return false;
+    int w = c->slots[s].writer;
+    if (w < 0 || w >= c->code_count || c->code[w].d != s ||
+        !(glsl_op_roles[c->code[w].op] & OW_D))
+        return false;
+    for (int i = w + 1; i < c->code_count; i++)
+        if (touches(&c->code[i], s) || touches(&c->code[i], d))
+            return false;
+    c->code[w].d = d;
+    c->slots[d].writer = w;
+    return true;
+}
+
+// Masks
+
+static int mask_and(compiler *c, int m, int n)
+{
+    if (m == MASK_DEAD || n == MASK_DEAD)
+        return MASK_DEAD;
+    if (m == MASK_ALL)
+        return n;
+    if (n == MASK_ALL)
+        return m;
+    return op2(c, GOP_AND, m, n);
+}
+
+static int mask_and_not(compiler *c, int m, int n)
+{
+    if (m == MASK_DEAD)
+        return MASK_DEAD;
+    int not_n = op1(c, GOP_NOT, n);
+    return mask_and(c, m, not_n);
+}
+
+// A mask that won't change under us.
+static int stable_mask(compiler *c, int slot)
+{
+    if (is_const(slot) || !c->slots[slot].var)
+        return slot;
+    int m = new_slots(c, 1, false);
+    emit(c, GOP_MOV, m, slot, 0, 0, 0);
+    return m;
+}
+
+// Clears the current lanes from mask slot m.
+static void clear_lanes(compiler *c, int m)
+{
+    if (c->mask == MASK_ALL)
+        emit(c, GOP_MOV, m, const_bool(c, false), 0, 0, 0);
+    else
+        emit(c, GOP_SEL, m, c->mask, const_bool(c, false), m, 0);
+}
+
+// The current mask after lanes may have left by break, continue or
+// return.
+static int rejoin(compiler *c, int saved, bool in_loop)
+{
+    int m = saved;
+    if (c->frame && c->frame->returned)
+        m = mask_and(c, m, c->frame->live);
+    if (in_loop && c->loop && c->loop->broke)
+        m = mask_and(c, m, c->loop->brk);
+    if (in_loop && c->loop && c->loop->continued)
+        m = mask_and(c, m, c->loop->cnt);
+    return m;
+}
+
+// Values
+
+static value make_value(compiler *c, const gtype *t, int first)
+{
+    value v = {
+        .type    = t,
+        .slot    = alloc(c, (t->size + 1) * sizeof (int)),
+        .index   = GLSL_NO_SLOT,
+        .sampler = -1,
+    };
+    for (int i = 0; i < t->size; i++)
+        v.slot[i] = first + i;
+    return v;
+}
+
+static value temp_value(compiler *c, const gtype *t)
+{
+    return make_value(c, t, new_slots(c, t->size, false));
+}
+
+static value slots_value(compiler *c, const gtype *t, const int *slots)
+{
+    value v = make_value(c, t, 0);
+    memcpy(v.slot, slots, t->size * sizeof *slots);
+    return v;
+}
+
+static value scalar_value(compiler *c, const gtype *t, int slot)
+{
+    return slots_value(c, t, &slot);
+}
+
+// Reads a dynamically indexed value into temporaries.
+static value rvalue(compiler *c, value v)
+{
+    if (v.index != GLSL_NO_SLOT) {
+        value r = temp_value(c, v.type);
+        for (int k = 0; k < v.type->size; k++)
+            emit(c, GOP_GATHER, r.slot[k], v.index, v.slot[k], 0,
+                 GLSL_PACK(v.stride, v.count));
+        v = r;
+    }
+    v.var = NULL;
+    return v;
+}
+
+static int convert_slot(compiler *c, int s, kind from, kind to)
+{
+    static const glsl_op ops[3][3] = {
+        //            to bool     to int      to float
+        [0] = { GOP_NOP,  GOP_BTOI, GOP_BTOF },     // from bool
+        [1] = { GOP_ITOB, GOP_NOP,  GOP_ITOF },     // from int
+        [2] = { GOP_FTOB, GOP_FTOI, GOP_NOP  },     // from float
+    };
+    glsl_op op = ops[from - K_BOOL][to - K_BOOL];
+    return op == GOP_NOP ? s : op1(c, op, s);
+}
+
+// Converts a scalar or vector's components to another kind.
+static value convert(compiler *c, value v, kind to)
+{
+    v = rvalue(c, v);
+    if (v.type->kind == to)
+        return v;
+    if (v.type->array || v.type->kind > K_FLOAT || to > K_FLOAT)
+        fail(c, "can't convert %s", type_name(c, v.type));
+    value r = make_value(c, vector_type(to, v.type->rows), 0);
+    if (is_matrix(v.type))
+        fail(c, "can't convert %s", type_name(c, v.type));
+    for (int k = 0; k < v.type->size; k++)
+        r.slot[k] = convert_slot(c, v.slot[k], v.type->kind, to);
+    return r;
+}
+
+// GLSL ES has no implicit conversions, but ints where floats belong
+// are a common slip that GPU drivers forgive.
+static value coerce(compiler *c, value v, const gtype *t, const char *what)
+{
+    if (same_type(v.type, t))
+        return v;
+    if (t->kind == K_FLOAT && v.type->kind == K_INT &&
+        !t->array && !v.type->array && t->rows == v.type->rows &&
+        t->cols == 1 && v.type->cols == 1)
+        return convert(c, v, K_FLOAT);
+    fail(c, "%s: %s where %s is needed",
+         what, type_name(c, v.type), type_name(c, t));
+}
+
+static int bool_scalar(compiler *c, value v, const char *what)
+{
+    v = rvalue(c, v);
+    if (v.type != T(BOOL))
+        fail(c, "%s needs a bool, not %s", what, type_name(c, v.type));
+    return v.slot[0];
+}
+
+static void move(compiler *c, int d, int s, int mask, bool unique)
+{
+    if (d == s)
+        return;
+    if (mask != GLSL_NO_SLOT)
+        emit(c, GOP_SEL, d, mask, s, d, 0);
+    else if (!unique || !retarget(c, s, d))
+        emit(c, GOP_MOV, d, s, 0, 0, 0);
+}
+
+static void store(compiler *c, value lv, value rv)
+{
+    symbol *var = lv.var;
+    if (!var)
+        fail(c, "assignment to something that isn't a variable");
+    if (var->readonly)
+        fail(c, "%s is read-only", var->name);
+    if (lv.type->kind == K_SAMPLER)
+        fail(c, "samplers can't be assigned");
+    rv = rvalue(c, coerce(c, rv, lv.type, "assignment"));
+    if (c->checking && var->param >= 0)
+        c->checking->written[var->param] = true;
+    if (c->mask == MASK_DEAD)
+        return;
+    int n = lv.type->size;
+    int mask = c->mask == MASK_ALL || c->mask == var->decl_mask ?
+               GLSL_NO_SLOT : c->mask;
+    if (lv.index != GLSL_NO_SLOT) {
+        for (int k = 0; k < n; k++)
+            emit(c, GOP_SCATTER, lv.slot[k], rv.slot[k], lv.index, mask,
+                 GLSL_PACK(lv.stride, lv.count));
+        return;
+    }
+
+    // Components mustn't be overwritten before they're read.
+    bool overlap = false;
+    for (int k = 0; k < n && !overlap; k++)
+        for (int j = k + 1; j < n; j++)
+            if (rv.slot[j] == lv.slot[k])
+                overlap = true;
+    if (overlap) {
+        value copy = temp_value(c, rv.type);
+        for (int k = 0; k < n; k++)
+            emit(c, GOP_MOV, copy.slot[k], rv.slot[k], 0, 0, 0);
+        rv = copy;
+    }
+    for (int k = 0; k < n; k++) {
+        bool unique = true;
+        for (int j = 0; j < n; j++)
+            if (j != k && rv.slot[j] == rv.slot[k])
+                unique = false;
+        move(c, lv.slot[k], rv.slot[k], mask, unique);
+    }
+}
+
+static symbol *new_symbol(compiler *c, const char *name, value v)
+{
+    symbol *s = alloc(c, sizeof *s);
+    s->name = name;
+    s->v = v;
+    s->decl_mask = c->mask;
+    s->param = -1;
+    s->v.var = s;
+    return s;
+}
+
+// A new variable, not yet in scope.
+static symbol *new_variable(compiler *c, const char *name, const gtype *t)
+{
+    value v = make_value(c, t, new_slots(c, t->size, true));
+    return new_symbol(c, name, v);
+}
+
+static value var_value(symbol *s)
+{
+    value v = s->v;
+    v.var = s;
+    return v;
+}
+
+// Component-wise operations, with scalars stretched to fit.
+
+static int component(value v, int k)
+{
+    return v.type->size == 1 ? v.slot[0] : v.slot[k];
+}
+
+static const gtype *wider(compiler *c, const gtype *a, const gtype *b)
+{
+    if (a->size == 1)
+        return b;
+    if (b->size == 1 || same_type(a, b))
+        return a;
+    fail(c, "%s and %s don't match", type_name(c, a), type_name(c, b));
+}
+
+static value map1(compiler *c, glsl_op op, value a)
+{
+    a = rvalue(c, a);
+    value r = make_value(c, a.type, 0);
+    for (int k = 0; k < a.type->size; k++)
+        r.slot[k] = op1(c, op, a.slot[k]);
+    return r;
+}
+
+static value map2(compiler *c, glsl_op op, value a, value b)
+{
+    a = rvalue(c, a);
+    b = rvalue(c, b);
+    const gtype *t = wider(c, a.type, b.type);
+    value r = make_value(c, t, 0);
+    for (int k = 0; k < t->size; k++)
+        r.slot[k] = op2(c, op, component(a, k), component(b, k));
+    return r;
+}
+
+static value map3(compiler *c, glsl_op op, value a, value b, value d)
+{
+    a = rvalue(c, a);
+    b = rvalue(c, b);
+    d = rvalue(c, d);
+    const gtype *t = wider(c, wider(c, a.type, b.type), d.type);
+    value r = make_value(c, t, 0);
+    for (int k = 0; k < t->size; k++)
+        r.slot[k] = op3(c, op, component(a, k), component(b, k),
+                        component(d, k));
+    return r;
+}
+
+static value float_arg(compiler *c, value v, const char *fn)
+{
+    v = rvalue(c, v);
+    if (v.type->kind == K_INT && !v.type->array && v.type->cols == 1)
+        return convert(c, v, K_FLOAT);
+    if (v.type->kind != K_FLOAT || v.type->array)
+        fail(c, "%s: %s where a float type is needed",
+             fn, type_name(c, v.type));
+    return v;
+}
+
+static int dot_slots(compiler *c, value a, value b)
+{
+    int s = op2(c, GOP_FMUL, a.slot[0], b.slot[0]);
+    for (int k = 1; k < a.type->size; k++)
+        s = op3(c, GOP_FMAD, a.slot[k], b.slot[k], s);
+    return s;
+}
+
+// Operators
+
+static value arithmetic(compiler *c, int op, value a, value b)
+{
+    a = rvalue(c, a);
+    b = rvalue(c, b);
+    if (!is_numeric(a.type) || !is_numeric(b.type))
+        fail(c, "bad operands for %c: %s and %s",
+             op, type_name(c, a.type), type_name(c, b.type));
+    if (a.type->kind != b.type->kind) {
+        a = convert(c, a, K_FLOAT);
+        b = convert(c, b, K_FLOAT);
+    }
+    bool fl = a.type->kind == K_FLOAT;
+
+    if (op == '*' && (is_matrix(a.type) || is_matrix(b.type)) &&
+        a.type->size > 1 && b.type->size > 1) {
+        const gtype *at = a.type, *bt = b.type;
+        int n = is_matrix(at) ? at->rows : bt->rows;
+        if ((is_matrix(at) ? at->cols : at->rows) != n ||
+            (is_matrix(bt) ? bt->rows : bt->rows) != n)
+            fail(c, "can't multiply %s by %s", at->name, bt->name);
+        if (is_matrix(at) && is_matrix(bt)) {
+            value r = make_value(c, at, 0);
+            for (int j = 0; j < n; j++) {
+                for (int i = 0; i < n; i++) {
+                    int s = op2(c, GOP_FMUL, a.slot[i], b.slot[j * n]);
+                    for (int k = 1; k < n; k++)
+                        s = op3(c, GOP_FMAD, a.slot[k * n + i],
+                                b.slot[j * n + k], s);
+                    r.slot[j * n + i] = s;
+                }
+            }
+            return r;
+        }
+        value r = make_value(c, vector_type(K_FLOAT, n), 0);
+        for (int i = 0; i < n; i++) {
+            int s;
+            if (is_matrix(at)) {        // matrix * column vector
+                s = op2(c, GOP_FMUL, a.slot[i], b.slot[0]);
+                for (int k = 1; k < n; k++)
+                    s = op3(c, GOP_FMAD, a.slot[k * n + i], b.slot[k], s);
+            } else {                    // row vector * matrix
+                s = op2(c, GOP_FMUL, a.slot[0], b.slot[i * n]);
+                for (int k = 1; k < n; k++)
+                    s = op3(c, GOP_FMAD, a.slot[k], b.slot[i * n + k], s);
+            }
+            r.slot[i] = s;
+        }
+        return r;
+    }
+
+    glsl_op gop;
+    switch (op) {
+    case '+': gop = fl ? GOP_FADD : GOP_IADD; break;
+    case '-': gop = fl ? GOP_FSUB : GOP_ISUB; break;
+    case '*': gop = fl ? GOP_FMUL : GOP_IMUL; break;
+    default:  gop = fl ? GOP_FDIV : GOP_IDIV; break;
+    }
+    return map2(c, gop, a, b);
+}
+
+static value relational(compiler *c, int op, value a, value b)
+{
+    a = rvalue(c, a);
+    b = rvalue(c, b);
+    if (!is_scalar(a.type) || !is_scalar(b.type) ||
+        a.type->kind == K_BOOL || b.type->kind == K_BOOL)
+        fail(c, "comparison needs int or float scalars");
+    if (a.type->kind != b.type->kind) {
+        a = convert(c, a, K_FLOAT);
+        b = convert(c, b, K_FLOAT);
+    }
+    bool fl = a.type->kind == K_FLOAT;
+    int x = a.slot[0], y = b.slot[0];
+    glsl_op lt = fl ? GOP_FLT : GOP_ILT, le = fl ? GOP_FLE : GOP_ILE;
+    int s;
+    switch (op) {
+    case '<':  s = op2(c, lt, x, y); break;
+    case '>':  s = op2(c, lt, y, x); break;
+    case P_LE: s = op2(c, le, x, y); break;
+    default:   s = op2(c, le, y, x); break;
+    }
+    return scalar_value(c, T(BOOL), s);
+}
+
+static value equality(compiler *c, bool equal, value a, value b)
+{
+    a = rvalue(c, a);
+    b = rvalue(c, b);
+    if (!same_type(a.type, b.type)) {
+        if (!is_numeric(a.type) || !is_numeric(b.type))
+            fail(c, "can't compare %s with %s",
+                 type_name(c, a.type), type_name(c, b.type));
+        a = convert(c, a, K_FLOAT);
+        b = convert(c, b, K_FLOAT);
+    }
+    if (a.type->kind == K_SAMPLER)
+        fail(c, "samplers can't be compared");
+    int s = -1;
+    for (int k = 0; k < a.type->size; k++) {
+        // Fields of structs may differ in kind.  Bits are as good.
+        glsl_op op = a.type->kind == K_FLOAT && !a.type->fields ?
+                     (equal ? GOP_FEQ : GOP_FNE) :
+                     (equal ? GOP_IEQ : GOP_INE);
+        int e = op2(c, op, a.slot[k], b.slot[k]);
+        s = k ? op2(c, equal ? GOP_AND : GOP_OR, s, e) : e;
+    }
+    return scalar_value(c, T(BOOL), s);
+}
+
+// Expressions
+
+static value expression(compiler *c);
+static value assignment(compiler *c);
+static value conditional(compiler *c);
+static value unary(compiler *c);
+static value call(compiler *c, const char *name);
+
+// Parses an expression that can't run, and throws its code away.
+static value dead_expression(compiler *c, value (*parse)(compiler *))
+{
+    int mask = c->mask, code = c->code_count;
+    c->mask = MASK_DEAD;
+    value v = parse(c);
+    c->mask = mask;
+    c->code_count = code;
+    return v;
+}
+
+static int const_int_expression(compiler *c)
+{
+    value v = rvalue(c, conditional(c));
+    if (v.type != T(INT) || !is_const(v.slot[0]))
+        fail(c, "expected a constant int");
+    return const_bits(c, v.slot[0]);
+}
+
+static bool contiguous(const value *v)
+{
+    for (int k = 1; k < v->type->size; k++)
+        if (v->slot[k] != v->slot[0] + k)
+            return false;
+    return true;
+}
+
+static value element(compiler *c, value v, value index)
+{
+    const gtype *t = v.type;
+    const gtype *et;
+    int count, stride;
+    if (t->array) {
+        et = t->elem;
+        count = t->array;
+    } else if (is_matrix(t)) {
+        et = vector_type(K_FLOAT, t->rows);
+        count = t->cols;
+    } else if (is_vector(t)) {
+        et = vector_type(t->kind, 1);
+        count = t->rows;
+    } else {
+        fail(c, "%s can't be indexed", type_name(c, t));
+    }
+    stride = et->size;
+    index = rvalue(c, index);
+    if (index.type != T(INT))
+        fail(c, "index must be an int");
+
+    int i = index.slot[0];
+    if (is_const(i)) {
+        int n = const_bits(c, i);
+        if (n < 0 || n >= count)
+            fail(c, "index %d is out of range", n);
+        value r = v;
+        r.type = et;
+        r.slot = v.slot + n * stride;
+        return r;
+    }
+
+    // A dynamic index.  Two at once can only be read.
+    symbol *var = v.var;
+    if (v.index != GLSL_NO_SLOT || !contiguous(&v)) {
+        value r = rvalue(c, v);
+        if (!contiguous(&r)) {
+            value copy = temp_value(c, r.type);
+            for (int k = 0; k < r.type->size; k++)
+                emit(c, GOP_MOV, copy.slot[k], r.slot[k], 0, 0, 0);
+            r = copy;
+        }
+        v = r;
+        var = NULL;
+    }
+    value r = make_value(c, et, v.slot[0]);
+    r.index = i;
+    r.stride = stride;
+    r.count = count;
+    r.var = var;
+    return r;
+}
+
+static int swizzle_index(char ch, int *set)
+{
+    static const char *sets[] = { "xyzw", "rgba", "stpq" };
+    for (int s = 0; s < 3; s++) {
+        const char *p = strchr(sets[s], ch);
+        if (p && ch) {
+            if (*set >= 0 && *set != s)
+                return -1;
+            *set = s;
+            return p - sets[s];
+        }
+    }
+    return -1;
+}
+
+static value member(compiler *c, value v, const char *name)
+{
+    const gtype *t = v.type;
+    if (t->kind == K_STRUCT && !t->array) {
+        for (int i = 0; i < t->field_count; i++) {
+            const field *f = &t->fields[i];
+            if (f->name == name) {
+                value r = v;
+                r.type = f->type;
+                r.slot = v.slot + f->offset;
+                return r;
+            }
+        }
+        fail(c, "%s has no field %s", t->name, name);
+    }
+    if (!is_vector(t))
+        fail(c, "%s has no field %s", type_name(c, t), name);
+    int n = strlen(name), set = -1;
+    if (n > 4)
+        fail(c, "bad swizzle %s", name);
+    value r = v;
+    r.type = vector_type(t->kind, n);
+    r.slot = alloc(c, (n + 1) * sizeof (int));
+    for (int i = 0; i < n; i++) {
+        int k = swizzle_index(name[i], &set);
+        if (k < 0 || k >= t->rows)
+            fail(c, "bad swizzle %s", name);
+        r.slot[i] = v.slot[k];
+        for (int j = 0; j < i; j++)
+            if (name[j] == name[i])
+                r.var = NULL;   // repeats can't be assigned
+    }
+    return r;
+}
+
+static value incdec(compiler *c, value lv, int op, bool postfix)
+{
+    value old = rvalue(c, lv);
+    if (!is_numeric(old.type))
+        fail(c, "%s needs a number", op == P_INC ? "++" : "--");
+    // No copy for "i++" as a statement or a for loop's step.
+    token *t = peek(c);
+    bool used = c->stmt_pos < 0 || !(is_punct(t, ';') || is_punct(t, ')'));
+    if (postfix && used) {
+        value copy = temp_value(c, old.type);
+        for (int k = 0; k < old.type->size; k++)
+            emit(c, GOP_MOV, copy.slot[k], old.slot[k], 0, 0, 0);
+        old = copy;
+    }
+    bool fl = old.type->kind == K_FLOAT;
+    int one = fl ? const_float(c, 1.0f) : const_int(c, 1);
+    value r = make_value(c, old.type, 0);
+    glsl_op gop = op == P_INC ? (fl ? GOP_FADD : GOP_IADD) :
+                                (fl ? GOP_FSUB : GOP_ISUB);
+    for (int k = 0; k < old.type->size; k++)
+        r.slot[k] = op2(c, gop, old.slot[k], one);
+    store(c, lv, r);
+    return postfix ? old : rvalue(c, lv);
+}
+
+static value primary(compiler *c)
+{
+    token *t = next(c);
+    switch (t->kind) {
+
+    case TK_INT:
+        if (t->ival > UINT32_MAX)
+            fail(c, "integer %.*s is too big", t->len, t->text);
+        return scalar_value(c, T(INT), const_int(c, (int32_t)t->ival));
+
+    case TK_FLOAT:
+        return scalar_value(c, T(FLOAT), const_float(c, t->fval));
+
+    case TK_IDENT:
+        if (is_word(t, "true") || is_word(t, "false"))
+            return scalar_value(c, T(BOOL), const_bool(c, is_word(t, "true")));
+        if (is_punct(peek(c), '('))
+            return call(c, t->name);
+        {
+            symbol *s = lookup(c, t->name);
+            if (!s || s->type)
+                fail(c, "%s is not declared", t->name);
+            return var_value(s);
+        }
+
+    case TK_PUNCT:
+        if (is_punct(t, '(')) {
+            value v = expression(c);
+            expect(c, ')');
+            return v;
+        }
+        break;
+    }
+    if (t->kind == TK_EOF)
+        fail(c, "unexpected end of shader");
+    c->pos--;
+    fail(c, "syntax error at '%.*s'", t->len, t->text);
+}
+
+static value postfix(compiler *c)
+{
+    int start = c->pos;
+    value v = primary(c);
+    while (true) {
+        if (accept(c, '[')) {
+            value index = expression(c);
+            expect(c, ']');
+            v = element(c, v, index);
+        } else if (accept(c, '.')) {
+            v = member(c, v, expect_ident(c));
+        } else if (is_punct(peek(c), P_INC) || is_punct(peek(c), P_DEC)) {
+            int op = next(c)->punct;
+            int stmt = c->stmt_pos;
+            if (stmt != start)
+                c->stmt_pos = -1;
+            v = incdec(c, v, op, true);
+            c->stmt_pos = stmt;
+        } else {
+            return v;
+        }
+    }
+}
+
+static value unary(compiler *c)
+{
+    token *t = peek(c);
+    if (is_punct(t, '+') || is_punct(t, '-') || is_punct(t, '!') ||
+        is_punct(t, '~') || is_punct(t, P_INC) || is_punct(t, P_DEC)) {
+        next(c);
+        int stmt = c->stmt_pos;
+        c->stmt_pos = -1;
+        value v = unary(c);
+        c->stmt_pos = stmt;
+        switch (t->punct) {
+
+        case '+':
+            if (!is_numeric(v.type))
+                fail(c, "unary + needs a number");
+            return rvalue(c, v);
+
+        case '-':
+            if (!is_numeric(v.type))
+                fail(c, "unary - needs a number");
+            return map1(c, v.type->kind == K_FLOAT ? GOP_FNEG : GOP_INEG, v);
+
+        case '!':
+            return scalar_value(c, T(BOOL),
+                                op1(c, GOP_NOT, bool_scalar(c, v, "!")));
+
+        case '~':
+            fail(c, "~ is reserved");
+
+        default:
+            return incdec(c, v, t->punct, false);
+        }
+    }
+    return postfix(c);
+}
+
+static value multiplicative(compiler *c)
+{
+    value v = unary(c);
+    while (true) {
+        token *t = peek(c);
+        if (is_punct(t, '%'))
+            fail(c, "%% is reserved; use mod()");
+        if (!is_punct(t, '*') && !is_punct(t, '/'))
+            return v;
+        next(c);
+        v = arithmetic(c, t->punct, v, unary(c));
+    }
+}
+
+static value additive(compiler *c)
+{
+    value v = multiplicative(c);
+    while (is_punct(peek(c), '+') || is_punct(peek(c), '-')) {
+        int op = next(c)->punct;
+        v = arithmetic(c, op, v, multiplicative(c));
+    }
+    return v;
+}
+
+static value relation(compiler *c)
+{
+    value v = additive(c);
+    while (true) {
+        token *t = peek(c);
+        if (is_punct(t, P_SHL) || is_punct(t, P_SHR))
+            fail(c, "shifts are reserved");
+        if (!is_punct(t, '<') && !is_punct(t, '>') &&
+            !is_punct(t, P_LE) && !is_punct(t, P_GE))
+            return v;
+        next(c);
+        v = relational(c, t->punct, v, additive(c));
+    }
+}
+
+static value equals(compiler *c)
+{
+    value v = relation(c);
+    while (is_punct(peek(c), P_EQ) || is_punct(peek(c), P_NE)) {
+        bool eq = next(c)->punct == P_EQ;
+        v = equality(c, eq, v, relation(c));
+    }
+    if (is_punct(peek(c), '&') || is_punct(peek(c), '|') ||
+        is_punct(peek(c), '^'))
+        fail(c, "bitwise operators are reserved");
+    return v;
+}
+
+// The right side runs only in the lanes where it matters, which
+// matters if it has side effects.
+static value logical(compiler *c, int op, value (*operand)(compiler *))
+{
+    value v = operand(c);
+    while (is_punct(peek(c), op)) {
+        next(c);
+        int a = stable_mask(c, bool_scalar(c, v, "logical operator"));
+        int saved = c->mask;
+        if (op == P_AND)
+            c->mask = mask_and(c, saved, a);
+        else if (op == P_OR)
+            c->mask = mask_and_not(c, saved, a);
+        int b = bool_scalar(c, operand(c), "logical operator");
+        c->mask = saved;
+        glsl_op gop = op == P_AND ? GOP_AND : op == P_OR ? GOP_OR : GOP_XOR;
+        v = scalar_value(c, T(BOOL), op2(c, gop, a, b));
+    }
+    return v;
+}
+
+static value logical_and(compiler *c)
+{
+    return logical(c, P_AND, equals);
+}
+
+static value logical_xor(compiler *c)
+{
+    return logical(c, P_XOR, logical_and);
+}
+
+static value logical_or(compiler *c)
+{
+    return logical(c, P_OR, logical_xor);
+}
+
+static value conditional(compiler *c)
+{
+    value v = logical_or(c);
+    if (!accept(c, '?'))
+        return v;
+    int cond = stable_mask(c, bool_scalar(c, v, "?:"));
+    int saved = c->mask;
+    value a, b;
+    if (is_const(cond)) {
+        bool taken = const_bits(c, cond);
+        a = taken ? expression(c) : dead_expression(c, expression);
+        expect(c, ':');
+        b = taken ? dead_expression(c, assignment) : assignment(c);
+        a = rvalue(c, a);
+        b = rvalue(c, coerce(c, b, a.type, "?:"));
+        return taken ? a : b;
+    }
+    c->mask = mask_and(c, saved, cond);
+    a = rvalue(c, expression(c));
+    expect(c, ':');
+    c->mask = mask_and_not(c, saved, cond);
+    b = assignment(c);
+    c->mask = saved;
+    if (a.type->kind == K_INT && b.type->kind == K_FLOAT)
+        a = coerce(c, a, b.type, "?:");
+    b = rvalue(c, coerce(c, b, a.type, "?:"));
+    if (a.type->kind == K_SAMPLER || a.type->kind == K_VOID)
+        fail(c, "bad operands for ?:");
+    value r = make_value(c, a.type, 0);
+    for (int k = 0; k < a.type->size; k++)
+        r.slot[k] = op3(c, GOP_SEL, cond, a.slot[k], b.slot[k]);
+    return r;
+}
+
+static value assignment(compiler *c)
+{
+    value lv = conditional(c);
+    token *t = peek(c);
+    int op;
+    switch (t->kind == TK_PUNCT ? t->punct : 0) {
+    case '=':          op = 0;   break;
+    case P_ADD_ASSIGN: op = '+'; break;
+    case P_SUB_ASSIGN: op = '-'; break;
+    case P_MUL_ASSIGN: op = '*'; break;
+    case P_DIV_ASSIGN: op = '/'; break;
+    case P_MOD_ASSIGN:
+    case P_AND_ASSIGN:
+    case P_OR_ASSIGN:
+    case P_XOR_ASSIGN:
+    case P_SHL_ASSIGN:
+    case P_SHR_ASSIGN:
+        fail(c, "%.*s is reserved", t->len, t->text);
+    default:
+        return lv;
+    }
+    next(c);
+    if (!lv.var)
+        fail(c, "assignment to something that isn't a variable");
+    int stmt = c->stmt_pos;
+    c->stmt_pos = -1;
+    value rv = assignment(c);
+    c->stmt_pos = stmt;
+    if (op)
+        rv = arithmetic(c, op, lv, rv);
+    store(c, lv, rv);
+    return rvalue(c, lv);
+}
+
+static value expression(compiler *c)
+{
+    value v = assignment(c);
+    while (accept(c, ','))
+        v = assignment(c);
+    return v;
+}
+
+// Calls
+
+static value construct(compiler *c, const gtype *t, value *args, int n)
+{
+    for (int i = 0; i < n; i++) {
+        args[i] = rvalue(c, args[i]);
+        if (args[i].type->kind == K_SAMPLER || args[i].type->array ||
+            args[i].type->kind == K_VOID)
+            fail(c, "bad argument to %s constructor", t->name);
+    }
+    value r = make_value(c, t, 0);
+    if (t->kind == K_STRUCT) {
+        if (n != t->field_count)
+            fail(c, "%s has %d fields", t->name, t->field_count);
+        for (int i = 0; i < n; i++) {
+            const field *f = &t->fields[i];
+            value a = rvalue(c, coerce(c, args[i], f->type, t->name));
+            memcpy(r.slot + f->offset, a.slot, f->type->size * sizeof (int));
+        }
+        return r;
+    }
+    if (n == 0)
+        fail(c, "%s constructor needs arguments", t->name);
+    if (is_scalar(t)) {
+        r.slot[0] = convert_slot(c, args[0].slot[0], args[0].type->kind,
+                                 t->kind);
+        return r;
+    }
+    if (n == 1 && args[0].type->size == 1) {
+        int s = convert_slot(c, args[0].slot[0], args[0].type->kind,
+                             t->kind);
+        int zero = const_float(c, 0.0f);
+        for (int k = 0; k < t->size; k++) {
+            bool diagonal = k / t->rows == k % t->rows;
+            r.slot[k] = !is_matrix(t) || diagonal ? s : zero;
+        }
+        return r;
+    }
+    if (n == 1 && is_matrix(t) && is_matrix(args[0].type)) {
+        const gtype *at = args[0].type;
+        for (int j = 0; j < t->cols; j++) {
+            for (int i = 0; i < t->rows; i++) {
+                int k = j * t->rows + i;
+                if (j < at->cols && i < at->rows)
+                    r.slot[k] = args[0].slot[j * at->rows + i];
+                else
+                    r.slot[k] = const_float(c, i == j ? 1.0f : 0.0f);
+            }
+        }
+        return r;
+    }
+    int k = 0;
+    for (int i = 0; i < n; i++) {
+        if (k == t->size)
+            fail(c, "too many arguments to %s constructor", t->name);
+        const gtype *at = args[i].type;
+        for (int j = 0; j < at->size && k < t->size; j++)
+            r.slot[k++] = convert_slot(c, args[i].slot[j], at->kind,
+                                       t->kind);
+    }
+    if (k < t->size)
+        fail(c, "not enough arguments to %s constructor", t->name);
+    return r;
+}
+
+static int parse_args(compiler *c, value *args)
+{
+    int n = 0;
+    expect(c, '(');
+    if (is_word(peek(c), "void") && is_punct(peek_at(c, 1), ')'))
+        next(c);
+    if (accept(c, ')'))
+        return 0;
+    do {
+        if (n == MAX_ARGS)
+            fail(c, "too many arguments");
+        int stmt = c->stmt_pos;
+        c->stmt_pos = -1;
+        args[n++] = assignment(c);
+        c->stmt_pos = stmt;
+    } while (accept(c, ','));
+    expect(c, ')');
+    return n;
+}
+
+static value builtin(compiler *c, const char *name, value *a, int n);
+static value inline_call(compiler *c, function *fn, value *args);
+
+static bool args_fit(const function *fn, const value *args, int n, bool exact)
+{
+    if (fn->param_count != n)
+        return false;
+    for (int i = 0; i < n; i++) {
+        const gtype *pt = fn->params[i].type, *at = args[i].type;
+        if (same_type(pt, at))
+            continue;
+        if (exact || fn->params[i].qual & Q_OUT)
+            return false;
+        if (!(pt->kind == K_FLOAT && at->kind == K_INT && !pt->array &&
+              !at->array && pt->rows == at->rows && pt->cols == 1))
+            return false;
+    }
+    return true;
+}
+
+static value call(compiler *c, const char *name)
+{
+    const gtype *t = builtin_type(&c->toks[c->pos - 1]);
+    if (!t) {
+        symbol *s = lookup(c, name);
+        if (s && s->type)
+            t = s->type;
+    }
+    value args[MAX_ARGS];
+    int n = parse_args(c, args);
+    if (t)
+        return construct(c, t, args, n);
+
+    for (int pass = 0; pass < 2; pass++)
+        for (function *fn = c->functions; fn; fn = fn->next)
+            if (fn->name == name && args_fit(fn, args, n, pass == 0))
+                return inline_call(c, fn, args);
+    for (function *fn = c->functions; fn; fn = fn->next)
+        if (fn->name == name)
+            fail(c, "no %s() takes these arguments", name);
+    return builtin(c, name, args, n);
+}
+
+// Builtin functions
+
+static void arity(compiler *c, const char *name, int n, int min, int max)
+{
+    if (n < min || n > max)
+        fail(c, "wrong number of arguments to %s()", name);
+}
+
+static value geometric_length(compiler *c, value v)
+{
+    int d = dot_slots(c, v, v);
+    return scalar_value(c, T(FLOAT), op1(c, GOP_FSQRT, d));
+}
+
+static value vector_compare(compiler *c, const char *name, glsl_op fop,
+                            glsl_op iop, value a, value b)
+{
+    a = rvalue(c, a);
+    b = rvalue(c, b);
+    if (!is_vector(a.type) || !same_type(a.type, b.type))
+        fail(c, "%s() needs two vectors of the same type", name);
+    if (a.type->kind == K_BOOL && iop != GOP_IEQ && iop != GOP_INE)
+        fail(c, "%s() needs numbers", name);
+    value r = make_value(c, vector_type(K_BOOL, a.type->rows), 0);
+    for (int k = 0; k < a.type->rows; k++)
+        r.slot[k] = op2(c, a.type->kind == K_FLOAT ? fop : iop,
+                        a.slot[k], b.slot[k]);
+    return r;
+}
+
+static value texture_call(compiler *c, const char *name, value *a, int n)
+{
+    arity(c, name, n, 2, 3);
+    if (a[0].type->kind != K_SAMPLER || a[0].sampler < 0)
+        fail(c, "%s() needs a sampler2D", name);
+    value uv = float_arg(c, a[1], name);
+    if (uv.type != T(VEC2))
+        fail(c, "%s() needs a vec2", name);
+    value r = temp_value(c, T(VEC4));
+    if (c->mask != MASK_DEAD)
+        emit(c, GOP_TEX, r.slot[0], uv.slot[0], uv.slot[1], a[0].sampler, 0);
+    return r;
+}
+
+static value builtin(compiler *c, const char *name, value *a, int n)
+{
+    static const struct {
+        const char *name;
+        glsl_op     op;
+    } unary_fns[] = {
+        { "sin",   GOP_FSIN },   { "cos",         GOP_FCOS },
+        { "tan",   GOP_FTAN },   { "asin",        GOP_FASIN },
+        { "acos",  GOP_FACOS },  { "exp",         GOP_FEXP },
+        { "log",   GOP_FLOG },   { "exp2",        GOP_FEXP2 },
+        { "log2",  GOP_FLOG2 },  { "sqrt",        GOP_FSQRT },
+        { "abs",   GOP_FABS },   { "inversesqrt", GOP_FRSQRT },
+        { "sign",  GOP_FSIGN },  { "floor",       GOP_FFLOOR },
+        { "ceil",  GOP_FCEIL },  { "fract",       GOP_FFRACT },
+    }, binary_fns[] = {
+        { "pow",   GOP_FPOW },   { "mod",         GOP_FMOD },
+        { "min",   GOP_FMIN },   { "max",         GOP_FMAX },
+        { "step",  GOP_FSTEP },
+    }, ternary_fns[] = {
+        { "clamp", GOP_FCLAMP }, { "mix",         GOP_FMIX },
+        { "smoothstep", GOP_FSMOOTH },
+    };
+
+    for (size_t i = 0; i < sizeof unary_fns / sizeof *unary_fns; i++) {
+        if (!strcmp(name, unary_fns[i].name)) {
+            arity(c, name, n, 1, 1);
+            return map1(c, unary_fns[i].op, float_arg(c, a[0], name));
+        }
+    }
+    for (size_t i = 0; i < sizeof binary_fns / sizeof *binary_fns; i++) {
+        if (!strcmp(name, binary_fns[i].name)) {
+            arity(c, name, n, 2, 2);
+            return map2(c, binary_fns[i].op,
+                        float_arg(c, a[0], name), float_arg(c, a[1], name));
+        }
+    }
+    for (size_t i = 0; i < sizeof ternary_fns / sizeof *ternary_fns; i++) {
+        if (!strcmp(name, ternary_fns[i].name)) {
+            arity(c, name, n, 3, 3);
+            return map3(c, ternary_fns[i].op, float_arg(c, a[0], name),
+                        float_arg(c, a[1], name), float_arg(c, a[2], name));
+        }
+    }
+
+    if (!strcmp(name, "atan")) {
+        arity(c, name, n, 1, 2);
+        if (n == 1)
+            return map1(c, GOP_FATAN, float_arg(c, a[0], name));
+        return map2(c, GOP_FATAN2,
+                    float_arg(c, a[0], name), float_arg(c, a[1], name));
+    }
+    if (!strcmp(name, "radians") || !strcmp(name, "degrees")) {
+        arity(c, name, n, 1, 1);
+        float k = name[0] == 'r' ? M_PI / 180.0 : 180.0 / M_PI;
+        return map2(c, GOP_FMUL, float_arg(c, a[0], name),
+                    scalar_value(c, T(FLOAT), const_float(c, k)));
+    }
+    if (!strcmp(name, "length")) {
+        arity(c, name, n, 1, 1);
+        return geometric_length(c, float_arg(c, a[0], name));
+    }
+    if (!strcmp(name, "distance")) {
+        arity(c, name, n, 2, 2);
+        value d = map2(c, GOP_FSUB,
+                       float_arg(c, a[0], name), float_arg(c, a[1], name));
+        return geometric_length(c, d);
+    }
+    if (!strcmp(name, "dot")) {
+        arity(c, name, n, 2, 2);
+        value x = float_arg(c, a[0], name), y = float_arg(c, a[1], name);
+        if (!same_type(x.type, y.type) || is_matrix(x.type))
+            fail(c, "dot() needs two vectors of the same size");
+        return scalar_value(c, T(FLOAT), dot_slots(c, x, y));
+    }
+    if (!strcmp(name, "normalize")) {
+        arity(c, name, n, 1, 1);
+        value v = float_arg(c, a[0], name);
+        int r = op1(c, GOP_FRSQRT, dot_slots(c, v, v));
+        return map2(c, GOP_FMUL, v, scalar_value(c, T(FLOAT), r));
+    }
+    if (!strcmp(name, "cross")) {
+        arity(c, name, n, 2, 2);
+        value x = float_arg(c, a[0], name), y = float_arg(c, a[1], name);
+        if (x.type != T(VEC3) || y.type != T(VEC3))
+            fail(c, "cross() needs two vec3s");
+        value r = make_value(c, T(VEC3), 0);
+        for (int k = 0; k < 3; k++) {
+            int i = (k + 1) % 3, j = (k + 2) % 3;
+            int p = op2(c, GOP_FMUL, x.slot[j], y.slot[i]);
+            int q = op2(c, GOP_FMUL, x.slot[i], y.slot[j]);
+            r.slot[k] = op2(c, GOP_FSUB, q, p);
+        }
+        return r;
+    }
+    if (!strcmp(name, "faceforward")) {
+        arity(c, name, n, 3, 3);
+        value nv = float_arg(c, a[0], name);
+        value iv = float_arg(c, a[1], name);
+        value ref = float_arg(c, a[2], name);
+        int d = dot_slots(c, ref, iv);
+        int neg = op2(c, GOP_FLT, d, const_float(c, 0.0f));
+        value m = map1(c, GOP_FNEG, nv);
+        value r = make_value(c, nv.type, 0);
+        for (int k = 0; k < nv.type->size; k++)
+            r.slot[k] = op3(c, GOP_SEL, neg, nv.slot[k], m.slot[k]);
+        return r;
+    }
+    if (!strcmp(name, "reflect")) {
+        arity(c, name, n, 2, 2);
+        value iv = float_arg(c, a[0], name), nv = float_arg(c, a[1], name);
+        int d = dot_slots(c, nv, iv);
+        int d2 = op2(c, GOP_FMUL, d, const_float(c, 2.0f));
+        value r = make_value(c, iv.type, 0);
+        for (int k = 0; k < iv.type->size; k++)
+            r.slot[k] = op2(c, GOP_FSUB, iv.slot[k],
+                            op2(c, GOP_FMUL, d2, nv.slot[k]));
+        return r;
+    }
+    if (!strcmp(name, "refract")) {
+        arity(c, name, n, 3, 3);
+        value iv = float_arg(c, a[0], name), nv = float_arg(c, a[1], name);
+        value eta = float_arg(c, a[2], name);
+        int e = eta.slot[0];
+        int d = dot_slots(c, nv, iv);
+        int one = const_float(c, 1.0f);
+        int k = op2(c, GOP_FSUB, one, op2(c, GOP_FMUL, d, d));
+        k = op2(c, GOP_FSUB, one, op2(c, GOP_FMUL, op2(c, GOP_FMUL, e, e), k));
+        int tir = op2(c, GOP_FLT, k, const_float(c, 0.0f));
+        int s = op3(c, GOP_FMAD, e, d, op1(c, GOP_FSQRT, k));
+        value r = make_value(c, iv.type, 0);
+        for (int j = 0; j < iv.type->size; j++) {
+            int x = op2(c, GOP_FSUB, op2(c, GOP_FMUL, e, iv.slot[j]),
+                        op2(c, GOP_FMUL, s, nv.slot[j]));
+            r.slot[j] = op3(c, GOP_SEL, tir, const_float(c, 0.0f), x);
+        }
+        return r;
+    }
+    if (!strcmp(name, "matrixCompMult")) {
+        arity(c, name, n, 2, 2);
+        value x = rvalue(c, a[0]), y = rvalue(c, a[1]);
+        if (!is_matrix(x.type) || !same_type(x.type, y.type))
+            fail(c, "matrixCompMult() needs two matrices of the same size");
+        return map2(c, GOP_FMUL, x, y);
+    }
+    if (!strcmp(name, "lessThan")) {
+        arity(c, name, n, 2, 2);
+        return vector_compare(c, name, GOP_FLT, GOP_ILT, a[0], a[1]);
+    }
+    if (!strcmp(name, "lessThanEqual")) {
+        arity(c, name, n, 2, 2);
+        return vector_compare(c, name, GOP_FLE, GOP_ILE, a[0], a[1]);
+    }
+    if (!strcmp(name, "greaterThan")) {
+        arity(c, name, n, 2, 2);
+        return vector_compare(c, name, GOP_FLT, GOP_ILT, a[1], a[0]);
+    }
+    if (!strcmp(name, "greaterThanEqual")) {
+        arity(c, name, n, 2, 2);
+        return vector_compare(c, name, GOP_FLE, GOP_ILE, a[1], a[0]);
+    }
+    if (!strcmp(name, "equal")) {
+        arity(c, name, n, 2, 2);
+        return vector_compare(c, name, GOP_FEQ, GOP_IEQ, a[0], a[1]);
+    }
+    if (!strcmp(name, "notEqual")) {
+        arity(c, name, n, 2, 2);
+        return vector_compare(c, name, GOP_FNE, GOP_INE, a[0], a[1]);
+    }
+    if (!strcmp(name, "any") || !strcmp(name, "all") || !strcmp(name, "not")) {
+        arity(c, name, n, 1, 1);
+        value v = rvalue(c, a[0]);
+        if (!is_vector(v.type) || v.type->kind != K_BOOL)
+            fail(c, "%s() needs a bvec", name);
+        if (name[0] == 'n')
+            return map1(c, GOP_NOT, v);
+        int s = v.slot[0];
+        for (int k = 1; k < v.type->rows; k++)
+            s = op2(c, name[1] == 'n' ? GOP_OR : GOP_AND, s, v.slot[k]);
+        return scalar_value(c, T(BOOL), s);
+    }
+    if (!strcmp(name, "texture2D") || !strcmp(name, "texture") ||
+        !strcmp(name, "texture2DLod"))
+        return texture_call(c, name, a, n);
+    fail(c, "no function %s()", name);
+}
+
+
+static void block(compiler *c);
+
+// Functions are inlined.  A parameter that the body never assigns
+// aliases its argument, and an out parameter aliases its argument if
+// that is a plain variable.
+static value inline_call(compiler *c, function *fn, value *args)
+{
+    int n = fn->param_count;
+    if (fn->body < 0)
+        fail(c, "%s() has no body", fn->name);
+    for (int i = 0; i < n; i++) {
+        if (!(fn->params[i].qual & Q_OUT))
+            continue;
+        if (!args[i].var)
+            fail(c, "argument %d to %s() isn't a variable", i + 1, fn->name);
+        if (args[i].var->readonly)
+            fail(c, "%s is read-only", args[i].var->name);
+    }
+
+    // A function being checked doesn't look inside the ones it calls.
+    if (c->checking) {
+        for (int i = 0; i < n; i++)
+            if (fn->params[i].qual & Q_OUT)
+                store(c, args[i], temp_value(c, fn->params[i].type));
+        return temp_value(c, fn->ret);
+    }
+    if (fn->inlining)
+        fail(c, "%s() is recursive", fn->name);
+
+    int entry = c->mask;
+    frame f = {
+        .fn         = fn,
+        .entry_mask = entry,
+    };
+    if (fn->ret != T(VOID))
+        f.result = new_variable(c, "return value", fn->ret);
+    int mark = c->next_slot;
+
+    symbol *params[MAX_ARGS];
+    bool copy_out[MAX_ARGS] = { false };
+    for (int i = 0; i < n; i++) {
+        const param *p = &fn->params[i];
+        value a = args[i];
+        symbol *s;
+        bool shared = false;
+        for (int j = 0; j < n; j++)
+            if (j != i && a.var && args[j].var == a.var &&
+                (fn->params[j].qual & Q_OUT))
+                shared = true;
+        if (p->qual == Q_IN) {
+            a = rvalue(c, coerce(c, a, p->type, fn->name));
+            if (fn->written[i] || shared) {
+                s = new_variable(c, p->name, p->type);
+                store(c, var_value(s), a);
+            } else {
+                s = new_symbol(c, p->name, a);
+                s->v.var = NULL;
+                for (int k = 0; k < p->type->size; k++)
+                    if (!is_const(a.slot[k]))
+                        c->slots[a.slot[k]].pinned = true;
+            }
+        } else if (a.index == GLSL_NO_SLOT && !shared) {
+            s = new_symbol(c, p->name, a);
+            s->v.var = a.var;
+        } else {
+            s = new_variable(c, p->name, p->type);
+            if (p->qual & Q_IN)
+                store(c, var_value(s), a);
+            copy_out[i] = true;
+        }
+        s->readonly |= p->is_const;
+        params[i] = s;
+    }
+
+    fn->inlining = true;
+    int floor = c->floor, scope = c->scope_start, syms = c->sym_count;
+    int nest = c->nest, jumps = c->jumps, pos = c->pos, stmt = c->stmt_pos;
+    loop *lp = c->loop;
+    frame *caller = c->frame;
+    c->floor = c->scope_start = c->sym_count;
+    for (int i = 0; i < n; i++)
+        if (params[i]->name)
+            add_symbol(c, params[i]);
+    f.live = new_slots(c, 1, true);
+    f.live_init = emit(c, GOP_MOV, f.live,
+                       entry == MASK_ALL ? const_bool(c, true) : entry,
+                       0, 0, 0);
+    c->loop = NULL;
+    c->nest = 0;
+    c->frame = &f;
+    c->pos = fn->body;
+    expect(c, '{');
+    block(c);
+    if (!f.returned)
+        c->code[f.live_init].op = GOP_NOP;
+
+    c->pos = pos;
+    c->floor = floor;
+    c->scope_start = scope;
+    c->sym_count = syms;
+    c->nest = nest;
+    c->jumps = jumps;
+    c->stmt_pos = stmt;
+    c->loop = lp;
+    c->frame = caller;
+    c->mask = entry;
+    for (int i = 0; i < n; i++)
+        if (copy_out[i])
+            store(c, args[i], var_value(params[i]));
+    c->next_slot = mark;
+    fn->inlining = false;
+    if (!f.result)
+        return make_value(c, T(VOID), 0);
+    return rvalue(c, var_value(f.result));
+}
+
+// Statements
+
+static void statement(compiler *c);
+static void declaration(compiler *c);
+
+static void block(compiler *c)
+{
+    int syms = c->sym_count, scope = c->scope_start, mark = c->next_slot;
+    c->scope_start = c->sym_count;
+    while (!accept(c, '}')) {
+        if (peek(c)->kind == TK_EOF)
+            fail(c, "missing }");
+        statement(c);
+    }
+    c->sym_count = syms;
+    c->scope_start = scope;
+    c->next_slot = mark;
+}
+
+// The body of an if or a loop has a scope of its own.
+static void scoped_statement(compiler *c)
+{
+    int syms = c->sym_count, scope = c->scope_start, mark = c->next_slot;
+    c->scope_start = c->sym_count;
+    statement(c);
+    c->sym_count = syms;
+    c->scope_start = scope;
+    c->next_slot = mark;
+}
+
+static void if_statement(compiler *c)
+{
+    expect(c, '(');
+    int cond = stable_mask(c, bool_scalar(c, expression(c), "if"));
+    expect(c, ')');
+    if (is_const(cond)) {
+        bool taken = const_bits(c, cond);
+        if (taken)
+            scoped_statement(c);
+        else
+            skip_statement(c);
+        if (accept_word(c, "else")) {
+            if (taken)
+                skip_statement(c);
+            else
+                scoped_statement(c);
+        }
+        return;
+    }
+
+    int saved = c->mask, jumps = c->jumps;
+    c->nest++;
+    c->mask = mask_and(c, saved, cond);
+    int skip = emit(c, GOP_JNONE, 0, 0, c->mask, 0, 0);
+    scoped_statement(c);
+    patch(c, skip);
+    if (accept_word(c, "else")) {
+        c->mask = mask_and_not(c, saved, cond);
+        skip = emit(c, GOP_JNONE, 0, 0, c->mask, 0, 0);
+        scoped_statement(c);
+        patch(c, skip);
+    }
+    c->nest--;
+    c->mask = saved;
+    if (c->jumps != jumps)
+        c->mask = rejoin(c, saved, true);
+}
+
+// Starts a loop: lanes running now are in brk.
+static void begin_loop(compiler *c, loop *l)
+{
+    *l = (loop) { .outer = c->loop };
+    l->brk = new_slots(c, 1, true);
+    int m = c->mask == MASK_ALL ? const_bool(c, true) : c->mask;
+    emit(c, GOP_MOV, l->brk, m, 0, 0, 0);
+}
+
+// Starts an iteration's body, under cnt.  Returns cnt's
+// initialization.
+static int begin_body(compiler *c, loop *l)
+{
+    l->cnt = new_slots(c, 1, true);
+    int init = emit(c, GOP_MOV, l->cnt, l->brk, 0, 0, 0);
+    c->loop = l;
+    c->nest++;
+    c->mask = l->cnt;
+    return init;
+}
+
+// Without a continue, cnt is always brk.
+static void end_body(compiler *c, loop *l, int init)
+{
+    c->nest--;
+    c->loop = l->outer;
+    if (l->continued)
+        return;
+    c->code[init].op = GOP_NOP;
+    for (int i = init + 1; i < c->code_count; i++) {
+        glsl_insn *in = &c->code[i];
+        unsigned roles = glsl_op_roles[in->op];
+        if ((roles & OR_A) && in->a == l->cnt)
+            in->a = l->brk;
+        if ((roles & OR_B) && in->b == l->cnt)
+            in->b = l->brk;
+        if ((roles & OR_C) && in->c == l->cnt)
+            in->c = l->brk;
+    }
+}
+
+static void end_loop(compiler *c, int saved, int jumps)
+{
+    c->mask = saved;
+    if (c->jumps != jumps)
+        c->mask = rejoin(c, saved, true);
+}
+
+// Narrows brk by a loop condition.  False if it's constant false.
+static bool loop_condition(compiler *c, loop *l, value v)
+{
+    int cond = bool_scalar(c, v, "loop condition");
+    if (is_const(cond))
+        return const_bits(c, cond);
+    emit(c, GOP_AND, l->brk, l->brk, cond, 0, 0);
+    return true;
+}
+
+static void for_statement(compiler *c)
+{
+    int syms = c->sym_count, scope = c->scope_start, mark = c->next_slot;
+    c->scope_start = c->sym_count;
+    expect(c, '(');
+    if (type_is_next(c)) {
+        declaration(c);
+    } else if (!accept(c, ';')) {
+        expression(c);
+        expect(c, ';');
+    }
+    int saved = c->mask, jumps = c->jumps;
+    loop l;
+    begin_loop(c, &l);
+    for (int i = syms; i < c->sym_count; i++)
+        c->syms[i]->decl_mask = l.brk;
+
+    int top = c->code_count;
+    c->mask = l.brk;
+    bool runs = true;
+    if (!is_punct(peek(c), ';'))
+        runs = loop_condition(c, &l, expression(c));
+    expect(c, ';');
+    if (!runs) {
+        skip_balanced(c);
+        c->pos--;
+        expect(c, ')');
+        skip_statement(c);
+    } else {
+        int exit = emit(c, GOP_JNONE, 0, 0, l.brk, 0, 0);
+        int step = c->pos;
+        while (!is_punct(peek(c), ')')) {
+            if (peek(c)->kind == TK_EOF)
+                fail(c, "unexpected end of shader");
+            if (is_punct(peek(c), '(') || is_punct(peek(c), '['))
+                skip_balanced(c);
+            else
+                next(c);
+        }
+        expect(c, ')');
+        int init = begin_body(c, &l);
+        scoped_statement(c);
+        c->mask = l.brk;
+        int after = c->pos;
+        c->pos = step;
+        if (!is_punct(peek(c), ')')) {
+            c->stmt_pos = step;
+            expression(c);
+            c->stmt_pos = -1;
+        }
+        c->pos = after;
+        emit(c, GOP_JMP, 0, top, 0, 0, 0);
+        patch(c, exit);
+        end_body(c, &l, init);
+    }
+    end_loop(c, saved, jumps);
+    c->sym_count = syms;
+    c->scope_start = scope;
+    c->next_slot = mark;
+}
+
+static void while_statement(compiler *c)
+{
+    int saved = c->mask, jumps = c->jumps;
+    loop l;
+    begin_loop(c, &l);
+    int top = c->code_count;
+    c->mask = l.brk;
+    expect(c, '(');
+    bool runs = loop_condition(c, &l, expression(c));
+    expect(c, ')');
+    if (!runs) {
+        skip_statement(c);
+    } else {
+        int exit = emit(c, GOP_JNONE, 0, 0, l.brk, 0, 0);
+        int init = begin_body(c, &l);
+        scoped_statement(c);
+        emit(c, GOP_JMP, 0, top, 0, 0, 0);
+        patch(c, exit);
+        end_body(c, &l, init);
+    }
+    end_loop(c, saved, jumps);
+}
+
+static void do_statement(compiler *c)
+{
+    int saved = c->mask, jumps = c->jumps;
+    loop l;
+    begin_loop(c, &l);
+    int top = c->code_count;
+    int init = begin_body(c, &l);
+    scoped_statement(c);
+    c->mask = l.brk;
+    if (!accept_word(c, "while"))
+        fail(c, "expected while");
+    expect(c, '(');
+    bool again = loop_condition(c, &l, expression(c));
+    expect(c, ')');
+    expect(c, ';');
+    if (again)
+        emit(c, GOP_JANY, 0, top, l.brk, 0, 0);
+    end_body(c, &l, init);
+    end_loop(c, saved, jumps);
+}
+
+// The running lanes leave the function.
+static void leave(compiler *c)
+{
+    frame *f = c->frame;
+    if (c->nest > 0) {
+        clear_lanes(c, f->live);
+        for (loop *l = c->loop; l; l = l->outer)
+            clear_lanes(c, l->brk);
+        f->returned = true;
+        c->jumps++;
+    }
+    c->mask = MASK_DEAD;
+}
+
+static void return_statement(compiler *c)
+{
+    frame *f = c->frame;
+    if (!accept(c, ';')) {
+        value v = expression(c);
+        expect(c, ';');
+        if (!f->result)
+            fail(c, "%s() returns void", f->fn->name);
+        store(c, var_value(f->result), v);
+    } else if (f->result) {
+        fail(c, "%s() must return a value", f->fn->name);
+    }
+    leave(c);
+}
+
+static void jump_statement(compiler *c, bool is_break)
+{
+    loop *l = c->loop;
+    expect(c, ';');
+    if (!l)
+        fail(c, "%s outside a loop", is_break ? "break" : "continue");
+    if (is_break) {
+        clear_lanes(c, l->brk);
+        l->broke = true;
+    } else {
+        clear_lanes(c, l->cnt);
+        l->continued = true;
+    }
+    c->jumps++;
+    c->mask = MASK_DEAD;
+}
+
+static void statement(compiler *c)
+{
+    if (c->mask == MASK_DEAD) {
+        skip_statement(c);
+        return;
+    }
+    int mark = c->next_slot;
+    if (accept(c, '{')) {
+        block(c);
+    } else if (accept(c, ';')) {
+    } else if (accept_word(c, "if")) {
+        if_statement(c);
+    } else if (accept_word(c, "for")) {
+        for_statement(c);
+    } else if (accept_word(c, "while")) {
+        while_statement(c);
+    } else if (accept_word(c, "do")) {
+        do_statement(c);
+    } else if (accept_word(c, "return")) {
+        return_statement(c);
+    } else if (accept_word(c, "break")) {
+        jump_statement(c, true);
+    } else if (accept_word(c, "continue")) {
+        jump_statement(c, false);
+    } else if (accept_word(c, "discard")) {
+        // Inlined functions can't leave main.
+        expect(c, ';');
+        if (strcmp(c->frame->fn->name, "main"))
+            fail(c, "discard is only supported in main()");
+        leave(c);
+    } else if (type_is_next(c)) {
+        declaration(c);
+        return;
+    } else {
+        c->stmt_pos = c->pos;
+        expression(c);
+        c->stmt_pos = -1;
+        expect(c, ';');
+    }
+    c->next_slot = mark;
+}
+
+// Declarations
+
+static glsl_type glsl_type_of(const gtype *t)
+{
+    if (t->kind == K_STRUCT)
+        return GT_STRUCT;
+    // The builtin types are in the same order.
+    return (glsl_type)(t - types - TY_BOOL);
+}
+
+static symbol *uniform(compiler *c, const char *name, const gtype *t)
+{
+    const gtype *et = t->array ? t->elem : t;
+    if (et->kind == K_STRUCT)
+        fail(c, "struct uniforms are not supported");
+    if (t->array && et->kind == K_SAMPLER)
+        fail(c, "sampler arrays are not supported");
+    GROW(c, c->uniforms, c->uniform_count, c->uniform_alloc);
+    int index = c->uniform_count++;
+    c->uniforms[index] = (glsl_uniform) {
+        .name       = (char *)name,
+        .type       = glsl_type_of(et),
+        .array_size = t->array,
+        .slot       = GLSL_NO_SLOT,
+        .slot_count = t->size,
+    };
+    symbol *s;
+    if (et->kind == K_SAMPLER) {
+        s = new_symbol(c, name, make_value(c, t, 0));
+        s->v.sampler = index;
+    } else {
+        s = new_variable(c, name, t);
+        c->uniforms[index].slot = s->v.slot[0];
+    }
+    s->readonly = true;
+    return s;
+}
+
+static void declaration(compiler *c)
+{
+    bool constant = false, is_uniform = false;
+    while (true) {
+        token *t = peek(c);
+        if (accept_word(c, "const"))
+            constant = true;
+        else if (accept_word(c, "uniform"))
+            is_uniform = true;
+        else if (is_word(t, "varying") || is_word(t, "attribute"))
+            fail(c, "%s variables are not supported", t->name);
+        else if (is_word(t, "invariant") || is_precision(t))
+            next(c);
+        else
+            break;
+    }
+    if (is_uniform && !c->at_global)
+        fail(c, "uniforms must be global");
+    const gtype *base = type_specifier(c);
+    if (!base) {
+        token *t = peek(c);
+        fail(c, "expected a type at '%.*s'", t->len, t->text);
+    }
+    if (accept(c, ';'))
+        return;
+    if (base == T(VOID))
+        fail(c, "variables can't be void");
+    do {
+        const char *name = expect_ident(c);
+        const gtype *t = base;
+        if (accept(c, '[')) {
+            int n = const_int_expression(c);
+            expect(c, ']');
+            t = array_of(c, t, n);
+        }
+        symbol *s;
+        if (is_uniform) {
+            s = uniform(c, name, t);
+        } else if (t->kind == K_SAMPLER) {
+            fail(c, "samplers must be uniforms");
+        } else if (constant) {
+            int first = c->next_slot;
+            s = new_variable(c, name, t);
+            if (!accept(c, '='))
+                fail(c, "const %s needs a value", name);
+            value v = rvalue(c, coerce(c, assignment(c), t, name));
+            bool folded = true;
+            for (int k = 0; k < t->size; k++)
+                folded &= is_const(v.slot[k]);
+            if (folded) {
+                s->v.slot = v.slot;
+                c->next_slot = first;
+            } else {
+                store(c, var_value(s), v);
+                c->next_slot = first + t->size;
+            }
+            s->readonly = true;
+        } else {
+            s = new_variable(c, name, t);
+            int end = c->next_slot;
+            if (accept(c, '='))
+                store(c, var_value(s), assignment(c));
+            c->next_slot = end;
+        }
+        add_symbol(c, s);
+    } while (accept(c, ','));
+    expect(c, ';');
+}
+
+static void parameters(compiler *c, function *fn)
+{
+    expect(c, '(');
+    if (is_word(peek(c), "void") && is_punct(peek_at(c, 1), ')'))
+        next(c);
+    if (accept(c, ')'))
+        return;
+    do {
+        param p = { .qual = Q_IN };
+        while (true) {
+            if (accept_word(c, "const"))
+                p.is_const = true;
+            else if (accept_word(c, "in"))
+                p.qual = Q_IN;
+            else if (accept_word(c, "out"))
+                p.qual = Q_OUT;
+            else if (accept_word(c, "inout"))
+                p.qual = Q_INOUT;
+            else if (is_precision(peek(c)))
+                next(c);
+            else
+                break;
+        }
+        p.type = type_specifier(c);
+        if (!p.type || p.type == T(VOID))
+            fail(c, "expected a parameter type");
+        if (peek(c)->kind == TK_IDENT)
+            p.name = expect_ident(c);
+        if (accept(c, '[')) {
+            int n = const_int_expression(c);
+            expect(c, ']');
+            p.type = array_of(c, p.type, n);
+        }
+        if (p.type->kind == K_SAMPLER && p.qual != Q_IN)
+            fail(c, "samplers can only be in parameters");
+        if (fn->param_count == MAX_ARGS)
+            fail(c, "%s() has too many parameters", fn->name);
+        fn->params[fn->param_count++] = p;
+    } while (accept(c, ','));
+    expect(c, ')');
+}
+
+// Compiles a function's body once, alone, to find its errors and the
+// parameters it assigns.  The code is thrown away.
+static void check_function(compiler *c, function *fn)
+{
+    int code = c->code_count, mark = c->next_slot, mask = c->mask;
+    int floor = c->floor, scope = c->scope_start, syms = c->sym_count;
+    c->at_global = false;
+    c->checking = fn;
+    c->mask = new_slots(c, 1, true);
+    frame f = {
+        .fn         = fn,
+        .entry_mask = c->mask,
+        .live       = new_slots(c, 1, true),
+    };
+    if (fn->ret != T(VOID))
+        f.result = new_variable(c, "return value", fn->ret);
+    c->floor = c->scope_start = c->sym_count;
+    for (int i = 0; i < fn->param_count; i++) {
+        const param *p = &fn->params[i];
+        if (!p->name)
+            continue;
+        symbol *s = new_variable(c, p->name, p->type);
+        s->param = i;
+        s->readonly = p->is_const;
+        if (p->type->kind == K_SAMPLER)
+            s->v.sampler = 0;
+        add_symbol(c, s);
+    }
+    c->frame = &f;
+    c->loop = NULL;
+    c->nest = 0;
+    expect(c, '{');
+    block(c);
+
+    c->frame = NULL;
+    c->checking = NULL;
+    c->at_global = true;
+    c->floor = floor;
+    c->scope_start = scope;
+    c->sym_count = syms;
+    c->code_count = code;
+    c->next_slot = mark;
+    c->mask = mask;
+}
+
+static void function_definition(compiler *c, const gtype *ret, const char *name)
+{
+    function def = {
+        .name = name,
+        .ret  = ret,
+        .body = -1,
+    };
+    parameters(c, &def);
+    function *fn = NULL;
+    for (function *f = c->functions; f && !fn; f = f->next) {
+        if (f->name != name || f->param_count != def.param_count)
+            continue;
+        fn = f;
+        for (int i = 0; i < def.param_count; i++)
+            if (!same_type(f->params[i].type, def.params[i].type))
+                fn = NULL;
+    }
+    if (fn && !same_type(fn->ret, ret))
+        fail(c, "%s() is declared with two return types", name);
+    if (!fn) {
+        fn = alloc(c, sizeof *fn);
+        *fn = def;
+        fn->next = c->functions;
+        c->functions = fn;
+    }
+    if (accept(c, ';'))
+        return;
+    if (fn->body >= 0)
+        fail(c, "%s() is already defined", name);
+    memcpy(fn->params, def.params, sizeof def.params);
+    if (!is_punct(peek(c), '{'))
+        fail(c, "expected '{' after %s()", name);
+    fn->body = c->pos;
+    check_function(c, fn);
+}
+
+static void external_declaration(compiler *c)
+{
+    if (accept(c, ';'))
+        return;
+    if (accept_word(c, "precision")) {
+        skip_statement(c);
+        return;
+    }
+    int start = c->pos;
+    while (is_precision(peek(c)))
+        next(c);
+    if (!is_word(peek(c), "struct")) {
+        const gtype *t = type_specifier(c);
+        if (t && peek(c)->kind == TK_IDENT && is_punct(peek_at(c, 1), '(')) {
+            function_definition(c, t, expect_ident(c));
+            return;
+        }
+    }
+    c->pos = start;
+    declaration(c);
+}
+
+static symbol *builtin_variable(compiler *c,
+                                const char  *name,
+                                const gtype *t,
+                                bool         readonly)
+{
+    symbol *s = new_variable(c, word(c, name), t);
+    s->readonly = readonly;
+    add_symbol(c, s);
+    return s;
+}
+
+static bool compile(compiler *c, const char *source)
+{
+    if (setjmp(c->fail))
+        return false;
+    preprocess(c, source);
+    c->at_global = true;
+    c->mask = MASK_ALL;
+    c->stmt_pos = -1;
+    c->frag_coord = builtin_variable(c, "gl_FragCoord", T(VEC4), true)->v.slot[0];
+    c->frag_color = builtin_variable(c, "gl_FragColor", T(VEC4), false)->v.slot[0];
+    symbol *facing = new_symbol(c, word(c, "gl_FrontFacing"),
+                                scalar_value(c, T(BOOL), const_bool(c, true)));
+    facing->readonly = true;
+    add_symbol(c, facing);
+
+    while (peek(c)->kind != TK_EOF)
+        external_declaration(c);
+    function *main_fn = NULL;
+    for (function *fn = c->functions; fn; fn = fn->next)
+        if (!strcmp(fn->name, "main") && !fn->param_count && fn->body >= 0)
+            main_fn = fn;
+    if (!main_fn)
+        fail(c, "no main()");
+    c->at_global = false;
+    inline_call(c, main_fn, NULL);
+    emit(c, GOP_HALT, 0, 0, 0, 0, 0);
+    return true;
+}
+
+static glsl_program *link(compiler *c)
+{
+    glsl_program *gp = calloc(1, sizeof *gp);
+    int *index = malloc((c->code_count + 1) * sizeof *index);
+    if (!gp || !index)
+        goto FAIL;
+
+    // Drop NOPs.
+    int n = 0;
+    for (int i = 0; i < c->code_count; i++) {
+        index[i] = n;
+        n += c->code[i].op != GOP_NOP;
+    }
+    index[c->code_count] = n;
+    gp->code = malloc(n * sizeof *gp->code);
+    if (!gp->code)
+        goto FAIL;
+    gp->code_count = n;
+
+    // Constants go after the variables.
+    int base = c->max_slot;
+    for (int i = 0, j = 0; i < c->code_count; i++) {
+        glsl_insn in = c->code[i];
+        if (in.op == GOP_NOP)
+            continue;
+        unsigned roles = glsl_op_roles[in.op];
+        if (roles & OR_TARGET)
+            in.a = index[in.a];
+        else if ((roles & OR_A) && is_const(in.a))
+            in.a += base - CONST_BASE;
+        if ((roles & OR_B) && is_const(in.b))
+            in.b += base - CONST_BASE;
+        if ((roles & OR_C) && is_const(in.c))
+            in.c += base - CONST_BASE;
+        gp->code[j++] = in;
+    }
+    gp->constants = malloc(c->const_count * sizeof *gp->constants + 1);
+    if (!gp->constants)
+        goto FAIL;
+    for (int i = 0; i < c->const_count; i++)
+        gp->constants[i] = (glsl_constant) { base + i, c->consts[i] };
+    gp->constant_count = c->const_count;
+    gp->slot_count = base + c->const_count;
+
+    gp->uniforms = calloc(c->uniform_count + 1, sizeof *gp->uniforms);
+    gp->textures = calloc(c->uniform_count + 1, sizeof *gp->textures);
+    if (!gp->uniforms || !gp->textures)
+        goto FAIL;
+    for (int i = 0; i < c->uniform_count; i++) {
+        gp->uniforms[i] = c->uniforms[i];
+        gp->uniforms[i].name = NULL;
+        gp->uniform_count = i + 1;
+        if (!(gp->uniforms[i].name = strdup(c->uniforms[i].name)))
+            goto FAIL;
+    }
+    gp->frag_coord = c->frag_coord;
+    gp->frag_color = c->frag_color;
+    gp->id = atomic_fetch_add(&next_program_id, 1) + 1;
+    free(index);
+    return gp;
+
+FAIL:
+    free(index);
+    glsl_destroy(gp);
+    return NULL;
+}
+
+static void destroy_compiler(compiler *c)
+{
+    while (c->arena) {
+        arena_block *next = c->arena->next;
+        free(c->arena);
+        c->arena = next;
+    }
+    free(c->message);
+    free(c->raw);
+    free(c->toks);
+    free(c->code);
+    free(c->slots);
+    free(c->consts);
+    free(c->uniforms);
+    free(c->syms);
+    free(c);
+}
+
+glsl_program *glsl_compile(const char *source, char **info_log)
+{
+    compiler *c = calloc(1, sizeof *c);
+    if (!c)
+        return NULL;
+    glsl_program *gp = NULL;
+    if (compile(c, source)) {
+        gp = link(c);
+        if (!gp)
+            c->message = strdup("out of memory");
+    }
+    if (!gp && info_log) {
+        *info_log = c->message;
+        c->message = NULL;
+    }
+    destroy_compiler(c);
+    return gp;
+}
+
+void glsl_destroy(glsl_program *gp)
+{
+    if (!gp)
+        return;
+    for (size_t i = 0; i < gp->uniform_count; i++) {
+        free(gp->uniforms[i].name);
+        free(gp->uniforms[i].values);
+    }
+    free(gp->uniforms);
+    free(gp->textures);
+    free(gp->constants);
+    free(gp->code);
+    free(gp);
+}
+
+size_t glsl_uniform_count(const glsl_program *gp)
+{
+    return gp->uniform_count;
+}
+
+const char *glsl_uniform_name(const glsl_program *gp, size_t index)
+{
+    return gp->uniforms[index].name;
+}
+
+glsl_type glsl_uniform_type(const glsl_program *gp, size_t index)
+{
+    return gp->uniforms[index].type;
+}
+
+size_t glsl_uniform_array_size(const glsl_program *gp, size_t index)
+{
+    return gp->uniforms[index].array_size;
+}
+
+bool glsl_uniform_is_bound(const glsl_program *gp, size_t index)
+{
+    return gp->uniforms[index].binding != GB_NONE;
+}
+
+bool glsl_bind_input(glsl_program *gp, size_t index, glsl_input input)
+{
+    static const glsl_type input_types[] = {
+        [GI_RESOLUTION] = GT_VEC3,
+        [GI_TIME]       = GT_FLOAT,
+        [GI_TIME_DELTA] = GT_FLOAT,
+        [GI_FRAME]      = GT_INT,
+        [GI_DATE]       = GT_VEC4,
+    };
+    glsl_uniform *up = &gp->uniforms[index];
+    if (up->array_size || up->type != input_types[input])
+        return false;
+    up->binding = GB_INPUT;
+    up->input = input;
+    return true;
+}
+
+bool glsl_bind_host(glsl_program *gp,
+                    size_t        index,
+                    size_t        offset,
+                    size_t        float_count)
+{
+    glsl_uniform *up = &gp->uniforms[index];
+    if (up->type == GT_SAMPLER_2D || float_count != up->slot_count)
+        return false;
+    up->binding = GB_HOST;
+    up->offset = offset;
+    return true;
+}
+
+bool glsl_bind_constant(glsl_program *gp,
+                        size_t        index,
+                        const float  *values,
+                        size_t        count)
+{
+    glsl_uniform *up = &gp->uniforms[index];
+    if (up->type == GT_SAMPLER_2D || count != up->slot_count)
+        return false;
+    float *copy = malloc(count * sizeof *copy + 1);
+    if (!copy)
+        return false;
+    memcpy(copy, values, count * sizeof *copy);
+    free(up->values);
+    up->values = copy;
+    up->binding = GB_CONSTANT;
+    return true;
+}
+
+bool glsl_bind_texture(glsl_program  *gp,
+                       size_t         index,
+                       size_t         width,
+                       size_t         height,
+                       const uint8_t *rgba)
+{
+    glsl_uniform *up = &gp->uniforms[index];
+    if (up->type != GT_SAMPLER_2D || !width || !height)
+        return false;
+    gp->textures[index] = (glsl_texture) { width, height, rgba };
+    up->binding = GB_TEXTURE;
+    return true;
+}
@@ -0,0 +1,108 @@
+#ifndef GLSL_included
+#define GLSL_included
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "native.h"
+
+// A compiler and interpreter for the GLSL ES 1.0 that fragment
+// shaders use, so they can run on the CPU.  Functions are inlined,
+// and each bytecode instruction works on GLSL_SPAN fragments at once,
+// masking off the lanes that a branch or loop has left.
+//
+// A compiled program's uniforms start out unbound, which reads as
+// zero, and are bound by name to frame inputs, host uniforms,
+// constants or textures.  After that, the program is read-only and
+// any number of threads may shade with it, each with a context of
+// its own.
+
+#define GLSL_SPAN 32
+
+// Loops get this many iterations per fragment, all loops together.
+// Past that, every loop exits after its current iteration, so a
+// shader that never leaves a loop still finishes.
+#define GLSL_MAX_ITERATIONS 65536
+
+typedef struct glsl_program glsl_program;
+typedef struct glsl_context glsl_context;
+
+typedef enum glsl_type {
+    GT_BOOL,
+    GT_INT,
+    GT_FLOAT,
+    GT_VEC2,
+    GT_VEC3,
+    GT_VEC4,
+    GT_BVEC2,
+    GT_BVEC3,
+    GT_BVEC4,
+    GT_IVEC2,
+    GT_IVEC3,
+    GT_IVEC4,
+    GT_MAT2,
+    GT_MAT3,
+    GT_MAT4,
+    GT_SAMPLER_2D,
+    GT_STRUCT,
+} glsl_type;
+
+typedef enum glsl_input {
+    GI_RESOLUTION,              // vec3
+    GI_TIME,                    // float
+    GI_TIME_DELTA,              // float
+    GI_FRAME,                   // int
+    GI_DATE,                    // vec4
+} glsl_input;
+
+// Returns NULL and, if info_log is not NULL, a malloced message on
+// failure.
+extern glsl_program *glsl_compile(const char *source, char **info_log);
+extern void          glsl_destroy(glsl_program *);
+
+// Uniforms that the shader declares, whether or not it uses them.
+// Array size is zero for uniforms that are not arrays.
+extern size_t        glsl_uniform_count(const glsl_program *);
+extern const char   *glsl_uniform_name(const glsl_program *, size_t index);
+extern glsl_type     glsl_uniform_type(const glsl_program *, size_t index);
+extern size_t        glsl_uniform_array_size(const glsl_program *,
+                                             size_t index);
+extern bool          glsl_uniform_is_bound(const glsl_program *,
+                                           size_t index);
+
+// Binding fails if the uniform's type doesn't fit.  Textures wrap and
+// are sampled linearly, like images on the GPU.  Their RGBA pixels
+// must outlive the program.
+extern bool          glsl_bind_input(glsl_program *,
+                                     size_t        index,
+                                     glsl_input);
+extern bool          glsl_bind_host(glsl_program *,
+                                    size_t        index,
+                                    size_t        offset,
+                                    size_t        float_count);
+extern bool          glsl_bind_constant(glsl_program *,
+                                        size_t        index,
+                                        const float  *values,
+                                        size_t        count);
+extern bool          glsl_bind_texture(glsl_program  *,
+                                       size_t         index,
+                                       size_t         width,
+                                       size_t         height,
+                                       const uint8_t *rgba);
+
+extern glsl_context *glsl_create_context(void);
+extern void          glsl_destroy_context(glsl_context *);
+
+// Shades `count' fragments, at most GLSL_SPAN, from (x, y) to the
+// right, where x and y are the first fragment's center.  color gets
+// each lane's gl_FragColor.
+extern void          glsl_shade(const glsl_program  *,
+                                glsl_context        *,
+                                const native_inputs *,
+                                float                x,
+                                float                y,
+                                size_t               count,
+                                float                color[4][GLSL_SPAN]);
+
+#endif /* !GLSL_included */
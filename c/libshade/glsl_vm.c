@@ -0,0 +1,600 @@
+#define _GNU_SOURCE
+#include "glsl_vm.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+const unsigned glsl_op_roles[GOP_COUNT] = {
+#define X(op, roles) [GOP_##op] = (roles),
+    GLSL_OPS(X)
+#undef X
+};
+
+struct glsl_context {
+    uint64_t   program_id;
+    glsl_slot *slots;
+    size_t     slot_alloc;
+};
+
+#define ONE_BITS 0x3f800000     // 1.0f
+
+#define S(x) (slots[ip->x])
+
+// Applies a scalar function to each lane.
+#define EACH_LANE(d, expr)                                              \
+    do {                                                                \
+        for (int l = 0; l < GLSL_SPAN; l++)                             \
+            (d)[l] = (expr);                                            \
+    } while (0)
+
+static bool any_lane(const glsl_vi *m)
+{
+    for (int l = 0; l < GLSL_SPAN; l++)
+        if ((*m)[l])
+            return true;
+    return false;
+}
+
+// Exact where |x| < 2^23; beyond that, every float is an integer.
+static void vfloor(glsl_vf *d, const glsl_vf *a)
+{
+    glsl_vf x = *a;
+    glsl_vf t = __builtin_convertvector(__builtin_convertvector(x, glsl_vi),
+                                        glsl_vf);
+    t -= (glsl_vf)((t > x) & ONE_BITS);
+    glsl_vi small = ((glsl_vi)x & 0x7fffffff) < 0x4b000000;
+    *d = (glsl_vf)(((glsl_vi)t & small) | ((glsl_vi)x & ~small));
+}
+
+static void vmin(glsl_vf *d, const glsl_vf *a, const glsl_vf *b)
+{
+    glsl_vi lt = *b < *a;
+    *d = (glsl_vf)(((glsl_vi)*b & lt) | ((glsl_vi)*a & ~lt));
+}
+
+static void vmax(glsl_vf *d, const glsl_vf *a, const glsl_vf *b)
+{
+    glsl_vi lt = *a < *b;
+    *d = (glsl_vf)(((glsl_vi)*b & lt) | ((glsl_vi)*a & ~lt));
+}
+
+// GLSL leaves division by zero undefined.  It mustn't trap.
+static void idiv(glsl_vi *d, const glsl_vi *a, const glsl_vi *b)
+{
+    for (int l = 0; l < GLSL_SPAN; l++) {
+        int32_t n = (*a)[l], q = (*b)[l];
+        if (q == 0)
+            (*d)[l] = 0;
+        else if (q == -1)
+            (*d)[l] = -(uint32_t)n;
+        else
+            (*d)[l] = n / q;
+    }
+}
+
+static float texel(const uint8_t *p)
+{
+    return *p * (1.0f / 255.0f);
+}
+
+// Bilinear, with wrapping, like a GL_REPEAT/GL_LINEAR texture.
+static void sample(glsl_slot          *out,
+                   const glsl_vf      *s,
+                   const glsl_vf      *t,
+                   const glsl_texture *tex)
+{
+    if (!tex->rgba) {
+        for (int ch = 0; ch < 4; ch++)
+            out[ch].f = (glsl_vf){ 0 };
+        return;
+    }
+    float w = tex->width, h = tex->height;
+    for (int l = 0; l < GLSL_SPAN; l++) {
+        float u = (*s)[l] * w - 0.5f, v = (*t)[l] * h - 0.5f;
+        if (!isfinite(u))
+            u = 0.0f;
+        if (!isfinite(v))
+            v = 0.0f;
+        float fu = floorf(u), fv = floorf(v);
+        float au = u - fu, av = v - fv;
+        size_t x0 = fu - w * floorf(fu / w);
+        size_t y0 = fv - h * floorf(fv / h);
+        if (x0 >= tex->width)
+            x0 = 0;
+        if (y0 >= tex->height)
+            y0 = 0;
+        size_t x1 = x0 + 1 < tex->width ? x0 + 1 : 0;
+        size_t y1 = y0 + 1 < tex->height ? y0 + 1 : 0;
+        const uint8_t *row0 = tex->rgba + y0 * tex->width * 4;
+        const uint8_t *row1 = tex->rgba + y1 * tex->width * 4;
+        for (int ch = 0; ch < 4; ch++) {
+            float p00 = texel(row0 + x0 * 4 + ch);
+            float p10 = texel(row0 + x1 * 4 + ch);
+            float p01 = texel(row1 + x0 * 4 + ch);
+            float p11 = texel(row1 + x1 * 4 + ch);
+            float p0 = p00 + (p10 - p00) * au;
+            float p1 = p01 + (p11 - p01) * au;
+            out[ch].f[l] = p0 + (p1 - p0) * av;
+        }
+    }
+}
+
+// Forward jumps are free.  A backward one spends an iteration.
+static bool may_jump(const glsl_insn *code,
+                     const glsl_insn *ip,
+                     uint32_t        *iterations)
+{
+    if (code + ip->a > ip)
+        return true;
+    if (!*iterations)
+        return false;
+    --*iterations;
+    return true;
+}
+
+void glsl_exec(const glsl_insn    *code,
+               glsl_slot          *slots,
+               const glsl_texture *textures)
+{
+    uint32_t iterations = GLSL_MAX_ITERATIONS;
+    for (const glsl_insn *ip = code; ; ip++) {
+        switch ((glsl_op)ip->op) {
+
+        case GOP_HALT:
+            return;
+
+        case GOP_NOP:
+            break;
+
+        case GOP_JMP:
+            if (may_jump(code, ip, &iterations))
+                ip = code + ip->a - 1;
+            break;
+
+        case GOP_JANY:
+            if (any_lane(&S(b).i) && may_jump(code, ip, &iterations))
+                ip = code + ip->a - 1;
+            break;
+
+        case GOP_JNONE:
+            if (!any_lane(&S(b).i))
+                ip = code + ip->a - 1;
+            break;
+
+        case GOP_MOV:
+            S(d) = S(a);
+            break;
+
+        case GOP_SEL:
+            S(d).i = (S(a).i & S(b).i) | (~S(a).i & S(c).i);
+            break;
+
+        case GOP_FADD:
+            S(d).f = S(a).f + S(b).f;
+            break;
+
+        case GOP_FSUB:
+            S(d).f = S(a).f - S(b).f;
+            break;
+
+        case GOP_FMUL:
+            S(d).f = S(a).f * S(b).f;
+            break;
+
+        case GOP_FDIV:
+            S(d).f = S(a).f / S(b).f;
+            break;
+
+        case GOP_FMOD:
+            {
+                glsl_vf q = S(a).f / S(b).f;
+                vfloor(&q, &q);
+                S(d).f = S(a).f - S(b).f * q;
+            }
+            break;
+
+        case GOP_FMIN:
+            vmin(&S(d).f, &S(a).f, &S(b).f);
+            break;
+
+        case GOP_FMAX:
+            vmax(&S(d).f, &S(a).f, &S(b).f);
+            break;
+
+        case GOP_FSTEP:
+            S(d).i = ~(S(b).f < S(a).f) & ONE_BITS;
+            break;
+
+        case GOP_FATAN2:
+            EACH_LANE(S(d).f, atan2f(S(a).f[l], S(b).f[l]));
+            break;
+
+        case GOP_FPOW:
+            EACH_LANE(S(d).f, powf(S(a).f[l], S(b).f[l]));
+            break;
+
+        case GOP_FNEG:
+            S(d).f = -S(a).f;
+            break;
+
+        case GOP_FABS:
+            S(d).i = S(a).i & 0x7fffffff;
+            break;
+
+        case GOP_FSIGN:
+            S(d).i = ((S(a).f > 0.0f) & ONE_BITS) |
+                     ((S(a).f < 0.0f) & (int32_t)0xbf800000);
+            break;
+
+        case GOP_FFLOOR:
+            vfloor(&S(d).f, &S(a).f);
+            break;
+
+        case GOP_FCEIL:
+            {
+                glsl_vf n = -S(a).f;
+                vfloor(&n, &n);
+                S(d).f = -n;
+            }
+            break;
+
+        case GOP_FFRACT:
+            {
+                glsl_vf f;
+                vfloor(&f, &S(a).f);
+                S(d).f = S(a).f - f;
+            }
+            break;
+
+        case GOP_FSQRT:
+            EACH_LANE(S(d).f, sqrtf(S(a).f[l]));
+            break;
+
+        case GOP_FRSQRT:
+            EACH_LANE(S(d).f, 1.0f / sqrtf(S(a).f[l]));
+            break;
+
+        case GOP_FSIN:
+            EACH_LANE(S(d).f, sinf(S(a).f[l]));
+            break;
+
+        case GOP_FCOS:
+            EACH_LANE(S(d).f, cosf(S(a).f[l]));
+            break;
+
+        case GOP_FTAN:
+            EACH_LANE(S(d).f, tanf(S(a).f[l]));
+            break;
+
+        case GOP_FASIN:
+            EACH_LANE(S(d).f, asinf(S(a).f[l]));
+            break;
+
+        case GOP_FACOS:
+            EACH_LANE(S(d).f, acosf(S(a).f[l]));
+            break;
+
+        case GOP_FATAN:
+            EACH_LANE(S(d).f, atanf(S(a).f[l]));
+            break;
+
+        case GOP_FEXP:
+            EACH_LANE(S(d).f, expf(S(a).f[l]));
+            break;
+
+        case GOP_FLOG:
+            EACH_LANE(S(d).f, logf(S(a).f[l]));
+            break;
+
+        case GOP_FEXP2:
+            EACH_LANE(S(d).f, exp2f(S(a).f[l]));
+            break;
+
+        case GOP_FLOG2:
+            EACH_LANE(S(d).f, log2f(S(a).f[l]));
+            break;
+
+        case GOP_FMAD:
+            S(d).f = S(a).f * S(b).f + S(c).f;
+            break;
+
+        case GOP_FMIX:
+            S(d).f = S(a).f + (S(b).f - S(a).f) * S(c).f;
+            break;
+
+        case GOP_FCLAMP:
+            {
+                glsl_vf t;
+                vmax(&t, &S(a).f, &S(b).f);
+                vmin(&S(d).f, &t, &S(c).f);
+            }
+            break;
+
+        case GOP_FSMOOTH:
+            {
+                glsl_vf zero = { 0 }, one = zero + 1.0f;
+                glsl_vf t = (S(c).f - S(a).f) / (S(b).f - S(a).f);
+                vmax(&t, &t, &zero);
+                vmin(&t, &t, &one);
+                S(d).f = t * t * (3.0f - 2.0f * t);
+            }
+            break;
+
+        case GOP_FLT:
+            S(d).i = S(a).f < S(b).f;
+            break;
+
+        case GOP_FLE:
+            S(d).i = S(a).f <= S(b).f;
+            break;
+
+        case GOP_FEQ:
+            S(d).i = S(a).f == S(b).f;
+            break;
+
+        case GOP_FNE:
+            S(d).i = S(a).f != S(b).f;
+            break;
+
+        case GOP_IADD:
+            S(d).i = S(a).i + S(b).i;
+            break;
+
+        case GOP_ISUB:
+            S(d).i = S(a).i - S(b).i;
+            break;
+
+        case GOP_IMUL:
+            S(d).i = S(a).i * S(b).i;
+            break;
+
+        case GOP_IDIV:
+            idiv(&S(d).i, &S(a).i, &S(b).i);
+            break;
+
+        case GOP_INEG:
+            S(d).i = -S(a).i;
+            break;
+
+        case GOP_ILT:
+            S(d).i = S(a).i < S(b).i;
+            break;
+
+        case GOP_ILE:
+            S(d).i = S(a).i <= S(b).i;
+            break;
+
+        case GOP_IEQ:
+            S(d).i = S(a).i == S(b).i;
+            break;
+
+        case GOP_INE:
+            S(d).i = S(a).i != S(b).i;
+            break;
+
+        case GOP_AND:
+            S(d).i = S(a).i & S(b).i;
+            break;
+
+        case GOP_OR:
+            S(d).i = S(a).i | S(b).i;
+            break;
+
+        case GOP_XOR:
+            S(d).i = S(a).i ^ S(b).i;
+            break;
+
+        case GOP_NOT:
+            S(d).i = ~S(a).i;
+            break;
+
+        case GOP_ITOF:
+            S(d).f = __builtin_convertvector(S(a).i, glsl_vf);
+            break;
+
+        case GOP_FTOI:
+            S(d).i = __builtin_convertvector(S(a).f, glsl_vi);
+            break;
+
+        case GOP_BTOF:
+            S(d).i = S(a).i & ONE_BITS;
+            break;
+
+        case GOP_BTOI:
+            S(d).i = S(a).i & 1;
+            break;
+
+        case GOP_FTOB:
+            S(d).i = S(a).f != 0.0f;
+            break;
+
+        case GOP_ITOB:
+            S(d).i = S(a).i != 0;
+            break;
+
+        case GOP_GATHER:
+            {
+                int32_t stride = GLSL_STRIDE(ip->e);
+                int32_t last = GLSL_COUNT(ip->e) - 1;
+                for (int l = 0; l < GLSL_SPAN; l++) {
+                    int32_t i = S(a).i[l];
+                    i = i < 0 ? 0 : i > last ? last : i;
+                    S(d).i[l] = slots[ip->b + i * stride].i[l];
+                }
+            }
+            break;
+
+        case GOP_SCATTER:
+            {
+                int32_t stride = GLSL_STRIDE(ip->e);
+                int32_t last = GLSL_COUNT(ip->e) - 1;
+                for (int l = 0; l < GLSL_SPAN; l++) {
+                    if (ip->c != GLSL_NO_SLOT && !S(c).i[l])
+                        continue;
+                    int32_t i = S(b).i[l];
+                    i = i < 0 ? 0 : i > last ? last : i;
+                    slots[ip->d + i * stride].i[l] = S(a).i[l];
+                }
+            }
+            break;
+
+        case GOP_TEX:
+            sample(&S(d), &S(a).f, &S(b).f, &textures[ip->c]);
+            break;
+
+        case GOP_COUNT:
+            return;
+        }
+    }
+}
+
+glsl_context *glsl_create_context(void)
+{
+    return calloc(1, sizeof (glsl_context));
+}
+
+void glsl_destroy_context(glsl_context *ctx)
+{
+    free(ctx->slots);
+    free(ctx);
+}
+
+static bool prepare_context(glsl_context *ctx, const glsl_program *gp)
+{
+    if (ctx->program_id == gp->id)
+        return true;
+    if (ctx->slot_alloc < gp->slot_count) {
+        free(ctx->slots);
+        ctx->slot_alloc = 0;
+        ctx->slots = aligned_alloc(sizeof (glsl_slot),
+                                   gp->slot_count * sizeof (glsl_slot));
+        if (!ctx->slots)
+            return false;
+        ctx->slot_alloc = gp->slot_count;
+    }
+    memset(ctx->slots, 0, gp->slot_count * sizeof (glsl_slot));
+    for (size_t i = 0; i < gp->constant_count; i++) {
+        const glsl_constant *k = &gp->constants[i];
+        ctx->slots[k->slot].i = (glsl_vi){ 0 } + k->bits;
+    }
+    ctx->program_id = gp->id;
+    return true;
+}
+
+static bool is_float(glsl_type type)
+{
+    switch (type) {
+
+    case GT_FLOAT:
+    case GT_VEC2:
+    case GT_VEC3:
+    case GT_VEC4:
+    case GT_MAT2:
+    case GT_MAT3:
+    case GT_MAT4:
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+// Host and constant values are floats.  Ints and bools convert.
+static void set_uniform(glsl_slot           *slots,
+                        const glsl_uniform  *up,
+                        const float         *values)
+{
+    for (size_t i = 0; i < up->slot_count; i++) {
+        glsl_slot *s = &slots[up->slot + i];
+        if (is_float(up->type))
+            s->f = (glsl_vf){ 0 } + values[i];
+        else if (up->type == GT_INT ||
+                 (up->type >= GT_IVEC2 && up->type <= GT_IVEC4))
+            s->i = (glsl_vi){ 0 } + (int32_t)values[i];
+        else
+            s->i = (glsl_vi){ 0 } - (values[i] != 0.0f);
+    }
+}
+
+static void load_uniforms(glsl_slot           *slots,
+                          const glsl_program  *gp,
+                          const native_inputs *in)
+{
+    for (size_t i = 0; i < gp->uniform_count; i++) {
+        const glsl_uniform *up = &gp->uniforms[i];
+        switch (up->binding) {
+
+        case GB_INPUT:
+            switch (up->input) {
+
+            case GI_RESOLUTION:
+                set_uniform(slots, up, in->resolution);
+                break;
+
+            case GI_TIME:
+                set_uniform(slots, up, &in->time);
+                break;
+
+            case GI_TIME_DELTA:
+                set_uniform(slots, up, &in->time_delta);
+                break;
+
+            case GI_FRAME:
+                slots[up->slot].i = (glsl_vi){ 0 } + in->frame;
+                break;
+
+            case GI_DATE:
+                set_uniform(slots, up, in->date);
+                break;
+            }
+            break;
+
+        case GB_HOST:
+            if (in->uniforms)
+                set_uniform(slots, up, in->uniforms + up->offset);
+            break;
+
+        case GB_CONSTANT:
+            set_uniform(slots, up, up->values);
+            break;
+
+        case GB_NONE:
+        case GB_TEXTURE:
+            break;
+        }
+    }
+}
+
+void glsl_shade(const glsl_program  *gp,
+                glsl_context        *ctx,
+                const native_inputs *in,
+                float                x,
+                float                y,
+                size_t               count,
+                float                color[4][GLSL_SPAN])
+{
+    if (!prepare_context(ctx, gp)) {
+        memset(color, 0, 4 * GLSL_SPAN * sizeof color[0][0]);
+        return;
+    }
+    glsl_slot *slots = ctx->slots;
+    load_uniforms(slots, gp, in);
+
+    glsl_vf lane_x;
+    for (int l = 0; l < GLSL_SPAN; l++)
+        lane_x[l] = x + l;
+    glsl_slot *coord = &slots[gp->frag_coord];
+    coord[0].f = lane_x;
+    coord[1].f = (glsl_vf){ 0 } + y;
+    coord[2].f = (glsl_vf){ 0 } + 0.5f;
+    coord[3].f = (glsl_vf){ 0 } + 1.0f;
+    glsl_slot *frag_color = &slots[gp->frag_color];
+    for (int ch = 0; ch < 4; ch++)
+        frag_color[ch].f = (glsl_vf){ 0 } + (ch == 3 ? 1.0f : 0.0f);
+
+    glsl_exec(gp->code, slots, gp->textures);
+
+    for (int ch = 0; ch < 4; ch++)
+        memcpy(color[ch], &frag_color[ch], count * sizeof color[ch][0]);
+}
@@ -0,0 +1,160 @@
+#ifndef GLSL_VM_included
+#define GLSL_VM_included
+
+#include "glsl.h"
+
+// The bytecode that glsl.c compiles to and glsl_vm.c runs.  Every
+// value lives in slots, one vector component per slot and one lane
+// per fragment.  Booleans are masks: all bits set or clear.
+//
+//     op          operands
+//
+//     HALT
+//     NOP
+//     JMP         a: target
+//     JANY        a: target, b: mask.  Jumps if any lane is set.
+//     JNONE       a: target, b: mask.  Jumps if no lane is set.
+//     MOV         d = a
+//     SEL         d = a ? b : c
+//     F...        float arithmetic and functions of a, b, c
+//     I...        int arithmetic of a, b
+//     AND ...     bitwise, on masks
+//     ITOF ...    conversions
+//     GATHER      d = (b + a * stride)[lane], a clamped to count
+//     SCATTER     (d + b * stride)[lane] = a where mask c is set
+//     TEX         d..d+3 = texture2D(uniform c, (a, b))
+//
+// GATHER and SCATTER pack stride and count into e.  A mask operand
+// of GLSL_NO_SLOT means every lane.
+
+#define GLSL_OPS(X)                                                       \
+    X(HALT,    0)                X(NOP,     0)                            \
+    X(JMP,     OR_TARGET)        X(JANY,    OR_TARGET | OR_B)             \
+    X(JNONE,   OR_TARGET | OR_B) X(MOV,     OW_D | OR_A)                  \
+    X(SEL,     OW_D | OR_ABC)                                             \
+    X(FADD,    OW_D | OR_AB)     X(FSUB,    OW_D | OR_AB)                 \
+    X(FMUL,    OW_D | OR_AB)     X(FDIV,    OW_D | OR_AB)                 \
+    X(FMOD,    OW_D | OR_AB)     X(FMIN,    OW_D | OR_AB)                 \
+    X(FMAX,    OW_D | OR_AB)     X(FSTEP,   OW_D | OR_AB)                 \
+    X(FATAN2,  OW_D | OR_AB)     X(FPOW,    OW_D | OR_AB)                 \
+    X(FNEG,    OW_D | OR_A)      X(FABS,    OW_D | OR_A)                  \
+    X(FSIGN,   OW_D | OR_A)      X(FFLOOR,  OW_D | OR_A)                  \
+    X(FCEIL,   OW_D | OR_A)      X(FFRACT,  OW_D | OR_A)                  \
+    X(FSQRT,   OW_D | OR_A)      X(FRSQRT,  OW_D | OR_A)                  \
+    X(FSIN,    OW_D | OR_A)      X(FCOS,    OW_D | OR_A)                  \
+    X(FTAN,    OW_D | OR_A)      X(FASIN,   OW_D | OR_A)                  \
+    X(FACOS,   OW_D | OR_A)      X(FATAN,   OW_D | OR_A)                  \
+    X(FEXP,    OW_D | OR_A)      X(FLOG,    OW_D | OR_A)                  \
+    X(FEXP2,   OW_D | OR_A)      X(FLOG2,   OW_D | OR_A)                  \
+    X(FMAD,    OW_D | OR_ABC)    X(FMIX,    OW_D | OR_ABC)                \
+    X(FCLAMP,  OW_D | OR_ABC)    X(FSMOOTH, OW_D | OR_ABC)                \
+    X(FLT,     OW_D | OR_AB)     X(FLE,     OW_D | OR_AB)                 \
+    X(FEQ,     OW_D | OR_AB)     X(FNE,     OW_D | OR_AB)                 \
+    X(IADD,    OW_D | OR_AB)     X(ISUB,    OW_D | OR_AB)                 \
+    X(IMUL,    OW_D | OR_AB)     X(IDIV,    OW_D | OR_AB)                 \
+    X(INEG,    OW_D | OR_A)                                               \
+    X(ILT,     OW_D | OR_AB)     X(ILE,     OW_D | OR_AB)                 \
+    X(IEQ,     OW_D | OR_AB)     X(INE,     OW_D | OR_AB)                 \
+    X(AND,     OW_D | OR_AB)     X(OR,      OW_D | OR_AB)                 \
+    X(XOR,     OW_D | OR_AB)     X(NOT,     OW_D | OR_A)                  \
+    X(ITOF,    OW_D | OR_A)      X(FTOI,    OW_D | OR_A)                  \
+    X(BTOF,    OW_D | OR_A)      X(BTOI,    OW_D | OR_A)                  \
+    X(FTOB,    OW_D | OR_A)      X(ITOB,    OW_D | OR_A)                  \
+    X(GATHER,  OW_D | OR_A | OR_RANGE)                                    \
+    X(SCATTER, OR_A | OR_B | OR_C | OR_RANGE)                             \
+    X(TEX,     OR_A | OR_B)
+
+// Operand roles
+#define OW_D       0x01         // writes slot d
+#define OR_A       0x02         // reads slot a
+#define OR_B       0x04         // reads slot b
+#define OR_C       0x08         // reads slot c
+#define OR_TARGET  0x10         // a is an instruction index
+#define OR_RANGE   0x20         // reads or writes slots indirectly
+#define OR_AB      (OR_A | OR_B)
+#define OR_ABC     (OR_A | OR_B | OR_C)
+
+typedef enum glsl_op {
+#define X(op, roles) GOP_##op,
+    GLSL_OPS(X)
+#undef X
+    GOP_COUNT
+} glsl_op;
+
+#define GLSL_NO_SLOT (-1)
+
+#define GLSL_PACK(stride, count) ((stride) << 16 | (count))
+#define GLSL_STRIDE(e)           ((e) >> 16)
+#define GLSL_COUNT(e)            ((e) & 0xFFFF)
+
+typedef struct glsl_insn {
+    int32_t op;
+    int32_t d, a, b, c, e;
+} glsl_insn;
+
+typedef float   glsl_vf __attribute__((vector_size(GLSL_SPAN * 4)));
+typedef int32_t glsl_vi __attribute__((vector_size(GLSL_SPAN * 4)));
+
+typedef union glsl_slot {
+    glsl_vf f;
+    glsl_vi i;
+} glsl_slot;
+
+typedef struct glsl_texture {
+    size_t         width;
+    size_t         height;
+    const uint8_t *rgba;
+} glsl_texture;
+
+typedef enum glsl_binding {
+    GB_NONE,
+    GB_INPUT,
+    GB_HOST,
+    GB_CONSTANT,
+    GB_TEXTURE,
+} glsl_binding;
+
+// Samplers have no slots.  Their textures are indexed the same as
+// the uniforms.
+typedef struct glsl_uniform {
+    char         *name;
+    glsl_type     type;
+    size_t        array_size;
+    int32_t       slot;
+    size_t        slot_count;
+    glsl_binding  binding;
+    glsl_input    input;
+    size_t        offset;       // GB_HOST
+    float        *values;       // GB_CONSTANT
+} glsl_uniform;
+
+// A constant's bits, to be broadcast to every lane of its slot.
+typedef struct glsl_constant {
+    int32_t slot;
+    int32_t bits;
+} glsl_constant;
+
+struct glsl_program {
+    uint64_t       id;          // unique, so contexts notice new ones
+    glsl_insn     *code;
+    size_t         code_count;
+    size_t         slot_count;
+    glsl_constant *constants;
+    size_t         constant_count;
+    glsl_uniform  *uniforms;
+    glsl_texture  *textures;
+    size_t         uniform_count;
+    int32_t        frag_coord;  // four slots each
+    int32_t        frag_color;
+};
+
+extern const unsigned glsl_op_roles[GOP_COUNT];
+
+// Runs code until HALT.  textures is indexed by TEX's c.  Only
+// loops jump backward, and after GLSL_MAX_ITERATIONS of those jumps
+// the rest fall through, out of their loops.
+extern void glsl_exec(const glsl_insn    *code,
+                      glsl_slot          *slots,
+                      const glsl_texture *textures);
+
+#endif /* !GLSL_VM_included */
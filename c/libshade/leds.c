@@ -1,40 +1,97 @@
 #include "leds.h"
 
 #include <assert.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "mpsse.h"
+#include "stats.h"
+#include "transport.h"
+#include "xfer.h"
 
-#define FRONT_PORCH_BYTES 7 /* could be 8 */
+#define FRONT_PORCH_BYTES 8 /* 7 + 1 pad so pixels are 16-bit aligned */
 #define BACK_PORCH_BYTES 14
+#define ROW_NUMBER_OFFSET 10    /* within the back porch */
+#define DEFAULT_TRANSFERS 2
+#define FRONT_PORCH_PAD 0x8A    /* MC_TCK_X5 */
+#define VSYNC_POLL_BATCH 4      /* status reads per USB round trip */
+#define VSYNC_TIMEOUT_NS 100000000      /* six refreshes at 60 Hz */
+
+// The swap command ends every cmdbuffer, so a whole frame goes out
+// in one USB transfer.
+static const LED_cmd swap_cmds[] = {
+    0x80, 0x00, 0x2b,           // MC_SETB_LOW: CS low
+    0x11, 2-1, 0,               // MC_DATA_OUT | MC_DATA_OCN, 2 bytes
+    0x04, 0x00,                 // swap
+    0x80, 0x28, 0x2b,           // MC_SETB_LOW: CS high
+};
 
 struct LEDs_context {
+    transport *transport;
+    mpsse     *mpsse;
     size_t framebuffer_width;
     size_t framebuffer_height;
     size_t framebuffer_offset;
     size_t led_width;
     size_t led_height;
+    size_t row_bytes;           // one row's commands, porches included
     size_t cmdbuf_size;
     size_t best_offset;
     size_t best_row_pitch;
     size_t best_buffer_size;
+    xfer_window *output;        // USB writes in flight
+    atomic_int   vsync_mode;
+
+    // delta encoding; the shadow state belongs to the cmd thread
+    atomic_bool delta_enabled;
+    bool        delta_active;
+    unsigned    full_frames_due;
+    LED_pixel  *shadow;         // led_width x led_height, last frame
+    bool       *row_changed;    // row differed in the last frame
 };
 
-LEDs_context *init_LEDs(size_t led_width,
-                        size_t led_height,
-                        size_t framebuffer_width,
-                        size_t framebuffer_height,
-                        size_t framebuffer_offset)
+// The panel is double buffered.  After a swap, the buffer we write
+// into holds the frame before last, so a row must be resent if it
+// changed in this frame or in the previous one, and the first two
+// frames of a delta run are sent whole.
+#define DELTA_FULL_FRAMES 2
+
+typedef uint8_t row_vec __attribute__((vector_size(16)));
+
+static void *usb_submit(void *device, uint8_t *data, size_t size)
 {
-    int ifnum = 0;
-    const char *devstr = NULL;
-    bool slow_clock = false;
-    mpsse_init(ifnum, devstr, slow_clock);
+    return mpsse_submit_raw(device, data, size);
+}
 
+static bool usb_complete(void *device, void *handle, size_t size)
+{
+    return mpsse_transfer_done(device, handle, size);
+}
+
+static const xfer_ops usb_ops = { usb_submit, usb_complete };
+
+LEDs_context *init_LEDs(transport *transport,
+                        size_t     led_width,
+                        size_t     led_height,
+                        size_t     framebuffer_width,
+                        size_t     framebuffer_height,
+                        size_t     framebuffer_offset)
+{
     LEDs_context *ctx = calloc(1, sizeof *ctx);
+    if (!ctx) {
+        transport_set_error("LEDs: out of memory");
+        close_transport(transport);
+        return NULL;
+    }
+    ctx->transport = transport;
+    bool slow_clock = false;
+    ctx->mpsse = mpsse_open(transport, slow_clock);
+    if (!ctx->mpsse)
+        goto FAIL;
+
     ctx->framebuffer_width  = framebuffer_width;
     ctx->framebuffer_height = framebuffer_height;
     ctx->framebuffer_offset = framebuffer_offset;
@@ -42,33 +99,128 @@ LEDs_context *init_LEDs(size_t led_width,
     ctx->led_height         = led_height;
     size_t row_pix_bytes = led_width * sizeof (LED_pixel);
     size_t row_bytes = FRONT_PORCH_BYTES + row_pix_bytes + BACK_PORCH_BYTES;
-    ctx->cmdbuf_size = led_height * row_bytes;
-    ctx->best_offset = FRONT_PORCH_BYTES;
-    ctx->best_row_pitch = (FRONT_PORCH_BYTES / sizeof (uint16_t) +
-                           led_width +
-                           BACK_PORCH_BYTES / sizeof (uint16_t));;
+    ctx->row_bytes = row_bytes;
+    ctx->cmdbuf_size = led_height * row_bytes + sizeof swap_cmds;
+    assert(row_bytes % sizeof (LED_pixel) == 0);
+    ctx->best_offset = FRONT_PORCH_BYTES / sizeof (LED_pixel);
+    ctx->best_row_pitch = row_bytes / sizeof (LED_pixel);
     ctx->best_buffer_size = led_height * ctx->best_row_pitch;
+    ctx->shadow = calloc(led_width * led_height, sizeof (LED_pixel));
+    ctx->row_changed = calloc(led_height, sizeof (bool));
+    ctx->output = create_xfer_window(&usb_ops, ctx->mpsse, DEFAULT_TRANSFERS);
+    if (!ctx->shadow || !ctx->row_changed || !ctx->output) {
+        transport_set_error("LEDs: out of memory");
+        goto FAIL;
+    }
     return ctx;
+
+FAIL:
+    deinit_LEDs(ctx);
+    return NULL;
 }
 
 void deinit_LEDs(LEDs_context *ctx)
 {
-    mpsse_close();
+    destroy_xfer_window(ctx->output);
+    mpsse_close(ctx->mpsse);
+    close_transport(ctx->transport);
+    free(ctx->shadow);
+    free(ctx->row_changed);
     free(ctx);
 }
 
+void LEDs_set_delta(LEDs_context *ctx, bool enabled)
+{
+    atomic_store(&ctx->delta_enabled, enabled);
+}
+
 LED_pixel *LEDs_alloc_framebuffer(LEDs_context *ctx)
 {
     size_t count = ctx->framebuffer_width * ctx->framebuffer_height;
     return calloc(count, sizeof (LED_pixel));
 }
 
+uint32_t *LEDs_alloc_rgba_framebuffer(LEDs_context *ctx)
+{
+    size_t count = ctx->framebuffer_width * ctx->framebuffer_height;
+    return calloc(count, sizeof (uint32_t));
+}
+
+static void stamp_front_porch(const LEDs_context *ctx, LED_cmd *cmds)
+{
+    size_t row_size = ctx->led_width * sizeof (LED_pixel);
+    size_t cmd_idx  = 0;
+
+    // Pad.  Clock divide-by-5 is already off, so this does nothing.
+    cmds[cmd_idx++] = FRONT_PORCH_PAD;
+
+    // Set CS low
+    cmds[cmd_idx++] = 0x80; // MC_SETB_LOW
+    cmds[cmd_idx++] = 0x00; // gpio
+    cmds[cmd_idx++] = 0x2b; // dir
+
+    // SPI packet header
+    cmds[cmd_idx++] = 0x11;
+    cmds[cmd_idx++] = (row_size + 1 - 1) & 0xFF;
+    cmds[cmd_idx++] = (row_size + 1 - 1) >> 8;
+
+    // SPI payload
+    cmds[cmd_idx++] = 0x80;
+    assert(cmd_idx == FRONT_PORCH_BYTES);
+}
+
+// Every row's commands are the same except for the pixels and the
+// row number.  Stamp the rest into each slot of a new cmdbuffer once,
+// so LEDs_create_cmds only has to fill in the blanks.
+static void stamp_row(const LEDs_context *ctx, LED_cmd *cmds)
+{
+    size_t row_size = ctx->led_width * sizeof (LED_pixel);
+    size_t cmd_idx  = FRONT_PORCH_BYTES;
+
+    stamp_front_porch(ctx, cmds);
+    cmd_idx += row_size;        // pixels go here
+
+    // Set CS high
+    cmds[cmd_idx++] = 0x80; // MZC_SETB_LOW
+    cmds[cmd_idx++] = 0x28; // gpio
+    cmds[cmd_idx++] = 0x2b;  // dir
+
+    // Set CS low
+    cmds[cmd_idx++] = 0x80; // MC_SETB_LOW
+    cmds[cmd_idx++] = 0x00; // gpio
+    cmds[cmd_idx++] = 0x2b; // dir
+
+    // SPI header
+    cmds[cmd_idx++] = 0x11; // MC_DATA_OUT | MC_DATA_OCN
+    cmds[cmd_idx++] = 2-1;
+    cmds[cmd_idx++] = 0;
+
+    // SPI payload
+    cmds[cmd_idx++] = 0x03;
+    assert(cmd_idx == FRONT_PORCH_BYTES + row_size + ROW_NUMBER_OFFSET);
+    cmds[cmd_idx++] = 0;    // row number goes here
+
+    // Set CS high
+    cmds[cmd_idx++] = 0x80; // MC_SETB_LOW
+    cmds[cmd_idx++] = 0x28; // gpio
+    cmds[cmd_idx++] = 0x2b; // dir
+
+    assert(cmd_idx == ctx->row_bytes);
+}
+
 LED_cmd *LEDs_alloc_cmdbuffer(LEDs_context *ctx)
 {
-    return calloc(ctx->cmdbuf_size, sizeof (LED_cmd));
+    LED_cmd *cmds = calloc(ctx->cmdbuf_size, sizeof (LED_cmd));
+    if (cmds) {
+        size_t rows_size = ctx->led_height * ctx->row_bytes;
+        for (size_t row = 0; row < ctx->led_height; row++)
+            stamp_row(ctx, cmds + row * ctx->row_bytes);
+        memcpy(cmds + rows_size, swap_cmds, sizeof swap_cmds);
+    }
+    return cmds;
 }
 
-void LEDs_free_framebuffer(LED_pixel *framebuffer)
+void LEDs_free_framebuffer(void *framebuffer)
 {
     free(framebuffer);
 }
@@ -98,89 +250,248 @@ size_t LEDs_best_row_pitch(const LEDs_context *ctx)
     return ctx->best_row_pitch;
 }
 
-void LEDs_create_cmds(LEDs_context *ctx,
-                      const LED_pixel *pixels,
-                      LED_cmd *cmds)
+bool LEDs_can_read_direct(const LEDs_context *ctx)
+{
+    return ctx->framebuffer_width  == ctx->led_width  &&
+           ctx->framebuffer_height == ctx->led_height &&
+           ctx->framebuffer_offset == 0;
+}
+
+// Compare a new row with the shadow copy, sixteen bytes at a time,
+// and update the shadow if they differ.  Returns true if they did.
+static bool update_shadow_row(LED_pixel       *shadow,
+                              const LED_pixel *pixels,
+                              size_t           row_size)
+{
+    const uint8_t *a = (const uint8_t *)shadow;
+    const uint8_t *b = (const uint8_t *)pixels;
+    const size_t step = 4 * sizeof (row_vec);
+    row_vec diff = { 0 };
+    size_t i = 0;
+    for ( ; i + step <= row_size; i += step) {
+        row_vec a0, a1, a2, a3, b0, b1, b2, b3;
+        memcpy(&a0, a + i + 0 * sizeof a0, sizeof a0);
+        memcpy(&a1, a + i + 1 * sizeof a1, sizeof a1);
+        memcpy(&a2, a + i + 2 * sizeof a2, sizeof a2);
+        memcpy(&a3, a + i + 3 * sizeof a3, sizeof a3);
+        memcpy(&b0, b + i + 0 * sizeof b0, sizeof b0);
+        memcpy(&b1, b + i + 1 * sizeof b1, sizeof b1);
+        memcpy(&b2, b + i + 2 * sizeof b2, sizeof b2);
+        memcpy(&b3, b + i + 3 * sizeof b3, sizeof b3);
+        diff |= (a0 ^ b0) | (a1 ^ b1) | (a2 ^ b2) | (a3 ^ b3);
+    }
+    uint8_t tail = 0;
+    for ( ; i < row_size; i++)
+        tail |= a[i] ^ b[i];
+
+    uint64_t halves[2];
+    memcpy(halves, &diff, sizeof halves);
+    if (!(halves[0] | halves[1] | tail))
+        return false;
+    memcpy(shadow, pixels, row_size);
+    return true;
+}
+
+static void copy_row(void            *user,
+                     LED_pixel       *dst,
+                     size_t           src_index,
+                     size_t           row,
+                     size_t           width)
+{
+    const LED_pixel *pixels = user;
+    memcpy(dst, pixels + src_index, width * sizeof *dst);
+}
+
+size_t LEDs_create_cmds(LEDs_context *ctx,
+                        const LED_pixel *pixels,
+                        LED_cmd *cmds)
+{
+    return LEDs_fill_cmds(ctx, copy_row, (void *)pixels, cmds);
+}
+
+// Each row is filled straight into its slot.  In delta mode, the
+// slot is then compared with the shadow, and an unchanged row's slot
+// is reused by the next row.  Returns the number of bytes written to
+// cmds.
+size_t LEDs_fill_cmds(LEDs_context *ctx,
+                      LEDs_row_fn  *fill,
+                      void         *user,
+                      LED_cmd      *cmds)
 {
     size_t fb_row_pitch = ctx->framebuffer_width;
     size_t fb_offset    = ctx->framebuffer_offset;
     size_t row_size     = ctx->led_width * sizeof (LED_pixel);
     size_t row_count    = ctx->led_height;
     size_t cmd_idx      = 0;
+
+    bool delta = atomic_load_explicit(&ctx->delta_enabled,
+                                      memory_order_relaxed);
+    if (delta && !ctx->delta_active)
+        ctx->full_frames_due = DELTA_FULL_FRAMES;
+    ctx->delta_active = delta;
+
     for (size_t row = 0; row < row_count; row++) {
-        // Set CS low
-        cmds[cmd_idx++] = 0x80; // MC_SETB_LOW
-        cmds[cmd_idx++] = 0x00; // gpio
-        cmds[cmd_idx++] = 0x2b; // dir
-
-        // SPI packet header
-        cmds[cmd_idx++] = 0x11;
-        cmds[cmd_idx++] = (row_size + 1 - 1) & 0xFF;
-        cmds[cmd_idx++] = (row_size + 1 - 1) >> 8;
-
-        // SPI payload
-        cmds[cmd_idx++] = 0x80;
-        size_t y = row;
-        memcpy(cmds + cmd_idx,
-               &pixels[y * fb_row_pitch + fb_offset],
-               row_size);
-        cmd_idx += row_size;
-
-        // Set CS high
-        cmds[cmd_idx++] = 0x80; // MZC_SETB_LOW
-        cmds[cmd_idx++] = 0x28; // gpio
-        cmds[cmd_idx++] = 0x2b;  // dir
-
-        // Set CS low
-        cmds[cmd_idx++] = 0x80; // MC_SETB_LOW
-        cmds[cmd_idx++] = 0x00; // gpio
-        cmds[cmd_idx++] = 0x2b; // dir
-
-        // SPI header
-        cmds[cmd_idx++] = 0x11; // MC_DATA_OUT | MC_DATA_OCN
-        cmds[cmd_idx++] = 2-1;
-        cmds[cmd_idx++] = 0;
-
-        // SPI payload
-        cmds[cmd_idx++] = 0x03;
-        cmds[cmd_idx++] = row;
-
-        // Set CS high
-        cmds[cmd_idx++] = 0x80; // MC_SETB_LOW
-        cmds[cmd_idx++] = 0x28; // gpio
-        cmds[cmd_idx++] = 0x2b; // dir
+        // The cmdbuffer was stamped by LEDs_alloc_cmdbuffer.  A short
+        // delta frame's swap commands may have overwritten this
+        // slot's front porch since; they don't start with the pad.
+        LED_cmd *slot = cmds + cmd_idx;
+        if (slot[0] != FRONT_PORCH_PAD)
+            stamp_front_porch(ctx, slot);
+        LED_pixel *row_pixels = (LED_pixel *)(slot + FRONT_PORCH_BYTES);
+        (*fill)(user, row_pixels, row * fb_row_pitch + fb_offset,
+                row, ctx->led_width);
+        if (delta) {
+            LED_pixel *shadow_row = ctx->shadow + row * ctx->led_width;
+            bool changed = update_shadow_row(shadow_row, row_pixels, row_size);
+            bool resend = changed || ctx->row_changed[row];
+            ctx->row_changed[row] = changed;
+            if (!resend && !ctx->full_frames_due)
+                continue;
+        }
+        slot[FRONT_PORCH_BYTES + row_size + ROW_NUMBER_OFFSET] = row;
+        cmd_idx += ctx->row_bytes;
     }
-    assert(cmd_idx == ctx->cmdbuf_size);
+    if (ctx->full_frames_due)
+        ctx->full_frames_due--;
+
+    memcpy(cmds + cmd_idx, swap_cmds, sizeof swap_cmds);
+    cmd_idx += sizeof swap_cmds;
+    assert(cmd_idx <= ctx->cmdbuf_size);
+    return cmd_idx;
+}
+
+// The pixels were read straight into the cmdbuffer's payload slots.
+// Only the row numbers need restoring; delta mode may have moved
+// rows around.
+size_t LEDs_finish_direct_cmds(LEDs_context *ctx, LED_cmd *cmds)
+{
+    size_t row_size = ctx->led_width * sizeof (LED_pixel);
+    size_t number_idx = FRONT_PORCH_BYTES + row_size + ROW_NUMBER_OFFSET;
+    for (size_t row = 0; row < ctx->led_height; row++)
+        cmds[row * ctx->row_bytes + number_idx] = row;
+
+    // The shadow is stale now.  Start delta mode over next time.
+    ctx->delta_active = false;
+    return ctx->cmdbuf_size;
 }
 
-static void set_cs(int cs_b)
+static void set_cs(LEDs_context *ctx, int cs_b)
 {
     uint8_t gpio = cs_b ? 0x28 : 0;
     uint8_t direction = 0x2b;
-    mpsse_set_gpio(gpio, direction);
+    mpsse_set_gpio(ctx->mpsse, gpio, direction);
+}
+
+bool LEDs_set_max_transfers(LEDs_context *ctx, size_t count)
+{
+    return xfer_set_limit(ctx->output, count);
+}
+
+size_t LEDs_max_transfers(LEDs_context *ctx)
+{
+    return xfer_limit(ctx->output);
+}
+
+size_t LEDs_transfers_in_flight(LEDs_context *ctx)
+{
+    return xfer_in_flight(ctx->output);
+}
+
+bool LEDs_submit_cmds(LEDs_context *ctx, LED_cmd *cmds, size_t size)
+{
+    return xfer_submit(ctx->output, cmds, size);
 }
 
-void LEDs_write_cmds(LEDs_context *ctx, const LED_cmd *cmds)
+bool LEDs_retire_cmds(LEDs_context *ctx)
 {
-    mpsse_send_raw((uint8_t *)cmds, ctx->cmdbuf_size);
+    return xfer_retire(ctx->output);
+}
+
+bool LEDs_set_vsync_mode(LEDs_context *ctx, LEDs_vsync_mode mode)
+{
+    switch (mode) {
+
+    case LVS_OFF:
+    case LVS_POLL:
+    case LVS_PIN:
+        atomic_store(&ctx->vsync_mode, mode);
+        return true;
 
-    // Swap
-    unsigned char cmd_buf[2];
-    set_cs(0);
-    cmd_buf[0] = 0x04;
-    cmd_buf[1] = 0x00;
-    mpsse_send_spi(cmd_buf, 2);
-    set_cs(1);
+    default:
+        return false;
+    }
 }
 
-void LEDs_await_vsync(LEDs_context *ctx)
+LEDs_vsync_mode LEDs_get_vsync_mode(LEDs_context *ctx)
 {
-    uint8_t spi_buf[2];
+    return atomic_load(&ctx->vsync_mode);
+}
+
+// Queue several status reads and collect their replies in one
+// blocking read.  Any of them seeing the vsync bit is enough.  The
+// replies never wait on the panel, so check the deadline between
+// batches.
+static LEDs_vsync_wait poll_vsync(LEDs_context *ctx)
+{
+    static const uint8_t zeros[2];
+    uint8_t status[VSYNC_POLL_BATCH * sizeof zeros];
+    uint64_t deadline = stats_now_ns() + VSYNC_TIMEOUT_NS;
+    uint8_t any;
     do {
-        spi_buf[0] = 0x00;
-        spi_buf[1] = 0x00;
-        set_cs(0);
-        mpsse_xfer_spi(spi_buf, 2);
-        set_cs(1);
-    } while (((spi_buf[0] | spi_buf[1]) & 0x02) != 0x02);
+        if (atomic_load(&ctx->transport->interrupted) ||
+            stats_now_ns() >= deadline)
+            return LVW_MISSED;
+        for (size_t i = 0; i < VSYNC_POLL_BATCH; i++) {
+            set_cs(ctx, 0);
+            mpsse_queue_xfer_spi(ctx->mpsse, zeros, sizeof zeros);
+            set_cs(ctx, 1);
+        }
+        if (!mpsse_recv(ctx->mpsse, status, sizeof status))
+            return LVW_FAILED;
+        any = 0;
+        for (size_t i = 0; i < sizeof status; i++)
+            any |= status[i];
+    } while (!(any & 0x02));
+    return LVW_SYNCED;
+}
+
+// A pin wait that timed out is collected first, whatever the mode is
+// now.
+LEDs_vsync_wait LEDs_await_vsync(LEDs_context *ctx)
+{
+    LEDs_vsync_mode mode = LEDs_get_vsync_mode(ctx);
+    if (mode == LVS_PIN || LEDs_vsync_stalled(ctx)) {
+        int rc = mpsse_await_gpiol1_rise(ctx->mpsse, VSYNC_TIMEOUT_NS);
+        if (rc <= 0)
+            return rc == 0 ? LVW_STALLED : LVW_FAILED;
+        if (mode == LVS_PIN)
+            return LVW_SYNCED;
+    }
+    switch (mode) {
+
+    case LVS_OFF:
+        return LVW_SYNCED;
+
+    case LVS_POLL:
+        return poll_vsync(ctx);
+
+    default:
+        break;
+    }
+    return LVW_FAILED;
+}
+
+bool LEDs_vsync_stalled(LEDs_context *ctx)
+{
+    return mpsse_gpiol1_wait_pending(ctx->mpsse);
+}
+
+void LEDs_interrupt_vsync(LEDs_context *ctx)
+{
+    transport_interrupt(ctx->transport);
+}
+
+void LEDs_resume_vsync(LEDs_context *ctx)
+{
+    transport_resume(ctx->transport);
 }
@@ -1,40 +1,110 @@
 #ifndef LEDS_included
 #define LEDS_included
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
 typedef struct LEDs_context LEDs_context;
+struct transport;
 typedef uint16_t LED_pixel;
 typedef uint8_t LED_cmd;
 
-extern LEDs_context *init_LEDs(size_t LEDs_width,
+typedef enum LEDs_vsync_mode {
+    LVS_OFF,                    // don't wait
+    LVS_POLL,                   // read the FPGA's status until vsync
+    LVS_PIN,                    // FTDI waits for vsync on GPIOL1
+} LEDs_vsync_mode;
+
+typedef enum LEDs_vsync_wait {
+    LVW_SYNCED,
+    LVW_MISSED,                 // timed out or interrupted
+    LVW_STALLED,                // same, and the FTDI is still waiting
+    LVW_FAILED,
+} LEDs_vsync_wait;
+
+// The LEDs take ownership of the transport, even on failure.
+// Functions that talk to the panel return false on failure, with
+// the reason in transport_last_error.
+extern LEDs_context *init_LEDs(struct transport *,
+                               size_t LEDs_width,
                                size_t LEDs_height,
                                size_t framebuffer_width,
                                size_t framebuffer_height,
                                size_t framebuffer_offset);
 extern void          deinit_LEDs(LEDs_context *);
 
+// RGBA framebuffers hold a uint32_t per pixel, R in the low byte,
+// and are the same size in pixels.
 extern LED_pixel    *LEDs_alloc_framebuffer(LEDs_context *);
+extern uint32_t     *LEDs_alloc_rgba_framebuffer(LEDs_context *);
 extern LED_cmd      *LEDs_alloc_cmdbuffer(LEDs_context *);
-extern void          LEDs_free_framebuffer(LED_pixel *);
+extern void          LEDs_free_framebuffer(void *);
 extern void          LEDs_free_cmdbuffer(LED_cmd *);
 extern size_t        LEDs_framebuffer_pitch(LEDs_context *);
 
+// Where pixels go inside a cmdbuffer, in LED_pixel units.  If
+// LEDs_can_read_direct, a renderer can read led_height rows at
+// (LED_pixel *)cmdbuffer + LEDs_best_offset with pitch
+// LEDs_best_row_pitch, and LEDs_finish_direct_cmds completes the
+// buffer without copying.
 extern size_t        LEDs_best_buffer_size(const LEDs_context *);
 extern size_t        LEDs_best_offset(const LEDs_context *);
 extern size_t        LEDs_best_row_pitch(const LEDs_context *);
+extern bool          LEDs_can_read_direct(const LEDs_context *);
+extern size_t        LEDs_finish_direct_cmds(LEDs_context *, LED_cmd *);
 
-extern void          LEDs_create_cmds(LEDs_context *,
+// In delta mode, LEDs_create_cmds only encodes rows that changed.
+// It returns the number of command bytes to pass to LEDs_submit_cmds.
+extern void          LEDs_set_delta(LEDs_context *, bool enabled);
+extern size_t        LEDs_create_cmds(LEDs_context *,
                                       const LED_pixel *,
                                       LED_cmd *);
-extern void          LEDs_write_cmds(LEDs_context *, const LED_cmd *);
+
+// LEDs_fill_cmds gets each row from `fill' instead of a framebuffer.
+// src_index is where the row starts in a framebuffer, in pixels.
+typedef void LEDs_row_fn(void      *user,
+                         LED_pixel *dst,
+                         size_t     src_index,
+                         size_t     row,
+                         size_t     width);
+extern size_t        LEDs_fill_cmds(LEDs_context *,
+                                    LEDs_row_fn  *fill,
+                                    void         *user,
+                                    LED_cmd      *);
+
+// Command buffers are sent asynchronously, several at a time.
+// LEDs_submit_cmds queues a buffer, which must not be touched until
+// LEDs_retire_cmds has waited for it.  Buffers retire in the order
+// they were submitted.  The caller keeps LEDs_transfers_in_flight
+// below LEDs_max_transfers.
+extern bool          LEDs_set_max_transfers(LEDs_context *, size_t count);
+extern size_t        LEDs_max_transfers(LEDs_context *);
+extern size_t        LEDs_transfers_in_flight(LEDs_context *);
+extern bool          LEDs_submit_cmds(LEDs_context *,
+                                      LED_cmd *,
+                                      size_t size);
+extern bool          LEDs_retire_cmds(LEDs_context *);
 
 // extern void          LEDs_write_pixels(LEDs_context *,
 //                                        LED_pixel *pixel_buf,
 //                                        size_t     row_offset,
 //                                        size_t     row_pitch);
 
-extern void          LEDs_await_vsync(LEDs_context *);
+// LVS_PIN needs gateware that drives GPIOL1 (ADBUS5) high at vsync.
+// LEDs_await_vsync returns immediately when the mode is LVS_OFF, and
+// gives up after a few refreshes.  LEDs_interrupt_vsync makes it give
+// up at once, from any thread, until LEDs_resume_vsync.
+//
+// An LVS_PIN wait that gives up leaves the FTDI stalled until GPIOL1
+// rises.  LEDs_vsync_stalled is true meanwhile, even after the mode
+// changes.  Don't send frames then; LEDs_await_vsync returns
+// LVW_STALLED until the stall clears.
+extern bool          LEDs_set_vsync_mode(LEDs_context *, LEDs_vsync_mode);
+extern LEDs_vsync_mode LEDs_get_vsync_mode(LEDs_context *);
+extern LEDs_vsync_wait LEDs_await_vsync(LEDs_context *);
+extern bool          LEDs_vsync_stalled(LEDs_context *);
+extern void          LEDs_interrupt_vsync(LEDs_context *);
+extern void          LEDs_resume_vsync(LEDs_context *);
 
 #endif /* !LEDS_included */
@@ -23,14 +23,14 @@
 
 #define _GNU_SOURCE
 
-#include <ftdi.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
-#include <unistd.h>
+#include <string.h>
 
 #include "mpsse.h"
+#include "transport.h"
 
 // ---------------------------------------------------------
 // MPSSE / FTDI definitions
@@ -49,345 +49,246 @@
  * xDBUS7 | CRESET | GPIO
  */
 
-struct ftdi_context mpsse_ftdic;
-bool mpsse_ftdic_open = false;
-bool mpsse_ftdic_latency_set = false;
-unsigned char mpsse_ftdi_latency;
-
-/* MPSSE engine command definitions */
-enum mpsse_cmd
-{
-	/* Mode commands */
-	MC_SETB_LOW = 0x80, /* Set Data bits LowByte */
-	MC_READB_LOW = 0x81, /* Read Data bits LowByte */
-	MC_SETB_HIGH = 0x82, /* Set Data bits HighByte */
-	MC_READB_HIGH = 0x83, /* Read data bits HighByte */
-	MC_LOOPBACK_EN = 0x84, /* Enable loopback */
-	MC_LOOPBACK_DIS = 0x85, /* Disable loopback */
-	MC_SET_CLK_DIV = 0x86, /* Set clock divisor */
-	MC_FLUSH = 0x87, /* Flush buffer fifos to the PC. */
-	MC_WAIT_H = 0x88, /* Wait on GPIOL1 to go high. */
-	MC_WAIT_L = 0x89, /* Wait on GPIOL1 to go low. */
-	MC_TCK_X5 = 0x8A, /* Disable /5 div, enables 60MHz master clock */
-	MC_TCK_D5 = 0x8B, /* Enable /5 div, backward compat to FT2232D */
-	MC_EN_3PH_CLK = 0x8C, /* Enable 3 phase clk, DDR I2C */
-	MC_DIS_3PH_CLK = 0x8D, /* Disable 3 phase clk */
-	MC_CLK_N = 0x8E, /* Clock every bit, used for JTAG */
-	MC_CLK_N8 = 0x8F, /* Clock every byte, used for JTAG */
-	MC_CLK_TO_H = 0x94, /* Clock until GPIOL1 goes high */
-	MC_CLK_TO_L = 0x95, /* Clock until GPIOL1 goes low */
-	MC_EN_ADPT_CLK = 0x96, /* Enable adaptive clocking */
-	MC_DIS_ADPT_CLK = 0x97, /* Disable adaptive clocking */
-	MC_CLK8_TO_H = 0x9C, /* Clock until GPIOL1 goes high, count bytes */
-	MC_CLK8_TO_L = 0x9D, /* Clock until GPIOL1 goes low, count bytes */
-	MC_TRI = 0x9E, /* Set IO to only drive on 0 and tristate on 1 */
-	/* CPU mode commands */
-	MC_CPU_RS = 0x90, /* CPUMode read short address */
-	MC_CPU_RE = 0x91, /* CPUMode read extended address */
-	MC_CPU_WS = 0x92, /* CPUMode write short address */
-	MC_CPU_WE = 0x93, /* CPUMode write extended address */
+/* Commands are accumulated here and written in one USB transfer by
+ * mpsse_flush.  Anything that reads from the chip flushes first.
+ * A failed write is remembered and reported by the next flush or
+ * read, so the queueing functions need not return errors. */
+#define MPSSE_CMD_BUF_SIZE 4096
+
+struct mpsse {
+	transport *transport;
+	bool failed;
+	bool gpiol1_wait_queued;
+	int cmd_len;
+	uint8_t cmd_buf[MPSSE_CMD_BUF_SIZE];
 };
 
-/* Transfer Command bits */
-
-/* All byte based commands consist of:
- * - Command byte
- * - Length lsb
- * - Length msb
- *
- * If data out is enabled the data follows after the above command bytes,
- * otherwise no additional data is needed.
- * - Data * n
- *
- * All bit based commands consist of:
- * - Command byte
- * - Length
- *
- * If data out is enabled a byte containing bitst to transfer follows.
- * Otherwise no additional data is needed. Only up to 8 bits can be transferred
- * per transaction when in bit mode.
- */
-
-/* b 0000 0000
- *   |||| |||`- Data out negative enable. Update DO on negative clock edge.
- *   |||| ||`-- Bit count enable. When reset count represents bytes.
- *   |||| |`--- Data in negative enable. Latch DI on negative clock edge.
- *   |||| `---- LSB enable. When set clock data out LSB first.
- *   ||||
- *   |||`------ Data out enable
- *   ||`------- Data in enable
- *   |`-------- TMS mode enable
- *   `--------- Special command mode enable. See mpsse_cmd enum.
- */
-
-#define MC_DATA_TMS  (0x40) /* When set use TMS mode */
-#define MC_DATA_IN   (0x20) /* When set read data (Data IN) */
-#define MC_DATA_OUT  (0x10) /* When set write data (Data OUT) */
-#define MC_DATA_LSB  (0x08) /* When set input/output data LSB first. */
-#define MC_DATA_ICN  (0x04) /* When set receive data on negative clock edge */
-#define MC_DATA_BITS (0x02) /* When set count bits not bytes */
-#define MC_DATA_OCN  (0x01) /* When set update data on negative clock edge */
-
 // ---------------------------------------------------------
 // MPSSE / FTDI function implementations
 // ---------------------------------------------------------
 
-void mpsse_check_rx()
+static bool mpsse_write(mpsse *m, const uint8_t *data, int n)
+{
+	if (!transport_write(m->transport, data, n))
+		m->failed = true;
+	return !m->failed;
+}
+
+bool mpsse_flush(mpsse *m)
 {
-	while (1) {
-		uint8_t data;
-		int rc = ftdi_read_data(&mpsse_ftdic, &data, 1);
-		if (rc <= 0)
-			break;
-		fprintf(stderr, "unexpected rx byte: %02X\n", data);
+	if (m->cmd_len) {
+		int n = m->cmd_len;
+		m->cmd_len = 0;
+		(void)mpsse_write(m, m->cmd_buf, n);
 	}
+	bool ok = !m->failed;
+	m->failed = false;
+	return ok;
 }
 
-void mpsse_error(int status)
+void mpsse_queue(mpsse *m, const uint8_t *data, int n)
 {
-	mpsse_check_rx();
-	fprintf(stderr, "ABORT.\n");
-	if (mpsse_ftdic_open) {
-		if (mpsse_ftdic_latency_set)
-			ftdi_set_latency_timer(&mpsse_ftdic, mpsse_ftdi_latency);
-		ftdi_usb_close(&mpsse_ftdic);
+	if (m->cmd_len + n > MPSSE_CMD_BUF_SIZE) {
+		int len = m->cmd_len;
+		m->cmd_len = 0;
+		(void)mpsse_write(m, m->cmd_buf, len);
 	}
-	ftdi_deinit(&mpsse_ftdic);
-	exit(status);
+	if (n > MPSSE_CMD_BUF_SIZE) {
+		(void)mpsse_write(m, data, n);
+		return;
+	}
+	memcpy(m->cmd_buf + m->cmd_len, data, n);
+	m->cmd_len += n;
 }
 
-uint8_t mpsse_recv_byte()
+/* Send everything queued, asking the chip to send its replies now
+ * rather than when its latency timer expires.  Then wait for them. */
+bool mpsse_recv(mpsse *m, uint8_t *data, int n)
+{
+	mpsse_send_byte(m, MC_FLUSH);
+	if (!mpsse_flush(m))
+		return false;
+	return transport_read(m->transport, data, n);
+}
+
+int mpsse_recv_byte(mpsse *m)
 {
 	uint8_t data;
-	while (1) {
-		int rc = ftdi_read_data(&mpsse_ftdic, &data, 1);
-		if (rc < 0) {
-			fprintf(stderr, "Read error.\n");
-			mpsse_error(2);
-		}
-		if (rc == 1)
-			break;
-		usleep(100);
-	}
+	if (!mpsse_recv(m, &data, 1))
+		return -1;
 	return data;
 }
 
-void mpsse_send_byte(uint8_t data)
+void mpsse_send_byte(mpsse *m, uint8_t data)
 {
-	int rc = ftdi_write_data(&mpsse_ftdic, &data, 1);
-	if (rc != 1) {
-		fprintf(stderr, "Write error (single byte, rc=%d, expected %d).\n", rc, 1);
-		mpsse_error(2);
-	}
+	mpsse_queue(m, &data, 1);
 }
 
-void mpsse_send_spi(uint8_t *data, int n)
+void mpsse_send_spi(mpsse *m, const uint8_t *data, int n)
 {
 	if (n < 1)
 		return;
 
 	/* Output only, update data on negative clock edge. */
-	mpsse_send_byte(MC_DATA_OUT | MC_DATA_OCN);
-	mpsse_send_byte(n - 1);
-	mpsse_send_byte((n - 1) >> 8);
-
-	int rc = ftdi_write_data(&mpsse_ftdic, data, n);
-	if (rc != n) {
-		fprintf(stderr, "Write error (chunk, rc=%d, expected %d).\n", rc, n);
-		mpsse_error(2);
-	}
+	uint8_t header[] = { MC_DATA_OUT | MC_DATA_OCN, n - 1, (n - 1) >> 8 };
+	mpsse_queue(m, header, sizeof header);
+	mpsse_queue(m, data, n);
 }
 
-void mpsse_send_raw(uint8_t *data, int n)
+bool mpsse_send_raw(mpsse *m, const uint8_t *data, int n)
 {
-	int rc = ftdi_write_data(&mpsse_ftdic, data, n);
-	if (rc != n) {
-		fprintf(stderr, "Write error (chunk, rc=%d, expected %d).\n", rc, n);
-		mpsse_error(2);
-	}
+	return mpsse_flush(m) && mpsse_write(m, data, n);
 }
 
-void mpsse_xfer_spi(uint8_t *data, int n)
+/* Start an asynchronous write.  data must stay valid until
+ * mpsse_transfer_done returns. */
+void *mpsse_submit_raw(mpsse *m, uint8_t *data, int n)
+{
+	if (!mpsse_flush(m))
+		return NULL;
+	return transport_submit(m->transport, data, n);
+}
+
+bool mpsse_transfer_done(mpsse *m, void *handle, int n)
+{
+	return transport_complete(m->transport, handle, n);
+}
+
+void mpsse_queue_xfer_spi(mpsse *m, const uint8_t *data, int n)
 {
 	if (n < 1)
 		return;
 
 	/* Input and output, update data on negative edge read on positive. */
-	mpsse_send_byte(MC_DATA_IN | MC_DATA_OUT | MC_DATA_OCN);
-	mpsse_send_byte(n - 1);
-	mpsse_send_byte((n - 1) >> 8);
-
-	int rc = ftdi_write_data(&mpsse_ftdic, data, n);
-	if (rc != n) {
-		fprintf(stderr, "Write error (chunk, rc=%d, expected %d).\n", rc, n);
-		mpsse_error(2);
-	}
-
-	for (int i = 0; i < n; i++)
-		data[i] = mpsse_recv_byte();
+	uint8_t header[] = { MC_DATA_IN | MC_DATA_OUT | MC_DATA_OCN, n - 1, (n - 1) >> 8 };
+	mpsse_queue(m, header, sizeof header);
+	mpsse_queue(m, data, n);
 }
 
-uint8_t mpsse_xfer_spi_bits(uint8_t data, int n)
+bool mpsse_xfer_spi(mpsse *m, uint8_t *data, int n)
 {
 	if (n < 1)
-		return 0;
-
-	/* Input and output, update data on negative edge read on positive, bits. */
-	mpsse_send_byte(MC_DATA_IN | MC_DATA_OUT | MC_DATA_OCN | MC_DATA_BITS);
-	mpsse_send_byte(n - 1);
-	mpsse_send_byte(data);
+		return true;
 
-	return mpsse_recv_byte();
+	mpsse_queue_xfer_spi(m, data, n);
+	return mpsse_recv(m, data, n);
 }
 
-void mpsse_set_gpio(uint8_t gpio, uint8_t direction)
+int mpsse_xfer_spi_bits(mpsse *m, uint8_t data, int n)
 {
-	mpsse_send_byte(MC_SETB_LOW);
-	mpsse_send_byte(gpio); /* Value */
-	mpsse_send_byte(direction); /* Direction */
-}
+	if (n < 1)
+		return 0;
 
-int mpsse_readb_low(void)
-{
-	uint8_t data;
-	mpsse_send_byte(MC_READB_LOW);
-	data = mpsse_recv_byte();
-	return data;
+	/* Input and output, update data on negative edge read on positive, bits. */
+	uint8_t cmd[] = { MC_DATA_IN | MC_DATA_OUT | MC_DATA_OCN | MC_DATA_BITS, n - 1, data };
+	mpsse_queue(m, cmd, sizeof cmd);
+	return mpsse_recv_byte(m);
 }
 
-int mpsse_readb_high(void)
+void mpsse_set_gpio(mpsse *m, uint8_t gpio, uint8_t direction)
 {
-	uint8_t data;
-	mpsse_send_byte(MC_READB_HIGH);
-	data = mpsse_recv_byte();
-	return data;
+	uint8_t cmd[] = { MC_SETB_LOW, gpio /* Value */, direction /* Direction */ };
+	mpsse_queue(m, cmd, sizeof cmd);
 }
 
-void mpsse_send_dummy_bytes(uint8_t n)
+int mpsse_readb_low(mpsse *m)
 {
-	// add 8 x count dummy bits (aka n bytes)
-	mpsse_send_byte(MC_CLK_N8);
-	mpsse_send_byte(n - 1);
-	mpsse_send_byte(0x00);
-
+	mpsse_send_byte(m, MC_READB_LOW);
+	return mpsse_recv_byte(m);
 }
 
-void mpsse_send_dummy_bit(void)
+int mpsse_readb_high(mpsse *m)
 {
-	// add 1  dummy bit
-	mpsse_send_byte(MC_CLK_N);
-	mpsse_send_byte(0x00);
+	mpsse_send_byte(m, MC_READB_HIGH);
+	return mpsse_recv_byte(m);
 }
 
-void mpsse_init(int ifnum, const char *devstr, bool slow_clock)
+/* The chip stalls until GPIOL1 rises.  The read makes the host
+ * block (in libusb, not a spin) until it does.  MC_WAIT_H alone is
+ * level triggered and would pass at once while the pin is still high
+ * from the last vsync, so wait for it to go low first.
+ *
+ * After a timeout the chip is still stalled on the same commands,
+ * so the next call waits for their reply instead of queueing more. */
+int mpsse_await_gpiol1_rise(mpsse *m, uint64_t timeout_ns)
 {
-	enum ftdi_interface ftdi_ifnum = INTERFACE_A;
-
-	switch (ifnum) {
-		case 0:
-			ftdi_ifnum = INTERFACE_A;
-			break;
-		case 1:
-			ftdi_ifnum = INTERFACE_B;
-			break;
-		case 2:
-			ftdi_ifnum = INTERFACE_C;
-			break;
-		case 3:
-			ftdi_ifnum = INTERFACE_D;
-			break;
-		default:
-			ftdi_ifnum = INTERFACE_A;
-			break;
-	}
-
-	ftdi_init(&mpsse_ftdic);
-	ftdi_set_interface(&mpsse_ftdic, ftdi_ifnum);
-
-	if (devstr != NULL) {
-		if (ftdi_usb_open_string(&mpsse_ftdic, devstr)) {
-			fprintf(stderr, "Can't find iCE FTDI USB device (device string %s).\n", devstr);
-			mpsse_error(2);
-		}
-	} else {
-		if (ftdi_usb_open(&mpsse_ftdic, 0x0403, 0x6010) && ftdi_usb_open(&mpsse_ftdic, 0x0403, 0x6014)) {
-			fprintf(stderr, "Can't find iCE FTDI USB device (vendor_id 0x0403, device_id 0x6010 or 0x6014).\n");
-			mpsse_error(2);
-		}
+	if (!m->gpiol1_wait_queued) {
+		uint8_t cmd[] = { MC_WAIT_L, MC_WAIT_H, MC_READB_LOW, MC_FLUSH };
+		mpsse_queue(m, cmd, sizeof cmd);
+		if (!mpsse_flush(m))
+			return -1;
+		m->gpiol1_wait_queued = true;
 	}
+	uint8_t pins;
+	switch (transport_read_timed(m->transport, &pins, 1, timeout_ns)) {
 
-	mpsse_ftdic_open = true;
-
-	if (ftdi_usb_reset(&mpsse_ftdic)) {
-		fprintf(stderr, "Failed to reset iCE FTDI USB device.\n");
-		mpsse_error(2);
-	}
+	case TS_OK:
+		m->gpiol1_wait_queued = false;
+		return 1;
 
-	if (ftdi_usb_purge_buffers(&mpsse_ftdic)) {
-		fprintf(stderr, "Failed to purge buffers on iCE FTDI USB device.\n");
-		mpsse_error(2);
-	}
+	case TS_TIMEOUT:
+		return 0;
 
-	if (ftdi_get_latency_timer(&mpsse_ftdic, &mpsse_ftdi_latency) < 0) {
-		fprintf(stderr, "Failed to get latency timer (%s).\n", ftdi_get_error_string(&mpsse_ftdic));
-		mpsse_error(2);
+	default:
+		m->gpiol1_wait_queued = false;
+		return -1;
 	}
+}
 
-	/* 1 is the fastest polling, it means 1 kHz polling */
-	if (ftdi_set_latency_timer(&mpsse_ftdic, 1) < 0) {
-		fprintf(stderr, "Failed to set latency timer (%s).\n", ftdi_get_error_string(&mpsse_ftdic));
-		mpsse_error(2);
-	}
+bool mpsse_gpiol1_wait_pending(mpsse *m)
+{
+	return m->gpiol1_wait_queued;
+}
 
-	mpsse_ftdic_latency_set = true;
+void mpsse_send_dummy_bytes(mpsse *m, uint8_t n)
+{
+	// add 8 x count dummy bits (aka n bytes)
+	uint8_t cmd[] = { MC_CLK_N8, n - 1, 0x00 };
+	mpsse_queue(m, cmd, sizeof cmd);
+}
 
-	/* Enter MPSSE (Multi-Protocol Synchronous Serial Engine) mode. Set all pins to output. */
-	if (ftdi_set_bitmode(&mpsse_ftdic, 0xff, BITMODE_MPSSE) < 0) {
-		fprintf(stderr, "Failed to set BITMODE_MPSSE on iCE FTDI USB device.\n");
-		mpsse_error(2);
-	}
+void mpsse_send_dummy_bit(mpsse *m)
+{
+	// add 1  dummy bit
+	uint8_t cmd[] = { MC_CLK_N, 0x00 };
+	mpsse_queue(m, cmd, sizeof cmd);
+}
 
-	if (ftdi_write_data_set_chunksize(&mpsse_ftdic, 65536)) {
-		fprintf(stderr, "Failed to set write chunk size.\n");
-		mpsse_error(2);
+mpsse *mpsse_open(transport *t, bool slow_clock)
+{
+	mpsse *m = calloc(1, sizeof *m);
+	if (!m) {
+		transport_set_error("mpsse: out of memory");
+		return NULL;
 	}
+	m->transport = t;
 
 	// disable clock divide by 5
-	mpsse_send_byte(MC_TCK_X5);
+	mpsse_send_byte(m, MC_TCK_X5);
 
 	if (slow_clock) {
 		// set 50 kHz clock
-		mpsse_send_byte(MC_SET_CLK_DIV);
-		mpsse_send_byte(119);
-		mpsse_send_byte(0x00);
+		mpsse_send_byte(m, MC_SET_CLK_DIV);
+		mpsse_send_byte(m, 119);
+		mpsse_send_byte(m, 0x00);
 	} else {
 		// set 6 MHz clock
-		mpsse_send_byte(MC_SET_CLK_DIV);
-		mpsse_send_byte(0x00);
-		mpsse_send_byte(0x00);
+		mpsse_send_byte(m, MC_SET_CLK_DIV);
+		mpsse_send_byte(m, 0x00);
+		mpsse_send_byte(m, 0x00);
 	}
-    // 
-	// mpsse_send_byte(MC_SET_CLK_DIV);
-	// mpsse_send_byte(0x00);
-	// mpsse_send_byte(0x00);
-	// // disable clock divide by 5
-	// mpsse_send_byte(MC_TCK_X5);
-	// mpsse_send_byte(MC_SET_CLK_DIV);
-	// mpsse_send_byte(0x00);
-	// mpsse_send_byte(0x00);
-	// // disable clock divide by 5
-	// mpsse_send_byte(MC_TCK_X5);
-	// mpsse_send_byte(MC_SET_CLK_DIV);
-	// mpsse_send_byte(0x00);
-	// mpsse_send_byte(0x00);
-	// // disable clock divide by 5
-	// mpsse_send_byte(MC_TCK_X5);
+	if (!mpsse_flush(m)) {
+		free(m);
+		return NULL;
+	}
+	return m;
 }
 
-void mpsse_close(void)
+/* Flushes, but leaves the transport open. */
+void mpsse_close(mpsse *m)
 {
-	ftdi_set_latency_timer(&mpsse_ftdic, mpsse_ftdi_latency);
-	ftdi_disable_bitbang(&mpsse_ftdic);
-	ftdi_usb_close(&mpsse_ftdic);
-	ftdi_deinit(&mpsse_ftdic);
+	if (m) {
+		(void)mpsse_flush(m);
+		free(m);
+	}
 }
@@ -0,0 +1,41 @@
+#ifndef NATIVE_included
+#define NATIVE_included
+
+#include <stdint.h>
+
+// Native shaders are C functions that the CPU runs in place of GLSL.
+// Each call shades NATIVE_LANES horizontally adjacent pixels, one
+// per lane of GCC's generic vectors.  Four lanes fill a 128-bit SSE
+// or NEON register; wider vectors would change the calling
+// convention with the instruction set.
+
+#define NATIVE_LANES 4
+
+typedef float   native_float __attribute__((vector_size(NATIVE_LANES * 4)));
+typedef int32_t native_int   __attribute__((vector_size(NATIVE_LANES * 4)));
+
+typedef struct native_vec2 {
+    native_float x, y;
+} native_vec2;
+
+typedef struct native_vec4 {
+    native_float x, y, z, w;
+} native_vec4;
+
+// The same for every pixel of a frame.
+typedef struct native_inputs {
+    float        resolution[3];
+    float        time;
+    float        time_delta;
+    int32_t      frame;
+    float        date[4];
+    const float *uniforms;      // host uniforms, at their offsets
+} native_inputs;
+
+// frag_color is (0, 0, 0, 1) on entry, and alpha is ignored.
+typedef void native_shader(native_vec4         *frag_color,
+                           const native_vec2   *frag_coord,
+                           const native_inputs *,
+                           void                *user);
+
+#endif /* !NATIVE_included */
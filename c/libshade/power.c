@@ -0,0 +1,95 @@
+#include "power.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LANES       8
+#define SCALE_BITS  8
+#define SCALE_ONE   (1 << SCALE_BITS)
+
+// Dimming takes effect on the next frame, to protect the supply.
+// Per frame, recovery moves the scale this fraction of the way back.
+#define RELEASE     (1.0f / 32)
+
+typedef uint16_t u16_vec __attribute__((vector_size(LANES * 2)));
+typedef uint32_t u32_vec __attribute__((vector_size(LANES * 4)));
+
+struct power_limiter {
+    float    budget;
+    float    amps_per_level[3];     // full_scale / 31, 63, 31
+    float    scale;
+    uint16_t scale_fixed;           // SCALE_BITS fixed point
+    u32_vec  sums[3];               // this frame's levels, before scaling
+};
+
+power_limiter *create_power_limiter(float budget, const float full_scale[3])
+{
+    power_limiter *pl = calloc(1, sizeof *pl);
+    if (!pl)
+        return NULL;
+    pl->budget = budget;
+    pl->amps_per_level[0] = full_scale[0] / 31;
+    pl->amps_per_level[1] = full_scale[1] / 63;
+    pl->amps_per_level[2] = full_scale[2] / 31;
+    pl->scale = 1.0f;
+    pl->scale_fixed = SCALE_ONE;
+    return pl;
+}
+
+void destroy_power_limiter(power_limiter *pl)
+{
+    free(pl);
+}
+
+static float sum_lanes(const u32_vec *v)
+{
+    uint64_t sum = 0;
+    for (size_t i = 0; i < LANES; i++)
+        sum += (*v)[i];
+    return sum;
+}
+
+// The last frame's sums are what it would have drawn unscaled.
+void power_next_frame(power_limiter *pl)
+{
+    float amps = 0;
+    for (size_t c = 0; c < 3; c++)
+        amps += sum_lanes(&pl->sums[c]) * pl->amps_per_level[c];
+    memset(pl->sums, 0, sizeof pl->sums);
+
+    float target = amps > pl->budget ? pl->budget / amps : 1.0f;
+    if (target < pl->scale)
+        pl->scale = target;
+    else
+        pl->scale += (target - pl->scale) * RELEASE;
+    pl->scale_fixed = pl->scale * SCALE_ONE + 0.5f;
+    if (pl->scale_fixed > SCALE_ONE)
+        pl->scale_fixed = SCALE_ONE;
+}
+
+void power_limit_row(power_limiter *pl, LED_pixel *row, size_t width)
+{
+    const uint16_t s = pl->scale_fixed;
+    u32_vec rs = { 0 }, gs = { 0 }, bs = { 0 };
+    for (size_t x = 0; x < width; x += LANES) {
+        size_t count = width - x < LANES ? width - x : LANES;
+        u16_vec px = { 0 };
+        memcpy(&px, row + x, count * sizeof *row);
+        u16_vec r = px >> 11;
+        u16_vec g = px >> 5 & 63;
+        u16_vec b = px & 31;
+        rs += __builtin_convertvector(r, u32_vec);
+        gs += __builtin_convertvector(g, u32_vec);
+        bs += __builtin_convertvector(b, u32_vec);
+        if (s == SCALE_ONE)
+            continue;
+        px = (r * s >> SCALE_BITS) << 11 |
+             (g * s >> SCALE_BITS) << 5 |
+             (b * s >> SCALE_BITS);
+        memcpy(row + x, &px, count * sizeof *row);
+    }
+    pl->sums[0] += rs;
+    pl->sums[1] += gs;
+    pl->sums[2] += bs;
+}
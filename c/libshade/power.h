@@ -0,0 +1,26 @@
+#ifndef POWER_included
+#define POWER_included
+
+#include <stddef.h>
+
+#include "leds.h"
+
+typedef struct power_limiter power_limiter;
+
+// Estimates the LEDs' current from the pixels sent and dims frames
+// that would draw more than `budget' amps.  `full_scale' is what one
+// LED draws with each channel full on.  A frame is scaled by what
+// the frames before it needed.  The scale drops at once to what the
+// last frame needed and recovers slowly, so it doesn't flicker.
+extern power_limiter *create_power_limiter(float       budget,
+                                           const float full_scale[3]);
+extern void           destroy_power_limiter(power_limiter *);
+
+// Call once per frame, before limiting its rows.
+extern void           power_next_frame(power_limiter *);
+// Measures and scales one row of LED pixels in place.
+extern void           power_limit_row(power_limiter *,
+                                      LED_pixel     *row,
+                                      size_t         width);
+
+#endif /* !POWER_included */
@@ -2,6 +2,7 @@
 #include "prog.h"
 
 #include <assert.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -10,11 +11,30 @@
 
 #include <GLES2/gl2.h>
 
+#include "progcache.h"
+#include "render.h"
+#include "ring.h"
+#include "texcache.h"
+
+// GLSL ES has no default float precision in fragment shaders.
+// VideoCore doesn't mind, but other compilers do.
+static const char fragment_preamble[] =
+    "#ifdef GL_ES\n"
+    "precision mediump float;\n"
+    "#endif\n";
+
+// The pixels are the caller's until release, which happens once the
+// texture is uploaded.  From then on the program holds a reference
+// to the texture, so the cache keeps it.
 typedef struct image_info {
-    char    *name;
-    size_t   width;
-    size_t   height;
-    uint8_t *data;
+    char           *name;
+    size_t          width;
+    size_t          height;
+    const uint8_t  *data;
+    uint64_t        key;        // for the texture cache
+    prog_release   *release;
+    void           *release_user;
+    GLuint          texture;
 } image_info;
 
 typedef struct predefined_info {
@@ -22,6 +42,49 @@ typedef struct predefined_info {
     predefined  value;
 } predefined_info;
 
+typedef struct uniform_info {
+    char    *name;
+    GLenum   type;
+    size_t   count;             // array length
+    size_t   offset;            // in floats
+} uniform_info;
+
+// Host uniforms live in the three slots of a mailbox ring.  Writers
+// take turns under `lock', update their own copy, and publish all of
+// it through the ring.  The render thread takes the newest slot once
+// a frame and never waits.
+typedef struct host_uniforms {
+    pthread_mutex_t  lock;
+    ring            *ring;
+    size_t           float_count;
+    GLfloat         *latest;    // the writers' copy
+    GLfloat         *slots;     // three copies
+    size_t           front;     // the render thread's slot
+} host_uniforms;
+
+// A stream is an image the host replaces while the program runs.
+// Its frames go through the three slots of a mailbox ring, so the
+// producer never waits and the render thread takes only the newest.
+typedef struct stream_info {
+    char    *name;
+    size_t   width;
+    size_t   height;
+    ring    *ring;
+    uint8_t *slots;             // three frames
+    size_t   front;             // the render thread's slot
+    bool     shown;             // front holds a frame
+} stream_info;
+
+typedef struct pass_info {
+    char    *name;
+    char    *frag_shader_source;
+} pass_info;
+
+typedef struct buffer_info {
+    char    *name;              // the sampler
+    char    *pass;              // the pass it reads
+} buffer_info;
+
 struct shd_prog {
     int              id;
     char            *vert_shader_source;
@@ -32,6 +95,23 @@ struct shd_prog {
     size_t           predef_count;
     size_t           predef_alloc;
     predefined_info *predefs;
+    size_t           pass_count;
+    size_t           pass_alloc;
+    pass_info       *passes;
+    size_t           buffer_count;
+    size_t           buffer_alloc;
+    buffer_info     *buffers;
+    size_t           uniform_count;
+    size_t           uniform_alloc;
+    uniform_info    *uniforms;
+    host_uniforms   *host;
+    size_t           stream_count;
+    size_t           stream_alloc;
+    stream_info     *streams;
+    native_shader   *native;
+    void            *native_user;
+    glsl_program    *glsl;
+    int              supersample;
 };
 
 static const char *GL_error_str(GLenum err)
@@ -78,11 +158,22 @@ static bool shader_is_ok(GLuint shader)
     return status == GL_TRUE;
 }
 
+static void release_image(image_info *ip)
+{
+    if (ip->release)
+        ip->release(ip->release_user);
+    ip->release = NULL;
+    ip->data = NULL;
+}
+
 prog *create_prog(void)
 {
     static int next_id;
     prog *pp = calloc(1, sizeof *pp);
     pp->id = ++next_id;
+    pp->supersample = 1;
+    pp->host = calloc(1, sizeof *pp->host);
+    pthread_mutex_init(&pp->host->lock, NULL);
     return pp;
 }
 
@@ -92,12 +183,39 @@ void destroy_prog(prog *pp)
     free(pp->frag_shader_source);
     for (size_t i = 0; i < pp->image_count; i++) {
         free(pp->images[i].name);
-        free(pp->images[i].data);
+        texcache_unref(pp->images[i].texture);
+        release_image(&pp->images[i]);
     }
     free(pp->images);
     for (size_t i = 0; i < pp->predef_count; i++)
         free(pp->predefs[i].name);
     free(pp->predefs);
+    for (size_t i = 0; i < pp->pass_count; i++) {
+        free(pp->passes[i].name);
+        free(pp->passes[i].frag_shader_source);
+    }
+    free(pp->passes);
+    for (size_t i = 0; i < pp->buffer_count; i++) {
+        free(pp->buffers[i].name);
+        free(pp->buffers[i].pass);
+    }
+    free(pp->buffers);
+    for (size_t i = 0; i < pp->uniform_count; i++)
+        free(pp->uniforms[i].name);
+    free(pp->uniforms);
+    if (pp->host->ring)
+        destroy_ring(pp->host->ring);
+    free(pp->host->latest);
+    free(pp->host->slots);
+    pthread_mutex_destroy(&pp->host->lock);
+    free(pp->host);
+    for (size_t i = 0; i < pp->stream_count; i++) {
+        free(pp->streams[i].name);
+        destroy_ring(pp->streams[i].ring);
+        free(pp->streams[i].slots);
+    }
+    free(pp->streams);
+    glsl_destroy(pp->glsl);
     free(pp);
 }
 
@@ -106,6 +224,26 @@ int prog_id(const prog *pp)
     return pp->id;
 }
 
+int prog_supersample(const prog *pp)
+{
+    return pp->supersample;
+}
+
+native_shader *prog_native_shader(const prog *pp)
+{
+    return pp->native;
+}
+
+void *prog_native_user(const prog *pp)
+{
+    return pp->native_user;
+}
+
+glsl_program *prog_cpu_program(const prog *pp)
+{
+    return pp->glsl;
+}
+
 size_t prog_image_count(const prog *pp)
 {
     return pp->image_count;
@@ -126,9 +264,23 @@ size_t prog_image_height(const prog *pp, size_t index)
     return pp->images[index].height;
 }
 
-const uint8_t *prog_image_data(const prog *pp, size_t index)
+GLuint prog_image_texture(const prog *pp, size_t index)
+{
+    image_info *ip = &pp->images[index];
+    if (!ip->texture) {
+        ip->texture = texcache_acquire(ip->key,
+                                       ip->width,
+                                       ip->height,
+                                       ip->data);
+        if (ip->texture)
+            release_image(ip);
+    }
+    return ip->texture;
+}
+
+uint64_t prog_image_key(const prog *pp, size_t index)
 {
-    return pp->images[index].data;
+    return pp->images[index].key;
 }
 
 size_t prog_predefined_count(const prog *pp)
@@ -150,6 +302,61 @@ predefined prog_predefined_value(const prog *pp, size_t index)
     return PD_UNKNOWN;
 }
 
+size_t prog_pass_count(const prog *pp)
+{
+    return pp->pass_count;
+}
+
+static size_t find_pass(const prog *pp, const char *name)
+{
+    for (size_t i = 0; i < pp->pass_count; i++)
+        if (!strcmp(pp->passes[i].name, name))
+            return i;
+    return PROG_NO_PASS;
+}
+
+size_t prog_buffer_count(const prog *pp)
+{
+    return pp->buffer_count;
+}
+
+const char *prog_buffer_name(const prog *pp, size_t index)
+{
+    return pp->buffers[index].name;
+}
+
+size_t prog_buffer_pass(const prog *pp, size_t index)
+{
+    return find_pass(pp, pp->buffers[index].pass);
+}
+
+// Returns the active uniform's index, which isn't its location, or
+// -1 if the shader doesn't use it.  Arrays are named "name[0]".
+static GLint find_uniform(GLuint prog,
+                          const char *name,
+                          GLint uniform_count,
+                          GLint name_max_length)
+{
+    for (GLint i = 0; i < uniform_count; i++) {
+        char u_name[name_max_length];
+        GLint u_size;
+        GLenum u_type;
+        glGetActiveUniform(prog,
+                           i,
+                           sizeof u_name,
+                           NULL,
+                           &u_size,
+                           &u_type,
+                           u_name);
+        char *bracket = strchr(u_name, '[');
+        if (bracket)
+            *bracket = '\0';
+        if (!strcmp(u_name, name))
+            return i;
+    }
+    return -1;
+}
+
 static bool check_uniform(GLuint prog,
                           const char *name,
                           GLint index,
@@ -168,7 +375,8 @@ static bool check_uniform(GLuint prog,
                        &u_size,
                        &u_type,
                        u_name);
-    if (u_type != expected_type || u_size != expected_size) {
+    // Drivers may drop array elements the shader never reads.
+    if (u_type != expected_type || u_size < 1 || u_size > expected_size) {
         log_info(info_log,
                  "uniform %s: unexpected type/size %#0x/%d\n",
                  name, u_type, u_size);
@@ -177,12 +385,8 @@ static bool check_uniform(GLuint prog,
     return true;
 }
 
-bool prog_is_okay(const prog *pp, char **info_log)
+static bool pass_is_okay(const prog *pp, GLuint prog, char **info_log)
 {
-    GLuint prog = prog_instantiate(pp, info_log);
-    if (prog == 0)
-        return false;
-
     // Enumerate attributes.  Verify that "vert" is the only one.
 
     GLint attrib_count;
@@ -221,7 +425,10 @@ bool prog_is_okay(const prog *pp, char **info_log)
     // Verify all images in pp.
     for (size_t i = 0; i < pp->image_count; i++) {
         const image_info *ip = &pp->images[i];
-        GLint index = glGetUniformLocation(prog, ip->name);
+        GLint index = find_uniform(prog,
+                                   ip->name,
+                                   uniform_count,
+                                   uniform_max_length);
         if (index == -1)
            continue;  // It's okay to provide unused uniforms.
         if (!check_uniform(prog,
@@ -238,7 +445,10 @@ bool prog_is_okay(const prog *pp, char **info_log)
     // Verify all predefineds in pp.
     for (size_t i = 0; i < pp->predef_count; i++) {
         const predefined_info *pip = &pp->predefs[i];
-        GLint index = glGetUniformLocation(prog, pip->name);
+        GLint index = find_uniform(prog,
+                                   pip->name,
+                                   uniform_count,
+                                   uniform_max_length);
         if (index == -1)
            continue;  // It's okay to provide unused uniforms.
         GLenum expected_type;
@@ -251,10 +461,22 @@ bool prog_is_okay(const prog *pp, char **info_log)
             break;
 
         case PD_PLAY_TIME:
+        case PD_RENDER_TIME:
             expected_type = GL_FLOAT;
             expected_size = 1;
             break;
 
+        case PD_DATE:
+        case PD_MOUSE:
+            expected_type = GL_FLOAT_VEC4;
+            expected_size = 1;
+            break;
+
+        case PD_CHANNEL_RESOLUTION:
+            expected_type = GL_FLOAT_VEC3;
+            expected_size = 4;
+            break;
+
         case PD_FRAME:
             expected_type = GL_INT;
             expected_size = 1;
@@ -266,6 +488,7 @@ bool prog_is_okay(const prog *pp, char **info_log)
             break;
 
         case PD_NOISE_MEDIUM:
+        case PD_BACK_BUFFER:
             expected_type = GL_SAMPLER_2D;
             expected_size = 1;
             break;
@@ -286,6 +509,66 @@ bool prog_is_okay(const prog *pp, char **info_log)
         uniform_bound[index] = true;
     }
 
+    // Verify all buffers in pp.
+    for (size_t i = 0; i < pp->buffer_count; i++) {
+        const buffer_info *bp = &pp->buffers[i];
+        GLint index = find_uniform(prog,
+                                   bp->name,
+                                   uniform_count,
+                                   uniform_max_length);
+        if (index == -1)
+           continue;
+        if (!check_uniform(prog,
+                           bp->name,
+                           index,
+                           GL_SAMPLER_2D,
+                           1,
+                           uniform_max_length,
+                           info_log))
+            return false;
+        uniform_bound[index] = true;
+    }
+
+    // Verify all streams in pp.
+    for (size_t i = 0; i < pp->stream_count; i++) {
+        const stream_info *sp = &pp->streams[i];
+        GLint index = find_uniform(prog,
+                                   sp->name,
+                                   uniform_count,
+                                   uniform_max_length);
+        if (index == -1)
+           continue;
+        if (!check_uniform(prog,
+                           sp->name,
+                           index,
+                           GL_SAMPLER_2D,
+                           1,
+                           uniform_max_length,
+                           info_log))
+            return false;
+        uniform_bound[index] = true;
+    }
+
+    // Verify all host uniforms in pp.
+    for (size_t i = 0; i < pp->uniform_count; i++) {
+        const uniform_info *up = &pp->uniforms[i];
+        GLint index = find_uniform(prog,
+                                   up->name,
+                                   uniform_count,
+                                   uniform_max_length);
+        if (index == -1)
+           continue;
+        if (!check_uniform(prog,
+                           up->name,
+                           index,
+                           up->type,
+                           up->count,
+                           uniform_max_length,
+                           info_log))
+            return false;
+        uniform_bound[index] = true;
+    }
+
     for (size_t i = 0; i < uniform_count; i++) {
         if (!uniform_bound[i]) {
             char u_name[uniform_max_length];
@@ -325,8 +608,32 @@ bool prog_is_okay(const prog *pp, char **info_log)
     //     glGetActiveUniform(...)
     //     check type, size against value.
 
-    glDeleteProgram(prog);
-    return prog != 0;
+    return true;
+}
+
+bool prog_is_okay(const prog *pp, char **info_log)
+{
+    if (pp->native || pp->glsl)
+        return true;
+    for (size_t i = 0; i < pp->buffer_count; i++) {
+        if (find_pass(pp, pp->buffers[i].pass) == PROG_NO_PASS) {
+            log_info(info_log,
+                     "buffer %s: no pass named %s",
+                     pp->buffers[i].name, pp->buffers[i].pass);
+            return false;
+        }
+    }
+
+    // The main shader is the last pass.  The programs stay in the
+    // cache, ready for the render thread.
+    for (size_t i = 0; i <= pp->pass_count; i++) {
+        GLuint prog = prog_instantiate_pass(pp, i, info_log);
+        bool ok = prog != 0 && pass_is_okay(pp, prog, info_log);
+        progcache_release(prog);
+        if (!ok)
+            return false;
+    }
+    return true;
 }
 
 bool prog_attach_shader(prog *pp, shader_type type, const char *source)
@@ -353,27 +660,486 @@ bool prog_attach_image(prog       *pp,
                        size_t      width,
                        size_t      height,
                        uint8_t    *data)
+{
+    // 4: four channels in RGBA
+    size_t byte_count = width * height * 4 * sizeof *data;
+    uint8_t *copy = malloc(byte_count);
+    if (!copy)
+        return false;
+    memcpy(copy, data, byte_count);
+    return prog_attach_image_ref(pp, name, width, height, copy, free, copy);
+}
+
+bool prog_attach_image_ref(prog          *pp,
+                           const char    *name,
+                           size_t         width,
+                           size_t         height,
+                           const uint8_t *data,
+                           prog_release  *release,
+                           void          *user)
 {
     size_t n = pp->image_count;
     if (pp->image_alloc <= n) {
         size_t new_alloc = 2 * n + 10;
-        pp->images = realloc(pp->images, new_alloc * sizeof *pp->images);
+        image_info *images = realloc(pp->images,
+                                     new_alloc * sizeof *pp->images);
+        if (!images)
+            goto FAIL;
+        pp->images = images;
         pp->image_alloc = new_alloc;
     }
-    // 4: four channels in RGBA
-    size_t byte_count = width * height * 4 * sizeof *data;
-    
-    pp->images[n].name = strdup(name);
-    pp->images[n].width = width;
-    pp->images[n].height = height;
-    pp->images[n].data = malloc(byte_count);
-    memcpy(pp->images[n].data, data, byte_count);
+    char *name_copy = strdup(name);
+    if (!name_copy)
+        goto FAIL;
+    pp->images[n] = (image_info) {
+        .name         = name_copy,
+        .width        = width,
+        .height       = height,
+        .data         = data,
+        .key          = texcache_key(width, height, data),
+        .release      = release,
+        .release_user = user,
+    };
     pp->image_count++;
     return true;
+
+FAIL:
+    if (release)
+        release(user);
+    return false;
+}
+
+static stream_info *find_stream(const prog *pp, const char *name)
+{
+    for (size_t i = 0; i < pp->stream_count; i++)
+        if (!strcmp(pp->streams[i].name, name))
+            return &pp->streams[i];
+    return NULL;
+}
+
+bool prog_attach_stream(prog       *pp,
+                        const char *name,
+                        size_t      width,
+                        size_t      height)
+{
+    if (!width || !height || find_stream(pp, name))
+        return false;
+    size_t n = pp->stream_count;
+    if (pp->stream_alloc <= n) {
+        size_t new_alloc = 2 * n + 10;
+        pp->streams = realloc(pp->streams, new_alloc * sizeof *pp->streams);
+        pp->stream_alloc = new_alloc;
+    }
+    stream_info *sp = &pp->streams[n];
+    *sp = (stream_info) {
+        .width  = width,
+        .height = height,
+        .ring   = create_mailbox_ring(),
+        .slots  = malloc(3 * width * height * 4),
+    };
+    if (!sp->ring || !sp->slots) {
+        if (sp->ring)
+            destroy_ring(sp->ring);
+        free(sp->slots);
+        return false;
+    }
+    sp->name = strdup(name);
+    pp->stream_count++;
+    return true;
+}
+
+uint8_t *prog_stream_acquire(prog *pp, const char *name)
+{
+    stream_info *sp = find_stream(pp, name);
+    if (!sp)
+        return NULL;
+    size_t slot = ring_acquire_empty(sp->ring);
+    return sp->slots + slot * sp->width * sp->height * 4;
+}
+
+bool prog_stream_release(prog *pp, const char *name)
+{
+    stream_info *sp = find_stream(pp, name);
+    if (!sp)
+        return false;
+    ring_release_full(sp->ring);
+    return true;
+}
+
+size_t prog_stream_count(const prog *pp)
+{
+    return pp->stream_count;
+}
+
+const char *prog_stream_name(const prog *pp, size_t index)
+{
+    return pp->streams[index].name;
+}
+
+size_t prog_stream_width(const prog *pp, size_t index)
+{
+    return pp->streams[index].width;
+}
+
+size_t prog_stream_height(const prog *pp, size_t index)
+{
+    return pp->streams[index].height;
+}
+
+uint64_t prog_stream_dropped(const prog *pp, size_t index)
+{
+    return ring_dropped_count(pp->streams[index].ring);
+}
+
+const uint8_t *prog_stream_frame(const prog *pp, size_t index, bool *fresh)
+{
+    stream_info *sp = &pp->streams[index];
+    size_t slot = ring_poll_full(sp->ring);
+    *fresh = slot != RING_EMPTY;
+    if (*fresh) {
+        sp->front = slot;
+        sp->shown = true;
+    }
+    if (!sp->shown)
+        return NULL;
+    return sp->slots + sp->front * sp->width * sp->height * 4;
+}
+
+bool prog_set_native(prog *pp, native_shader *shader, void *user)
+{
+    pp->native = shader;
+    pp->native_user = user;
+    return true;
+}
+
+static size_t type_floats(GLenum type)
+{
+    switch (type) {
+
+    case GL_FLOAT:
+        return 1;
+
+    case GL_FLOAT_VEC2:
+        return 2;
+
+    case GL_FLOAT_VEC3:
+        return 3;
+
+    case GL_FLOAT_VEC4:
+    case GL_FLOAT_MAT2:
+        return 4;
+
+    case GL_FLOAT_MAT3:
+        return 9;
+
+    case GL_FLOAT_MAT4:
+        return 16;
+
+    default:
+        return 0;
+    }
+}
+
+static const uniform_info *find_host_uniform(const prog *pp, const char *name)
+{
+    for (size_t i = 0; i < pp->uniform_count; i++)
+        if (!strcmp(pp->uniforms[i].name, name))
+            return &pp->uniforms[i];
+    return NULL;
+}
+
+// Writers hold host->lock.
+static void publish_uniforms(prog *pp)
+{
+    host_uniforms *hp = pp->host;
+    size_t slot = ring_acquire_empty(hp->ring);
+    memcpy(hp->slots + slot * hp->float_count,
+           hp->latest,
+           hp->float_count * sizeof *hp->latest);
+    ring_release_full(hp->ring);
+}
+
+bool prog_attach_uniform(prog *pp, const char *name, GLenum type, size_t count)
+{
+    size_t floats = type_floats(type) * count;
+    if (!floats || find_host_uniform(pp, name))
+        return false;
+    host_uniforms *hp = pp->host;
+    size_t new_count = hp->float_count + floats;
+    GLfloat *latest = realloc(hp->latest, new_count * sizeof *latest);
+    if (latest)
+        hp->latest = latest;
+    GLfloat *slots = calloc(3 * new_count, sizeof *slots);
+    if (!hp->ring)
+        hp->ring = create_mailbox_ring();
+    if (!latest || !slots || !hp->ring) {
+        free(slots);
+        return false;
+    }
+    memset(latest + hp->float_count, 0, floats * sizeof *latest);
+    free(hp->slots);
+    hp->slots = slots;
+
+    size_t n = pp->uniform_count;
+    if (pp->uniform_alloc <= n) {
+        size_t new_alloc = 2 * n + 10;
+        pp->uniforms = realloc(pp->uniforms,
+                               new_alloc * sizeof *pp->uniforms);
+        pp->uniform_alloc = new_alloc;
+    }
+    pp->uniforms[n].name = strdup(name);
+    pp->uniforms[n].type = type;
+    pp->uniforms[n].count = count;
+    pp->uniforms[n].offset = hp->float_count;
+    pp->uniform_count++;
+    hp->float_count = new_count;
+
+    pthread_mutex_lock(&hp->lock);
+    publish_uniforms(pp);
+    pthread_mutex_unlock(&hp->lock);
+    return true;
+}
+
+bool prog_set_uniform(prog          *pp,
+                      const char    *name,
+                      const GLfloat *values,
+                      size_t         value_count)
+{
+    const uniform_info *up = find_host_uniform(pp, name);
+    if (!up || value_count > type_floats(up->type) * up->count)
+        return false;
+    host_uniforms *hp = pp->host;
+    pthread_mutex_lock(&hp->lock);
+    memcpy(hp->latest + up->offset, values, value_count * sizeof *values);
+    publish_uniforms(pp);
+    pthread_mutex_unlock(&hp->lock);
+    return true;
+}
+
+size_t prog_uniform_count(const prog *pp)
+{
+    return pp->uniform_count;
+}
+
+const char *prog_uniform_name(const prog *pp, size_t index)
+{
+    return pp->uniforms[index].name;
+}
+
+GLenum prog_uniform_type(const prog *pp, size_t index)
+{
+    return pp->uniforms[index].type;
+}
+
+size_t prog_uniform_size(const prog *pp, size_t index)
+{
+    return pp->uniforms[index].count;
+}
+
+size_t prog_uniform_offset(const prog *pp, size_t index)
+{
+    return pp->uniforms[index].offset;
+}
+
+const GLfloat *prog_uniform_values(const prog *pp, bool *changed)
+{
+    host_uniforms *hp = pp->host;
+    *changed = false;
+    if (!hp->ring)
+        return NULL;
+    size_t slot = ring_poll_full(hp->ring);
+    if (slot != RING_EMPTY) {
+        hp->front = slot;
+        *changed = true;
+    }
+    return hp->slots + hp->front * hp->float_count;
+}
+
+// The GLSL type of a host uniform's elements.
+static glsl_type host_glsl_type(GLenum type)
+{
+    switch (type) {
+
+    case GL_FLOAT:
+        return GT_FLOAT;
+
+    case GL_FLOAT_VEC2:
+        return GT_VEC2;
+
+    case GL_FLOAT_VEC3:
+        return GT_VEC3;
+
+    case GL_FLOAT_VEC4:
+        return GT_VEC4;
+
+    case GL_FLOAT_MAT2:
+        return GT_MAT2;
+
+    case GL_FLOAT_MAT3:
+        return GT_MAT3;
+
+    default:
+        return GT_MAT4;
+    }
+}
+
+static bool bind_cpu_predefined(const prog   *pp,
+                                glsl_program *gp,
+                                size_t        index,
+                                predefined    value)
+{
+    switch (value) {
+
+    case PD_RESOLUTION:
+        return glsl_bind_input(gp, index, GI_RESOLUTION);
+
+    case PD_PLAY_TIME:
+        return glsl_bind_input(gp, index, GI_TIME);
+
+    case PD_RENDER_TIME:
+        return glsl_bind_input(gp, index, GI_TIME_DELTA);
+
+    case PD_FRAME:
+        return glsl_bind_input(gp, index, GI_FRAME);
+
+    case PD_DATE:
+        return glsl_bind_input(gp, index, GI_DATE);
+
+    case PD_MOUSE:
+        {
+            static const float mouse[4];
+            return glsl_bind_constant(gp, index, mouse, 4);
+        }
+
+    case PD_CHANNEL_RESOLUTION:
+        {
+            float res[4][3] = { { 0.0 } };
+            for (int ch = 0; ch < 4; ch++) {
+                char ch_name[16];
+                snprintf(ch_name, sizeof ch_name, "iChannel%d", ch);
+                for (size_t i = 0; i < pp->image_count; i++) {
+                    if (!strcmp(pp->images[i].name, ch_name)) {
+                        res[ch][0] = pp->images[i].width;
+                        res[ch][1] = pp->images[i].height;
+                    }
+                }
+                for (size_t i = 0; i < pp->predef_count; i++) {
+                    size_t dim;
+                    if (!strcmp(pp->predefs[i].name, ch_name) &&
+                        render_noise(pp->predefs[i].value, &dim))
+                        res[ch][0] = res[ch][1] = dim;
+                }
+                if (res[ch][0])
+                    res[ch][2] = 1.0;
+            }
+            return glsl_bind_constant(gp, index, res[0], 12);
+        }
+
+    case PD_NOISE_SMALL:
+    case PD_NOISE_MEDIUM:
+        {
+            size_t dim;
+            const uint8_t *noise = render_noise(value, &dim);
+            return glsl_bind_texture(gp, index, dim, dim, noise);
+        }
+
+    default:
+        return false;
+    }
+}
+
+// Binds a uniform the shader declares to whatever the program has
+// attached by that name.  Anything else reads as zero, as on the GPU.
+static bool bind_cpu_uniform(const prog   *pp,
+                             glsl_program *gp,
+                             size_t        index,
+                             char        **info_log)
+{
+    const char *name = glsl_uniform_name(gp, index);
+    bool ok = true;
+    for (size_t i = 0; i < pp->image_count; i++) {
+        const image_info *ip = &pp->images[i];
+        if (strcmp(ip->name, name))
+            continue;
+        if (!ip->data) {
+            log_info(info_log, "image %s is already on the GPU", name);
+            return false;
+        }
+        ok = glsl_bind_texture(gp, index, ip->width, ip->height, ip->data);
+    }
+    for (size_t i = 0; i < pp->predef_count; i++) {
+        if (strcmp(pp->predefs[i].name, name))
+            continue;
+        predefined value = pp->predefs[i].value;
+        if (value == PD_BACK_BUFFER) {
+            log_info(info_log, "%s: the back buffer is not on the CPU", name);
+            return false;
+        }
+        ok = bind_cpu_predefined(pp, gp, index, value);
+    }
+    for (size_t i = 0; i < pp->uniform_count; i++) {
+        const uniform_info *up = &pp->uniforms[i];
+        if (strcmp(up->name, name))
+            continue;
+        size_t size = glsl_uniform_array_size(gp, index);
+        ok = glsl_uniform_type(gp, index) == host_glsl_type(up->type) &&
+             (size ? size : 1) == up->count &&
+             glsl_bind_host(gp, index, up->offset,
+                            type_floats(up->type) * up->count);
+    }
+    for (size_t i = 0; i < pp->stream_count; i++) {
+        if (!strcmp(pp->streams[i].name, name)) {
+            log_info(info_log, "stream %s is not on the CPU", name);
+            return false;
+        }
+    }
+    for (size_t i = 0; i < pp->buffer_count; i++) {
+        if (!strcmp(pp->buffers[i].name, name)) {
+            log_info(info_log, "buffer %s is not on the CPU", name);
+            return false;
+        }
+    }
+    if (!ok)
+        log_info(info_log, "uniform %s has the wrong type", name);
+    return ok;
+}
+
+bool prog_use_cpu(prog *pp, char **info_log)
+{
+    if (pp->native)
+        return true;
+    if (pp->pass_count) {
+        log_info(info_log, "buffer passes are not on the CPU");
+        return false;
+    }
+    if (!pp->frag_shader_source) {
+        log_info(info_log, "no fragment shader");
+        return false;
+    }
+    glsl_program *gp = glsl_compile(pp->frag_shader_source, info_log);
+    if (!gp)
+        return false;
+    for (size_t i = 0; i < glsl_uniform_count(gp); i++) {
+        if (!bind_cpu_uniform(pp, gp, i, info_log)) {
+            glsl_destroy(gp);
+            return false;
+        }
+    }
+    glsl_destroy(pp->glsl);
+    pp->glsl = gp;
+    return true;
 }
 
 bool prog_attach_predefined(prog *pp, const char *name, predefined value)
 {
+    if (value == PD_IMU) {
+        // The host's orientation matrix, identity until it says.
+        static const GLfloat identity[16] = {
+            1, 0, 0, 0,  0, 1, 0, 0,  0, 0, 1, 0,  0, 0, 0, 1,
+        };
+        return prog_attach_uniform(pp, name, GL_FLOAT_MAT4, 1) &&
+               prog_set_uniform(pp, name, identity, 16);
+    }
     size_t n = pp->predef_count;
     if (pp->predef_alloc <= n) {
         size_t new_alloc = 2 * n + 10;
@@ -386,6 +1152,44 @@ bool prog_attach_predefined(prog *pp, const char *name, predefined value)
     return true;
 }
 
+bool prog_attach_pass(prog *pp, const char *name, const char *source)
+{
+    if (find_pass(pp, name) != PROG_NO_PASS)
+        return false;
+    size_t n = pp->pass_count;
+    if (pp->pass_alloc <= n) {
+        size_t new_alloc = 2 * n + 10;
+        pp->passes = realloc(pp->passes, new_alloc * sizeof *pp->passes);
+        pp->pass_alloc = new_alloc;
+    }
+    pp->passes[n].name = strdup(name);
+    pp->passes[n].frag_shader_source = strdup(source);
+    pp->pass_count++;
+    return true;
+}
+
+bool prog_attach_buffer(prog *pp, const char *name, const char *pass)
+{
+    size_t n = pp->buffer_count;
+    if (pp->buffer_alloc <= n) {
+        size_t new_alloc = 2 * n + 10;
+        pp->buffers = realloc(pp->buffers, new_alloc * sizeof *pp->buffers);
+        pp->buffer_alloc = new_alloc;
+    }
+    pp->buffers[n].name = strdup(name);
+    pp->buffers[n].pass = strdup(pass);
+    pp->buffer_count++;
+    return true;
+}
+
+bool prog_set_supersample(prog *pp, int factor)
+{
+    if (factor < 1 || factor > PROG_MAX_SUPERSAMPLE)
+        return false;
+    pp->supersample = factor;
+    return true;
+}
+
 static GLuint create_shader(const prog *pp,
                             GLenum type,
                             const char *source,
@@ -397,8 +1201,12 @@ static GLuint create_shader(const prog *pp,
                  "glCreateShader failed: %s", GL_error_str(glGetError()));
         return 0;
     }
-    GLint length = -1;
-    glShaderSource(s, 1, &source, &length);
+    const char *sources[2] = { fragment_preamble, source };
+    GLint lengths[2] = { -1, -1 };
+    if (type == GL_FRAGMENT_SHADER)
+        glShaderSource(s, 2, sources, lengths);
+    else
+        glShaderSource(s, 1, &source, lengths);
     glCompileShader(s);
     if (info_log && !shader_is_ok(s)) {
         GLint info_len;
@@ -413,17 +1221,38 @@ static GLuint create_shader(const prog *pp,
     return s;
 }
 
+static uint64_t source_hash(const prog *pp, const char *frag_source)
+{
+    uint64_t hash = PROGCACHE_HASH_INIT;
+    hash = progcache_hash(hash, pp->vert_shader_source ?: "");
+    hash = progcache_hash(hash, fragment_preamble);
+    hash = progcache_hash(hash, frag_source ?: "");
+    return hash;
+}
+
 GLuint prog_instantiate(const prog *pp, char **info_log)
+{
+    return prog_instantiate_pass(pp, pp->pass_count, info_log);
+}
+
+// Programs come from the cache when they can.  The cache owns them,
+// and the caller holds a reference.
+GLuint prog_instantiate_pass(const prog *pp, size_t pass, char **info_log)
 {
     GLuint v = 0, f = 0, p = 0;
+    const char *frag_source = pass < pp->pass_count ?
+                              pp->passes[pass].frag_shader_source :
+                              pp->frag_shader_source;
+
+    uint64_t key = source_hash(pp, frag_source);
+    p = progcache_find(key);
+    if (p)
+        return p;
 
     v = create_shader(pp, GL_VERTEX_SHADER, pp->vert_shader_source, info_log);
     if (!v)
         goto FAIL;
-    f = create_shader(pp,
-                      GL_FRAGMENT_SHADER,
-                      pp->frag_shader_source,
-                      info_log);
+    f = create_shader(pp, GL_FRAGMENT_SHADER, frag_source, info_log);
     if (!f)
         goto FAIL;
     p = glCreateProgram();
@@ -469,7 +1298,9 @@ GLuint prog_instantiate(const prog *pp, char **info_log)
         goto FAIL;
     }
 
-    return p;
+    glDeleteShader(f);
+    glDeleteShader(v);
+    return progcache_insert(key, p);
 
 FAIL:
     if (p)
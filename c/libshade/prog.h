@@ -3,9 +3,13 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #include <GLES2/gl2.h>
 
+#include "glsl.h"
+#include "native.h"
+
 typedef enum shader_type {
     PST_VERTEX,
     PST_FRAGMENT,
@@ -14,18 +18,33 @@ typedef enum shader_type {
 typedef enum predefined {
     PD_RESOLUTION,
     PD_PLAY_TIME,
+    PD_RENDER_TIME,
     PD_FRAME,
+    PD_DATE,
+    PD_MOUSE,
+    PD_CHANNEL_RESOLUTION,
     PD_NOISE_SMALL,
     PD_NOISE_MEDIUM,
+    PD_BACK_BUFFER,
+    PD_IMU,
 
     PD_UNKNOWN = -999,
 } predefined;
 
 typedef struct shd_prog prog;
 
+typedef void prog_release(void *user);
+
+#define PROG_MAX_SUPERSAMPLE 4
+#define PROG_NO_PASS         ((size_t)-1)
+
 extern prog          *create_prog(void);
 extern void           destroy_prog(prog *);
 extern bool           prog_is_okay(const prog *, char **info_log);
+// Compile the fragment shader for the CPU renderer, which then draws
+// the program instead of the GPU.  Images must not be uploaded yet;
+// buffer passes, streams and the back buffer don't work on the CPU.
+extern bool           prog_use_cpu(prog *, char **info_log);
 extern bool           prog_attach_shader(prog *,
                                          shader_type,
                                          const char *source);
@@ -34,21 +53,108 @@ extern bool           prog_attach_image(prog       *,
                                         size_t      width,
                                         size_t      height,
                                         uint8_t    *data);
+// Attach width x height RGBA pixels without copying them.  The
+// program reads data until it calls release(user): once the image is
+// uploaded, when the program is destroyed, or at once on failure.
+extern bool           prog_attach_image_ref(prog          *,
+                                            const char    *name,
+                                            size_t         width,
+                                            size_t         height,
+                                            const uint8_t *data,
+                                            prog_release  *release,
+                                            void          *user);
 extern bool           prog_attach_predefined(prog       *,
                                              const char *name,
                                              predefined value);
+// Buffer passes draw before the main fragment shader, in the order
+// attached, each into a texture the size of the frame.  Sampler
+// `name' reads pass `pass': this frame's output if the pass has
+// already drawn, the previous frame's otherwise.  PD_BACK_BUFFER
+// reads the main shader's previous frame.
+extern bool           prog_attach_pass(prog       *,
+                                       const char *name,
+                                       const char *source);
+extern bool           prog_attach_buffer(prog       *,
+                                         const char *name,
+                                         const char *pass);
+// Host uniforms are float, vecN or matN arrays the application sets
+// while the program runs.  prog_set_uniform may be called from any
+// thread and never blocks the render thread; matrices are column
+// major.  PD_IMU attaches a mat4 host uniform set to the identity.
+extern bool           prog_attach_uniform(prog       *,
+                                          const char *name,
+                                          GLenum      type,
+                                          size_t      count);
+extern bool           prog_set_uniform(prog          *,
+                                       const char    *name,
+                                       const GLfloat *values,
+                                       size_t         value_count);
+// A stream is an RGBA image the host replaces while the program
+// runs, e.g. video.  One producer thread per stream fills the buffer
+// prog_stream_acquire returns and then calls prog_stream_release; it
+// never waits.  The render thread draws with the newest frame, and
+// frames it never saw count as dropped.
+extern bool           prog_attach_stream(prog       *,
+                                         const char *name,
+                                         size_t      width,
+                                         size_t      height);
+extern uint8_t       *prog_stream_acquire(prog *, const char *name);
+extern bool           prog_stream_release(prog *, const char *name);
+// A native shader runs on the CPU instead of the GLSL.  A program
+// with one needs no other shaders.
+extern bool           prog_set_native(prog *, native_shader *, void *user);
+// Shade at factor x factor samples per LED, then box filter down.
+extern bool           prog_set_supersample(prog *, int factor);
 
+// The program is cached and shared; don't delete it.  Each call
+// takes a reference, which progcache_release drops.  The main shader
+// is pass number prog_pass_count().
 extern GLuint         prog_instantiate(const prog *, char **info_log);
+extern GLuint         prog_instantiate_pass(const prog *,
+                                            size_t pass,
+                                            char **info_log);
 extern int            prog_id(const prog *);
+extern int            prog_supersample(const prog *);
+extern native_shader *prog_native_shader(const prog *);
+extern void          *prog_native_user(const prog *);
+extern glsl_program  *prog_cpu_program(const prog *);
 
 extern size_t         prog_image_count(const prog *);
 extern const char    *prog_image_name(const prog *, size_t index);
 extern size_t         prog_image_width(const prog *, size_t index);
 extern size_t         prog_image_height(const prog *, size_t index);
-extern const uint8_t *prog_image_data(const prog *, size_t index);
+// Render thread only.  Uploads the image the first time, after which
+// the program keeps the texture loaded and lets go of the pixels.
+extern GLuint         prog_image_texture(const prog *, size_t index);
+extern uint64_t       prog_image_key(const prog *, size_t index);
 
 extern size_t         prog_predefined_count(const prog *);
 extern const char    *prog_predefined_name(const prog *, size_t index);
 extern predefined     prog_predefined_value(const prog *, size_t index);
 
+extern size_t         prog_pass_count(const prog *);
+extern size_t         prog_buffer_count(const prog *);
+extern const char    *prog_buffer_name(const prog *, size_t index);
+extern size_t         prog_buffer_pass(const prog *, size_t index);
+
+extern size_t         prog_stream_count(const prog *);
+extern const char    *prog_stream_name(const prog *, size_t index);
+extern size_t         prog_stream_width(const prog *, size_t index);
+extern size_t         prog_stream_height(const prog *, size_t index);
+extern uint64_t       prog_stream_dropped(const prog *, size_t index);
+// Render thread only: the newest frame, or NULL before the first.
+// `fresh' is set if it is new since the last call.
+extern const uint8_t *prog_stream_frame(const prog *,
+                                        size_t index,
+                                        bool  *fresh);
+
+extern size_t         prog_uniform_count(const prog *);
+extern const char    *prog_uniform_name(const prog *, size_t index);
+extern GLenum         prog_uniform_type(const prog *, size_t index);
+extern size_t         prog_uniform_size(const prog *, size_t index);
+extern size_t         prog_uniform_offset(const prog *, size_t index);
+// Render thread only: the newest values, indexed by offset.
+// `changed' is set if they are new since the last call.
+extern const GLfloat *prog_uniform_values(const prog *, bool *changed);
+
 #endif /* !PROG_included */
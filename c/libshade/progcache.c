@@ -0,0 +1,325 @@
+#define _GNU_SOURCE
+#include "progcache.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <EGL/egl.h>
+#include <GLES2/gl2ext.h>
+
+#define BINARY_MAGIC      "SHDPROG1"
+#define MAX_BINARY_BYTES  (16 * 1024 * 1024)
+
+typedef struct cache_entry {
+    uint64_t key;
+    GLuint   program;
+    size_t   refs;
+    uint64_t last_used;
+} cache_entry;
+
+// What precedes the driver's blob in a cache file.  A binary is only
+// good for the driver that made it.
+typedef struct binary_header {
+    char     magic[8];
+    uint64_t key;
+    uint64_t driver;
+    uint32_t format;
+    uint32_t length;
+} binary_header;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static cache_entry    *entries;
+static size_t          entry_count;
+static size_t          entry_alloc;
+static uint64_t        use_clock;
+
+static bool            dir_chosen;
+static char           *cache_dir;
+
+// Probed on first use.  -1 means not yet.
+static int             binary_formats = -1;
+static uint64_t        driver_hash;
+static PFNGLGETPROGRAMBINARYOESPROC get_program_binary;
+static PFNGLPROGRAMBINARYOESPROC    program_binary;
+
+static char *default_dir(void)
+{
+    char *dir = NULL;
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    if (xdg && *xdg) {
+        if (asprintf(&dir, "%s/shaderboy", xdg) < 0)
+            dir = NULL;
+    } else if (home && *home) {
+        if (asprintf(&dir, "%s/.cache/shaderboy", home) < 0)
+            dir = NULL;
+    }
+    return dir;
+}
+
+void progcache_set_dir(const char *dir)
+{
+    char *copy = dir ? strdup(dir) : NULL;
+    pthread_mutex_lock(&cache_lock);
+    free(cache_dir);
+    cache_dir = copy;
+    dir_chosen = true;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// Call with cache_lock held.  Returns the path of the key's file, or
+// NULL if programs aren't saved.
+static char *binary_path(uint64_t key)
+{
+    if (!dir_chosen) {
+        cache_dir = default_dir();
+        dir_chosen = true;
+    }
+    if (!cache_dir)
+        return NULL;
+
+    if (binary_formats < 0) {
+        binary_formats = 0;
+        const char *ext = (const char *)glGetString(GL_EXTENSIONS);
+        if (ext && strstr(ext, "GL_OES_get_program_binary")) {
+            glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS_OES, &binary_formats);
+            get_program_binary = (PFNGLGETPROGRAMBINARYOESPROC)
+                eglGetProcAddress("glGetProgramBinaryOES");
+            program_binary = (PFNGLPROGRAMBINARYOESPROC)
+                eglGetProcAddress("glProgramBinaryOES");
+            if (!get_program_binary || !program_binary)
+                binary_formats = 0;
+            const char *renderer = (const char *)glGetString(GL_RENDERER);
+            const char *version = (const char *)glGetString(GL_VERSION);
+            driver_hash = progcache_hash(PROGCACHE_HASH_INIT,
+                                         renderer ? renderer : "");
+            driver_hash = progcache_hash(driver_hash, version ? version : "");
+        }
+    }
+    if (binary_formats <= 0)
+        return NULL;
+
+    char *path;
+    if (asprintf(&path, "%s/%016" PRIx64 ".prog", cache_dir, key) < 0)
+        return NULL;
+    return path;
+}
+
+// mkdir -p, but the last component is a file name.
+static void make_parent_dirs(const char *path)
+{
+    char *p = strdup(path);
+    if (!p)
+        return;
+    char *slash = p;
+    while ((slash = strchr(slash + 1, '/'))) {
+        *slash = '\0';
+        (void)mkdir(p, 0755);
+        *slash = '/';
+    }
+    free(p);
+}
+
+static GLuint load_binary(const char *path, uint64_t key)
+{
+    GLuint program = 0;
+    void *data = NULL;
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return 0;
+    binary_header hdr;
+    if (fread(&hdr, sizeof hdr, 1, f) != 1                  ||
+        memcmp(hdr.magic, BINARY_MAGIC, sizeof hdr.magic)   ||
+        hdr.key != key                                      ||
+        hdr.driver != driver_hash                           ||
+        hdr.length > MAX_BINARY_BYTES)
+        goto DONE;
+    data = malloc(hdr.length);
+    if (!data || fread(data, 1, hdr.length, f) != hdr.length)
+        goto DONE;
+
+    program = glCreateProgram();
+    program_binary(program, hdr.format, data, hdr.length);
+    GLint link_status = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &link_status);
+    if (link_status != GL_TRUE) {
+        // Stale: the driver changed under the same name.
+        glDeleteProgram(program);
+        program = 0;
+    }
+
+DONE:
+    free(data);
+    fclose(f);
+    return program;
+}
+
+// Best effort.  Write a temporary file and rename it so readers never
+// see half a binary.
+static void save_binary(const char *path, uint64_t key, GLuint program)
+{
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH_OES, &length);
+    if (length <= 0 || length > MAX_BINARY_BYTES)
+        return;
+    binary_header hdr = {
+        .magic  = BINARY_MAGIC,
+        .key    = key,
+        .driver = driver_hash,
+    };
+    void *data = malloc(length);
+    if (!data)
+        return;
+    GLenum format = 0;
+    GLsizei written = 0;
+    get_program_binary(program, length, &written, &format, data);
+    hdr.format = format;
+    hdr.length = written;
+
+    char *tmp_path = NULL;
+    if (written > 0 &&
+        asprintf(&tmp_path, "%s.%d", path, (int)getpid()) >= 0) {
+        make_parent_dirs(tmp_path);
+        FILE *f = fopen(tmp_path, "wb");
+        if (f) {
+            bool ok = fwrite(&hdr, sizeof hdr, 1, f) == 1 &&
+                      fwrite(data, 1, written, f) == (size_t)written;
+            ok &= fclose(f) == 0;
+            if (!ok || rename(tmp_path, path))
+                (void)unlink(tmp_path);
+        }
+    }
+    free(tmp_path);
+    free(data);
+}
+
+// Call with cache_lock held.  Delete the least recently used idle
+// programs until no more than PROGCACHE_MAX_ENTRIES are left.
+static void trim_idle(void)
+{
+    while (entry_count > PROGCACHE_MAX_ENTRIES) {
+        cache_entry *oldest = NULL;
+        for (size_t i = 0; i < entry_count; i++) {
+            cache_entry *e = &entries[i];
+            if (!e->refs && (!oldest || e->last_used < oldest->last_used))
+                oldest = e;
+        }
+        if (!oldest)
+            break;
+        glDeleteProgram(oldest->program);
+        *oldest = entries[--entry_count];
+    }
+}
+
+// Call with cache_lock held.  Takes a reference.
+static cache_entry *lookup(uint64_t key)
+{
+    for (size_t i = 0; i < entry_count; i++) {
+        if (entries[i].key == key) {
+            entries[i].refs++;
+            entries[i].last_used = ++use_clock;
+            return &entries[i];
+        }
+    }
+    return NULL;
+}
+
+// Call with cache_lock held.  Returns the program referenced, or zero
+// if there is no room for it.
+static GLuint add_entry(uint64_t key, GLuint program)
+{
+    cache_entry *e = lookup(key);
+    if (e) {
+        glDeleteProgram(program);
+        return e->program;
+    }
+    if (entry_alloc <= entry_count) {
+        size_t new_alloc = 2 * entry_count + 10;
+        cache_entry *new_entries =
+            realloc(entries, new_alloc * sizeof *entries);
+        if (!new_entries) {
+            glDeleteProgram(program);
+            return 0;
+        }
+        entries = new_entries;
+        entry_alloc = new_alloc;
+    }
+    entries[entry_count++] = (cache_entry) {
+        .key       = key,
+        .program   = program,
+        .refs      = 1,
+        .last_used = ++use_clock,
+    };
+    trim_idle();
+    return program;
+}
+
+GLuint progcache_find(uint64_t key)
+{
+    pthread_mutex_lock(&cache_lock);
+    cache_entry *e = lookup(key);
+    GLuint program = e ? e->program : 0;
+    char *path = program ? NULL : binary_path(key);
+    pthread_mutex_unlock(&cache_lock);
+    if (program || !path)
+        return program;
+
+    program = load_binary(path, key);
+    free(path);
+    if (!program)
+        return 0;
+    // Other contexts only see the program once it's finished.
+    glFinish();
+    pthread_mutex_lock(&cache_lock);
+    program = add_entry(key, program);
+    pthread_mutex_unlock(&cache_lock);
+    return program;
+}
+
+GLuint progcache_insert(uint64_t key, GLuint program)
+{
+    glFinish();
+    pthread_mutex_lock(&cache_lock);
+    GLuint cached = add_entry(key, program);
+    char *path = cached == program ? binary_path(key) : NULL;
+    pthread_mutex_unlock(&cache_lock);
+    if (path) {
+        save_binary(path, key, program);
+        free(path);
+    }
+    return cached;
+}
+
+void progcache_release(GLuint program)
+{
+    if (!program)
+        return;
+    pthread_mutex_lock(&cache_lock);
+    for (size_t i = 0; i < entry_count; i++) {
+        cache_entry *e = &entries[i];
+        if (e->program == program) {
+            if (e->refs && !--e->refs)
+                trim_idle();
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void progcache_clear(void)
+{
+    pthread_mutex_lock(&cache_lock);
+    for (size_t i = 0; i < entry_count; i++)
+        glDeleteProgram(entries[i].program);
+    free(entries);
+    entries = NULL;
+    entry_count = 0;
+    entry_alloc = 0;
+    pthread_mutex_unlock(&cache_lock);
+}
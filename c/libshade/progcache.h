@@ -0,0 +1,53 @@
+#ifndef PROGCACHE_included
+#define PROGCACHE_included
+
+#include <stdint.h>
+
+#include <GLES2/gl2.h>
+
+// Linked GL programs, keyed by a hash of their shader sources.  Every
+// libshade EGL context shares objects with the main one, so a program
+// linked on one thread is ready to use on another.  The cache owns
+// its programs; don't delete them.  Each user holds a reference, and
+// a program nobody references stays cached in case it is wanted
+// again, until there are more than PROGCACHE_MAX_ENTRIES.
+//
+// When GL_OES_get_program_binary is available, linked programs are
+// also written to a directory, and later runs load them from there
+// instead of running the GLSL compiler.
+
+#define PROGCACHE_MAX_ENTRIES 64
+
+// FNV-1a, for building keys.
+#define PROGCACHE_HASH_INIT 0xcbf29ce484222325ULL
+
+static inline uint64_t progcache_hash(uint64_t hash, const char *s)
+{
+    do {
+        hash ^= (unsigned char)*s;
+        hash *= 0x100000001b3ULL;
+    } while (*s++);             // the NUL separates strings
+    return hash;
+}
+
+// NULL keeps programs in memory only.  The default is
+// $XDG_CACHE_HOME/shaderboy or ~/.cache/shaderboy.
+extern void   progcache_set_dir(const char *dir);
+
+// Returns a referenced program, or zero if there is no such program
+// in memory or on disk.
+extern GLuint progcache_find(uint64_t key);
+
+// Takes ownership of a freshly linked program.  Returns the program
+// to use, referenced, which is an earlier one if another thread beat
+// us to it.
+extern GLuint progcache_insert(uint64_t key, GLuint program);
+
+// Drop a reference from find or insert.  A sharing context must be
+// current.
+extern void   progcache_release(GLuint program);
+
+// Delete every program.  A sharing context must be current.
+extern void   progcache_clear(void);
+
+#endif /* !PROGCACHE_included */
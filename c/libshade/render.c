@@ -1,12 +1,17 @@
 #include "render.h"
 
+#include <pthread.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 #include <GLES2/gl2.h>
 
 #include "egl.h"
+#include "progcache.h"
+#include "texcache.h"
 
 static GLfloat vertices[] = {
     -1.0, -1.0, 0.0,
@@ -21,26 +26,132 @@ static size_t vertex_count = ((&vertices)[1] - vertices) / 3;
 
 static uint8_t noise_small_data[NOISE_SMALL_DIM * NOISE_SMALL_DIM * 4];
 static uint8_t noise_medium_data[NOISE_MEDIUM_DIM * NOISE_MEDIUM_DIM * 4];
+static uint64_t noise_small_key;
+static uint64_t noise_medium_key;
+
+// The predefineds that change, computed once per frame.
+typedef struct frame_uniforms {
+    GLfloat    time;
+    GLfloat    time_delta;
+    GLint      frame;
+    GLfloat    date[4];
+} frame_uniforms;
+
+// A uniform a pass updates from frame_uniforms, and what it last sent.
+// Uniforms that never change are set once, and aren't in the list.
+typedef struct uniform_update {
+    GLint      index;
+    GLenum     type;            // GL_FLOAT, GL_INT or GL_FLOAT_VEC4
+    size_t     offset;
+    GLfloat    last[4];
+    bool       sent;
+} uniform_update;
+
+// A host uniform a pass sends whenever the host has changed any.
+typedef struct host_map {
+    GLint      index;
+    GLenum     type;
+    GLsizei    count;
+    size_t     offset;
+} host_map;
 
-typedef struct pd_map {
+typedef struct buffer_map {
     GLint      index;
-    predefined value;
-} pd_map;
+    size_t     pass;
+} buffer_map;
+
+typedef struct stream_map {
+    GLint      index;
+    size_t     stream;
+} stream_map;
+
+// One pass of the current prog.  Samplers for images and noise use
+// units from zero up, then samplers for buffers, then streams.
+// An offscreen pass draws into color[!front] while its readers
+// sample color[front], then the two swap.
+typedef struct pass_state {
+    GLuint           prog;
+    GLint            vert_index;
+    size_t           update_count;
+    uniform_update  *updates;
+    size_t           host_count;
+    host_map        *hosts;
+    bool             hosts_sent;
+    size_t           texture_count;
+    GLuint          *textures;
+    size_t           buffer_count;
+    buffer_map      *buffer_map;
+    size_t           stream_count;
+    stream_map      *stream_map;
+    bool             offscreen;
+    GLuint           color[2];
+    GLuint           framebuffer[2];
+    int              front;
+} pass_state;
 
 struct render_state {
     bcm_context      bcm;
     EGL_context     *egl;
+    GLfloat          width;
+    GLfloat          height;
+    GLint            target;            // the backend's framebuffer
+    int              supersample;       // of the current prog
+
+    // When the main pass draws offscreen, because it's supersampled
+    // or reads its previous frame, down_prog averages each factor x
+    // factor block into one pixel of the target.
+    int              down_factor;
+    GLuint           down_prog;
+    GLint            down_vert_index;
+    GLint            down_unit;
+
     int              prog_id;
-    GLuint           prog;
-    GLint            vert_index;
     struct timespec  time_zero;
-    GLint            frame_counter;
-    GLenum           active_texture;
-    size_t           pd_count;
-    pd_map          *pd_map;
+    bool             uses_date;
+    frame_uniforms   frame;
+    const GLfloat   *host_values;       // this frame's host uniforms
+    bool             host_changed;
+    size_t           pass_count;        // buffer passes, then main
+    pass_state      *passes;
+    size_t           stream_count;
+    GLuint          *streams;           // a texture per stream
 };
 
-render_state *render_init(const bcm_context bcm)
+static void make_noise(void)
+{
+    srand(69069);               // historical reasons
+    for (size_t i = 0; i < sizeof noise_small_data; i++)
+        noise_small_data[i] = random() % 256;
+    for (size_t i = 0; i < sizeof noise_medium_data; i++)
+        noise_medium_data[i] = random() % 256;
+    noise_small_key = texcache_key(NOISE_SMALL_DIM,
+                                   NOISE_SMALL_DIM,
+                                   noise_small_data);
+    noise_medium_key = texcache_key(NOISE_MEDIUM_DIM,
+                                    NOISE_MEDIUM_DIM,
+                                    noise_medium_data);
+}
+
+const uint8_t *render_noise(predefined which, size_t *dim)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, make_noise);
+    switch (which) {
+
+    case PD_NOISE_SMALL:
+        *dim = NOISE_SMALL_DIM;
+        return noise_small_data;
+
+    case PD_NOISE_MEDIUM:
+        *dim = NOISE_MEDIUM_DIM;
+        return noise_medium_data;
+
+    default:
+        return NULL;
+    }
+}
+
+render_state *render_init(const bcm_context bcm, EGL_context *share)
 {    
     render_state *rs = calloc(1, sizeof *rs);
 
@@ -48,30 +159,67 @@ render_state *render_init(const bcm_context bcm)
     uint32_t bcm_surface = bcm_get_surface(bcm);
     uint32_t surface_width = bcm_get_surface_width(bcm);
     uint32_t surface_height = bcm_get_surface_height(bcm);
-    rs->egl = init_EGL(bcm_surface, surface_width, surface_height);
+    rs->egl = init_EGL(bcm_surface, surface_width, surface_height, share);
+    if (!rs->egl) {
+        fprintf(stderr, "render: %s\n", EGL_last_error());
+        free(rs);
+        return NULL;
+    }
+    if (!bcm_init_render_target(bcm)) {
+        fprintf(stderr, "render: %s\n", bcm_last_error());
+        deinit_EGL(rs->egl);
+        free(rs);
+        return NULL;
+    }
 
-    glViewport(0, 0, 128*6, 128);
+    rs->width = bcm_get_viewport_width(bcm);
+    rs->height = bcm_get_viewport_height(bcm);
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &rs->target);
+    glViewport(0, 0, rs->width, rs->height);
     glClearColor(0.0, 0.0, 0.0, 1.0);
+    GLint units = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_IMAGE_UNITS, &units);
+    rs->down_unit = units - 1;          // out of the passes' way
 
-    srand(69069);               // historical reasons
-    for (size_t i = 0; i < sizeof noise_small_data; i++)
-        noise_small_data[i] = random() % 256;
-    for (size_t i = 0; i < sizeof noise_medium_data; i++)
-        noise_medium_data[i] = random() % 256;
+    size_t dim;
+    render_noise(PD_NOISE_SMALL, &dim);     // and the keys
 
     return rs;
 }
 
+static void destroy_passes(pass_state *passes, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        pass_state *ps = &passes[i];
+        for (size_t j = 0; j < ps->texture_count; j++)
+            texcache_release(ps->textures[j]);
+        progcache_release(ps->prog);
+        free(ps->textures);
+        free(ps->updates);
+        free(ps->hosts);
+        free(ps->buffer_map);
+        free(ps->stream_map);
+        glDeleteFramebuffers(2, ps->framebuffer);
+        glDeleteTextures(2, ps->color);
+    }
+    free(passes);
+}
+
 void render_deinit(render_state *rs)
 {
-    glDeleteProgram(rs->prog);
+    destroy_passes(rs->passes, rs->pass_count);
+    glDeleteTextures(rs->stream_count, rs->streams);
+    free(rs->streams);
+    glDeleteProgram(rs->down_prog);
+    bcm_deinit_render_target(rs->bcm);
     deinit_EGL(rs->egl);
-    free(rs->pd_map);
     free(rs);
 }
 
 static void load_texture(render_state  *rs,
+                         pass_state    *ps,
                          GLint          index,
+                         uint64_t       key,
                          size_t         width,
                          size_t         height,
                          const uint8_t *data)
@@ -79,110 +227,172 @@ static void load_texture(render_state  *rs,
     if (index == -1)
         return;
 
-    glActiveTexture(rs->active_texture++);
-    GLuint texture;
-    glGenTextures(1, &texture);
-    glBindTexture(GL_TEXTURE_2D, texture);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexImage2D(GL_TEXTURE_2D,
-                 0,             // level
-                 GL_RGBA,
-                 width,
-                 height,
-                 0,             // border, must be zero
-                 GL_RGBA,
-                 GL_UNSIGNED_BYTE,
-                 data);
-    glGenerateMipmap(GL_TEXTURE_2D);
-    glUniform1i(index, 0);
-}
-
-static void load_images(render_state *rs, const prog *pp)
-{
-    rs->active_texture = GL_TEXTURE0;
+    GLuint texture = texcache_acquire(key, width, height, data);
+    if (!texture)
+        return;
+    GLint unit = ps->texture_count;
+    ps->textures[ps->texture_count++] = texture;
+    glUniform1i(index, unit);
+}
+
+static void load_images(render_state *rs, pass_state *ps, const prog *pp)
+{
     size_t im_count = prog_image_count(pp);
     for (size_t i = 0; i < im_count; i++) {
         const char *name = prog_image_name(pp, i);
         size_t width = prog_image_width(pp, i);
         size_t height = prog_image_height(pp, i);
-        const uint8_t *data = prog_image_data(pp, i);
-        GLint index = glGetUniformLocation(rs->prog, name);
-        load_texture(rs, index, width, height, data);
+        uint64_t key = prog_image_key(pp, i);
+        GLint index = glGetUniformLocation(ps->prog, name);
+        if (index != -1 && prog_image_texture(pp, i))
+            load_texture(rs, ps, index, key, width, height, NULL);
     }
 }
 
-static void update_predefineds(render_state *rs, const prog *pp, bool new_prog)
+static void map_buffer(pass_state *ps, GLint index, size_t pass)
 {
-    size_t pd_count = prog_predefined_count(pp);
-    if (new_prog) {
-        free(rs->pd_map);
-        rs->pd_map = calloc(pd_count, sizeof *rs->pd_map);
-        rs->pd_count = pd_count;
-        for (size_t i = 0; i < pd_count; i++) {
-            const char *name = prog_predefined_name(pp, i);
-            predefined value = prog_predefined_value(pp, i);
-            GLint index = glGetUniformLocation(rs->prog, name);
-            rs->pd_map[i].index = index;
-            rs->pd_map[i].value = value;
-            switch (value) {
-
-            case PD_RESOLUTION:
-                glUniform3f(index,
-                            (GLfloat)768.0, // XXX
-                            (GLfloat)128.0, // XXX
-                            (GLfloat)1.0);
-                break;
+    if (index == -1 || pass == PROG_NO_PASS)
+        return;
+    ps->buffer_map[ps->buffer_count].index = index;
+    ps->buffer_map[ps->buffer_count].pass = pass;
+    ps->buffer_count++;
+}
 
-            case PD_PLAY_TIME:
-                clock_gettime(CLOCK_MONOTONIC, &rs->time_zero);
-                glUniform1f(index, 0.0);
-                break;
+static void add_update(pass_state *ps, GLint index, GLenum type, size_t offset)
+{
+    ps->updates[ps->update_count++] = (uniform_update) {
+        .index  = index,
+        .type   = type,
+        .offset = offset,
+    };
+}
 
-            case PD_FRAME:
-                rs->frame_counter = 0;
-                break;
+// Shadertoy's iChannelResolution[n] is the size of iChannel<n>.
+static void set_channel_resolutions(render_state *rs,
+                                    const prog   *pp,
+                                    GLint         index)
+{
+    GLfloat res[4][3] = { { 0.0 } };
+    for (int ch = 0; ch < 4; ch++) {
+        char name[16];
+        snprintf(name, sizeof name, "iChannel%d", ch);
+        GLfloat *r = res[ch];
+        for (size_t i = 0; i < prog_image_count(pp); i++) {
+            if (!strcmp(prog_image_name(pp, i), name)) {
+                r[0] = prog_image_width(pp, i);
+                r[1] = prog_image_height(pp, i);
+            }
+        }
+        for (size_t i = 0; i < prog_predefined_count(pp); i++) {
+            if (strcmp(prog_predefined_name(pp, i), name))
+                continue;
+            switch (prog_predefined_value(pp, i)) {
 
             case PD_NOISE_SMALL:
-                load_texture(rs,
-                             index,
-                             NOISE_SMALL_DIM,
-                             NOISE_SMALL_DIM,
-                             noise_small_data);
+                r[0] = r[1] = NOISE_SMALL_DIM;
                 break;
 
             case PD_NOISE_MEDIUM:
-                load_texture(rs,
-                             index,
-                             NOISE_MEDIUM_DIM,
-                             NOISE_MEDIUM_DIM,
-                             noise_medium_data);
+                r[0] = r[1] = NOISE_MEDIUM_DIM;
+                break;
+
+            case PD_BACK_BUFFER:
+                r[0] = rs->width * rs->supersample;
+                r[1] = rs->height * rs->supersample;
                 break;
 
             default:
                 break;
             }
         }
+        for (size_t i = 0; i < prog_buffer_count(pp); i++) {
+            if (!strcmp(prog_buffer_name(pp, i), name)) {
+                r[0] = rs->width * rs->supersample;
+                r[1] = rs->height * rs->supersample;
+            }
+        }
+        for (size_t i = 0; i < prog_stream_count(pp); i++) {
+            if (!strcmp(prog_stream_name(pp, i), name)) {
+                r[0] = prog_stream_width(pp, i);
+                r[1] = prog_stream_height(pp, i);
+            }
+        }
+        if (r[0])
+            r[2] = 1.0;
     }
-    for (size_t i = 0; i < rs->pd_count; i++) {
-        GLint index = rs->pd_map[i].index;
-        switch (rs->pd_map[i].value) {
+    glUniform3fv(index, 4, res[0]);
+}
+
+static void map_predefineds(render_state *rs, pass_state *ps, const prog *pp)
+{
+    size_t pd_count = prog_predefined_count(pp);
+    for (size_t i = 0; i < pd_count; i++) {
+        const char *name = prog_predefined_name(pp, i);
+        predefined value = prog_predefined_value(pp, i);
+        GLint index = glGetUniformLocation(ps->prog, name);
+        if (index == -1)
+            continue;
+        switch (value) {
+
+        case PD_RESOLUTION:
+            glUniform3f(index,
+                        rs->width * rs->supersample,
+                        rs->height * rs->supersample,
+                        (GLfloat)1.0);
+            break;
+
+        case PD_NOISE_SMALL:
+            load_texture(rs,
+                         ps,
+                         index,
+                         noise_small_key,
+                         NOISE_SMALL_DIM,
+                         NOISE_SMALL_DIM,
+                         noise_small_data);
+            break;
+
+        case PD_NOISE_MEDIUM:
+            load_texture(rs,
+                         ps,
+                         index,
+                         noise_medium_key,
+                         NOISE_MEDIUM_DIM,
+                         NOISE_MEDIUM_DIM,
+                         noise_medium_data);
+            break;
+
+        case PD_BACK_BUFFER:
+            map_buffer(ps, index, prog_pass_count(pp));
+            break;
+
+        case PD_CHANNEL_RESOLUTION:
+            set_channel_resolutions(rs, pp, index);
+            break;
+
+        case PD_MOUSE:
+            // Nobody clicks on the cube.
+            glUniform4f(index, 0.0, 0.0, 0.0, 0.0);
+            break;
 
         case PD_PLAY_TIME:
-            if (!new_prog) {
-                struct timespec now;
-                clock_gettime(CLOCK_MONOTONIC, &now);
-                GLfloat t = (now.tv_nsec - rs->time_zero.tv_nsec) / 1.0e9;
-                t += now.tv_sec - rs->time_zero.tv_sec;
-                glUniform1f(index, t);
-            }
+            add_update(ps, index, GL_FLOAT,
+                       offsetof(frame_uniforms, time));
+            break;
+
+        case PD_RENDER_TIME:
+            add_update(ps, index, GL_FLOAT,
+                       offsetof(frame_uniforms, time_delta));
             break;
 
         case PD_FRAME:
-            glUniform1i(index, rs->frame_counter);
-            rs->frame_counter++;
+            add_update(ps, index, GL_INT,
+                       offsetof(frame_uniforms, frame));
+            break;
+
+        case PD_DATE:
+            add_update(ps, index, GL_FLOAT_VEC4,
+                       offsetof(frame_uniforms, date));
+            rs->uses_date = true;
             break;
 
         default:
@@ -191,6 +401,117 @@ static void update_predefineds(render_state *rs, const prog *pp, bool new_prog)
     }
 }
 
+// Year, month from 0, day from 1, and seconds since midnight.
+static void get_date(GLfloat date[4])
+{
+    struct timespec now;
+    struct tm tm;
+    clock_gettime(CLOCK_REALTIME, &now);
+    localtime_r(&now.tv_sec, &tm);
+    date[0] = tm.tm_year + 1900;
+    date[1] = tm.tm_mon;
+    date[2] = tm.tm_mday;
+    date[3] = tm.tm_hour * 3600 + tm.tm_min * 60 + tm.tm_sec +
+              now.tv_nsec / 1.0e9;
+}
+
+static void update_frame_uniforms(render_state *rs)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    GLfloat t = (now.tv_nsec - rs->time_zero.tv_nsec) / 1.0e9;
+    t += now.tv_sec - rs->time_zero.tv_sec;
+    rs->frame.time_delta = rs->frame.frame ? t - rs->frame.time : 0.0;
+    rs->frame.time = t;
+    if (rs->uses_date)
+        get_date(rs->frame.date);
+}
+
+static void update_uniforms(render_state *rs, pass_state *ps)
+{
+    for (size_t i = 0; i < ps->update_count; i++) {
+        uniform_update *up = &ps->updates[i];
+        const void *value = (const char *)&rs->frame + up->offset;
+        size_t size = up->type == GL_FLOAT_VEC4 ? 4 * sizeof (GLfloat)
+                                                : sizeof (GLfloat);
+        if (up->sent && !memcmp(up->last, value, size))
+            continue;
+        memcpy(up->last, value, size);
+        up->sent = true;
+        switch (up->type) {
+
+        case GL_FLOAT:
+            glUniform1fv(up->index, 1, value);
+            break;
+
+        case GL_INT:
+            glUniform1iv(up->index, 1, value);
+            break;
+
+        case GL_FLOAT_VEC4:
+            glUniform4fv(up->index, 1, value);
+            break;
+        }
+    }
+}
+
+static void map_host_uniforms(pass_state *ps, const prog *pp)
+{
+    size_t count = prog_uniform_count(pp);
+    for (size_t i = 0; i < count; i++) {
+        GLint index = glGetUniformLocation(ps->prog, prog_uniform_name(pp, i));
+        if (index == -1)
+            continue;
+        ps->hosts[ps->host_count++] = (host_map) {
+            .index  = index,
+            .type   = prog_uniform_type(pp, i),
+            .count  = prog_uniform_size(pp, i),
+            .offset = prog_uniform_offset(pp, i),
+        };
+    }
+}
+
+static void update_host_uniforms(render_state *rs, pass_state *ps)
+{
+    if (!rs->host_values || (ps->hosts_sent && !rs->host_changed))
+        return;
+    for (size_t i = 0; i < ps->host_count; i++) {
+        const host_map *hp = &ps->hosts[i];
+        const GLfloat *value = rs->host_values + hp->offset;
+        switch (hp->type) {
+
+        case GL_FLOAT:
+            glUniform1fv(hp->index, hp->count, value);
+            break;
+
+        case GL_FLOAT_VEC2:
+            glUniform2fv(hp->index, hp->count, value);
+            break;
+
+        case GL_FLOAT_VEC3:
+            glUniform3fv(hp->index, hp->count, value);
+            break;
+
+        case GL_FLOAT_VEC4:
+            glUniform4fv(hp->index, hp->count, value);
+            break;
+
+        case GL_FLOAT_MAT2:
+            glUniformMatrix2fv(hp->index, hp->count, GL_FALSE, value);
+            break;
+
+        case GL_FLOAT_MAT3:
+            glUniformMatrix3fv(hp->index, hp->count, GL_FALSE, value);
+            break;
+
+        case GL_FLOAT_MAT4:
+            glUniformMatrix4fv(hp->index, hp->count, GL_FALSE, value);
+            break;
+        }
+    }
+    ps->hosts_sent = true;
+}
+
 #define CHECK_ERROR                                                     \
     ({                                                                  \
         GLenum err = glGetError();                                      \
@@ -200,39 +521,460 @@ static void update_predefineds(render_state *rs, const prog *pp, bool new_prog)
     })
 
 
-void render_frame(render_state *rs, const prog *pp)
+static GLuint compile_shader(GLenum type, const char *source)
 {
-    bool new_prog = rs->prog_id != prog_id(pp);
-    if (new_prog) {
-        rs->prog_id = prog_id(pp);
-        glDeleteProgram(rs->prog);
-        rs->prog = prog_instantiate((prog *)pp, NULL);
-        CHECK_ERROR;
-        glUseProgram(rs->prog);
-        CHECK_ERROR;
-        rs->vert_index = glGetAttribLocation(rs->prog, "vert");
-        CHECK_ERROR;
-        glVertexAttribPointer(rs->vert_index,
+    GLuint s = glCreateShader(type);
+    glShaderSource(s, 1, &source, NULL);
+    glCompileShader(s);
+    GLint ok = GL_FALSE;
+    glGetShaderiv(s, GL_COMPILE_STATUS, &ok);
+    if (!ok) {
+        char log[512] = "";
+        glGetShaderInfoLog(s, sizeof log, NULL, log);
+        fprintf(stderr, "render: downsample shader: %s\n", log);
+        glDeleteShader(s);
+        return 0;
+    }
+    return s;
+}
+
+// Box filter.  When the factor is even, each bilinear tap lands
+// between four texels and averages them, so only a quarter as many
+// taps are needed.
+static GLuint create_downsample_prog(int factor)
+{
+    static const char vert_source[] =
+        "attribute vec3 vert;\n"
+        "void main(void) {\n"
+        "    gl_Position = vec4(vert, 1.0);\n"
+        "}\n";
+    static const char frag_format[] =
+        "#ifdef GL_FRAGMENT_PRECISION_HIGH\n"
+        "precision highp float;\n"
+        "#else\n"
+        "precision mediump float;\n"
+        "#endif\n"
+        "#define FACTOR %d\n"
+        "#define STEP %d\n"
+        "#define TAPS (FACTOR / STEP)\n"
+        "uniform sampler2D src;\n"
+        "uniform vec2 src_size;\n"
+        "void main(void) {\n"
+        "    vec2 base = floor(gl_FragCoord.xy) * float(FACTOR);\n"
+        "    vec4 sum = vec4(0.0);\n"
+        "    for (int j = 0; j < TAPS; j++) {\n"
+        "        for (int i = 0; i < TAPS; i++) {\n"
+        "            vec2 p = base + (vec2(i, j) + 0.5) * float(STEP);\n"
+        "            sum += texture2D(src, p / src_size);\n"
+        "        }\n"
+        "    }\n"
+        "    gl_FragColor = sum / float(TAPS * TAPS);\n"
+        "}\n";
+    char frag_source[sizeof frag_format + 16];
+    snprintf(frag_source, sizeof frag_source,
+             frag_format, factor, factor % 2 ? 1 : 2);
+
+    GLuint v = compile_shader(GL_VERTEX_SHADER, vert_source);
+    GLuint f = compile_shader(GL_FRAGMENT_SHADER, frag_source);
+    GLuint p = 0;
+    if (v && f) {
+        p = glCreateProgram();
+        glAttachShader(p, v);
+        glAttachShader(p, f);
+        glLinkProgram(p);
+        GLint ok = GL_FALSE;
+        glGetProgramiv(p, GL_LINK_STATUS, &ok);
+        if (!ok) {
+            fprintf(stderr, "render: downsample program did not link\n");
+            glDeleteProgram(p);
+            p = 0;
+        }
+    }
+    glDeleteShader(v);
+    glDeleteShader(f);
+    return p;
+}
+
+// Make the filter for an offscreen main pass at `factor'.  Returns
+// false if the GPU can't, and the caller shades once per pixel.
+static bool prepare_downsample(render_state *rs, int factor)
+{
+    if (rs->down_factor == factor)
+        return true;
+
+    GLint max_size = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+    GLsizei ss_width = rs->width * factor;
+    GLsizei ss_height = rs->height * factor;
+    if (ss_width > max_size || ss_height > max_size) {
+        fprintf(stderr, "render: can't supersample %dx\n", factor);
+        return false;
+    }
+
+    GLuint down_prog = create_downsample_prog(factor);
+    if (!down_prog)
+        return false;
+    glDeleteProgram(rs->down_prog);
+    rs->down_prog = down_prog;
+    rs->down_vert_index = glGetAttribLocation(down_prog, "vert");
+
+    glUseProgram(down_prog);
+    glUniform1i(glGetUniformLocation(down_prog, "src"), rs->down_unit);
+    glUniform2f(glGetUniformLocation(down_prog, "src_size"),
+                ss_width, ss_height);
+    rs->down_factor = factor;
+    return true;
+}
+
+// Passes draw at the supersampled size.
+static bool create_buffers(render_state *rs, pass_state *ps)
+{
+    GLsizei width = rs->width * rs->supersample;
+    GLsizei height = rs->height * rs->supersample;
+    glGenTextures(2, ps->color);
+    glGenFramebuffers(2, ps->framebuffer);
+    GLenum status = GL_FRAMEBUFFER_COMPLETE;
+    for (int i = 0; i < 2 && status == GL_FRAMEBUFFER_COMPLETE; i++) {
+        glBindTexture(GL_TEXTURE_2D, ps->color[i]);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexImage2D(GL_TEXTURE_2D,
+                     0,         // level
+                     GL_RGBA,
+                     width,
+                     height,
+                     0,         // border, must be zero
+                     GL_RGBA,
+                     GL_UNSIGNED_BYTE,
+                     NULL);
+        glBindFramebuffer(GL_FRAMEBUFFER, ps->framebuffer[i]);
+        glFramebufferTexture2D(GL_FRAMEBUFFER,
+                               GL_COLOR_ATTACHMENT0,
+                               GL_TEXTURE_2D,
+                               ps->color[i],
+                               0);
+        status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+        if (status == GL_FRAMEBUFFER_COMPLETE)
+            glClear(GL_COLOR_BUFFER_BIT);
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, rs->target);
+    if (status != GL_FRAMEBUFFER_COMPLETE) {
+        fprintf(stderr, "render: pass framebuffer incomplete\n");
+        glDeleteFramebuffers(2, ps->framebuffer);
+        glDeleteTextures(2, ps->color);
+        ps->framebuffer[0] = ps->framebuffer[1] = 0;
+        ps->color[0] = ps->color[1] = 0;
+        return false;
+    }
+    return true;
+}
+
+static bool init_pass(render_state *rs,
+                      const prog   *pp,
+                      size_t        index,
+                      pass_state   *ps,
+                      bool          offscreen)
+{
+    ps->prog = prog_instantiate_pass(pp, index, NULL);
+    if (!ps->prog)
+        return false;
+    glUseProgram(ps->prog);
+    ps->vert_index = glGetAttribLocation(ps->prog, "vert");
+
+    size_t im_count = prog_image_count(pp);
+    size_t pd_count = prog_predefined_count(pp);
+    size_t buf_count = prog_buffer_count(pp);
+    size_t host_count = prog_uniform_count(pp);
+    size_t stream_count = prog_stream_count(pp);
+    ps->textures = calloc(im_count + pd_count, sizeof *ps->textures);
+    ps->updates = calloc(pd_count, sizeof *ps->updates);
+    ps->hosts = calloc(host_count, sizeof *ps->hosts);
+    ps->buffer_map = calloc(buf_count + pd_count, sizeof *ps->buffer_map);
+    ps->stream_map = calloc(stream_count, sizeof *ps->stream_map);
+    if (!ps->textures || !ps->updates || !ps->buffer_map ||
+        (host_count && !ps->hosts) || (stream_count && !ps->stream_map)) {
+        progcache_release(ps->prog);
+        ps->prog = 0;
+        return false;
+    }
+
+    load_images(rs, ps, pp);
+    map_predefineds(rs, ps, pp);
+    map_host_uniforms(ps, pp);
+    for (size_t i = 0; i < buf_count; i++) {
+        GLint index = glGetUniformLocation(ps->prog, prog_buffer_name(pp, i));
+        map_buffer(ps, index, prog_buffer_pass(pp, i));
+    }
+    for (size_t i = 0; i < ps->buffer_count; i++)
+        glUniform1i(ps->buffer_map[i].index, ps->texture_count + i);
+    for (size_t i = 0; i < stream_count; i++) {
+        GLint index = glGetUniformLocation(ps->prog, prog_stream_name(pp, i));
+        if (index == -1)
+            continue;
+        GLint unit = ps->texture_count + ps->buffer_count + ps->stream_count;
+        ps->stream_map[ps->stream_count].index = index;
+        ps->stream_map[ps->stream_count].stream = i;
+        ps->stream_count++;
+        glUniform1i(index, unit);
+    }
+
+    ps->offscreen = offscreen;
+    if (offscreen && !create_buffers(rs, ps))
+        return false;
+    return true;
+}
+
+// Stream textures are allocated once per prog and updated in place.
+static void create_streams(render_state *rs, const prog *pp)
+{
+    glDeleteTextures(rs->stream_count, rs->streams);
+    free(rs->streams);
+    rs->stream_count = prog_stream_count(pp);
+    rs->streams = calloc(rs->stream_count, sizeof *rs->streams);
+    if (!rs->streams) {
+        rs->stream_count = 0;
+        return;
+    }
+    glGenTextures(rs->stream_count, rs->streams);
+    for (size_t i = 0; i < rs->stream_count; i++) {
+        glBindTexture(GL_TEXTURE_2D, rs->streams[i]);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexImage2D(GL_TEXTURE_2D,
+                     0,         // level
+                     GL_RGBA,
+                     prog_stream_width(pp, i),
+                     prog_stream_height(pp, i),
+                     0,         // border, must be zero
+                     GL_RGBA,
+                     GL_UNSIGNED_BYTE,
+                     NULL);
+    }
+}
+
+// Upload the newest frame of each stream, at most once a frame.
+// After a switch, also upload the frame the prog showed last time.
+static void update_streams(render_state *rs, const prog *pp, bool all)
+{
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    for (size_t i = 0; i < rs->stream_count; i++) {
+        bool fresh;
+        const uint8_t *data = prog_stream_frame(pp, i, &fresh);
+        if (!data || !(fresh || all))
+            continue;
+        glBindTexture(GL_TEXTURE_2D, rs->streams[i]);
+        glTexSubImage2D(GL_TEXTURE_2D,
+                        0,      // level
+                        0, 0,   // offset
+                        prog_stream_width(pp, i),
+                        prog_stream_height(pp, i),
+                        GL_RGBA,
+                        GL_UNSIGNED_BYTE,
+                        data);
+    }
+}
+
+static bool uses_back_buffer(const prog *pp)
+{
+    size_t pd_count = prog_predefined_count(pp);
+    for (size_t i = 0; i < pd_count; i++)
+        if (prog_predefined_value(pp, i) == PD_BACK_BUFFER)
+            return true;
+    return false;
+}
+
+// Images and noise, buffers and streams share the units below
+// down_unit.
+static bool pass_units_fit(const render_state *rs, const pass_state *ps)
+{
+    size_t units = ps->texture_count + ps->buffer_count + ps->stream_count;
+    return units <= (size_t)rs->down_unit;
+}
+
+// Build the new prog's passes before releasing the old ones, so
+// textures they share stay loaded.  A prog with more samplers in a
+// pass than there are units draws nothing.
+static void switch_prog(render_state *rs, const prog *pp)
+{
+    pass_state *old_passes = rs->passes;
+    size_t old_pass_count = rs->pass_count;
+
+    rs->prog_id = prog_id(pp);
+    rs->supersample = prog_supersample(pp);
+    rs->uses_date = false;
+    bool feedback = uses_back_buffer(pp);
+    bool main_offscreen = rs->supersample > 1 || feedback;
+    if (main_offscreen && !prepare_downsample(rs, rs->supersample)) {
+        rs->supersample = 1;
+        main_offscreen = feedback && prepare_downsample(rs, 1);
+    }
+
+    size_t pass_count = prog_pass_count(pp) + 1;
+    rs->passes = calloc(pass_count, sizeof *rs->passes);
+    rs->pass_count = rs->passes ? pass_count : 0;
+    bool units_fit = true;
+    for (size_t i = 0; i < rs->pass_count; i++) {
+        bool is_main = i + 1 == pass_count;
+        pass_state *ps = &rs->passes[i];
+        bool offscreen = !is_main || main_offscreen;
+        if (!init_pass(rs, pp, i, ps, offscreen) && is_main && ps->prog)
+            ps->offscreen = false;      // draw straight to the LEDs
+        units_fit = units_fit && pass_units_fit(rs, ps);
+    }
+    if (!units_fit) {
+        fprintf(stderr, "render: a pass samples more than %d textures\n",
+                rs->down_unit);
+        destroy_passes(rs->passes, rs->pass_count);
+        rs->passes = NULL;
+        rs->pass_count = 0;
+    }
+    destroy_passes(old_passes, old_pass_count);
+    create_streams(rs, pp);
+
+    clock_gettime(CLOCK_MONOTONIC, &rs->time_zero);
+    rs->frame.frame = 0;
+}
+
+static void draw_pass(render_state *rs, pass_state *ps)
+{
+    if (!ps->prog || (ps->offscreen && !ps->framebuffer[0]))
+        return;
+    if (ps->offscreen) {
+        glBindFramebuffer(GL_FRAMEBUFFER, ps->framebuffer[!ps->front]);
+        glViewport(0, 0,
+                   rs->width * rs->supersample,
+                   rs->height * rs->supersample);
+    } else {
+        glBindFramebuffer(GL_FRAMEBUFFER, rs->target);
+        glViewport(0, 0, rs->width, rs->height);
+    }
+    glUseProgram(ps->prog);
+    glVertexAttribPointer(ps->vert_index,
+                          3,
+                          GL_FLOAT,
+                          GL_FALSE,
+                          0,
+                          vertices);
+    glEnableVertexAttribArray(ps->vert_index);
+
+    GLint unit = 0;
+    for (size_t i = 0; i < ps->texture_count; i++) {
+        glActiveTexture(GL_TEXTURE0 + unit++);
+        glBindTexture(GL_TEXTURE_2D, ps->textures[i]);
+    }
+    for (size_t i = 0; i < ps->buffer_count; i++) {
+        const pass_state *src = &rs->passes[ps->buffer_map[i].pass];
+        glActiveTexture(GL_TEXTURE0 + unit++);
+        glBindTexture(GL_TEXTURE_2D, src->color[src->front]);
+    }
+    for (size_t i = 0; i < ps->stream_count; i++) {
+        glActiveTexture(GL_TEXTURE0 + unit++);
+        glBindTexture(GL_TEXTURE_2D, rs->streams[ps->stream_map[i].stream]);
+    }
+    update_uniforms(rs, ps);
+    update_host_uniforms(rs, ps);
+
+    glClear(GL_COLOR_BUFFER_BIT);
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, vertex_count);
+    if (ps->offscreen)
+        ps->front = !ps->front;
+}
+
+static void downsample(render_state *rs, GLuint texture)
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, rs->target);
+    glViewport(0, 0, rs->width, rs->height);
+    glUseProgram(rs->down_prog);
+    glActiveTexture(GL_TEXTURE0 + rs->down_unit);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glVertexAttribPointer(rs->down_vert_index,
+                          3,
+                          GL_FLOAT,
+                          GL_FALSE,
+                          0,
+                          vertices);
+    glEnableVertexAttribArray(rs->down_vert_index);
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, vertex_count);
+}
+
+// Drivers that generate code at the first draw with a program would
+// otherwise do it on the render thread, so draw one pixel offscreen
+// here.  The target is RGBA like the render thread's, which lets the
+// driver reuse that code on a sharing context.
+bool render_prepare(const prog *pp)
+{
+    GLuint texture, framebuffer;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0,
+                 GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glGenFramebuffers(1, &framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                           GL_TEXTURE_2D, texture, 0);
+
+    glViewport(0, 0, 1, 1);
+    bool ok = true;
+    for (size_t i = 0; i <= prog_pass_count(pp); i++) {
+        GLuint program = prog_instantiate_pass(pp, i, NULL);
+        if (!program) {
+            ok = false;
+            break;
+        }
+        glUseProgram(program);
+        GLint vert_index = glGetAttribLocation(program, "vert");
+        glVertexAttribPointer(vert_index,
                               3,
                               GL_FLOAT,
                               GL_FALSE,
                               0,
                               vertices);
-        CHECK_ERROR;
-        glEnableVertexAttribArray(rs->vert_index);
-        CHECK_ERROR;
-        load_images(rs, pp);
-        CHECK_ERROR;
+        glEnableVertexAttribArray(vert_index);
+        glDrawArrays(GL_TRIANGLE_STRIP, 0, vertex_count);
+        progcache_release(program);
     }
+    glFinish();
 
-    CHECK_ERROR;
-    update_predefineds(rs, pp, new_prog);
-    CHECK_ERROR;
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteFramebuffers(1, &framebuffer);
+    glDeleteTextures(1, &texture);
+    return ok;
+}
 
-    glClear(GL_COLOR_BUFFER_BIT);
+void render_frame(render_state *rs, const prog *pp)
+{
+    bool switched = rs->prog_id != prog_id(pp);
+    if (switched)
+        switch_prog(rs, pp);
     CHECK_ERROR;
-    glDrawArrays(GL_TRIANGLE_STRIP, rs->vert_index, vertex_count);
+
+    update_streams(rs, pp, switched);
     CHECK_ERROR;
 
+    update_frame_uniforms(rs);
+    rs->host_values = prog_uniform_values(pp, &rs->host_changed);
+    if (!rs->pass_count) {
+        glBindFramebuffer(GL_FRAMEBUFFER, rs->target);
+        glClear(GL_COLOR_BUFFER_BIT);
+    }
+    for (size_t i = 0; i < rs->pass_count; i++) {
+        draw_pass(rs, &rs->passes[i]);
+        CHECK_ERROR;
+    }
+    if (rs->pass_count) {
+        pass_state *last = &rs->passes[rs->pass_count - 1];
+        if (last->offscreen && last->framebuffer[0]) {
+            downsample(rs, last->color[last->front]);
+            CHECK_ERROR;
+        }
+    }
+    rs->frame.frame++;
+
     EGL_swap_buffers(rs->egl);
 }
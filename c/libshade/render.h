@@ -2,12 +2,22 @@
 #define RENDER_included
 
 #include "bcm.h"
+#include "egl.h"
 #include "prog.h"
 
 typedef struct render_state render_state;
 
-extern render_state *render_init(const bcm_context);
+// The render context shares GL objects with `share'.
+extern render_state *render_init(const bcm_context, EGL_context *share);
 extern void          render_deinit(render_state *);
 extern void          render_frame(render_state *, const prog *);
 
+// Get a program ready to draw, on any context that shares with the
+// render thread's.
+extern bool          render_prepare(const prog *);
+
+// The RGBA pixels of PD_NOISE_SMALL or PD_NOISE_MEDIUM, which are
+// dim x dim and the same every run.
+extern const uint8_t *render_noise(predefined, size_t *dim);
+
 #endif /* !RENDER_included */
@@ -0,0 +1,276 @@
+#define _GNU_SOURCE
+#include "ring.h"
+
+#include <assert.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define CACHE_LINE_SIZE 64
+#define SPIN_COUNT      200
+
+#define MAILBOX_SLOTS   3
+#define MAILBOX_FRESH   0x80000000u // set while the mailbox slot is unread
+
+// head and tail count modulo 2 * size so that a full ring and an
+// empty ring are distinguishable, just like `queue'.  Each index
+// lives on its own cache line together with the fields that only
+// its writer touches often.
+
+// A mailbox ring is a triple buffer.  The producer owns one slot
+// (back), the consumer owns one (front), and the third sits in
+// `tail', tagged MAILBOX_FRESH if it holds a frame the consumer has
+// not seen.  Both sides trade their slot for the mailbox slot with
+// an atomic exchange.
+
+struct ring {
+    uint32_t size;
+    uint32_t wrap;
+    uint32_t spin_count;        // zero on a uniprocessor
+    bool     is_mailbox;
+    _Atomic bool interrupted;
+
+    // written by the producer
+    _Alignas(CACHE_LINE_SIZE)
+    _Atomic uint32_t tail;         // or mailbox slot
+    _Atomic uint32_t tail_waiters; // consumer is parked on tail
+    uint32_t         head_cache;   // producer's last look at head
+    uint32_t         back;         // mailbox: producer's slot
+    _Atomic uint64_t dropped;      // mailbox: frames never consumed
+
+    // written by the consumer
+    _Alignas(CACHE_LINE_SIZE)
+    _Atomic uint32_t head;
+    _Atomic uint32_t head_waiters; // producer is parked on head
+    uint32_t         next;         // next full slot to hand out
+    uint32_t         tail_cache;   // consumer's last look at tail
+    uint32_t         front;        // mailbox: consumer's slot
+};
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__arm__) || defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+static void futex_wait(_Atomic uint32_t *word, uint32_t value)
+{
+    (void)syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+static void futex_wake(_Atomic uint32_t *word)
+{
+    (void)syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+static void futex_wake_all(_Atomic uint32_t *word)
+{
+    (void)syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+// Wait until *word != value.  Spin first, since the peer is usually
+// only a few hundred nanoseconds away (unless there is no other CPU
+// for it to run on).  Then announce ourselves in *waiters and sleep.
+// The sequentially consistent increment here and the sequentially
+// consistent store in the peer's publish() guarantee that at least
+// one side sees the other.
+//
+// Returns value unchanged if the ring is interrupted.
+static uint32_t await_change(const ring       *r,
+                             _Atomic uint32_t *word,
+                             _Atomic uint32_t *waiters,
+                             uint32_t          value)
+{
+    uint32_t now;
+    for (uint32_t i = 0; i < r->spin_count; i++) {
+        now = atomic_load_explicit(word, memory_order_acquire);
+        if (now != value)
+            return now;
+        cpu_relax();
+    }
+    atomic_fetch_add(waiters, 1);
+    while ((now = atomic_load(word)) == value &&
+           !atomic_load(&r->interrupted))
+        futex_wait(word, value);
+    atomic_fetch_sub(waiters, 1);
+    return now;
+}
+
+static void publish(_Atomic uint32_t *word,
+                    _Atomic uint32_t *waiters,
+                    uint32_t          value)
+{
+    atomic_store(word, value);
+    if (atomic_load(waiters))
+        futex_wake(word);
+}
+
+static bool ring_is_full(const ring *r, uint32_t head, uint32_t tail)
+{
+    return (r->wrap + tail - head) % r->wrap == r->size;
+}
+
+ring *create_ring(size_t size)
+{
+    assert(0 < size && size <= UINT32_MAX / 2);
+    void *mem;
+    if (posix_memalign(&mem, CACHE_LINE_SIZE, sizeof (ring)))
+        return NULL;
+    ring *r = mem;
+    memset(r, 0, sizeof *r);
+    r->size = size;
+    r->wrap = 2 * size;
+    r->spin_count = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SPIN_COUNT : 0;
+    return r;
+}
+
+ring *create_mailbox_ring(void)
+{
+    ring *r = create_ring(MAILBOX_SLOTS);
+    if (r) {
+        r->is_mailbox = true;
+        r->front = 0;
+        r->tail = 1;
+        r->back = 2;
+    }
+    return r;
+}
+
+void destroy_ring(ring *r)
+{
+    free(r);
+}
+
+size_t ring_slot_count(const ring *r)
+{
+    return r->size;
+}
+
+size_t ring_hold_limit(const ring *r)
+{
+    return r->is_mailbox ? 1 : r->size;
+}
+
+// A racy but consistent-enough count of full slots, for telemetry.
+size_t ring_occupancy(const ring *r)
+{
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    if (r->is_mailbox)
+        return (tail & MAILBOX_FRESH) != 0;
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    return (r->wrap + tail - head) % r->wrap;
+}
+
+uint64_t ring_dropped_count(const ring *r)
+{
+    return atomic_load_explicit(&r->dropped, memory_order_relaxed);
+}
+
+size_t ring_acquire_empty(ring *r)
+{
+    if (r->is_mailbox)
+        return r->back;
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    while (ring_is_full(r, r->head_cache, tail)) {
+        uint32_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+        if (head == r->head_cache) {
+            head = await_change(r, &r->head, &r->head_waiters, head);
+            if (head == r->head_cache)
+                return RING_INTERRUPTED;
+        }
+        r->head_cache = head;
+    }
+    return tail % r->size;
+}
+
+void ring_release_full(ring *r)
+{
+    if (r->is_mailbox) {
+        uint32_t old = atomic_exchange(&r->tail, r->back | MAILBOX_FRESH);
+        if (atomic_load(&r->tail_waiters))
+            futex_wake(&r->tail);
+        if (old & MAILBOX_FRESH)
+            atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+        r->back = old & ~MAILBOX_FRESH;
+        return;
+    }
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    publish(&r->tail, &r->tail_waiters, (tail + 1) % r->wrap);
+}
+
+size_t ring_acquire_full(ring *r)
+{
+    if (r->is_mailbox) {
+        uint32_t box = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        while (!(box & MAILBOX_FRESH)) {
+            uint32_t old = box;
+            box = await_change(r, &r->tail, &r->tail_waiters, box);
+            if (box == old)
+                return RING_INTERRUPTED;
+        }
+        uint32_t old = atomic_exchange(&r->tail, r->front);
+        r->front = old & ~MAILBOX_FRESH;
+        return r->front;
+    }
+    uint32_t next = r->next;
+    while (next == r->tail_cache) {
+        uint32_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+        if (tail == next) {
+            tail = await_change(r, &r->tail, &r->tail_waiters, tail);
+            if (tail == next)
+                return RING_INTERRUPTED;
+        }
+        r->tail_cache = tail;
+    }
+    r->next = (next + 1) % r->wrap;
+    return next % r->size;
+}
+
+size_t ring_poll_full(ring *r)
+{
+    assert(r->is_mailbox);
+    uint32_t box = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    if (!(box & MAILBOX_FRESH))
+        return RING_EMPTY;
+    uint32_t old = atomic_exchange(&r->tail, r->front);
+    r->front = old & ~MAILBOX_FRESH;
+    return r->front;
+}
+
+void ring_release_empty(ring *r)
+{
+    if (r->is_mailbox)
+        return;                 // front stays ours until the next swap
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    publish(&r->head, &r->head_waiters, (head + 1) % r->wrap);
+}
+
+// A waiter can check the flag just before we set it and then sleep
+// through the wakeup, so keep waking until no one is parked.  The
+// waiter's sequentially consistent increment comes before its check
+// of the flag: either we see it in *waiters here, or it sees the
+// flag and never sleeps.
+void ring_interrupt(ring *r)
+{
+    atomic_store(&r->interrupted, true);
+    while (atomic_load(&r->tail_waiters) || atomic_load(&r->head_waiters)) {
+        futex_wake_all(&r->tail);
+        futex_wake_all(&r->head);
+        sched_yield();
+    }
+}
+
+void ring_resume(ring *r)
+{
+    atomic_store(&r->interrupted, false);
+}
@@ -0,0 +1,52 @@
+#ifndef RING_included
+#define RING_included
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RING_INTERRUPTED SIZE_MAX
+#define RING_EMPTY       (SIZE_MAX - 1)
+
+// A ring is a lock-free single-producer/single-consumer queue with
+// the same acquire/release protocol as `queue'.  Exactly one thread
+// may call the producer side (acquire_empty/release_full) and
+// exactly one thread the consumer side (acquire_full/release_empty).
+// Threads spin briefly and then sleep on a futex only when the ring
+// is actually full or empty.
+//
+// The consumer may acquire several full slots before releasing
+// any, up to ring_hold_limit.  It releases them in the order it
+// acquired them.
+//
+// A mailbox ring has three slots and never blocks the producer.
+// Each release_full replaces any frame the consumer has not yet
+// taken, and acquire_full always returns the newest one.  Its
+// consumer may hold only one slot.  ring_poll_full is acquire_full
+// that returns RING_EMPTY instead of waiting for a new frame.
+//
+// ring_interrupt wakes any thread blocked in an acquire, and until
+// ring_resume, acquires that would block return RING_INTERRUPTED
+// instead.  An interrupted acquire takes no slot.  ring_interrupt
+// returns once no thread is left sleeping in an acquire.
+
+typedef struct ring ring;
+
+extern ring    *create_ring(size_t size);
+extern ring    *create_mailbox_ring(void);
+extern void     destroy_ring(ring *r);
+
+extern size_t   ring_slot_count(const ring *r);
+extern size_t   ring_hold_limit(const ring *r);
+extern size_t   ring_occupancy(const ring *r);
+extern uint64_t ring_dropped_count(const ring *r);
+
+extern size_t   ring_acquire_empty(ring *r);
+extern void     ring_release_full(ring *r);
+extern size_t   ring_acquire_full(ring *r);
+extern void     ring_release_empty(ring *r);
+extern size_t   ring_poll_full(ring *r);
+
+extern void     ring_interrupt(ring *r);
+extern void     ring_resume(ring *r);
+
+#endif /* !RING_included */
@@ -2,11 +2,15 @@
 
 #include <stddef.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "bcm.h"
 #include "egl.h"
 #include "exec.h"
 #include "prog.h"
+#include "progcache.h"
+#include "texcache.h"
+#include "transport.h"
 
 #define EXPORT __attribute__((visibility("default")))
 
@@ -22,31 +26,97 @@ EXPORT const int SHD_PREDEFINED_NOISE_MEDIUM_VALUE =
                      SHD_PREDEFINED_NOISE_MEDIUM;
 EXPORT const int SHD_PREDEFINED_BACK_BUFFER_VALUE = SHD_PREDEFINED_BACK_BUFFER;
 EXPORT const int SHD_PREDEFINED_IMU_VALUE = SHD_PREDEFINED_IMU;
+EXPORT const int SHD_PREDEFINED_DATE_VALUE = SHD_PREDEFINED_DATE;
+EXPORT const int SHD_PREDEFINED_MOUSE_VALUE = SHD_PREDEFINED_MOUSE;
+EXPORT const int SHD_PREDEFINED_CHANNEL_RESOLUTION_VALUE =
+                     SHD_PREDEFINED_CHANNEL_RESOLUTION;
+
+EXPORT const int SHD_UNIFORM_FLOAT_VALUE = SHD_UNIFORM_FLOAT;
+EXPORT const int SHD_UNIFORM_VEC2_VALUE = SHD_UNIFORM_VEC2;
+EXPORT const int SHD_UNIFORM_VEC3_VALUE = SHD_UNIFORM_VEC3;
+EXPORT const int SHD_UNIFORM_VEC4_VALUE = SHD_UNIFORM_VEC4;
+EXPORT const int SHD_UNIFORM_MAT2_VALUE = SHD_UNIFORM_MAT2;
+EXPORT const int SHD_UNIFORM_MAT3_VALUE = SHD_UNIFORM_MAT3;
+EXPORT const int SHD_UNIFORM_MAT4_VALUE = SHD_UNIFORM_MAT4;
+
+EXPORT const int SHD_PIPELINE_QUEUE_VALUE = SHD_PIPELINE_QUEUE;
+EXPORT const int SHD_PIPELINE_MAILBOX_VALUE = SHD_PIPELINE_MAILBOX;
+
+EXPORT const int SHD_READBACK_AUTO_VALUE = SHD_READBACK_AUTO;
+EXPORT const int SHD_READBACK_COPY_VALUE = SHD_READBACK_COPY;
+EXPORT const int SHD_READBACK_DIRECT_VALUE = SHD_READBACK_DIRECT;
+
+EXPORT const int SHD_VSYNC_OFF_VALUE = SHD_VSYNC_OFF;
+EXPORT const int SHD_VSYNC_POLL_VALUE = SHD_VSYNC_POLL;
+EXPORT const int SHD_VSYNC_PIN_VALUE = SHD_VSYNC_PIN;
 
 static bcm_context  *the_bcm;
 static EGL_context  *the_EGL;
 static LEDs_context *the_LEDs;
 static exec         *the_exec;
 static char         *the_info_log;
+static char         *the_transport_spec;
+static const char   *the_last_error;
 
 // Should pass in sizes?
 
-EXPORT void shd_init(int LEDs_width, int LEDs_height)
+EXPORT bool shd_set_transport(const char *spec)
+{
+    char *copy = NULL;
+    if (spec && !(copy = strdup(spec)))
+        return false;
+    free(the_transport_spec);
+    the_transport_spec = copy;
+    return true;
+}
+
+EXPORT void shd_set_program_cache(const char *dir)
+{
+    progcache_set_dir(dir);
+}
+
+EXPORT bool shd_init(int LEDs_width, int LEDs_height)
 {
-    the_bcm = init_bcm();
+    the_bcm = init_bcm(LEDs_width, LEDs_height);
+    if (!the_bcm) {
+        the_last_error = bcm_last_error();
+        goto FAIL;
+    }
     uint32_t bcm_surface    = bcm_get_surface(the_bcm);
     uint32_t surface_width  = bcm_get_surface_width(the_bcm);
     uint32_t surface_height = bcm_get_surface_height(the_bcm);
-    uint32_t pixels_width   = surface_width / 2;
-    uint32_t pixels_height  = surface_height / 2;
+    uint32_t pixels_width   = bcm_get_framebuffer_width(the_bcm);
+    uint32_t pixels_height  = bcm_get_framebuffer_height(the_bcm);
     uint32_t pixels_offset  = (pixels_height - LEDs_height) * pixels_width;
-    the_EGL = init_EGL(bcm_surface, surface_width, surface_height);
-    the_LEDs = init_LEDs(LEDs_width,
+    // Without a GPU, CPU programs still draw.
+    the_EGL = init_EGL(bcm_surface, surface_width, surface_height, NULL);
+    transport *tp = open_transport(the_transport_spec,
+                                   LEDs_width,
+                                   LEDs_height);
+    if (!tp) {
+        the_last_error = transport_last_error();
+        goto FAIL;
+    }
+    the_LEDs = init_LEDs(tp,
+                         LEDs_width,
                          LEDs_height,
                          pixels_width,
                          pixels_height,
                          pixels_offset);
-    the_exec = create_exec(the_bcm, the_LEDs);
+    if (!the_LEDs) {
+        the_last_error = transport_last_error();
+        goto FAIL;
+    }
+    the_exec = create_exec(the_bcm, the_EGL, the_LEDs);
+    if (!the_exec) {
+        the_last_error = "can't start the render pipeline";
+        goto FAIL;
+    }
+    return true;
+
+FAIL:
+    shd_deinit();
+    return false;
 }
 
 EXPORT void shd_deinit(void)
@@ -62,6 +132,8 @@ EXPORT void shd_deinit(void)
         the_LEDs = NULL;
     }
     if (the_EGL) {
+        progcache_clear();
+        texcache_clear();
         deinit_EGL(the_EGL);
         the_EGL = NULL;
     }
@@ -73,6 +145,11 @@ EXPORT void shd_deinit(void)
     the_info_log = NULL;
 }
 
+EXPORT const char *shd_last_error(void)
+{
+    return the_last_error;
+}
+
 EXPORT void shd_start(void)
 {
     exec_start(the_exec);
@@ -93,6 +170,167 @@ EXPORT void shd_use_prog(shd_prog *pp)
     exec_use_prog(the_exec, pp);
 }
 
+EXPORT void shd_set_background_compile(bool enabled)
+{
+    exec_set_background_compile(the_exec, enabled);
+}
+
+EXPORT const shd_prog *shd_current_prog(uint64_t *switch_count)
+{
+    return exec_current_prog(the_exec, switch_count);
+}
+
+EXPORT bool shd_set_pipeline_policy(shd_pipeline_policy policy, size_t depth)
+{
+    pipeline_policy pp;
+    switch (policy) {
+
+    case SHD_PIPELINE_QUEUE:
+        pp = PP_QUEUE;
+        break;
+
+    case SHD_PIPELINE_MAILBOX:
+        pp = PP_MAILBOX;
+        break;
+
+    default:
+        return false;
+    }
+    return exec_set_pipeline_policy(the_exec, pp, depth);
+}
+
+EXPORT bool shd_set_readback_mode(shd_readback_mode mode)
+{
+    readback_mode rm;
+    switch (mode) {
+
+    case SHD_READBACK_AUTO:
+        rm = RM_AUTO;
+        break;
+
+    case SHD_READBACK_COPY:
+        rm = RM_COPY;
+        break;
+
+    case SHD_READBACK_DIRECT:
+        rm = RM_DIRECT;
+        break;
+
+    default:
+        return false;
+    }
+    return exec_set_readback_mode(the_exec, rm);
+}
+
+EXPORT bool shd_readback_is_direct(void)
+{
+    return exec_is_direct(the_exec);
+}
+
+EXPORT bool shd_set_color_correction(bool  enabled,
+                                     float gamma,
+                                     float red_gain,
+                                     float green_gain,
+                                     float blue_gain)
+{
+    const float gain[3] = { red_gain, green_gain, blue_gain };
+    return exec_set_color(the_exec, enabled, gamma, gain);
+}
+
+EXPORT bool shd_set_power_limit(bool  enabled,
+                                float budget_amps,
+                                float red_amps,
+                                float green_amps,
+                                float blue_amps)
+{
+    const float full_scale[3] = { red_amps, green_amps, blue_amps };
+    return exec_set_power_limit(the_exec, enabled, budget_amps, full_scale);
+}
+
+EXPORT bool shd_set_usb_transfers(size_t count)
+{
+    return LEDs_set_max_transfers(the_LEDs, count);
+}
+
+EXPORT bool shd_set_vsync_mode(shd_vsync_mode mode)
+{
+    LEDs_vsync_mode lvs;
+    switch (mode) {
+
+    case SHD_VSYNC_OFF:
+        lvs = LVS_OFF;
+        break;
+
+    case SHD_VSYNC_POLL:
+        lvs = LVS_POLL;
+        break;
+
+    case SHD_VSYNC_PIN:
+        lvs = LVS_PIN;
+        break;
+
+    default:
+        return false;
+    }
+    return LEDs_set_vsync_mode(the_LEDs, lvs);
+}
+
+EXPORT uint64_t shd_frames_shown(void)
+{
+    return exec_frames_shown(the_exec);
+}
+
+EXPORT uint64_t shd_frames_dropped(void)
+{
+    return exec_frames_dropped(the_exec);
+}
+
+static void copy_histogram(shd_histogram *dst, const hist_summary *src)
+{
+    dst->count = src->count;
+    dst->mean  = src->mean;
+    dst->p50   = src->p50;
+    dst->p90   = src->p90;
+    dst->p99   = src->p99;
+    dst->p999  = src->p999;
+    dst->max   = src->max;
+}
+
+EXPORT void shd_get_stats(shd_stats *stats)
+{
+    exec_stats es;
+    exec_get_stats(the_exec, &es);
+    copy_histogram(&stats->render_time,       &es.metrics[EM_RENDER]);
+    copy_histogram(&stats->readback_time,     &es.metrics[EM_READBACK]);
+    copy_histogram(&stats->encode_time,       &es.metrics[EM_ENCODE]);
+    copy_histogram(&stats->output_time,       &es.metrics[EM_OUTPUT]);
+    copy_histogram(&stats->vsync_time,        &es.metrics[EM_VSYNC]);
+    copy_histogram(&stats->frame_time,        &es.metrics[EM_FRAME]);
+    copy_histogram(&stats->framebuffer_queue, &es.metrics[EM_FB_QUEUE]);
+    copy_histogram(&stats->cmdbuffer_queue,   &es.metrics[EM_CB_QUEUE]);
+    copy_histogram(&stats->cmd_bytes,         &es.metrics[EM_CMD_BYTES]);
+    stats->frames_shown   = es.frames_shown;
+    stats->frames_dropped = es.frames_dropped;
+    stats->output_errors  = es.output_errors;
+    stats->vsync_missed   = es.vsync_missed;
+    stats->render_errors  = es.render_errors;
+}
+
+EXPORT void shd_reset_stats(void)
+{
+    exec_reset_stats(the_exec);
+}
+
+EXPORT void shd_set_delta_updates(bool enabled)
+{
+    exec_set_delta(the_exec, enabled);
+}
+
+EXPORT bool shd_set_cpu_cores(const int *cores, size_t count)
+{
+    return exec_set_cpu_cores(the_exec, cores, count);
+}
+
 EXPORT shd_prog *shd_create_prog(void)
 {
     return create_prog();
@@ -100,6 +338,8 @@ EXPORT shd_prog *shd_create_prog(void)
 
 EXPORT void shd_destroy_prog(shd_prog *prog)
 {
+    if (the_exec)
+        exec_forget_prog(the_exec, prog);
     destroy_prog(prog);
 }
 
@@ -113,6 +353,16 @@ EXPORT bool shd_prog_is_okay(const shd_prog *prog, char **info_log)
     return ok;
 }
 
+EXPORT bool shd_prog_use_cpu(shd_prog *prog, char **info_log)
+{
+    free(the_info_log);
+    the_info_log = NULL;
+    bool ok = prog_use_cpu(prog, &the_info_log);
+    if (!ok && info_log)
+        *info_log = the_info_log;
+    return ok;
+}
+
 EXPORT bool shd_prog_attach_shader(shd_prog       *prog,
                                    shd_shader_type type,
                                    const char     *source)
@@ -143,6 +393,18 @@ EXPORT bool shd_prog_attach_image(shd_prog   *pp,
     return prog_attach_image(pp, name, width, height, data);
 }
 
+EXPORT bool shd_prog_attach_image_ref(shd_prog       *pp,
+                                      const char     *name,
+                                      size_t          width,
+                                      size_t          height,
+                                      const uint8_t  *data,
+                                      shd_release_fn *release,
+                                      void           *user)
+{
+    return prog_attach_image_ref(pp, name, width, height, data,
+                                 release, user);
+}
+
 EXPORT bool shd_prog_attach_predefined(shd_prog       *pp,
                                        const char     *name,
                                        shd_predefined  predef)
@@ -158,10 +420,26 @@ EXPORT bool shd_prog_attach_predefined(shd_prog       *pp,
         pd = PD_PLAY_TIME;
         break;
 
+    case SHD_PREDEFINED_RENDER_TIME:
+        pd = PD_RENDER_TIME;
+        break;
+
     case SHD_PREDEFINED_FRAME:
         pd = PD_FRAME;
         break;
 
+    case SHD_PREDEFINED_DATE:
+        pd = PD_DATE;
+        break;
+
+    case SHD_PREDEFINED_MOUSE:
+        pd = PD_MOUSE;
+        break;
+
+    case SHD_PREDEFINED_CHANNEL_RESOLUTION:
+        pd = PD_CHANNEL_RESOLUTION;
+        break;
+
     case SHD_PREDEFINED_NOISE_SMALL:
         pd = PD_NOISE_SMALL;
         break;
@@ -170,8 +448,117 @@ EXPORT bool shd_prog_attach_predefined(shd_prog       *pp,
         pd = PD_NOISE_MEDIUM;
         break;
 
+    case SHD_PREDEFINED_BACK_BUFFER:
+        pd = PD_BACK_BUFFER;
+        break;
+
+    case SHD_PREDEFINED_IMU:
+        pd = PD_IMU;
+        break;
+
     default:
         return false;
     }
     return prog_attach_predefined(pp, name, pd);
 }
+
+EXPORT bool shd_prog_attach_pass(shd_prog   *pp,
+                                 const char *name,
+                                 const char *source)
+{
+    return prog_attach_pass(pp, name, source);
+}
+
+EXPORT bool shd_prog_attach_buffer(shd_prog   *pp,
+                                   const char *name,
+                                   const char *pass)
+{
+    return prog_attach_buffer(pp, name, pass);
+}
+
+EXPORT bool shd_prog_attach_stream(shd_prog   *pp,
+                                   const char *name,
+                                   size_t      width,
+                                   size_t      height)
+{
+    return prog_attach_stream(pp, name, width, height);
+}
+
+EXPORT uint8_t *shd_stream_acquire(shd_prog *pp, const char *name)
+{
+    return prog_stream_acquire(pp, name);
+}
+
+EXPORT bool shd_stream_release(shd_prog *pp, const char *name)
+{
+    return prog_stream_release(pp, name);
+}
+
+_Static_assert(sizeof (shd_native_inputs) == sizeof (native_inputs) &&
+               offsetof(shd_native_inputs, uniforms) ==
+               offsetof(native_inputs, uniforms) &&
+               sizeof (shd_vec4) == sizeof (native_vec4) &&
+               SHD_LANES == NATIVE_LANES,
+               "shd_native_shader must match native_shader");
+
+EXPORT bool shd_prog_set_native(shd_prog          *pp,
+                                shd_native_shader *shader,
+                                void              *user)
+{
+    return prog_set_native(pp, (native_shader *)shader, user);
+}
+
+EXPORT bool shd_prog_attach_uniform(shd_prog        *pp,
+                                    const char      *name,
+                                    shd_uniform_type type,
+                                    size_t           count)
+{
+    GLenum gl_type;
+    switch (type) {
+
+    case SHD_UNIFORM_FLOAT:
+        gl_type = GL_FLOAT;
+        break;
+
+    case SHD_UNIFORM_VEC2:
+        gl_type = GL_FLOAT_VEC2;
+        break;
+
+    case SHD_UNIFORM_VEC3:
+        gl_type = GL_FLOAT_VEC3;
+        break;
+
+    case SHD_UNIFORM_VEC4:
+        gl_type = GL_FLOAT_VEC4;
+        break;
+
+    case SHD_UNIFORM_MAT2:
+        gl_type = GL_FLOAT_MAT2;
+        break;
+
+    case SHD_UNIFORM_MAT3:
+        gl_type = GL_FLOAT_MAT3;
+        break;
+
+    case SHD_UNIFORM_MAT4:
+        gl_type = GL_FLOAT_MAT4;
+        break;
+
+    default:
+        return false;
+    }
+    return prog_attach_uniform(pp, name, gl_type, count);
+}
+
+EXPORT bool shd_set_uniform(shd_prog    *pp,
+                            const char  *name,
+                            const float *values,
+                            size_t       value_count)
+{
+    return prog_set_uniform(pp, name, values, value_count);
+}
+
+EXPORT bool shd_prog_set_supersample(shd_prog *pp, int factor)
+{
+    return prog_set_supersample(pp, factor);
+}
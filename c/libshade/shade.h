@@ -19,8 +19,38 @@ typedef enum shd_predefined {
     SHD_PREDEFINED_NOISE_MEDIUM,
     SHD_PREDEFINED_BACK_BUFFER,
     SHD_PREDEFINED_IMU,
+    SHD_PREDEFINED_DATE,
+    SHD_PREDEFINED_MOUSE,
+    SHD_PREDEFINED_CHANNEL_RESOLUTION,
 } shd_predefined;
 
+typedef enum shd_uniform_type {
+    SHD_UNIFORM_FLOAT,
+    SHD_UNIFORM_VEC2,
+    SHD_UNIFORM_VEC3,
+    SHD_UNIFORM_VEC4,
+    SHD_UNIFORM_MAT2,
+    SHD_UNIFORM_MAT3,
+    SHD_UNIFORM_MAT4,
+} shd_uniform_type;
+
+typedef enum shd_pipeline_policy {
+    SHD_PIPELINE_QUEUE,
+    SHD_PIPELINE_MAILBOX,
+} shd_pipeline_policy;
+
+typedef enum shd_readback_mode {
+    SHD_READBACK_AUTO,
+    SHD_READBACK_COPY,
+    SHD_READBACK_DIRECT,
+} shd_readback_mode;
+
+typedef enum shd_vsync_mode {
+    SHD_VSYNC_OFF,
+    SHD_VSYNC_POLL,
+    SHD_VSYNC_PIN,
+} shd_vsync_mode;
+
 // These are integer constants matching the enum values above.
 // Python can't access the enum values directly.
 extern const int SHD_SHADER_VERTEX_VALUE;
@@ -34,21 +64,199 @@ extern const int SHD_PREDEFINED_NOISE_SMALL_VALUE;
 extern const int SHD_PREDEFINED_NOISE_MEDIUM_VALUE;
 extern const int SHD_PREDEFINED_BACK_BUFFER_VALUE;
 extern const int SHD_PREDEFINED_IMU_VALUE;
+extern const int SHD_PREDEFINED_DATE_VALUE;
+extern const int SHD_PREDEFINED_MOUSE_VALUE;
+extern const int SHD_PREDEFINED_CHANNEL_RESOLUTION_VALUE;
+
+extern const int SHD_UNIFORM_FLOAT_VALUE;
+extern const int SHD_UNIFORM_VEC2_VALUE;
+extern const int SHD_UNIFORM_VEC3_VALUE;
+extern const int SHD_UNIFORM_VEC4_VALUE;
+extern const int SHD_UNIFORM_MAT2_VALUE;
+extern const int SHD_UNIFORM_MAT3_VALUE;
+extern const int SHD_UNIFORM_MAT4_VALUE;
+
+extern const int SHD_PIPELINE_QUEUE_VALUE;
+extern const int SHD_PIPELINE_MAILBOX_VALUE;
+
+extern const int SHD_READBACK_AUTO_VALUE;
+extern const int SHD_READBACK_COPY_VALUE;
+extern const int SHD_READBACK_DIRECT_VALUE;
+
+extern const int SHD_VSYNC_OFF_VALUE;
+extern const int SHD_VSYNC_POLL_VALUE;
+extern const int SHD_VSYNC_PIN_VALUE;
 
 typedef struct shd_prog shd_prog;
 
-extern void        shd_init(int LEDs_width, int LEDs_height);
+typedef void shd_release_fn(void *user);
+
+// Native shaders are C, run on the CPU instead of GLSL, e.g. where
+// there is no GPU.  Each call shades SHD_LANES horizontally adjacent
+// pixels, one per lane of GCC's vector types, which compile to SSE
+// or NEON.  frag_coord is in GL's convention, with y up and the
+// pixel centers at .5.  frag_color is (0, 0, 0, 1) on entry.
+#define SHD_LANES 4
+
+typedef float shd_lanes __attribute__((vector_size(SHD_LANES * 4)));
+
+typedef struct shd_vec2 {
+    shd_lanes x, y;
+} shd_vec2;
+
+typedef struct shd_vec4 {
+    shd_lanes x, y, z, w;
+} shd_vec4;
+
+typedef struct shd_native_inputs {
+    float        resolution[3];
+    float        time;
+    float        time_delta;
+    int32_t      frame;
+    float        date[4];
+    const float *uniforms;      // host uniforms, at their offsets
+} shd_native_inputs;
+
+typedef void shd_native_shader(shd_vec4                *frag_color,
+                               const shd_vec2          *frag_coord,
+                               const shd_native_inputs *,
+                               void                    *user);
+
+// Summary of one histogram.  Times are in seconds, queue occupancy
+// is in frames, and command sizes are in bytes.
+typedef struct shd_histogram {
+    uint64_t count;
+    double   mean;
+    double   p50;
+    double   p90;
+    double   p99;
+    double   p999;
+    double   max;
+} shd_histogram;
+
+typedef struct shd_stats {
+    shd_histogram render_time;
+    shd_histogram readback_time;
+    shd_histogram encode_time;
+    shd_histogram output_time;
+    shd_histogram vsync_time;
+    shd_histogram frame_time;
+    shd_histogram framebuffer_queue;
+    shd_histogram cmdbuffer_queue;
+    shd_histogram cmd_bytes;
+    uint64_t      frames_shown;
+    uint64_t      frames_dropped;
+    uint64_t      output_errors;
+    uint64_t      vsync_missed;
+    uint64_t      render_errors;
+} shd_stats;
+
+// Call before shd_init.  "ftdi[:DEVSTR]" (the default) drives an
+// iCEBreaker.  "loopback[:BYTES_PER_SEC]" simulates the panel in
+// process, and "file:PATH" writes the command stream to a file.
+extern bool        shd_set_transport(const char *spec);
+
+// Linked programs are kept on disk, where the driver allows, so
+// restarts skip the GLSL compiler.  The default directory is
+// $XDG_CACHE_HOME/shaderboy or ~/.cache/shaderboy.  NULL disables.
+extern void        shd_set_program_cache(const char *dir);
+
+// On failure, shd_last_error says why.  Without a usable GPU, only
+// native programs and those set to use the CPU draw.
+extern bool        shd_init(int LEDs_width, int LEDs_height);
 extern void        shd_deinit(void);
+extern const char *shd_last_error(void);
 
 extern void        shd_start(void);
 extern void        shd_stop(void);
 extern double      shd_fps(void);
 extern void        shd_use_prog(shd_prog *);
 
+// With background compilation, shd_use_prog returns at once and the
+// LEDs keep showing the old program while the new one compiles.
+// shd_current_prog tells when the switch happened: it returns the
+// program drawn most recently, and counts the switches so far.
+// Destroying a program that is still waiting to be compiled cancels
+// it; destroying one mid-compile waits for the compile to finish.
+extern void        shd_set_background_compile(bool enabled);
+extern const shd_prog *shd_current_prog(uint64_t *switch_count);
+
+// Call while stopped.  In QUEUE mode the renderer blocks once `depth'
+// frames are waiting.  In MAILBOX mode the renderer never blocks and
+// frames the LEDs never showed are counted as dropped.  A depth of
+// zero picks the default, three.
+extern bool        shd_set_pipeline_policy(shd_pipeline_policy,
+                                           size_t depth);
+
+// Call while stopped.  DIRECT reads pixels straight into the LED
+// command buffers and skips the encoding thread.  It needs a
+// framebuffer exactly the size of the LEDs, and returns false if
+// there isn't one.  AUTO (the default) uses DIRECT when it can,
+// unless delta updates are on.
+extern bool        shd_set_readback_mode(shd_readback_mode);
+extern bool        shd_readback_is_direct(void);
+
+// Call while stopped.  Color correction reads frames back as RGBA,
+// scales each channel by its gain, applies the gamma, and dithers the
+// LEDs' 5-6-5 bits over time instead of truncating.  It needs COPY
+// readback, so SHD_READBACK_DIRECT fails while it is on.
+extern bool        shd_set_color_correction(bool  enabled,
+                                            float gamma,
+                                            float red_gain,
+                                            float green_gain,
+                                            float blue_gain);
+
+// Call while stopped.  The power limiter estimates the LEDs' current
+// from each frame, given the amps one LED draws with each channel
+// full on, and dims the frames that follow when it is over
+// `budget_amps'.  It dims at once and recovers slowly.  Like color
+// correction, it needs COPY readback.
+extern bool        shd_set_power_limit(bool  enabled,
+                                       float budget_amps,
+                                       float red_amps,
+                                       float green_amps,
+                                       float blue_amps);
+
+// How many frames may be on the USB bus at once, 1 to 8.  With two
+// or more, the next frame is queued while the current one drains.
+extern bool        shd_set_usb_transfers(size_t count);
+
+// Send each frame at the panel's vsync.  POLL reads the FPGA's
+// status register; PIN needs gateware that raises GPIOL1 at vsync.
+// A frame whose vsync doesn't come within 100 msec is counted in
+// shd_stats.vsync_missed.  In POLL mode it is sent anyway.  In PIN
+// mode the FTDI is still waiting on GPIOL1, so the frame is dropped,
+// and so are later ones until the pin rises.
+extern bool        shd_set_vsync_mode(shd_vsync_mode);
+extern uint64_t    shd_frames_shown(void);
+extern uint64_t    shd_frames_dropped(void);
+extern void        shd_get_stats(shd_stats *);
+extern void        shd_reset_stats(void);
+
+// Send only the LED rows that changed since the previous frame.
+// DIRECT readback sends every row, so AUTO readback uses COPY while
+// delta updates are on.  Call while stopped for that to take effect;
+// a frame read back directly is always sent whole.
+extern void        shd_set_delta_updates(bool enabled);
+
+// Call while stopped.  Native and CPU programs are shaded in tiles by
+// the render thread and by one worker pinned to each of `cores', which
+// steal tiles from each other as they finish.  The default, NULL,
+// leaves the lowest core to the render thread and takes the rest.
+// If the workers can't be started, frames are skipped and counted in
+// shd_stats.render_errors, and the next frame tries again.
+extern bool        shd_set_cpu_cores(const int *cores, size_t count);
+
 extern shd_prog   *shd_create_prog(void);
 extern void        shd_destroy_prog(shd_prog *);
 extern bool        shd_prog_is_okay(const shd_prog       *,
                                     char                **info_log);
+// Draw the program on the CPU by interpreting its fragment shader,
+// which works without a GPU.  Call before shd_use_prog.  Buffer
+// passes, streams and the back buffer are GPU only.  A pixel's loops
+// stop after 65536 iterations in all, so a loop that never ends
+// can't hang the renderer.
+extern bool        shd_prog_use_cpu(shd_prog *, char **info_log);
 extern bool        shd_prog_attach_shader(shd_prog       *,
                                           shd_shader_type type,
                                           const char      *source);
@@ -57,8 +265,76 @@ extern bool        shd_prog_attach_image(shd_prog         *,
                                          size_t            width,
                                          size_t            height,
                                          uint8_t          *data);
+// Like shd_prog_attach_image, but without a copy.  libshade reads
+// `data' until it calls release(user), which it does once the image
+// is on the GPU, when the program is destroyed, or at once if the
+// attach fails.  release may be NULL, and may be called on any
+// thread.  Programs must not outlive shd_deinit.
+extern bool        shd_prog_attach_image_ref(shd_prog       *,
+                                             const char     *name,
+                                             size_t          width,
+                                             size_t          height,
+                                             const uint8_t  *data,
+                                             shd_release_fn *release,
+                                             void           *user);
 extern bool        shd_prog_attach_predefined(shd_prog    *,
                                               const char  *name,
                                               shd_predefined);
 
+// Buffer passes are extra fragment shaders that draw before the main
+// one, in the order attached, each into its own texture the size of
+// the frame.  Sampler `name' reads the output of pass `pass', in any
+// shader: this frame's if that pass has already drawn, otherwise the
+// previous frame's, so a pass can read itself.  A sampler mapped to
+// SHD_PREDEFINED_BACK_BUFFER reads the main shader's previous frame.
+extern bool        shd_prog_attach_pass(shd_prog   *,
+                                        const char *name,
+                                        const char *source);
+extern bool        shd_prog_attach_buffer(shd_prog   *,
+                                          const char *name,
+                                          const char *pass);
+
+// A program with a native shader needs no GLSL.  It is shaded a tile
+// at a time by the render thread and the workers that
+// shd_set_cpu_cores sets up.
+extern bool        shd_prog_set_native(shd_prog          *,
+                                       shd_native_shader *,
+                                       void              *user);
+
+// A stream is an RGBA image the host replaces while the program
+// runs, such as video.  Its producer (one thread per stream) writes
+// a width x height x 4 frame into the buffer shd_stream_acquire
+// returns, then calls shd_stream_release.  Neither call waits.  Each
+// frame draws with the newest released frame; frames nobody drew
+// are dropped.
+//
+// The images, buffers and streams one pass samples share the GPU's
+// texture units, less one (seven on a Pi).  A program that needs
+// more draws nothing.
+extern bool        shd_prog_attach_stream(shd_prog   *,
+                                          const char *name,
+                                          size_t      width,
+                                          size_t      height);
+extern uint8_t    *shd_stream_acquire(shd_prog *, const char *name);
+extern bool        shd_stream_release(shd_prog *, const char *name);
+
+// Host uniforms are set by the application while the program runs,
+// e.g. from a sensor thread.  `count' is the array length, 1 for a
+// plain uniform.  shd_set_uniform may be called from any thread, as
+// often as it likes; it never makes the renderer wait, and each
+// frame sees the newest values.  Matrices are column major.
+// SHD_PREDEFINED_IMU is a mat4 host uniform that starts as identity.
+extern bool        shd_prog_attach_uniform(shd_prog        *,
+                                           const char      *name,
+                                           shd_uniform_type type,
+                                           size_t           count);
+extern bool        shd_set_uniform(shd_prog    *,
+                                   const char  *name,
+                                   const float *values,
+                                   size_t       value_count);
+
+// Shade factor x factor samples per LED and average them, 1 to 4.
+// The default, 1, runs the shader once per LED.
+extern bool        shd_prog_set_supersample(shd_prog *, int factor);
+
 #endif /* !SHADE_included */
@@ -0,0 +1,88 @@
+#include "stats.h"
+
+#include <string.h>
+
+static size_t bucket_index(uint64_t value)
+{
+    if (value < HIST_SUB_COUNT)
+        return value;
+    unsigned msb = 63 - __builtin_clzll(value);
+    unsigned shift = msb - HIST_SUB_BITS;
+    size_t mantissa = (value >> shift) & (HIST_SUB_COUNT - 1);
+    return HIST_SUB_COUNT + shift * HIST_SUB_COUNT + mantissa;
+}
+
+// the middle of the range of values that land in bucket `index'
+static double bucket_value(size_t index)
+{
+    if (index < HIST_SUB_COUNT)
+        return index;
+    unsigned shift = index / HIST_SUB_COUNT - 1;
+    uint64_t mantissa = index % HIST_SUB_COUNT;
+    uint64_t low = (HIST_SUB_COUNT + mantissa) << shift;
+    return low + ((1ull << shift) - 1) / 2.0;
+}
+
+// Only the owning thread writes, so a plain load and store is
+// enough; the atomics just keep readers from seeing torn values.
+static inline void bump(_Atomic uint64_t *p, uint64_t n)
+{
+    uint64_t v = atomic_load_explicit(p, memory_order_relaxed);
+    atomic_store_explicit(p, v + n, memory_order_relaxed);
+}
+
+void histogram_record(histogram *h, uint64_t value)
+{
+    bump(&h->buckets[bucket_index(value)], 1);
+    bump(&h->sum, value);
+    bump(&h->count, 1);
+}
+
+void histogram_copy(histogram *dst, const histogram *src)
+{
+    for (size_t i = 0; i < HIST_BUCKETS; i++)
+        dst->buckets[i] = atomic_load_explicit(&src->buckets[i],
+                                               memory_order_relaxed);
+    dst->sum = atomic_load_explicit(&src->sum, memory_order_relaxed);
+    dst->count = atomic_load_explicit(&src->count, memory_order_relaxed);
+}
+
+void histogram_summarize(const histogram *h,
+                         const histogram *baseline,
+                         double           scale,
+                         hist_summary    *out)
+{
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total = 0;
+    for (size_t i = 0; i < HIST_BUCKETS; i++) {
+        uint64_t n = atomic_load_explicit(&h->buckets[i],
+                                          memory_order_relaxed);
+        if (baseline)
+            n -= atomic_load_explicit(&baseline->buckets[i],
+                                      memory_order_relaxed);
+        counts[i] = n;
+        total += n;
+    }
+    uint64_t sum = atomic_load_explicit(&h->sum, memory_order_relaxed);
+    if (baseline)
+        sum -= atomic_load_explicit(&baseline->sum, memory_order_relaxed);
+
+    memset(out, 0, sizeof *out);
+    out->count = total;
+    if (total == 0)
+        return;
+    out->mean = scale * sum / total;
+
+    static const double quantiles[] = { 0.50, 0.90, 0.99, 0.999 };
+    double *results[] = { &out->p50, &out->p90, &out->p99, &out->p999 };
+    size_t q = 0;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HIST_BUCKETS; i++) {
+        if (!counts[i])
+            continue;
+        seen += counts[i];
+        while (q < 4 && seen >= quantiles[q] * total)
+            *results[q++] = scale * bucket_value(i);
+        out->max = scale * bucket_value(i);
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef STATS_included
+#define STATS_included
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+
+// Log-bucket histograms in the style of HdrHistogram.  Values below
+// 2^HIST_SUB_BITS get their own bucket; above that each power of two
+// is split into 2^HIST_SUB_BITS buckets, so every bucket is within
+// 12.5% of the values it holds.
+//
+// A histogram has exactly one writer, which never takes a lock.
+// Readers may see a histogram mid-update; the summaries they compute
+// are off by at most the sample being recorded.
+
+#define HIST_SUB_BITS 3
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (HIST_SUB_COUNT * (64 - HIST_SUB_BITS + 1))
+
+typedef struct histogram {
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum;
+    _Atomic uint64_t buckets[HIST_BUCKETS];
+} histogram;
+
+typedef struct hist_summary {
+    uint64_t count;
+    double   mean;
+    double   p50;
+    double   p90;
+    double   p99;
+    double   p999;
+    double   max;
+} hist_summary;
+
+extern void     histogram_record(histogram *, uint64_t value);
+
+// Summarize the samples recorded since `baseline' was copied from
+// `h'.  (baseline may be NULL.)  Values are multiplied by `scale'.
+extern void     histogram_summarize(const histogram *h,
+                                    const histogram *baseline,
+                                    double           scale,
+                                    hist_summary    *out);
+extern void     histogram_copy(histogram *dst, const histogram *src);
+
+static inline uint64_t stats_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#endif /* !STATS_included */
@@ -0,0 +1,162 @@
+#include "texcache.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+typedef struct cache_entry {
+    uint64_t key;
+    size_t   width;
+    size_t   height;
+    GLuint   texture;
+    size_t   refs;
+    size_t   bytes;
+    uint64_t last_used;
+} cache_entry;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static cache_entry    *entries;
+static size_t          entry_count;
+static size_t          entry_alloc;
+static size_t          idle_bytes;
+static uint64_t        use_clock;
+
+// Call with cache_lock held.
+static void remove_entry(cache_entry *e)
+{
+    glDeleteTextures(1, &e->texture);
+    *e = entries[--entry_count];
+}
+
+// Call with cache_lock held.  Delete the least recently used idle
+// textures until the rest fit the budget.
+static void trim_idle(void)
+{
+    while (idle_bytes > TEXCACHE_MAX_IDLE_BYTES) {
+        cache_entry *oldest = NULL;
+        for (size_t i = 0; i < entry_count; i++) {
+            cache_entry *e = &entries[i];
+            if (!e->refs && (!oldest || e->last_used < oldest->last_used))
+                oldest = e;
+        }
+        if (!oldest)
+            break;
+        idle_bytes -= oldest->bytes;
+        remove_entry(oldest);
+    }
+}
+
+static GLuint upload(size_t width, size_t height, const uint8_t *data)
+{
+    GLuint texture = 0;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexImage2D(GL_TEXTURE_2D,
+                 0,             // level
+                 GL_RGBA,
+                 width,
+                 height,
+                 0,             // border, must be zero
+                 GL_RGBA,
+                 GL_UNSIGNED_BYTE,
+                 data);
+    glGenerateMipmap(GL_TEXTURE_2D);
+    return texture;
+}
+
+GLuint texcache_acquire(uint64_t       key,
+                        size_t         width,
+                        size_t         height,
+                        const uint8_t *data)
+{
+    pthread_mutex_lock(&cache_lock);
+    for (size_t i = 0; i < entry_count; i++) {
+        cache_entry *e = &entries[i];
+        if (e->key == key && e->width == width && e->height == height) {
+            if (!e->refs++)
+                idle_bytes -= e->bytes;
+            e->last_used = ++use_clock;
+            pthread_mutex_unlock(&cache_lock);
+            return e->texture;
+        }
+    }
+
+    GLuint texture = 0;
+    if (!data)
+        goto DONE;
+    if (entry_alloc <= entry_count) {
+        size_t new_alloc = 2 * entry_count + 10;
+        cache_entry *new_entries =
+            realloc(entries, new_alloc * sizeof *entries);
+        if (!new_entries)
+            goto DONE;
+        entries = new_entries;
+        entry_alloc = new_alloc;
+    }
+    texture = upload(width, height, data);
+    if (!texture)
+        goto DONE;
+    entries[entry_count++] = (cache_entry) {
+        .key       = key,
+        .width     = width,
+        .height    = height,
+        .texture   = texture,
+        .refs      = 1,
+        .bytes     = width * height * 4 * 4 / 3,    // with mipmaps
+        .last_used = ++use_clock,
+    };
+
+DONE:
+    pthread_mutex_unlock(&cache_lock);
+    return texture;
+}
+
+void texcache_release(GLuint texture)
+{
+    if (!texture)
+        return;
+    pthread_mutex_lock(&cache_lock);
+    for (size_t i = 0; i < entry_count; i++) {
+        cache_entry *e = &entries[i];
+        if (e->texture == texture) {
+            if (e->refs && !--e->refs) {
+                idle_bytes += e->bytes;
+                trim_idle();
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void texcache_unref(GLuint texture)
+{
+    if (!texture)
+        return;
+    pthread_mutex_lock(&cache_lock);
+    for (size_t i = 0; i < entry_count; i++) {
+        cache_entry *e = &entries[i];
+        if (e->texture == texture) {
+            if (e->refs && !--e->refs)
+                idle_bytes += e->bytes;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void texcache_clear(void)
+{
+    pthread_mutex_lock(&cache_lock);
+    while (entry_count)
+        remove_entry(&entries[entry_count - 1]);
+    free(entries);
+    entries = NULL;
+    entry_alloc = 0;
+    idle_bytes = 0;
+    pthread_mutex_unlock(&cache_lock);
+}
@@ -0,0 +1,55 @@
+#ifndef TEXCACHE_included
+#define TEXCACHE_included
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <GLES2/gl2.h>
+
+// RGBA textures, keyed by a hash of their dimensions and contents, and
+// shared by every program that uses the same image.  Each user holds
+// a reference.  A texture nobody references stays loaded in case a
+// program switch brings it back, until idle textures add up to more
+// than TEXCACHE_MAX_IDLE_BYTES.
+//
+// Call these with a libshade EGL context current.
+
+#define TEXCACHE_MAX_IDLE_BYTES (16 * 1024 * 1024)
+
+// FNV-1a over the dimensions and the pixels.
+static inline uint64_t texcache_key(size_t         width,
+                                    size_t         height,
+                                    const uint8_t *data)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    uint64_t dims[2] = { width, height };
+    const uint8_t *p = (const uint8_t *)dims;
+    for (size_t i = 0; i < sizeof dims; i++) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+    for (size_t i = 0; i < width * height * 4; i++) {
+        hash ^= data[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Returns a mipmapped, repeating texture holding data, uploading it
+// only if it isn't loaded already.  Returns zero on failure, or if
+// data is NULL and the texture isn't loaded.
+extern GLuint texcache_acquire(uint64_t       key,
+                               size_t         width,
+                               size_t         height,
+                               const uint8_t *data);
+
+extern void   texcache_release(GLuint texture);
+
+// Like texcache_release, but safe on any thread.  It makes no GL
+// calls, so an idle texture waits for the next release to be trimmed.
+extern void   texcache_unref(GLuint texture);
+
+// Delete every texture, referenced or not.
+extern void   texcache_clear(void);
+
+#endif /* !TEXCACHE_included */
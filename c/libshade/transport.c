@@ -0,0 +1,65 @@
+#include "transport.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static __thread char last_error[256];
+
+void transport_set_error(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(last_error, sizeof last_error, fmt, ap);
+    va_end(ap);
+}
+
+const char *transport_last_error(void)
+{
+    return last_error[0] ? last_error : NULL;
+}
+
+transport *open_transport(const char *spec,
+                          size_t      LEDs_width,
+                          size_t      LEDs_height)
+{
+    if (!spec || !*spec)
+        spec = "ftdi";
+    const char *colon = strchr(spec, ':');
+    size_t name_len = colon ? (size_t)(colon - spec) : strlen(spec);
+    const char *arg = colon ? colon + 1 : NULL;
+
+    if (name_len == 4 && !strncmp(spec, "ftdi", 4))
+        return open_ftdi_transport(0, arg && *arg ? arg : NULL);
+
+    if (name_len == 8 && !strncmp(spec, "loopback", 8)) {
+        double rate = 0;
+        if (arg) {
+            char *end;
+            rate = strtod(arg, &end);
+            if (end == arg || *end || rate < 0) {
+                transport_set_error("loopback: bad rate \"%s\"", arg);
+                return NULL;
+            }
+        }
+        return open_loopback_transport(LEDs_width, LEDs_height, rate);
+    }
+
+    if (name_len == 4 && !strncmp(spec, "file", 4)) {
+        if (!arg || !*arg) {
+            transport_set_error("file: no path");
+            return NULL;
+        }
+        return open_file_transport(arg);
+    }
+
+    transport_set_error("unknown transport \"%.*s\"", (int)name_len, spec);
+    return NULL;
+}
+
+void close_transport(transport *t)
+{
+    if (t)
+        t->ops->close(t);
+}
@@ -0,0 +1,127 @@
+#ifndef TRANSPORT_included
+#define TRANSPORT_included
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A transport carries the MPSSE command stream to something that
+// executes it: an FTDI chip over USB, an in-process simulation of
+// the iCEBreaker panel, or a file.
+//
+// write sends bytes and returns once they are gone.  read waits for
+// `size' reply bytes.  submit starts an asynchronous write and
+// returns a handle, or NULL; the data must stay untouched until
+// complete has returned for that handle.  Handles complete in order.
+//
+// read_timed is read for replies that wait on the hardware, like
+// vsync.  It gives up after timeout_ns, or at once while the
+// transport is interrupted, and returns TS_TIMEOUT.  Bytes that
+// arrive after that go to the next read.  transport_interrupt may be
+// called from any thread, and lasts until transport_resume.
+// Backends whose replies never wait leave read_timed and interrupt
+// NULL.
+//
+// Nothing here exits the process.  Failures return false or NULL
+// and leave a message in transport_last_error.
+
+typedef struct transport transport;
+
+typedef enum transport_status {
+    TS_OK,
+    TS_TIMEOUT,                 // timed out or interrupted
+    TS_ERROR,
+} transport_status;
+
+typedef struct transport_ops {
+    bool  (*write)(transport *, const uint8_t *data, size_t size);
+    bool  (*read)(transport *, uint8_t *data, size_t size);
+    transport_status
+          (*read_timed)(transport *, uint8_t *data, size_t size,
+                        uint64_t timeout_ns);
+    void *(*submit)(transport *, uint8_t *data, size_t size);
+    bool  (*complete)(transport *, void *handle, size_t size);
+    void  (*interrupt)(transport *);
+    void  (*close)(transport *);
+} transport_ops;
+
+struct transport {
+    const transport_ops *ops;
+    _Atomic bool         interrupted;
+};
+
+// Backends.  The loopback decodes the stream into a simulated panel
+// and holds each transfer for as long as `bytes_per_sec' takes to
+// carry it.  Zero means unlimited.  A file sink writes the stream to
+// `path' ("-" is stdout); its reads return 0xFF bytes.
+extern transport   *open_ftdi_transport(int ifnum, const char *devstr);
+extern transport   *open_loopback_transport(size_t LEDs_width,
+                                            size_t LEDs_height,
+                                            double bytes_per_sec);
+extern transport   *open_file_transport(const char *path);
+
+// Parse "ftdi[:DEVSTR]", "loopback[:BYTES_PER_SEC]" or "file:PATH".
+// NULL or "" means "ftdi".
+extern transport   *open_transport(const char *spec,
+                                   size_t LEDs_width,
+                                   size_t LEDs_height);
+extern void         close_transport(transport *);
+
+static inline bool transport_write(transport *t,
+                                   const uint8_t *data,
+                                   size_t size)
+{
+    return t->ops->write(t, data, size);
+}
+
+static inline bool transport_read(transport *t, uint8_t *data, size_t size)
+{
+    return t->ops->read(t, data, size);
+}
+
+static inline transport_status transport_read_timed(transport *t,
+                                                    uint8_t   *data,
+                                                    size_t     size,
+                                                    uint64_t   timeout_ns)
+{
+    if (atomic_load(&t->interrupted))
+        return TS_TIMEOUT;
+    if (!t->ops->read_timed)
+        return transport_read(t, data, size) ? TS_OK : TS_ERROR;
+    return t->ops->read_timed(t, data, size, timeout_ns);
+}
+
+static inline void *transport_submit(transport *t, uint8_t *data, size_t size)
+{
+    return t->ops->submit(t, data, size);
+}
+
+static inline bool transport_complete(transport *t, void *handle, size_t size)
+{
+    return t->ops->complete(t, handle, size);
+}
+
+static inline void transport_interrupt(transport *t)
+{
+    atomic_store(&t->interrupted, true);
+    if (t->ops->interrupt)
+        t->ops->interrupt(t);
+}
+
+static inline void transport_resume(transport *t)
+{
+    atomic_store(&t->interrupted, false);
+}
+
+// The simulated panel: the frame on display, led_width by led_height
+// pixels, and how many swaps it has seen.  Only valid for a loopback
+// transport, and only while nothing is writing to it.
+extern const uint16_t *loopback_front_buffer(transport *);
+extern uint64_t     loopback_frame_count(transport *);
+
+extern void         transport_set_error(const char *fmt, ...)
+                        __attribute__((format(printf, 1, 2)));
+extern const char  *transport_last_error(void);
+
+#endif /* !TRANSPORT_included */
@@ -0,0 +1,91 @@
+#include "transport.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// The file sink records the command stream for offline inspection,
+// or feeds it to another process through a pipe.  Nothing answers,
+// so reads see all ones: every status bit and pin is high.
+
+typedef struct file_transport {
+    transport base;
+    int       fd;
+    bool      owns_fd;
+} file_transport;
+
+static bool file_write(transport *t, const uint8_t *data, size_t size)
+{
+    file_transport *ft = (file_transport *)t;
+    while (size) {
+        ssize_t n = write(ft->fd, data, size);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            transport_set_error("file: write: %s", strerror(errno));
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool file_read(transport *t, uint8_t *data, size_t size)
+{
+    (void)t;
+    memset(data, 0xFF, size);
+    return true;
+}
+
+// Writes finish before submit returns, so the handle just has to be
+// non-NULL.
+static void *file_submit(transport *t, uint8_t *data, size_t size)
+{
+    return file_write(t, data, size) ? data : NULL;
+}
+
+static bool file_complete(transport *t, void *handle, size_t size)
+{
+    (void)t;
+    (void)handle;
+    (void)size;
+    return true;
+}
+
+static void file_close(transport *t)
+{
+    file_transport *ft = (file_transport *)t;
+    if (ft->owns_fd)
+        (void)close(ft->fd);
+    free(ft);
+}
+
+static const transport_ops file_ops = {
+    file_write, file_read, NULL, file_submit, file_complete, NULL,
+    file_close,
+};
+
+transport *open_file_transport(const char *path)
+{
+    file_transport *ft = calloc(1, sizeof *ft);
+    if (!ft) {
+        transport_set_error("file: out of memory");
+        return NULL;
+    }
+    ft->base.ops = &file_ops;
+    if (!strcmp(path, "-")) {
+        ft->fd = STDOUT_FILENO;
+    } else {
+        ft->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (ft->fd < 0) {
+            transport_set_error("file: %s: %s", path, strerror(errno));
+            free(ft);
+            return NULL;
+        }
+        ft->owns_fd = true;
+    }
+    return &ft->base;
+}
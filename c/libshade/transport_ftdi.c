@@ -0,0 +1,199 @@
+// FTDI transport.  The device setup is from iceprog's mpsse_init,
+// Copyright (C) 2015 Clifford Wolf and (C) 2018 Piotr Esden-Tempski,
+// under the ISC license (see mpsse.c).
+
+#include "transport.h"
+
+#include <ftdi.h>
+#include <libusb.h>
+#include <stdlib.h>
+
+#include "stats.h"
+
+typedef struct ftdi_transport {
+    transport           base;
+    struct ftdi_context ftdic;
+    bool                open;
+    bool                latency_set;
+    unsigned char       latency;
+} ftdi_transport;
+
+static bool ftdi_fail(ftdi_transport *ft, const char *what)
+{
+    transport_set_error("ftdi: %s (%s)",
+                        what, ftdi_get_error_string(&ft->ftdic));
+    return false;
+}
+
+static bool ftdi_tp_write(transport *t, const uint8_t *data, size_t size)
+{
+    ftdi_transport *ft = (ftdi_transport *)t;
+    int rc = ftdi_write_data(&ft->ftdic, data, size);
+    if (rc != (int)size)
+        return ftdi_fail(ft, "write error");
+    return true;
+}
+
+// Blocks in libusb until all the bytes arrive, rather than polling.
+static bool ftdi_tp_read(transport *t, uint8_t *data, size_t size)
+{
+    ftdi_transport *ft = (ftdi_transport *)t;
+    struct ftdi_transfer_control *tc =
+        ftdi_read_data_submit(&ft->ftdic, data, size);
+    if (!tc || ftdi_transfer_data_done(tc) != (int)size)
+        return ftdi_fail(ft, "read error");
+    return true;
+}
+
+// ftdi_transfer_data_done would wait forever for a reply that never
+// comes, so handle libusb's events here until the deadline.
+// ftdi_tp_interrupt wakes the event handler early.
+static transport_status ftdi_tp_read_timed(transport *t,
+                                           uint8_t   *data,
+                                           size_t     size,
+                                           uint64_t   timeout_ns)
+{
+    ftdi_transport *ft = (ftdi_transport *)t;
+    struct ftdi_transfer_control *tc =
+        ftdi_read_data_submit(&ft->ftdic, data, size);
+    if (!tc) {
+        (void)ftdi_fail(ft, "read error");
+        return TS_ERROR;
+    }
+    uint64_t deadline = stats_now_ns() + timeout_ns;
+    while (!tc->completed) {
+        uint64_t now = stats_now_ns();
+        if (atomic_load(&t->interrupted) || now >= deadline) {
+            ftdi_transfer_data_cancel(tc, NULL);
+            return TS_TIMEOUT;
+        }
+        struct timeval tv = {
+            .tv_sec  = (deadline - now) / 1000000000,
+            .tv_usec = (deadline - now) % 1000000000 / 1000,
+        };
+        int rc = libusb_handle_events_timeout_completed(ft->ftdic.usb_ctx,
+                                                        &tv,
+                                                        &tc->completed);
+        if (rc < 0 && rc != LIBUSB_ERROR_INTERRUPTED)
+            break;              // ftdi_transfer_data_done cleans up
+    }
+    if (ftdi_transfer_data_done(tc) != (int)size) {
+        (void)ftdi_fail(ft, "read error");
+        return TS_ERROR;
+    }
+    return TS_OK;
+}
+
+static void *ftdi_tp_submit(transport *t, uint8_t *data, size_t size)
+{
+    ftdi_transport *ft = (ftdi_transport *)t;
+    struct ftdi_transfer_control *tc =
+        ftdi_write_data_submit(&ft->ftdic, data, size);
+    if (!tc)
+        (void)ftdi_fail(ft, "write submit error");
+    return tc;
+}
+
+static bool ftdi_tp_complete(transport *t, void *handle, size_t size)
+{
+    ftdi_transport *ft = (ftdi_transport *)t;
+    if (ftdi_transfer_data_done(handle) != (int)size)
+        return ftdi_fail(ft, "async write error");
+    return true;
+}
+
+static void ftdi_tp_interrupt(transport *t)
+{
+    ftdi_transport *ft = (ftdi_transport *)t;
+    libusb_interrupt_event_handler(ft->ftdic.usb_ctx);
+}
+
+static void ftdi_tp_close(transport *t)
+{
+    ftdi_transport *ft = (ftdi_transport *)t;
+    if (ft->open) {
+        if (ft->latency_set)
+            (void)ftdi_set_latency_timer(&ft->ftdic, ft->latency);
+        (void)ftdi_disable_bitbang(&ft->ftdic);
+        (void)ftdi_usb_close(&ft->ftdic);
+    }
+    ftdi_deinit(&ft->ftdic);
+    free(ft);
+}
+
+static const transport_ops ftdi_ops = {
+    ftdi_tp_write, ftdi_tp_read, ftdi_tp_read_timed, ftdi_tp_submit,
+    ftdi_tp_complete, ftdi_tp_interrupt, ftdi_tp_close,
+};
+
+transport *open_ftdi_transport(int ifnum, const char *devstr)
+{
+    static const enum ftdi_interface interfaces[] = {
+        INTERFACE_A, INTERFACE_B, INTERFACE_C, INTERFACE_D,
+    };
+    enum ftdi_interface ftdi_ifnum = INTERFACE_A;
+    if (0 <= ifnum && ifnum < 4)
+        ftdi_ifnum = interfaces[ifnum];
+
+    ftdi_transport *ft = calloc(1, sizeof *ft);
+    if (!ft) {
+        transport_set_error("ftdi: out of memory");
+        return NULL;
+    }
+    ft->base.ops = &ftdi_ops;
+    if (ftdi_init(&ft->ftdic) < 0) {
+        transport_set_error("ftdi: ftdi_init failed");
+        free(ft);
+        return NULL;
+    }
+    (void)ftdi_set_interface(&ft->ftdic, ftdi_ifnum);
+
+    if (devstr) {
+        if (ftdi_usb_open_string(&ft->ftdic, devstr)) {
+            (void)ftdi_fail(ft, "can't find iCE FTDI USB device");
+            goto FAIL;
+        }
+    } else {
+        if (ftdi_usb_open(&ft->ftdic, 0x0403, 0x6010) &&
+            ftdi_usb_open(&ft->ftdic, 0x0403, 0x6014)) {
+            (void)ftdi_fail(ft, "can't find iCE FTDI USB device");
+            goto FAIL;
+        }
+    }
+    ft->open = true;
+
+    if (ftdi_usb_reset(&ft->ftdic)) {
+        (void)ftdi_fail(ft, "failed to reset iCE FTDI USB device");
+        goto FAIL;
+    }
+    if (ftdi_usb_purge_buffers(&ft->ftdic)) {
+        (void)ftdi_fail(ft, "failed to purge buffers");
+        goto FAIL;
+    }
+    if (ftdi_get_latency_timer(&ft->ftdic, &ft->latency) < 0) {
+        (void)ftdi_fail(ft, "failed to get latency timer");
+        goto FAIL;
+    }
+    // 1 is the fastest polling, it means 1 kHz polling
+    if (ftdi_set_latency_timer(&ft->ftdic, 1) < 0) {
+        (void)ftdi_fail(ft, "failed to set latency timer");
+        goto FAIL;
+    }
+    ft->latency_set = true;
+
+    // Enter MPSSE (Multi-Protocol Synchronous Serial Engine) mode.
+    // Set all pins to output.
+    if (ftdi_set_bitmode(&ft->ftdic, 0xff, BITMODE_MPSSE) < 0) {
+        (void)ftdi_fail(ft, "failed to set BITMODE_MPSSE");
+        goto FAIL;
+    }
+    if (ftdi_write_data_set_chunksize(&ft->ftdic, 65536)) {
+        (void)ftdi_fail(ft, "failed to set write chunk size");
+        goto FAIL;
+    }
+    return &ft->base;
+
+FAIL:
+    ftdi_tp_close(&ft->base);
+    return NULL;
+}
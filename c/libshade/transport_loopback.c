@@ -0,0 +1,403 @@
+#define _GNU_SOURCE
+#include "transport.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mpsse.h"
+#include "stats.h"
+
+// The loopback transport plays the part of the FTDI chip and the
+// iCEBreaker gateware.  It parses the MPSSE stream, collects the SPI
+// bytes sent while CS is low into packets, and executes the packets
+// against a simulated double-buffered panel:
+//
+//     0x80 pixels...     load the row buffer
+//     0x03 row           copy the row buffer into back buffer row
+//     0x04 0x00          swap front and back buffers
+//     0x00 0x00          status read; bit 1 is set once per refresh
+//
+// Each transfer is held for as long as the modeled bus would take to
+// carry it, so the output path can be benchmarked without hardware.
+
+#define CS_BITS             0x28        /* set_cs(1) in leds.c */
+#define REFRESH_HZ          60
+#define ROUND_TRIP_NS       125000      /* one USB microframe */
+#define MAX_COMMAND_BYTES   (3 + 65536)
+
+typedef struct loopback_transport {
+    transport base;
+    size_t    width;
+    size_t    height;
+    double    ns_per_byte;
+    uint64_t  bus_free_ns;      // when queued transfers finish
+
+    // MPSSE parser
+    uint8_t  *partial;          // a command split across writes
+    size_t    partial_len;
+    bool      cs_low;
+
+    // SPI packet being collected
+    uint8_t  *packet;
+    size_t    packet_len;
+    size_t    packet_cap;
+
+    // bytes the host has not read yet
+    uint8_t  *replies;
+    size_t    reply_len;
+    size_t    reply_cap;
+
+    // panel
+    uint16_t *row;
+    uint16_t *front;
+    uint16_t *back;
+    uint64_t  frame_count;
+    uint64_t  refresh_seen;     // last refresh reported in status
+} loopback_transport;
+
+static void sleep_until(uint64_t ns)
+{
+    struct timespec ts = {
+        .tv_sec  = ns / 1000000000,
+        .tv_nsec = ns % 1000000000,
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        continue;
+}
+
+// Returns a command's length once enough of it is present to tell,
+// zero if more bytes are needed first, or SIZE_MAX if it is not a
+// command the panel's host would send.
+static size_t command_length(const uint8_t *cmd, size_t avail)
+{
+    if (!avail)
+        return 0;
+    uint8_t op = cmd[0];
+    if (!(op & 0x80)) {
+        bool out = op & MC_DATA_OUT;
+        if (op & MC_DATA_BITS)
+            return 2 + out;
+        if (avail < 3)
+            return 0;
+        return 3 + (out ? cmd[1] + 256 * cmd[2] + 1 : 0);
+    }
+    switch (op) {
+
+    case MC_SETB_LOW:
+    case MC_SETB_HIGH:
+    case MC_SET_CLK_DIV:
+    case MC_CLK_N8:
+    case MC_CLK8_TO_H:
+    case MC_CLK8_TO_L:
+    case MC_TRI:
+        return 3;
+
+    case MC_CLK_N:
+        return 2;
+
+    case MC_READB_LOW:
+    case MC_READB_HIGH:
+    case MC_LOOPBACK_EN:
+    case MC_LOOPBACK_DIS:
+    case MC_FLUSH:
+    case MC_WAIT_H:
+    case MC_WAIT_L:
+    case MC_TCK_X5:
+    case MC_TCK_D5:
+    case MC_EN_3PH_CLK:
+    case MC_DIS_3PH_CLK:
+    case MC_CLK_TO_H:
+    case MC_CLK_TO_L:
+    case MC_EN_ADPT_CLK:
+    case MC_DIS_ADPT_CLK:
+        return 1;
+
+    default:
+        return SIZE_MAX;
+    }
+}
+
+static bool reserve(uint8_t **buf, size_t *cap, size_t need)
+{
+    if (need <= *cap)
+        return true;
+    size_t new_cap = *cap ? *cap : 64;
+    while (new_cap < need)
+        new_cap *= 2;
+    uint8_t *p = realloc(*buf, new_cap);
+    if (!p)
+        return false;
+    *buf = p;
+    *cap = new_cap;
+    return true;
+}
+
+static uint8_t status_byte(loopback_transport *lt)
+{
+    uint64_t refresh = stats_now_ns() * REFRESH_HZ / 1000000000;
+    if (refresh == lt->refresh_seen)
+        return 0x00;
+    lt->refresh_seen = refresh;
+    return 0x02;
+}
+
+static bool reply(loopback_transport *lt, uint8_t value, size_t count)
+{
+    if (!reserve(&lt->replies, &lt->reply_cap, lt->reply_len + count))
+        return false;
+    memset(lt->replies + lt->reply_len, value, count);
+    lt->reply_len += count;
+    return true;
+}
+
+static void end_packet(loopback_transport *lt)
+{
+    const uint8_t *p = lt->packet;
+    size_t len = lt->packet_len;
+    size_t row_size = lt->width * sizeof *lt->row;
+    if (!len)
+        return;
+    switch (p[0]) {
+
+    case 0x80:
+        memcpy(lt->row, p + 1, len - 1 < row_size ? len - 1 : row_size);
+        break;
+
+    case 0x03:
+        if (len >= 2 && p[1] < lt->height)
+            memcpy(lt->back + p[1] * lt->width, lt->row, row_size);
+        break;
+
+    case 0x04: {
+        uint16_t *tmp = lt->front;
+        lt->front = lt->back;
+        lt->back = tmp;
+        lt->frame_count++;
+        break;
+    }
+    }
+    lt->packet_len = 0;
+}
+
+static bool execute(loopback_transport *lt, const uint8_t *cmd, size_t len)
+{
+    uint8_t op = cmd[0];
+    if (!(op & 0x80)) {
+        size_t count = op & MC_DATA_BITS ? 1 : cmd[1] + 256 * cmd[2] + 1;
+        if ((op & MC_DATA_OUT) && lt->cs_low) {
+            const uint8_t *data = cmd + len - ((op & MC_DATA_BITS) ? 1 : count);
+            if (!reserve(&lt->packet, &lt->packet_cap, lt->packet_len + count))
+                return false;
+            memcpy(lt->packet + lt->packet_len, data, count);
+            lt->packet_len += count;
+        }
+        if (op & MC_DATA_IN)
+            return reply(lt, status_byte(lt), count);
+        return true;
+    }
+
+    switch (op) {
+
+    case MC_SETB_LOW: {
+        bool cs_low = !(cmd[1] & CS_BITS);
+        if (lt->cs_low && !cs_low)
+            end_packet(lt);
+        else if (!lt->cs_low && cs_low)
+            lt->packet_len = 0;
+        lt->cs_low = cs_low;
+        return true;
+    }
+
+    case MC_READB_LOW:
+    case MC_READB_HIGH:
+        return reply(lt, 0xFF, 1);
+
+    case MC_WAIT_L:
+        // GPIOL1 is the vsync pin, a short pulse at each refresh.
+        // Model it as already low.
+        return true;
+
+    case MC_WAIT_H: {
+        // Wait for the next refresh.
+        uint64_t refresh = stats_now_ns() * REFRESH_HZ / 1000000000;
+        sleep_until((refresh + 1) * 1000000000 / REFRESH_HZ);
+        return true;
+    }
+
+    default:
+        return true;
+    }
+}
+
+static bool decode(loopback_transport *lt, const uint8_t *data, size_t size)
+{
+    while (size) {
+        if (lt->partial_len) {
+            // Finish the command that the last write split.
+            size_t len = command_length(lt->partial, lt->partial_len);
+            while (!len && size) {
+                lt->partial[lt->partial_len++] = *data++;
+                size--;
+                len = command_length(lt->partial, lt->partial_len);
+            }
+            if (len == SIZE_MAX)
+                goto BAD;
+            if (!len)
+                return true;
+            size_t take = len - lt->partial_len;
+            if (take > size)
+                take = size;
+            memcpy(lt->partial + lt->partial_len, data, take);
+            lt->partial_len += take;
+            data += take;
+            size -= take;
+            if (lt->partial_len < len)
+                return true;
+            lt->partial_len = 0;
+            if (!execute(lt, lt->partial, len))
+                goto NOMEM;
+            continue;
+        }
+
+        size_t len = command_length(data, size);
+        if (len == SIZE_MAX)
+            goto BAD;
+        if (!len || len > size) {
+            memcpy(lt->partial, data, size);
+            lt->partial_len = size;
+            return true;
+        }
+        if (!execute(lt, data, len))
+            goto NOMEM;
+        data += len;
+        size -= len;
+    }
+    return true;
+
+BAD:
+    transport_set_error("loopback: unknown MPSSE command 0x%02x",
+                        lt->partial_len ? lt->partial[0] : data[0]);
+    lt->partial_len = 0;
+    return false;
+
+NOMEM:
+    transport_set_error("loopback: out of memory");
+    return false;
+}
+
+// Put `size' bytes on the modeled bus after whatever is already
+// queued.  Returns when they will have been sent.
+static uint64_t occupy_bus(loopback_transport *lt, size_t size)
+{
+    uint64_t now = stats_now_ns();
+    uint64_t start = lt->bus_free_ns > now ? lt->bus_free_ns : now;
+    lt->bus_free_ns = start + (uint64_t)(size * lt->ns_per_byte);
+    return lt->bus_free_ns;
+}
+
+static bool loopback_write(transport *t, const uint8_t *data, size_t size)
+{
+    loopback_transport *lt = (loopback_transport *)t;
+    if (!decode(lt, data, size))
+        return false;
+    sleep_until(occupy_bus(lt, size));
+    return true;
+}
+
+static bool loopback_read(transport *t, uint8_t *data, size_t size)
+{
+    loopback_transport *lt = (loopback_transport *)t;
+    sleep_until(stats_now_ns() + ROUND_TRIP_NS);
+    if (lt->reply_len < size) {
+        transport_set_error("loopback: read of %zu bytes, %zu available",
+                            size, lt->reply_len);
+        return false;
+    }
+    memcpy(data, lt->replies, size);
+    lt->reply_len -= size;
+    memmove(lt->replies, lt->replies + size, lt->reply_len);
+    return true;
+}
+
+// The handle is the time the transfer finishes.
+static void *loopback_submit(transport *t, uint8_t *data, size_t size)
+{
+    loopback_transport *lt = (loopback_transport *)t;
+    uint64_t *done_ns = malloc(sizeof *done_ns);
+    if (!done_ns) {
+        transport_set_error("loopback: out of memory");
+        return NULL;
+    }
+    if (!decode(lt, data, size)) {
+        free(done_ns);
+        return NULL;
+    }
+    *done_ns = occupy_bus(lt, size);
+    return done_ns;
+}
+
+static bool loopback_complete(transport *t, void *handle, size_t size)
+{
+    (void)t;
+    (void)size;
+    uint64_t *done_ns = handle;
+    sleep_until(*done_ns);
+    free(done_ns);
+    return true;
+}
+
+static void loopback_close(transport *t)
+{
+    loopback_transport *lt = (loopback_transport *)t;
+    free(lt->partial);
+    free(lt->packet);
+    free(lt->replies);
+    free(lt->row);
+    free(lt->front);
+    free(lt->back);
+    free(lt);
+}
+
+static const transport_ops loopback_ops = {
+    loopback_write, loopback_read, NULL, loopback_submit, loopback_complete,
+    NULL, loopback_close,
+};
+
+transport *open_loopback_transport(size_t LEDs_width,
+                                   size_t LEDs_height,
+                                   double bytes_per_sec)
+{
+    loopback_transport *lt = calloc(1, sizeof *lt);
+    if (!lt)
+        goto FAIL;
+    lt->base.ops = &loopback_ops;
+    lt->width = LEDs_width;
+    lt->height = LEDs_height;
+    lt->ns_per_byte = bytes_per_sec > 0 ? 1e9 / bytes_per_sec : 0;
+    lt->partial = malloc(MAX_COMMAND_BYTES);
+    lt->row = calloc(LEDs_width, sizeof *lt->row);
+    lt->front = calloc(LEDs_width * LEDs_height, sizeof *lt->front);
+    lt->back = calloc(LEDs_width * LEDs_height, sizeof *lt->back);
+    if (!lt->partial || !lt->row || !lt->front || !lt->back)
+        goto FAIL;
+    return &lt->base;
+
+FAIL:
+    if (lt)
+        loopback_close(&lt->base);
+    transport_set_error("loopback: out of memory");
+    return NULL;
+}
+
+const uint16_t *loopback_front_buffer(transport *t)
+{
+    return ((loopback_transport *)t)->front;
+}
+
+uint64_t loopback_frame_count(transport *t)
+{
+    return ((loopback_transport *)t)->frame_count;
+}
@@ -0,0 +1,81 @@
+#include "xfer.h"
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+struct xfer_window {
+    const xfer_ops  *ops;
+    void            *device;
+    _Atomic size_t   limit;
+    size_t           oldest;
+    size_t           count;
+    void            *handles[XFER_MAX_IN_FLIGHT];
+    size_t           sizes[XFER_MAX_IN_FLIGHT];
+};
+
+xfer_window *create_xfer_window(const xfer_ops *ops,
+                                void           *device,
+                                size_t          limit)
+{
+    xfer_window *w = calloc(1, sizeof *w);
+    if (!w)
+        return NULL;
+    w->ops = ops;
+    w->device = device;
+    if (!xfer_set_limit(w, limit)) {
+        free(w);
+        return NULL;
+    }
+    return w;
+}
+
+void destroy_xfer_window(xfer_window *w)
+{
+    if (w) {
+        while (w->count)
+            (void)xfer_retire(w);
+        free(w);
+    }
+}
+
+bool xfer_set_limit(xfer_window *w, size_t limit)
+{
+    if (limit < 1 || limit > XFER_MAX_IN_FLIGHT)
+        return false;
+    atomic_store_explicit(&w->limit, limit, memory_order_relaxed);
+    return true;
+}
+
+size_t xfer_limit(const xfer_window *w)
+{
+    return atomic_load_explicit(&w->limit, memory_order_relaxed);
+}
+
+size_t xfer_in_flight(const xfer_window *w)
+{
+    return w->count;
+}
+
+bool xfer_submit(xfer_window *w, uint8_t *data, size_t size)
+{
+    assert(w->count < XFER_MAX_IN_FLIGHT);
+    void *handle = w->ops->submit(w->device, data, size);
+    if (!handle)
+        return false;
+    size_t i = (w->oldest + w->count) % XFER_MAX_IN_FLIGHT;
+    w->handles[i] = handle;
+    w->sizes[i] = size;
+    w->count++;
+    return true;
+}
+
+bool xfer_retire(xfer_window *w)
+{
+    if (!w->count)
+        return false;
+    size_t i = w->oldest;
+    w->oldest = (i + 1) % XFER_MAX_IN_FLIGHT;
+    w->count--;
+    return w->ops->complete(w->device, w->handles[i], w->sizes[i]);
+}
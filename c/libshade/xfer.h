@@ -0,0 +1,45 @@
+#ifndef XFER_included
+#define XFER_included
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// An xfer window keeps several asynchronous writes in flight on one
+// device and retires them in the order they were submitted.  The
+// device is a pair of callbacks, so the window works the same over
+// libftdi or a mock.
+//
+// submit starts a write and returns a handle, or NULL on failure.
+// The data must stay untouched until the handle is completed.
+// complete blocks until the write is done and returns true if all
+// `size' bytes were written.
+//
+// One thread uses a window, except that xfer_set_limit may be
+// called from any thread.
+
+#define XFER_MAX_IN_FLIGHT 8
+
+typedef struct xfer_ops {
+    void *(*submit)(void *device, uint8_t *data, size_t size);
+    bool  (*complete)(void *device, void *handle, size_t size);
+} xfer_ops;
+
+typedef struct xfer_window xfer_window;
+
+extern xfer_window *create_xfer_window(const xfer_ops *,
+                                       void *device,
+                                       size_t limit);
+extern void         destroy_xfer_window(xfer_window *);
+
+extern bool         xfer_set_limit(xfer_window *, size_t limit);
+extern size_t       xfer_limit(const xfer_window *);
+extern size_t       xfer_in_flight(const xfer_window *);
+
+// xfer_submit requires xfer_in_flight < XFER_MAX_IN_FLIGHT.
+// xfer_retire waits for the oldest write and returns false if it
+// failed or nothing was in flight.
+extern bool         xfer_submit(xfer_window *, uint8_t *data, size_t size);
+extern bool         xfer_retire(xfer_window *);
+
+#endif /* !XFER_included */
@@ -0,0 +1,93 @@
+// Program cache test.  Fills the cache past PROGCACHE_MAX_ENTRIES
+// while a supersampled program is on screen.  The running program
+// must stay cached and alive.
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include <GLES2/gl2.h>
+
+#include "prog.h"
+#include "progcache.h"
+#include "shade.h"
+
+static const int LEDS_WIDTH  = 6 * 64;
+static const int LEDS_HEIGHT = 64;
+
+#define OTHER_PROGS (PROGCACHE_MAX_ENTRIES + 6)
+
+static const char vertex_shader_source[] =
+    "attribute vec3 vert;\n"
+    "\n"
+    "void main(void) {\n"
+    "    gl_Position = vec4(vert, 1.0);\n"
+    "}\n"
+    ;
+
+// Each program gets its own constant, so each has its own key.
+static shd_prog *create_gradient(int n)
+{
+    char frag[200];
+    snprintf(frag, sizeof frag,
+             "precision mediump float;\n"
+             "\n"
+             "void main(void) {\n"
+             "    gl_FragColor = vec4(gl_FragCoord.xy / 384.0, %d.0 / 100.0, 1.0);\n"
+             "}\n",
+             n);
+    shd_prog *prog = shd_create_prog();
+    shd_prog_attach_shader(prog, SHD_SHADER_VERTEX, vertex_shader_source);
+    shd_prog_attach_shader(prog, SHD_SHADER_FRAGMENT, frag);
+    return prog;
+}
+
+int main(int argc, char *argv[])
+{
+    // Optional transport, e.g. "loopback" to run without hardware.
+    if (argc > 1)
+        shd_set_transport(argv[1]);
+    shd_set_program_cache(NULL);
+    if (!shd_init(LEDS_WIDTH, LEDS_HEIGHT)) {
+        fprintf(stderr, "shd_init: %s\n", shd_last_error());
+        return 1;
+    }
+
+    shd_prog *running = create_gradient(0);
+    shd_prog_set_supersample(running, 2);
+    char *info_log = NULL;
+    if (!shd_prog_is_okay(running, &info_log)) {
+        fprintf(stderr, "info: %s\n", info_log);
+        return 1;
+    }
+    shd_use_prog(running);
+    shd_start();
+    usleep(100000);
+
+    GLuint before = prog_instantiate(running, NULL);
+    progcache_release(before);
+
+    int errors = 0;
+    for (int i = 1; i <= OTHER_PROGS; i++) {
+        shd_prog *other = create_gradient(i);
+        if (!shd_prog_is_okay(other, NULL)) {
+            fprintf(stderr, "program %d failed\n", i);
+            errors++;
+        }
+        shd_destroy_prog(other);
+    }
+    usleep(100000);
+
+    GLuint after = prog_instantiate(running, NULL);
+    if (after != before || !glIsProgram(before)) {
+        fprintf(stderr, "running program %u was evicted (now %u)\n",
+                before, after);
+        errors++;
+    }
+    progcache_release(after);
+
+    shd_stop();
+    shd_destroy_prog(running);
+    shd_deinit();
+    printf("progcache: %s\n", errors ? "FAILED" : "ok");
+    return errors != 0;
+}
@@ -0,0 +1,194 @@
+// Encode stage test.  Checks that color correction stays within the
+// LEDs' levels and dithers to the right average, and that the power
+// limiter passes frames under budget through, dims on the frame after
+// one goes over, and recovers once the load drops.
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "color.h"
+#include "power.h"
+
+#define WIDTH        21         // not a multiple of the vector width
+#define ROWS         4          // one dither period
+#define FRAMES       16         // one dither cycle
+#define SENTINEL     0xDEAD
+
+#define PANEL_WIDTH  64
+#define PANEL_ROWS   8
+#define LED_AMPS     0.02f      // per channel, full on
+#define BUDGET       10.0f      // amps; a white panel draws 30.72
+
+static const unsigned levels[3] = { 31, 63, 31 };
+
+static void unpack(LED_pixel px, unsigned rgb[3])
+{
+    rgb[0] = px >> 11;
+    rgb[1] = px >> 5 & 63;
+    rgb[2] = px & 31;
+}
+
+static int test_color(float gamma, const float gain[3])
+{
+    color_stage *cs = create_color_stage(gamma, gain);
+    if (!cs) {
+        fprintf(stderr, "color: can't create stage\n");
+        return 1;
+    }
+    int errors = 0;
+    for (unsigned v = 0; v < 256 && errors < 10; v++) {
+        uint32_t src[WIDTH];
+        for (size_t x = 0; x < WIDTH; x++)
+            src[x] = 0xFF000000 | v << 16 | v << 8 | v;
+        double sums[3] = { 0 };
+        for (unsigned f = 0; f < FRAMES; f++) {
+            color_next_frame(cs);
+            for (size_t y = 0; y < ROWS; y++) {
+                LED_pixel dst[WIDTH + 1];
+                dst[WIDTH] = SENTINEL;
+                color_convert_row(cs, dst, src, WIDTH, y);
+                if (dst[WIDTH] != SENTINEL) {
+                    fprintf(stderr, "color: wrote past the row\n");
+                    errors++;
+                }
+                for (size_t x = 0; x < WIDTH; x++) {
+                    unsigned rgb[3];
+                    unpack(dst[x], rgb);
+                    for (size_t c = 0; c < 3; c++)
+                        sums[c] += rgb[c];
+                }
+            }
+        }
+        for (size_t c = 0; c < 3; c++) {
+            float exact = gain[c] * powf(v / 255.0f, gamma);
+            exact = (exact > 1 ? 1 : exact) * levels[c];
+            float mean = sums[c] / (FRAMES * ROWS * WIDTH);
+            bool ok = fabsf(mean - exact) <= 1.0f / 16;
+            if (v == 0)
+                ok = ok && mean == 0;
+            if (v == 255 && gain[c] >= 1)
+                ok = ok && mean == levels[c];
+            if (!ok) {
+                fprintf(stderr,
+                        "color: gamma %g gain %g, value %u channel %zu: "
+                        "mean %g, expected %g\n",
+                        gamma, gain[c], v, c, mean, exact);
+                errors++;
+            }
+        }
+    }
+    destroy_color_stage(cs);
+    return errors;
+}
+
+static float amps(const LED_pixel *px, size_t count)
+{
+    float sum = 0;
+    for (size_t i = 0; i < count; i++) {
+        unsigned rgb[3];
+        unpack(px[i], rgb);
+        for (size_t c = 0; c < 3; c++)
+            sum += LED_AMPS * rgb[c] / levels[c];
+    }
+    return sum;
+}
+
+// Limits one frame of `px'.  Returns the amps it would draw.
+static float limit_frame(power_limiter *pl,
+                         LED_pixel      px,
+                         LED_pixel      frame[PANEL_ROWS][PANEL_WIDTH])
+{
+    power_next_frame(pl);
+    for (size_t y = 0; y < PANEL_ROWS; y++) {
+        for (size_t x = 0; x < PANEL_WIDTH; x++)
+            frame[y][x] = px;
+        power_limit_row(pl, frame[y], PANEL_WIDTH);
+    }
+    return amps(&frame[0][0], PANEL_ROWS * PANEL_WIDTH);
+}
+
+static bool unchanged(LED_pixel px, LED_pixel frame[PANEL_ROWS][PANEL_WIDTH])
+{
+    for (size_t y = 0; y < PANEL_ROWS; y++)
+        for (size_t x = 0; x < PANEL_WIDTH; x++)
+            if (frame[y][x] != px)
+                return false;
+    return true;
+}
+
+static int test_power(void)
+{
+    const float full_scale[3] = { LED_AMPS, LED_AMPS, LED_AMPS };
+    const LED_pixel white = 0xFFFF;
+    const LED_pixel dim = 4 << 11 | 8 << 5 | 4;  // about 4 amps
+    LED_pixel frame[PANEL_ROWS][PANEL_WIDTH];
+    int errors = 0;
+
+    power_limiter *pl = create_power_limiter(100, full_scale);
+    if (!pl) {
+        fprintf(stderr, "power: can't create limiter\n");
+        return 1;
+    }
+    for (int f = 0; f < 10; f++) {
+        limit_frame(pl, white, frame);
+        if (!unchanged(white, frame)) {
+            fprintf(stderr, "power: frame %d under budget was dimmed\n", f);
+            errors++;
+            break;
+        }
+    }
+    destroy_power_limiter(pl);
+
+    pl = create_power_limiter(BUDGET, full_scale);
+    if (!pl) {
+        fprintf(stderr, "power: can't create limiter\n");
+        return 1;
+    }
+    // The first frame over budget is only measured.  Every one after
+    // it is dimmed to the budget, not toward it.
+    limit_frame(pl, white, frame);
+    for (int f = 1; f < 20; f++) {
+        float a = limit_frame(pl, white, frame);
+        if (a > BUDGET * 1.01f || a < BUDGET * 0.85f) {
+            fprintf(stderr, "power: frame %d draws %g amps, budget %g\n",
+                    f, a, BUDGET);
+            errors++;
+            break;
+        }
+    }
+
+    // Back under budget, it recovers over many frames.
+    limit_frame(pl, dim, frame);
+    if (unchanged(dim, frame)) {
+        fprintf(stderr, "power: recovered in one frame\n");
+        errors++;
+    }
+    int f;
+    for (f = 1; f < 300; f++) {
+        limit_frame(pl, dim, frame);
+        if (unchanged(dim, frame))
+            break;
+    }
+    if (f == 300) {
+        fprintf(stderr, "power: no recovery after %d frames\n", f);
+        errors++;
+    }
+    destroy_power_limiter(pl);
+    return errors;
+}
+
+int main(void)
+{
+    const float unity[3] = { 1, 1, 1 };
+    const float tinted[3] = { 1.5f, 0.8f, 0.5f };
+    int errors = 0;
+    errors += test_color(1.0f, unity);
+    errors += test_color(2.2f, unity);
+    errors += test_color(2.2f, tinted);
+    errors += test_power();
+    if (!errors)
+        printf("encode: all tests passed\n");
+    return errors != 0;
+}
@@ -0,0 +1,272 @@
+// GLSL interpreter test.  Compiles small fragment shaders, shades a
+// few rows with them and checks every fragment's color, then checks
+// that bad shaders fail to compile.
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "glsl.h"
+
+#define WIDTH  40               // more than a span, so two calls a row
+#define HEIGHT 3
+#define UNSET  -7.0f            // lanes past the row's end stay this
+
+typedef void expect_fn(float x, float y, float color[4]);
+
+typedef struct shade_case {
+    const char *name;
+    const char *source;
+    expect_fn  *expect;         // color at (x, y)
+} shade_case;
+
+static void set(float color[4], float r, float g, float b, float a)
+{
+    color[0] = r;
+    color[1] = g;
+    color[2] = b;
+    color[3] = a;
+}
+
+static void expect_coord(float x, float y, float color[4])
+{
+    set(color, x, y, 0, 1);
+}
+
+static void expect_uniforms(float x, float y, float color[4])
+{
+    set(color, x / WIDTH, y / 4, 2, 1);
+}
+
+// Discarded fragments keep gl_FragColor's initial value.
+static void expect_branch(float x, float y, float color[4])
+{
+    if (x < 2)
+        set(color, 1, 1, 1, 1);
+    else if (x < 3)
+        set(color, 0, 0, 0, 1);
+    else
+        set(color, .25, .5, .75, 1);
+}
+
+static void expect_loop(float x, float y, float color[4])
+{
+    float s = 0;
+    for (int i = 0; i < 100 && i <= x; i++)
+        if (i != 1)
+            s += i;
+    int n = 1;
+    while (n < y)
+        n++;
+    set(color, s, n, 0, 1);
+}
+
+static void expect_runaway(float x, float y, float color[4])
+{
+    set(color, GLSL_MAX_ITERATIONS + 1, 1, 0, 1);
+}
+
+static void expect_functions(float x, float y, float color[4])
+{
+    set(color, x > 2 ? x * x : -1, y + 1, 6, 1);
+}
+
+static void expect_structs(float x, float y, float color[4])
+{
+    int k = y;
+    set(color, 2 * k, -2, 1, 1);
+}
+
+static void expect_builtins(float x, float y, float color[4])
+{
+    set(color, .8, .6, .4, 1);
+}
+
+static const shade_case shade_cases[] = {
+    {
+        "coord",
+        "void main() { gl_FragColor = vec4(gl_FragCoord.xy, 0.0, 1.0); }",
+        expect_coord,
+    },
+    {
+        "uniforms",
+        "uniform vec3 iResolution;\n"
+        "uniform float iTime;\n"
+        "void main() {\n"
+        "    vec2 uv = gl_FragCoord.xy / iResolution.xy;\n"
+        "    gl_FragColor = vec4(uv, iTime, 1.0);\n"
+        "}\n",
+        expect_uniforms,
+    },
+    {
+        "branch",
+        "void main() {\n"
+        "    float x = gl_FragCoord.x;\n"
+        "    if (x < 2.0) gl_FragColor = vec4(1.0);\n"
+        "    else if (x < 3.0) discard;\n"
+        "    else gl_FragColor = vec4(0.25, 0.5, 0.75, 1.0);\n"
+        "}\n",
+        expect_branch,
+    },
+    {
+        "loop",
+        "void main() {\n"
+        "    float s = 0.0;\n"
+        "    for (int i = 0; i < 100; i++) {\n"
+        "        if (float(i) > gl_FragCoord.x) break;\n"
+        "        if (i == 1) continue;\n"
+        "        s += float(i);\n"
+        "    }\n"
+        "    int n = 0;\n"
+        "    do n++; while (float(n) < gl_FragCoord.y);\n"
+        "    gl_FragColor = vec4(s, float(n), 0.0, 1.0);\n"
+        "}\n",
+        expect_loop,
+    },
+    {
+        // The first loop spends every iteration, so the second runs
+        // once.
+        "runaway",
+        "void main() {\n"
+        "    float x = 0.0;\n"
+        "    while (x >= 0.0) x += 1.0;\n"
+        "    int n = 0;\n"
+        "    do n++; while (n > 0);\n"
+        "    gl_FragColor = vec4(x, float(n), 0.0, 1.0);\n"
+        "}\n",
+        expect_runaway,
+    },
+    {
+        "functions",
+        "#define SQ(x) ((x) * (x))\n"
+        "float f(float x) { if (x > 2.0) return SQ(x); return -1.0; }\n"
+        "void g(in float a, out float b, inout float c) {\n"
+        "    b = a + 1.0; c *= 2.0;\n"
+        "}\n"
+        "void main() {\n"
+        "    float b, c = 3.0;\n"
+        "    g(gl_FragCoord.y, b, c);\n"
+        "    gl_FragColor = vec4(f(gl_FragCoord.x), b, c, 1.0);\n"
+        "}\n",
+        expect_functions,
+    },
+    {
+        "structs",
+        "struct light { vec3 color; float power; };\n"
+        "const mat2 rot = mat2(0.0, 1.0, -1.0, 0.0);\n"
+        "void main() {\n"
+        "    light l[3];\n"
+        "    for (int i = 0; i < 3; i++)\n"
+        "        l[i] = light(vec3(float(i)), 0.5);\n"
+        "    int k = int(gl_FragCoord.y);\n"
+        "    l[k].power = 2.0;\n"
+        "    vec2 v = rot * vec2(1.0, 2.0);\n"
+        "    gl_FragColor = vec4(l[k].color.x * l[k].power, v, 1.0);\n"
+        "}\n",
+        expect_structs,
+    },
+    {
+        "builtins",
+        "void main() {\n"
+        "    vec3 n = normalize(vec3(3.0, 0.0, 4.0));\n"
+        "    gl_FragColor = vec4(n.zx, clamp(fract(gl_FragCoord.x), 0.0, 0.4),\n"
+        "                        mix(0.0, 2.0, smoothstep(0.0, 1.0, 0.5)));\n"
+        "}\n",
+        expect_builtins,
+    },
+};
+
+static const char *const bad_sources[] = {
+    "void main() { gl_FragColor = vec3(1.0); }",
+    "void main() { undeclared = 1.0; }",
+    "void main() { gl_FragCoord = vec4(0.0); }",
+    "float f(float x) { return f(x); }\nvoid main() { f(1.0); }",
+    "void main() { float x = 1.0 }",
+    "#if 1\nvoid main() {}\n",
+    "void f() { discard; }\nvoid main() { f(); }",
+    "void notmain() {}",
+};
+
+static int test_shade(const shade_case *sc, glsl_context *ctx)
+{
+    char *info_log = NULL;
+    glsl_program *gp = glsl_compile(sc->source, &info_log);
+    if (!gp) {
+        fprintf(stderr, "%s: %s\n", sc->name, info_log);
+        free(info_log);
+        return 1;
+    }
+    for (size_t i = 0; i < glsl_uniform_count(gp); i++) {
+        if (!strcmp(glsl_uniform_name(gp, i), "iResolution"))
+            glsl_bind_input(gp, i, GI_RESOLUTION);
+        else if (!strcmp(glsl_uniform_name(gp, i), "iTime"))
+            glsl_bind_input(gp, i, GI_TIME);
+    }
+
+    native_inputs in = { .resolution = { WIDTH, 4, 1 }, .time = 2 };
+    int errors = 0;
+    for (size_t y = 0; y < HEIGHT && !errors; y++) {
+        for (size_t x = 0; x < WIDTH && !errors; x += GLSL_SPAN) {
+            size_t count = WIDTH - x < GLSL_SPAN ? WIDTH - x : GLSL_SPAN;
+            float color[4][GLSL_SPAN];
+            for (size_t j = 0; j < 4; j++)
+                for (size_t l = 0; l < GLSL_SPAN; l++)
+                    color[j][l] = UNSET;
+            glsl_shade(gp, ctx, &in, x + 0.5f, y + 0.5f, count, color);
+            for (size_t l = 0; l < GLSL_SPAN && !errors; l++) {
+                float expect[4] = { UNSET, UNSET, UNSET, UNSET };
+                if (l < count)
+                    sc->expect(x + l + 0.5f, y + 0.5f, expect);
+                for (size_t j = 0; j < 4; j++) {
+                    float tolerance = 1e-5f * fmaxf(1, fabsf(expect[j]));
+                    if (fabsf(color[j][l] - expect[j]) > tolerance)
+                        errors++;
+                }
+                if (errors)
+                    fprintf(stderr,
+                            "%s: at (%g, %g) got (%g %g %g %g), "
+                            "expected (%g %g %g %g)\n",
+                            sc->name, x + l + 0.5f, y + 0.5f,
+                            color[0][l], color[1][l],
+                            color[2][l], color[3][l],
+                            expect[0], expect[1], expect[2], expect[3]);
+            }
+        }
+    }
+    glsl_destroy(gp);
+    return errors != 0;
+}
+
+static int test_bad(const char *source)
+{
+    char *info_log = NULL;
+    glsl_program *gp = glsl_compile(source, &info_log);
+    if (gp) {
+        fprintf(stderr, "compiled, but should not have:\n%s\n", source);
+        glsl_destroy(gp);
+        return 1;
+    }
+    if (!info_log || !*info_log) {
+        fprintf(stderr, "no info log for:\n%s\n", source);
+        free(info_log);
+        return 1;
+    }
+    free(info_log);
+    return 0;
+}
+
+int main(void)
+{
+    glsl_context *ctx = glsl_create_context();
+    int errors = 0;
+    for (size_t i = 0; i < sizeof shade_cases / sizeof shade_cases[0]; i++)
+        errors += test_shade(&shade_cases[i], ctx);
+    for (size_t i = 0; i < sizeof bad_sources / sizeof bad_sources[0]; i++)
+        errors += test_bad(bad_sources[i]);
+    glsl_destroy_context(ctx);
+    if (!errors)
+        printf("glsl: all tests passed\n");
+    return errors != 0;
+}
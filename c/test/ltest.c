@@ -85,9 +85,15 @@ static const char frag_shader_source[] =
     "}\n"
     ;
 
-int main()
+int main(int argc, char *argv[])
 {
-    shd_init(LEDS_WIDTH, LEDS_HEIGHT);
+    // Optional transport, e.g. "loopback" to run without hardware.
+    if (argc > 1)
+        shd_set_transport(argv[1]);
+    if (!shd_init(LEDS_WIDTH, LEDS_HEIGHT)) {
+        fprintf(stderr, "shd_init: %s\n", shd_last_error());
+        return 1;
+    }
     shd_prog *prog = shd_create_prog();
     shd_prog_attach_shader(prog, SHD_SHADER_VERTEX, vertex_shader_source);
     shd_prog_attach_shader(prog, SHD_SHADER_FRAGMENT, frag_shader_source);
@@ -0,0 +1,69 @@
+// Benchmark a native shader on the CPU renderer.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "shade.h"
+
+static const int LEDS_WIDTH  = 6 * 64;
+static const int LEDS_HEIGHT = 64;
+
+// A triangle wave in [0, 1].
+static shd_lanes tri(shd_lanes x)
+{
+    typedef int32_t ints __attribute__((vector_size(sizeof (shd_lanes))));
+    shd_lanes f = x - __builtin_convertvector(__builtin_convertvector(x, ints),
+                                              shd_lanes);
+    shd_lanes d = 2.0f * f - 1.0f;
+    ints neg = d < 0.0f;
+    return (shd_lanes)(((ints)-d & neg) | ((ints)d & ~neg));
+}
+
+// Diagonal bands of color, scrolling.
+static void bands(shd_vec4                *frag_color,
+                  const shd_vec2          *frag_coord,
+                  const shd_native_inputs *in,
+                  void                    *user)
+{
+    shd_lanes u = frag_coord->x / in->resolution[1];
+    shd_lanes v = frag_coord->y / in->resolution[1];
+    frag_color->x = tri(u + v + in->time * 0.25f + 16.0f);
+    frag_color->y = tri(u - v + in->time * 0.5f + 16.0f);
+    frag_color->z = tri(v * 2.0f + in->time + 16.0f);
+}
+
+int main(int argc, char *argv[])
+{
+    // Optional transport, e.g. "loopback" to run without hardware.
+    if (argc > 1)
+        shd_set_transport(argv[1]);
+    double seconds = argc > 2 ? atof(argv[2]) : 1.0;
+    if (!shd_init(LEDS_WIDTH, LEDS_HEIGHT)) {
+        fprintf(stderr, "shd_init: %s\n", shd_last_error());
+        return 1;
+    }
+    shd_prog *prog = shd_create_prog();
+    shd_prog_set_native(prog, bands, NULL);
+    char *info_log = NULL;
+    if (!shd_prog_is_okay(prog, &info_log)) {
+        fprintf(stderr, "info: %s\n", info_log);
+        return 1;
+    }
+    shd_use_prog(prog);
+
+    shd_reset_stats();
+    shd_start();
+    usleep(seconds * 1e6);
+    shd_stop();
+
+    shd_stats stats;
+    shd_get_stats(&stats);
+    printf("native: %.1f FPS, render mean %.3f msec, p99 %.3f msec\n",
+           shd_fps(),
+           stats.render_time.mean * 1000,
+           stats.render_time.p99 * 1000);
+    shd_destroy_prog(prog);
+    shd_deinit();
+    return stats.frames_shown ? 0 : 1;
+}
@@ -0,0 +1,138 @@
+// Output test.  Encodes frames, sends them through the loopback
+// transport, and checks that the simulated panel shows them.  Then
+// measures output throughput over a modeled USB link.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "leds.h"
+#include "transport.h"
+
+#define LEDS_WIDTH     384
+#define LEDS_HEIGHT     64
+#define BENCH_FRAMES   200
+#define BENCH_RATE   30e6           // bytes/sec, roughly FT2232H bulk
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1.e9;
+}
+
+static LEDs_context *open_LEDs(double rate, transport **tp)
+{
+    *tp = open_loopback_transport(LEDS_WIDTH, LEDS_HEIGHT, rate);
+    LEDs_context *leds = init_LEDs(*tp,
+                                   LEDS_WIDTH, LEDS_HEIGHT,
+                                   LEDS_WIDTH, LEDS_HEIGHT,
+                                   0);
+    if (!leds)
+        fprintf(stderr, "init_LEDs: %s\n", transport_last_error());
+    return leds;
+}
+
+static void fill(LED_pixel *pixels, unsigned seed)
+{
+    for (size_t i = 0; i < LEDS_WIDTH * LEDS_HEIGHT; i++)
+        pixels[i] = seed * 2654435761u + i;
+}
+
+static bool send(LEDs_context *leds, LED_cmd *cmds, size_t size)
+{
+    return LEDs_submit_cmds(leds, cmds, size) && LEDs_retire_cmds(leds);
+}
+
+// Full frames, then delta frames that change one row at a time, then
+// delta frames that change every row.  The panel must match the
+// source after every frame.
+static int test_loopback(void)
+{
+    transport *tp;
+    LEDs_context *leds = open_LEDs(0, &tp);
+    if (!leds)
+        return 1;
+    LED_pixel *pixels = LEDs_alloc_framebuffer(leds);
+    LED_cmd *cmds = LEDs_alloc_cmdbuffer(leds);
+    size_t frame_bytes = LEDS_WIDTH * LEDS_HEIGHT * sizeof *pixels;
+
+    int errors = 0;
+    for (unsigned frame = 0; frame < 10; frame++) {
+        if (frame == 3)
+            LEDs_set_delta(leds, true);
+        if (frame < 3 || frame >= 8)
+            fill(pixels, frame);
+        else
+            pixels[(frame * 7 % LEDS_HEIGHT) * LEDS_WIDTH + frame] ^= 0xFFFF;
+        size_t size = LEDs_create_cmds(leds, pixels, cmds);
+        if (!send(leds, cmds, size)) {
+            fprintf(stderr, "send: %s\n", transport_last_error());
+            errors++;
+            break;
+        }
+        if (memcmp(loopback_front_buffer(tp), pixels, frame_bytes)) {
+            fprintf(stderr, "loopback: frame %u differs\n", frame);
+            errors++;
+        }
+    }
+    if (loopback_frame_count(tp) != 10) {
+        fprintf(stderr, "loopback: %llu swaps, expected 10\n",
+                (unsigned long long)loopback_frame_count(tp));
+        errors++;
+    }
+    printf("loopback: %s\n", errors ? "FAILED" : "ok");
+
+    LEDs_free_cmdbuffer(cmds);
+    LEDs_free_framebuffer(pixels);
+    deinit_LEDs(leds);
+    return errors;
+}
+
+// Throughput with one and with several transfers in flight.
+static int bench_output(size_t transfers)
+{
+    transport *tp;
+    LEDs_context *leds = open_LEDs(BENCH_RATE, &tp);
+    if (!leds || !LEDs_set_max_transfers(leds, transfers))
+        return 1;
+    LED_pixel *pixels = LEDs_alloc_framebuffer(leds);
+    LED_cmd *cmds[8];
+    for (size_t i = 0; i < transfers; i++)
+        cmds[i] = LEDs_alloc_cmdbuffer(leds);
+
+    int errors = 0;
+    double t0 = now_seconds();
+    size_t size = 0;
+    for (size_t frame = 0; frame < BENCH_FRAMES; frame++) {
+        LED_cmd *cb = cmds[frame % transfers];
+        if (LEDs_transfers_in_flight(leds) == transfers)
+            errors += !LEDs_retire_cmds(leds);
+        fill(pixels, frame);
+        size = LEDs_create_cmds(leds, pixels, cb);
+        errors += !LEDs_submit_cmds(leds, cb, size);
+    }
+    while (LEDs_transfers_in_flight(leds))
+        errors += !LEDs_retire_cmds(leds);
+    double dt = now_seconds() - t0;
+
+    printf("output, %zu in flight: %7.1f frames/sec, link %4.0f%% busy\n",
+           transfers,
+           BENCH_FRAMES / dt,
+           100 * BENCH_FRAMES * size / BENCH_RATE / dt);
+
+    for (size_t i = 0; i < transfers; i++)
+        LEDs_free_cmdbuffer(cmds[i]);
+    LEDs_free_framebuffer(pixels);
+    deinit_LEDs(leds);
+    return errors;
+}
+
+int main(void)
+{
+    int errors = test_loopback();
+    errors += bench_output(1);
+    errors += bench_output(2);
+    return errors != 0;
+}
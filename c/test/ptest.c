@@ -1,70 +1,541 @@
+// Pipeline test.  Verifies the inter-thread queues and compares the
+// mutex queue with the lock-free ring for throughput and latency.
+// Also runs the output stage's async transfer window on a mock USB
+// device.
+
 #include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "queue.h"
+#include "ring.h"
+#include "xfer.h"
+
+#define THROUGHPUT_ITEMS 200000
+#define LATENCY_ROUNDS      20000
+#define OUTPUT_FRAMES        2000
+
+// Both implementations share one protocol.  Wrap them so the
+// tests and benchmarks can run against either.
+
+typedef struct pipe_impl {
+    const char *name;
+    void       *(*create)(size_t size);
+    void        (*destroy)(void *);
+    size_t      (*acquire_empty)(void *);
+    void        (*release_full)(void *);
+    size_t      (*acquire_full)(void *);
+    void        (*release_empty)(void *);
+} pipe_impl;
+
+#define WRAP_IMPL(T)                                                    \
+    static void *T##_create(size_t size) { return create_##T(size); }   \
+    static void T##_destroy(void *q) { destroy_##T(q); }                \
+    static size_t T##_aq_empty(void *q) { return T##_acquire_empty(q); } \
+    static void T##_rl_full(void *q) { T##_release_full(q); }           \
+    static size_t T##_aq_full(void *q) { return T##_acquire_full(q); }  \
+    static void T##_rl_empty(void *q) { T##_release_empty(q); }         \
+    static const pipe_impl T##_impl = {                                \
+        #T,                                                             \
+        T##_create, T##_destroy,                                        \
+        T##_aq_empty, T##_rl_full, T##_aq_full, T##_rl_empty,           \
+    };
 
-typedef struct queues {
-    queue *a;
-    queue *b;
+WRAP_IMPL(queue)
+WRAP_IMPL(ring)
+
+static const pipe_impl *impls[] = { &queue_impl, &ring_impl };
+static const size_t impl_count = sizeof impls / sizeof impls[0];
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1.e9;
+}
+
+// Hello, World: three threads and two queues, like exec.c.
+
+typedef struct hello {
+    const pipe_impl *impl;
+    void *a;
+    void *b;
     char b0[10];
     char b1[10];
-} queues;
+    char out[32];
+} hello;
 
-static void *produce(void *user_data)
+static void *hello_produce(void *user_data)
 {
-    queues *qs = user_data;
+    hello *h = user_data;
     for (const char *src = "_Hello, World!\n"; *src; src++) {
-        size_t i = queue_acquire_empty(qs->a);
-        qs->b0[i] = src[1];
-        queue_release_full(qs->a);
+        size_t i = h->impl->acquire_empty(h->a);
+        h->b0[i] = src[1];
+        h->impl->release_full(h->a);
     }
     return NULL;
 }
 
-static void *mediate(void *user_data)
+static void *hello_mediate(void *user_data)
 {
-    queues *qs = user_data;
+    hello *h = user_data;
     while (1) {
-        size_t i0 = queue_acquire_full(qs->a);
-        char c = qs->b0[i0];
-        queue_release_empty(qs->a);
-        size_t i1 = queue_acquire_empty(qs->b);
-        qs->b1[i1] = c;
-        queue_release_full(qs->b);
+        size_t i0 = h->impl->acquire_full(h->a);
+        char c = h->b0[i0];
+        h->impl->release_empty(h->a);
+        size_t i1 = h->impl->acquire_empty(h->b);
+        h->b1[i1] = c;
+        h->impl->release_full(h->b);
         if (c == 0)
             break;
     }
     return NULL;
 }
 
-static void *consume(void *user_data)
+static void *hello_consume(void *user_data)
 {
-    queues *qs = user_data;
+    hello *h = user_data;
+    size_t n = 0;
     while (1) {
-        size_t index = queue_acquire_full(qs->b);
-        char c = qs->b1[index];
-        queue_release_empty(qs->b);
+        size_t index = h->impl->acquire_full(h->b);
+        char c = h->b1[index];
+        h->impl->release_empty(h->b);
+        h->out[n++] = c;
         if (c == '\0')
             break;
-        putchar(c);
-        fflush(stdout);
     }
     return NULL;
 }
 
-int main(void)
+static int test_hello(const pipe_impl *impl)
 {
-    queues qs;
-    qs.a = create_queue(4);
-    qs.b = create_queue(3);
+    hello h;
+    memset(&h, 0, sizeof h);
+    h.impl = impl;
+    h.a = impl->create(4);
+    h.b = impl->create(3);
 
     pthread_t producer, middle, consumer;
-
-    pthread_create(&producer, NULL, produce, &qs);
-    pthread_create(&middle, NULL, mediate, &qs);
-    pthread_create(&consumer, NULL, consume, &qs);
+    pthread_create(&producer, NULL, hello_produce, &h);
+    pthread_create(&middle, NULL, hello_mediate, &h);
+    pthread_create(&consumer, NULL, hello_consume, &h);
     pthread_join(producer, NULL);
     pthread_join(middle, NULL);
     pthread_join(consumer, NULL);
+
+    impl->destroy(h.a);
+    impl->destroy(h.b);
+
+    fputs(h.out, stdout);
+    if (strcmp(h.out, "Hello, World!\n")) {
+        fprintf(stderr, "%s: hello test failed\n", impl->name);
+        return 1;
+    }
+    return 0;
+}
+
+// Throughput: stream items through one queue and check the sum.
+
+typedef struct stream {
+    const pipe_impl *impl;
+    void     *q;
+    size_t    item_count;
+    uint64_t *slots;
+    uint64_t  sum;
+} stream;
+
+static void *stream_produce(void *user_data)
+{
+    stream *s = user_data;
+    for (uint64_t i = 1; i <= s->item_count; i++) {
+        size_t index = s->impl->acquire_empty(s->q);
+        s->slots[index] = i;
+        s->impl->release_full(s->q);
+    }
+    return NULL;
+}
+
+static void *stream_consume(void *user_data)
+{
+    stream *s = user_data;
+    uint64_t sum = 0;
+    for (size_t i = 0; i < s->item_count; i++) {
+        size_t index = s->impl->acquire_full(s->q);
+        sum += s->slots[index];
+        s->impl->release_empty(s->q);
+    }
+    s->sum = sum;
+    return NULL;
+}
+
+static int bench_throughput(const pipe_impl *impl,
+                            size_t            size,
+                            size_t            item_count)
+{
+    stream s = {
+        .impl       = impl,
+        .q          = impl->create(size),
+        .item_count = item_count,
+        .slots      = calloc(size, sizeof *s.slots),
+    };
+
+    double t0 = now_seconds();
+    pthread_t producer, consumer;
+    pthread_create(&producer, NULL, stream_produce, &s);
+    pthread_create(&consumer, NULL, stream_consume, &s);
+    pthread_join(producer, NULL);
+    pthread_join(consumer, NULL);
+    double dt = now_seconds() - t0;
+
+    impl->destroy(s.q);
+    free(s.slots);
+
+    printf("  %-5s size %3zu: %8.3f Mitems/sec\n",
+           impl->name, size, item_count / dt / 1.e6);
+    uint64_t expected = (uint64_t)item_count * (item_count + 1) / 2;
+    if (s.sum != expected) {
+        fprintf(stderr, "%s: throughput checksum mismatch\n", impl->name);
+        return 1;
+    }
     return 0;
 }
+
+// Mailbox: the producer never blocks.  The consumer must see an
+// increasing sequence ending with the last item, and every item
+// must be either consumed or counted as dropped.
+
+typedef struct mailbox {
+    ring     *r;
+    size_t    item_count;
+    uint64_t  slots[3];
+    size_t    consumed;
+    bool      in_order;
+} mailbox;
+
+static void *mailbox_produce(void *user_data)
+{
+    mailbox *m = user_data;
+    for (uint64_t i = 1; i <= m->item_count; i++) {
+        size_t index = ring_acquire_empty(m->r);
+        m->slots[index] = i;
+        ring_release_full(m->r);
+    }
+    return NULL;
+}
+
+static void *mailbox_consume(void *user_data)
+{
+    mailbox *m = user_data;
+    uint64_t prev = 0;
+    while (prev != m->item_count) {
+        size_t index = ring_acquire_full(m->r);
+        uint64_t item = m->slots[index];
+        ring_release_empty(m->r);
+        if (item <= prev)
+            m->in_order = false;
+        prev = item;
+        m->consumed++;
+    }
+    return NULL;
+}
+
+static int test_mailbox(size_t item_count)
+{
+    mailbox m = {
+        .r          = create_mailbox_ring(),
+        .item_count = item_count,
+        .in_order   = true,
+    };
+
+    pthread_t producer, consumer;
+    pthread_create(&producer, NULL, mailbox_produce, &m);
+    pthread_create(&consumer, NULL, mailbox_consume, &m);
+    pthread_join(producer, NULL);
+    pthread_join(consumer, NULL);
+
+    uint64_t dropped = ring_dropped_count(m.r);
+    destroy_ring(m.r);
+
+    printf("mailbox, %zu items: %zu consumed, %llu dropped\n",
+           item_count, m.consumed, (unsigned long long)dropped);
+    if (!m.in_order || m.consumed + dropped != item_count) {
+        fprintf(stderr, "mailbox test failed\n");
+        return 1;
+    }
+    return 0;
+}
+
+// Interrupt: a consumer blocked on an empty ring and a producer
+// blocked on a full one both come back with RING_INTERRUPTED, and
+// after ring_resume the ring works as before.
+
+typedef struct blocked {
+    ring     *r;
+    bool      producer;
+    size_t    result;
+} blocked;
+
+static void *blocked_main(void *user_data)
+{
+    blocked *b = user_data;
+    b->result = b->producer ? ring_acquire_empty(b->r)
+                            : ring_acquire_full(b->r);
+    return NULL;
+}
+
+static bool interrupts(ring *r, bool producer)
+{
+    blocked b = { .r = r, .producer = producer };
+    pthread_t thread;
+    pthread_create(&thread, NULL, blocked_main, &b);
+    usleep(10000);
+    ring_interrupt(r);
+    pthread_join(thread, NULL);
+    ring_resume(r);
+    return b.result == RING_INTERRUPTED;
+}
+
+static int test_interrupt(void)
+{
+    ring *r = create_ring(1);
+    bool ok = interrupts(r, false);
+    size_t index = ring_acquire_empty(r);
+    ring_release_full(r);
+    ok &= interrupts(r, true);
+    ok &= ring_acquire_full(r) == index;
+    ring_release_empty(r);
+    destroy_ring(r);
+
+    r = create_mailbox_ring();
+    ok &= interrupts(r, false);
+    destroy_ring(r);
+
+    printf("interrupt: %s\n", ok ? "ok" : "failed");
+    return !ok;
+}
+
+// Poll: a mailbox consumer that never waits sees only the newest
+// frame, once.
+
+static int test_poll(void)
+{
+    uint64_t slots[3];
+    ring *r = create_mailbox_ring();
+    bool ok = ring_poll_full(r) == RING_EMPTY;
+    for (uint64_t i = 1; i <= 2; i++) {
+        slots[ring_acquire_empty(r)] = i;
+        ring_release_full(r);
+    }
+    size_t index = ring_poll_full(r);
+    ok &= index != RING_EMPTY && slots[index] == 2;
+    ok &= ring_poll_full(r) == RING_EMPTY;
+    destroy_ring(r);
+
+    printf("poll: %s\n", ok ? "ok" : "failed");
+    return !ok;
+}
+
+// Output: a producer streams frames through a ring while the
+// consumer keeps several of them in flight on a mock USB device, as
+// the exec output thread does.  The mock checks at completion that
+// each buffer still holds the frame it held at submission, so a
+// buffer recycled while on the wire is caught.
+
+typedef struct mock_usb {
+    size_t   in_flight;
+    size_t   max_in_flight;
+    uint64_t next_frame;
+    bool     ok;
+} mock_usb;
+
+static void *mock_submit(void *device, uint8_t *data, size_t size)
+{
+    mock_usb *usb = device;
+    if (++usb->in_flight > usb->max_in_flight)
+        usb->max_in_flight = usb->in_flight;
+    return data;
+}
+
+static bool mock_complete(void *device, void *handle, size_t size)
+{
+    mock_usb *usb = device;
+    sched_yield();              // let the producer try to catch up
+    uint64_t frame;
+    memcpy(&frame, handle, sizeof frame);
+    if (size != sizeof frame || frame != usb->next_frame++)
+        usb->ok = false;
+    usb->in_flight--;
+    return true;
+}
+
+static const xfer_ops mock_ops = { mock_submit, mock_complete };
+
+typedef struct output {
+    ring     *r;
+    size_t    frame_count;
+    uint64_t *slots;
+} output;
+
+static void *output_produce(void *user_data)
+{
+    output *o = user_data;
+    for (uint64_t i = 1; i <= o->frame_count; i++) {
+        size_t index = ring_acquire_empty(o->r);
+        o->slots[index] = i;
+        ring_release_full(o->r);
+    }
+    return NULL;
+}
+
+static int test_output(size_t frame_count, size_t depth, size_t transfers)
+{
+    mock_usb usb = { .next_frame = 1, .ok = true };
+    output o = {
+        .r           = create_ring(depth),
+        .frame_count = frame_count,
+        .slots       = calloc(depth, sizeof *o.slots),
+    };
+    xfer_window *w = create_xfer_window(&mock_ops, &usb, transfers);
+    size_t limit = xfer_limit(w);
+    if (limit > ring_hold_limit(o.r))
+        limit = ring_hold_limit(o.r);
+
+    pthread_t producer;
+    pthread_create(&producer, NULL, output_produce, &o);
+    for (size_t i = 0; i < frame_count; i++) {
+        while (xfer_in_flight(w) >= limit) {
+            if (!xfer_retire(w))
+                usb.ok = false;
+            ring_release_empty(o.r);
+        }
+        size_t index = ring_acquire_full(o.r);
+        if (!xfer_submit(w, (uint8_t *)&o.slots[index], sizeof o.slots[index]))
+            usb.ok = false;
+    }
+    while (xfer_in_flight(w)) {
+        (void)xfer_retire(w);
+        ring_release_empty(o.r);
+    }
+    pthread_join(producer, NULL);
+
+    destroy_xfer_window(w);
+    destroy_ring(o.r);
+    free(o.slots);
+
+    printf("output, depth %zu, %zu transfers: %zu max in flight\n",
+           depth, transfers, usb.max_in_flight);
+    if (!usb.ok ||
+        usb.next_frame != frame_count + 1 ||
+        usb.max_in_flight != limit) {
+        fprintf(stderr, "output test failed\n");
+        return 1;
+    }
+    return 0;
+}
+
+// Latency: bounce a token between two threads through a pair of
+// queues and time each round trip.
+
+typedef struct pingpong {
+    const pipe_impl *impl;
+    void   *ping;
+    void   *pong;
+    size_t  round_count;
+} pingpong;
+
+static void *pong_main(void *user_data)
+{
+    pingpong *pp = user_data;
+    for (size_t i = 0; i < pp->round_count; i++) {
+        (void)pp->impl->acquire_full(pp->ping);
+        pp->impl->release_empty(pp->ping);
+        (void)pp->impl->acquire_empty(pp->pong);
+        pp->impl->release_full(pp->pong);
+    }
+    return NULL;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double da = *(const double *)a, db = *(const double *)b;
+    return (da > db) - (da < db);
+}
+
+static int bench_latency(const pipe_impl *impl, size_t round_count)
+{
+    pingpong pp = {
+        .impl        = impl,
+        .ping        = impl->create(1),
+        .pong        = impl->create(1),
+        .round_count = round_count,
+    };
+    double *rtt = calloc(round_count, sizeof *rtt);
+
+    pthread_t peer;
+    pthread_create(&peer, NULL, pong_main, &pp);
+    for (size_t i = 0; i < round_count; i++) {
+        double t0 = now_seconds();
+        (void)impl->acquire_empty(pp.ping);
+        impl->release_full(pp.ping);
+        (void)impl->acquire_full(pp.pong);
+        impl->release_empty(pp.pong);
+        rtt[i] = now_seconds() - t0;
+    }
+    pthread_join(peer, NULL);
+
+    qsort(rtt, round_count, sizeof *rtt, compare_doubles);
+    double sum = 0;
+    for (size_t i = 0; i < round_count; i++)
+        sum += rtt[i];
+    printf("  %-5s round trip: mean %7.2f usec, p50 %7.2f, p99 %7.2f, "
+           "max %8.2f\n",
+           impl->name,
+           sum / round_count * 1.e6,
+           rtt[round_count / 2] * 1.e6,
+           rtt[round_count * 99 / 100] * 1.e6,
+           rtt[round_count - 1] * 1.e6);
+
+    free(rtt);
+    impl->destroy(pp.ping);
+    impl->destroy(pp.pong);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t item_count = THROUGHPUT_ITEMS;
+    size_t round_count = LATENCY_ROUNDS;
+    if (argc > 1)
+        item_count = strtoul(argv[1], NULL, 0);
+    if (argc > 2)
+        round_count = strtoul(argv[2], NULL, 0);
+
+    int errors = 0;
+    for (size_t i = 0; i < impl_count; i++)
+        errors += test_hello(impls[i]);
+
+    printf("throughput, %zu items\n", item_count);
+    static const size_t sizes[] = { 1, 4, 200 };
+    for (size_t j = 0; j < sizeof sizes / sizeof sizes[0]; j++)
+        for (size_t i = 0; i < impl_count; i++)
+            errors += bench_throughput(impls[i], sizes[j], item_count);
+
+    errors += test_mailbox(item_count);
+    errors += test_interrupt();
+    errors += test_poll();
+    errors += test_output(OUTPUT_FRAMES, 3, 2);
+    errors += test_output(OUTPUT_FRAMES, 4, 4);
+    errors += test_output(OUTPUT_FRAMES, 2, 8);
+
+    printf("latency, %zu round trips\n", round_count);
+    for (size_t i = 0; i < impl_count; i++)
+        errors += bench_latency(impls[i], round_count);
+
+    return errors != 0;
+}
@@ -0,0 +1,190 @@
+// CPU renderer test.  Draws shaders that encode each pixel's
+// coordinates in its color, natively and through the GLSL
+// interpreter, at sizes that aren't whole tiles, with and without
+// workers.  Every pixel must hold its own coordinates, and nothing
+// past a row's width or the last row may be written.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cpurender.h"
+#include "prog.h"
+
+#define PAD         5           // pixels between a row's end and the pitch
+#define SENTINEL    0xA5A5A5A5u
+#define MAX_WORKERS 5
+#define FRAMES      2
+
+typedef struct size {
+    size_t width;
+    size_t height;
+} size;
+
+static const size sizes[] = {
+    { 384, 64 },                // six square faces
+    { 100, 30 },
+    { 37, 5 },
+    { 7, 3 },
+};
+
+static const size_t worker_counts[] = { 0, MAX_WORKERS };
+
+// Red is x mod r_levels, green y mod g_levels, and blue x / r_levels,
+// each as a level of its channel.
+typedef struct encoding {
+    int r_levels;
+    int g_levels;
+    int b_levels;
+} encoding;
+
+static const encoding enc565  = {  32,  64,  32 };
+static const encoding enc8888 = { 256, 256, 256 };
+
+static void coords(native_vec4         *frag_color,
+                   const native_vec2   *frag_coord,
+                   const native_inputs *in,
+                   void                *user)
+{
+    const encoding *e = user;
+    native_int x = __builtin_convertvector(frag_coord->x, native_int);
+    native_int y = __builtin_convertvector(frag_coord->y, native_int);
+    frag_color->x = __builtin_convertvector(x % e->r_levels, native_float) /
+                    (float)(e->r_levels - 1);
+    frag_color->y = __builtin_convertvector(y % e->g_levels, native_float) /
+                    (float)(e->g_levels - 1);
+    frag_color->z = __builtin_convertvector(x / e->r_levels, native_float) /
+                    (float)(e->b_levels - 1);
+}
+
+static prog *create_glsl_coords(const encoding *e)
+{
+    static const char vertex_source[] =
+        "attribute vec3 vert;\n"
+        "void main(void) { gl_Position = vec4(vert, 1.0); }\n";
+    char fragment_source[400];
+    snprintf(fragment_source, sizeof fragment_source,
+             "precision highp float;\n"
+             "void main(void) {\n"
+             "    vec2 p = floor(gl_FragCoord.xy);\n"
+             "    gl_FragColor = vec4(mod(p.x, %d.0) / %d.0,\n"
+             "                        mod(p.y, %d.0) / %d.0,\n"
+             "                        floor(p.x / %d.0) / %d.0,\n"
+             "                        1.0);\n"
+             "}\n",
+             e->r_levels, e->r_levels - 1,
+             e->g_levels, e->g_levels - 1,
+             e->r_levels, e->b_levels - 1);
+    prog *pp = create_prog();
+    char *info_log = NULL;
+    if (!pp ||
+        !prog_attach_shader(pp, PST_VERTEX, vertex_source) ||
+        !prog_attach_shader(pp, PST_FRAGMENT, fragment_source) ||
+        !prog_use_cpu(pp, &info_log)) {
+        fprintf(stderr, "glsl: %s\n", info_log ? info_log : "no program");
+        free(info_log);
+        if (pp)
+            destroy_prog(pp);
+        return NULL;
+    }
+    return pp;
+}
+
+// What the pixel at column x of LED row y holds.  GL's y is flipped.
+static uint32_t expected(const size *sz, bool rgba, size_t x, size_t y)
+{
+    size_t gl_y = sz->height - 1 - y;
+    if (rgba)
+        return 0xFF000000 | x / 256 << 16 | gl_y % 256 << 8 | x % 256;
+    return x % 32 << 11 | gl_y % 64 << 5 | x / 32;
+}
+
+static int check_frame(const char *name,
+                       const size *sz,
+                       size_t      workers,
+                       bool        rgba,
+                       const void *pixels)
+{
+    size_t pitch = sz->width + PAD;
+    for (size_t y = 0; y <= sz->height; y++) {
+        for (size_t x = 0; x < pitch; x++) {
+            size_t i = y * pitch + x;
+            uint32_t got = rgba ? ((const uint32_t *)pixels)[i]
+                                : ((const LED_pixel *)pixels)[i];
+            uint32_t want;
+            if (y < sz->height && x < sz->width)
+                want = expected(sz, rgba, x, y);
+            else
+                want = rgba ? SENTINEL : (LED_pixel)SENTINEL;
+            if (got != want) {
+                fprintf(stderr,
+                        "%s %s %zux%zu, %zu workers: pixel (%zu, %zu) "
+                        "is %#x, expected %#x\n",
+                        name, rgba ? "rgba" : "565",
+                        sz->width, sz->height, workers,
+                        x, y, got, want);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int test_size(const size *sz, size_t workers, prog *progs[4])
+{
+    static const int cores[MAX_WORKERS];
+    static const char *const names[] = {
+        "native", "native", "glsl", "glsl",
+    };
+    cpu_render_state *cs = cpu_render_init(sz->width, sz->height,
+                                           cores, workers);
+    if (!cs) {
+        fprintf(stderr, "cpu_render_init failed\n");
+        return 1;
+    }
+    size_t pitch = sz->width + PAD;
+    size_t count = pitch * (sz->height + 1);
+    uint32_t *pixels = malloc(count * sizeof *pixels);
+    int errors = 0;
+    for (size_t p = 0; p < 4 && !errors; p++) {
+        bool rgba = p & 1;
+        for (int f = 0; f < FRAMES && !errors; f++) {
+            if (rgba) {
+                for (size_t i = 0; i < count; i++)
+                    pixels[i] = SENTINEL;
+                cpu_render_frame_rgba(cs, progs[p], pixels, pitch);
+            } else {
+                LED_pixel *led = (LED_pixel *)pixels;
+                for (size_t i = 0; i < count; i++)
+                    led[i] = (LED_pixel)SENTINEL;
+                cpu_render_frame(cs, progs[p], led, pitch);
+            }
+            errors += check_frame(names[p], sz, workers, rgba, pixels);
+        }
+    }
+    free(pixels);
+    cpu_render_deinit(cs);
+    return errors;
+}
+
+int main(void)
+{
+    // Native and GLSL, each as RGB565 and RGBA.
+    prog *progs[4] = {
+        create_prog(), create_prog(),
+        create_glsl_coords(&enc565), create_glsl_coords(&enc8888),
+    };
+    if (!progs[0] || !progs[1] || !progs[2] || !progs[3])
+        return 1;
+    prog_set_native(progs[0], coords, (void *)&enc565);
+    prog_set_native(progs[1], coords, (void *)&enc8888);
+
+    int errors = 0;
+    for (size_t s = 0; s < sizeof sizes / sizeof sizes[0]; s++)
+        for (size_t w = 0; w < sizeof worker_counts / sizeof *worker_counts; w++)
+            errors += test_size(&sizes[s], worker_counts[w], progs);
+    for (size_t p = 0; p < 4; p++)
+        destroy_prog(progs[p]);
+    if (!errors)
+        printf("cpurender: all tests passed\n");
+    return errors != 0;
+}
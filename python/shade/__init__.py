@@ -1,19 +1,46 @@
 import ctypes
 from ctypes import byref, c_bool, c_char, c_char_p, c_double, c_int
-from ctypes import c_void_p, POINTER
+from ctypes import c_float, c_size_t, c_ssize_t, c_uint64, c_void_p
+from ctypes import CFUNCTYPE, POINTER, py_object, Structure
 from enum import Enum
+import itertools
+import threading
 
 
 __all__ = [
     'ShaderType',
     'Predefined',
+    'UniformType',
+    'PipelinePolicy',
+    'ReadbackMode',
+    'VsyncMode',
     'ProgError',
+    'InitError',
     'Prog',
+    'Histogram',
+    'Stats',
+    'set_transport',
+    'set_program_cache',
     'init',
     'deinit',
     'start',
     'stop',
     'fps',
+    'set_pipeline_policy',
+    'set_readback_mode',
+    'readback_is_direct',
+    'set_color_correction',
+    'set_power_limit',
+    'set_usb_transfers',
+    'set_vsync_mode',
+    'frames_shown',
+    'frames_dropped',
+    'get_stats',
+    'reset_stats',
+    'set_delta_updates',
+    'set_cpu_cores',
+    'set_background_compile',
+    'current_prog',
     ]
 
 
@@ -45,18 +72,109 @@ def_enum('ShaderType', 'SHD_SHADER_', 'VERTEX FRAGMENT', '_VALUE')
 def_enum('Predefined',
          'SHD_PREDEFINED_',
          'RESOLUTION PLAY_TIME RENDER_TIME FRAME '
-         'NOISE_SMALL NOISE_MEDIUM BACK_BUFFER IMU',
+         'NOISE_SMALL NOISE_MEDIUM BACK_BUFFER IMU DATE MOUSE '
+         'CHANNEL_RESOLUTION',
          '_VALUE')
 
+def_enum('UniformType',
+         'SHD_UNIFORM_',
+         'FLOAT VEC2 VEC3 VEC4 MAT2 MAT3 MAT4',
+         '_VALUE')
+
+def_enum('PipelinePolicy', 'SHD_PIPELINE_', 'QUEUE MAILBOX', '_VALUE')
+def_enum('ReadbackMode', 'SHD_READBACK_', 'AUTO COPY DIRECT', '_VALUE')
+def_enum('VsyncMode', 'SHD_VSYNC_', 'OFF POLL PIN', '_VALUE')
+
+
+class Histogram(Structure):
+    """summary of one pipeline histogram (seconds or frames)"""
+    _fields_ = [(name, c_uint64 if name == 'count' else c_double)
+                for name in 'count mean p50 p90 p99 p999 max'.split()]
+
+    def __repr__(self):
+        return ('Histogram(count={0.count}, mean={0.mean:.6g}, '
+                'p50={0.p50:.6g}, p99={0.p99:.6g}, max={0.max:.6g})'
+                .format(self))
+
+
+class Stats(Structure):
+    """pipeline telemetry returned by get_stats()"""
+    _fields_ = [
+        ('render_time', Histogram),
+        ('readback_time', Histogram),
+        ('encode_time', Histogram),
+        ('output_time', Histogram),
+        ('vsync_time', Histogram),
+        ('frame_time', Histogram),
+        ('framebuffer_queue', Histogram),
+        ('cmdbuffer_queue', Histogram),
+        ('cmd_bytes', Histogram),
+        ('frames_shown', c_uint64),
+        ('frames_dropped', c_uint64),
+        ('output_errors', c_uint64),
+        ('vsync_missed', c_uint64),
+        ('render_errors', c_uint64),
+    ]
+
+
+class _Py_buffer(Structure):
+    _fields_ = [
+        ('buf', c_void_p),
+        ('obj', py_object),
+        ('len', c_ssize_t),
+        ('itemsize', c_ssize_t),
+        ('readonly', c_int),
+        ('ndim', c_int),
+        ('format', c_char_p),
+        ('shape', POINTER(c_ssize_t)),
+        ('strides', POINTER(c_ssize_t)),
+        ('suboffsets', POINTER(c_ssize_t)),
+        ('internal', c_void_p),
+    ]
+
+_PyBUF_SIMPLE = 0
+_get_buffer = ctypes.pythonapi.PyObject_GetBuffer
+_get_buffer.restype = c_int
+_get_buffer.argtypes = (py_object, POINTER(_Py_buffer), c_int)
+_release_buffer = ctypes.pythonapi.PyBuffer_Release
+_release_buffer.restype = None
+_release_buffer.argtypes = (POINTER(_Py_buffer), )
+
+# Images are attached by reference.  Each one's buffer stays exported,
+# so its exporter can't resize or close it, until libshade lets go.
+_images_lock = threading.Lock()
+_images = {}
+_image_ids = itertools.count(1)
+
+@CFUNCTYPE(None, c_void_p)
+def _release_image(user):
+    with _images_lock:
+        view = _images.pop(user)
+    _release_buffer(byref(view))
+
+def _export(data):
+    view = _Py_buffer()
+    try:
+        _get_buffer(data, byref(view), _PyBUF_SIMPLE)
+    except BufferError:
+        # not contiguous
+        _get_buffer(memoryview(data).tobytes(), byref(view), _PyBUF_SIMPLE)
+    return view
+
 
 class ProgError(Exception):
     pass
 
 
+class InitError(Exception):
+    pass
+
+
 class Prog:
 
     def __init__(self):
         self.c_prog = create_prog()
+        self.stream_sizes = {}
 
     def close(self):
         destroy_prog(self.c_prog)
@@ -67,25 +185,93 @@ class Prog:
                                   source.encode(encoding))
 
     def attach_image(self, name, width, height, data):
-        return prog_attach_image(self.c_prog,
-                                 name.encode('ascii'),
-                                 width, height,
-                                 data)
+        """data is any buffer of RGBA bytes: bytes, numpy array, mmap..."""
+        view = _export(data)
+        if view.len < width * height * 4:
+            _release_buffer(byref(view))
+            raise ValueError('image {} is too small'.format(name))
+        user = next(_image_ids)
+        with _images_lock:
+            _images[user] = view
+        return prog_attach_image_ref(self.c_prog,
+                                     name.encode('ascii'),
+                                     width, height,
+                                     view.buf,
+                                     _release_image,
+                                     user)
 
     def attach_predefined(self, name, predefined):
         return prog_attach_predefined(self.c_prog,
                                       name.encode('ascii'),
                                       predefined)
 
+    def attach_pass(self, name, source, encoding='utf-8'):
+        return prog_attach_pass(self.c_prog,
+                                name.encode('utf-8'),
+                                source.encode(encoding))
+
+    def attach_buffer(self, name, pass_name):
+        return prog_attach_buffer(self.c_prog,
+                                  name.encode('ascii'),
+                                  pass_name.encode('utf-8'))
+
+    def attach_stream(self, name, width, height):
+        ok = prog_attach_stream(self.c_prog,
+                                name.encode('ascii'),
+                                width, height)
+        if ok:
+            self.stream_sizes[name] = width * height * 4
+        return ok
+
+    def write_stream(self, name, frame):
+        """send one RGBA frame; only one thread may write each stream"""
+        view = memoryview(frame).cast('B')
+        if view.nbytes != self.stream_sizes.get(name):
+            return False
+        c_name = name.encode('ascii')
+        buf = stream_acquire(self.c_prog, c_name)
+        if view.readonly:
+            src = view.obj if isinstance(view.obj, bytes) else bytes(view)
+        else:
+            src = (c_char * view.nbytes).from_buffer(view)
+        ctypes.memmove(buf, src, view.nbytes)
+        return stream_release(self.c_prog, c_name)
+
+    def attach_uniform(self, name, utype, count=1):
+        return prog_attach_uniform(self.c_prog,
+                                   name.encode('ascii'),
+                                   utype,
+                                   count)
+
+    def set_uniform(self, name, values):
+        """safe from any thread; matrices are column major"""
+        values = list(values)
+        return set_uniform(self.c_prog,
+                           name.encode('ascii'),
+                           (c_float * len(values))(*values),
+                           len(values))
+
+    def set_supersample(self, factor):
+        return prog_set_supersample(self.c_prog, factor)
+
     def check_okay(self):
         info_log = c_char_p()
         ok = prog_is_okay(self.c_prog, byref(info_log))
         if not ok:
             raise ProgError(info_log.value.decode('utf-8'))
 
+    def use_cpu(self):
+        info_log = c_char_p()
+        ok = prog_use_cpu(self.c_prog, byref(info_log))
+        if not ok:
+            raise ProgError(info_log.value.decode('utf-8'))
+
     def make_current(self):
         use_prog(self.c_prog)
 
+    def is_current(self):
+        return current_prog()[0] == self.c_prog
+
 
 def def_fun(name, restype, argtypes):
     fun = libshade['shd_' + name]
@@ -93,19 +279,122 @@ def def_fun(name, restype, argtypes):
     fun.argtypes = argtypes
     globals()[name] = fun
 
-def_fun('init', None, (c_int, c_int))
 def_fun('deinit', None, ())
+def_fun('last_error', c_char_p, ())
+
+_set_transport = libshade['shd_set_transport']
+_set_transport.restype = c_bool
+_set_transport.argtypes = (c_char_p, )
+
+def set_transport(spec):
+    return _set_transport(spec.encode('utf-8') if spec else None)
+
+_set_program_cache = libshade['shd_set_program_cache']
+_set_program_cache.restype = None
+_set_program_cache.argtypes = (c_char_p, )
+
+def set_program_cache(dir):
+    _set_program_cache(str(dir).encode('utf-8') if dir else None)
+
+_init = libshade['shd_init']
+_init.restype = c_bool
+_init.argtypes = (c_int, c_int)
+
+def init(width, height):
+    if not _init(width, height):
+        err = last_error()
+        raise InitError(err.decode('utf-8') if err else 'init failed')
 
 def_fun('start', None, ())
 def_fun('stop', None, ())
 def_fun('fps', c_double, ())
 def_fun('use_prog', None, (c_void_p, ))
+def_fun('set_pipeline_policy', c_bool, (PipelinePolicy, c_size_t))
+def_fun('set_readback_mode', c_bool, (ReadbackMode, ))
+def_fun('readback_is_direct', c_bool, ())
+def_fun('set_usb_transfers', c_bool, (c_size_t, ))
+def_fun('set_vsync_mode', c_bool, (VsyncMode, ))
+def_fun('frames_shown', c_uint64, ())
+def_fun('frames_dropped', c_uint64, ())
+def_fun('reset_stats', None, ())
+def_fun('set_delta_updates', None, (c_bool, ))
+def_fun('set_background_compile', None, (c_bool, ))
+
+_set_cpu_cores = libshade['shd_set_cpu_cores']
+_set_cpu_cores.restype = c_bool
+_set_cpu_cores.argtypes = (POINTER(c_int), c_size_t)
+
+def set_cpu_cores(cores):
+    """Pin the CPU renderer's workers to cores, or None for the default."""
+    if cores is None:
+        return _set_cpu_cores(None, 0)
+    return _set_cpu_cores((c_int * len(cores))(*cores), len(cores))
+
+_set_color_correction = libshade['shd_set_color_correction']
+_set_color_correction.restype = c_bool
+_set_color_correction.argtypes = (c_bool, c_float, c_float, c_float, c_float)
+
+def set_color_correction(gamma, gains=(1.0, 1.0, 1.0)):
+    """Gamma correct and dither the LEDs, or None for plain 5-6-5."""
+    if gamma is None:
+        return _set_color_correction(False, 1.0, 1.0, 1.0, 1.0)
+    return _set_color_correction(True, gamma, *gains)
+
+_set_power_limit = libshade['shd_set_power_limit']
+_set_power_limit.restype = c_bool
+_set_power_limit.argtypes = (c_bool, c_float, c_float, c_float, c_float)
+
+def set_power_limit(budget, led_amps=(0.0, 0.0, 0.0)):
+    """Dim frames over budget amps, or None for no limit.
+
+    led_amps is what one LED draws with red, green and blue full on.
+    """
+    if budget is None:
+        return _set_power_limit(False, 0.0, 0.0, 0.0, 0.0)
+    return _set_power_limit(True, budget, *led_amps)
+
+_current_prog = libshade['shd_current_prog']
+_current_prog.restype = c_void_p
+_current_prog.argtypes = (POINTER(c_uint64), )
+
+def current_prog():
+    """(program drawn most recently, number of switches so far)"""
+    switches = c_uint64()
+    return _current_prog(byref(switches)), switches.value
+
+_get_stats = libshade['shd_get_stats']
+_get_stats.restype = None
+_get_stats.argtypes = (POINTER(Stats), )
+
+def get_stats():
+    stats = Stats()
+    _get_stats(byref(stats))
+    return stats
 
 def_fun('create_prog', c_void_p, ())
 def_fun('destroy_prog', None, (c_void_p, ));
 def_fun('prog_is_okay', c_bool, (c_void_p, POINTER(c_char_p)))
+def_fun('prog_use_cpu', c_bool, (c_void_p, POINTER(c_char_p)))
 def_fun('prog_attach_shader', c_bool, (c_void_p, ShaderType, c_char_p))
 def_fun('prog_attach_image',
         c_bool,
         (c_void_p, c_char_p, c_int, c_int, c_char_p))
+def_fun('prog_attach_image_ref',
+        c_bool,
+        (c_void_p, c_char_p, c_size_t, c_size_t, c_void_p,
+         type(_release_image), c_void_p))
 def_fun('prog_attach_predefined', c_bool, (c_void_p, c_char_p, Predefined))
+def_fun('prog_attach_pass', c_bool, (c_void_p, c_char_p, c_char_p))
+def_fun('prog_attach_buffer', c_bool, (c_void_p, c_char_p, c_char_p))
+def_fun('prog_attach_stream',
+        c_bool,
+        (c_void_p, c_char_p, c_size_t, c_size_t))
+def_fun('stream_acquire', c_void_p, (c_void_p, c_char_p))
+def_fun('stream_release', c_bool, (c_void_p, c_char_p))
+def_fun('prog_attach_uniform',
+        c_bool,
+        (c_void_p, c_char_p, UniformType, c_size_t))
+def_fun('set_uniform',
+        c_bool,
+        (c_void_p, c_char_p, POINTER(c_float), c_size_t))
+def_fun('prog_set_supersample', c_bool, (c_void_p, c_int))